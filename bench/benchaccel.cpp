@@ -0,0 +1,149 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+#include "sceneloader.hpp"
+
+
+/* Acceleration structure benchmark
+ * Loads a scene, or scatters the given number of random spheres, and for each acceleration
+ * structure measures how long it takes to build (including the BVHs over each mesh's triangles)
+ * and how many rays per second it traces, both for random rays from the camera and for a full
+ * render. Every structure must find exactly the same hits
+ * The random rays also report how many nodes each visits and how many primitives (objects and
+ * triangles) each tests, which is what a tighter tree such as the SBVH saves
+ * For the grid, nodes are the cells each ray steps through
+ *
+ * usage: benchaccel <scene_file | num_spheres> [repeats]
+ */
+
+
+const int DEFAULT_REPEATS { 3 };
+
+// Random rays traced from the camera per repeat
+const int NUM_RAYS { 200000 };
+
+// Random spheres are scattered through a cube this wide in front of the camera
+const float SCENE_SIZE { 1000.0f };
+
+// Focal length of the camera for random scenes, kept short so renders stay small
+const int RANDOM_SCENE_FOCAL_LENGTH { 200 };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+std::shared_ptr<Scene> random_scene(int num_spheres, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> pos { -SCENE_SIZE / 2.0f, SCENE_SIZE / 2.0f };
+
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    scene->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, RANDOM_SCENE_FOCAL_LENGTH, 1.33f);
+    scene->lights.push_back(std::make_shared<Light>(Vec3 { 0.0, SCENE_SIZE, 0.0 },
+        Vec3 { 0.2 }, Vec3 { 0.5 }, Vec3 { 0.5 }));
+
+    int white { scene->materials.add(Material { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 1.0f }) };
+    for (int i = 0; i < num_spheres; i++)
+    {
+        scene->objects.push_back(std::make_shared<Sphere>(
+            Vec3 { pos(rng), pos(rng), pos(rng) - SCENE_SIZE }, 1.0f, white));
+    }
+
+    return scene;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: benchaccel <scene_file | num_spheres> [repeats]" << std::endl;
+        return 1;
+    }
+    int repeats { (argc > 2) ? std::stoi(argv[2]) : DEFAULT_REPEATS };
+
+    std::mt19937 rng { 1 };
+
+    std::string source { argv[1] };
+    std::shared_ptr<Scene> scene;
+    if (source.find_first_not_of("0123456789") == std::string::npos)
+        scene = random_scene(std::stoi(source), rng);
+    else
+        scene = load_scene(source);
+
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    std::vector<Vec3> dirs;
+    for (int i = 0; i < NUM_RAYS; i++)
+        dirs.push_back(glm::normalize(Vec3 { unit(rng) * 0.5f, unit(rng) * 0.5f, -1.0f }));
+
+    std::vector<std::pair<std::string, AccelType>> accels {
+        { "bvh", AccelType::BVH },
+        { "bvh4", AccelType::BVH4 },
+        { "sbvh", AccelType::SBVH },
+        { "kdtree", AccelType::KDTree },
+        { "grid", AccelType::Grid },
+        { "auto", AccelType::Auto }
+    };
+
+    std::cout << std::fixed << std::setprecision(2)
+                << "accel   build(ms)  rays(Mrays/s)  nodes/ray  tests/ray  render(ms)" << std::endl;
+
+    std::vector<Collision> reference;
+    for (const auto &accel : accels)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+            scene->build_accel(accel.second);
+        double build_ms { elapsed_ms(start) / repeats };
+
+        std::vector<Collision> hits(dirs.size(), NO_COLLISION);
+        traversal_stats = TraversalStats { 0, 0, 0 };
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+        {
+            for (unsigned int i = 0; i < dirs.size(); i++)
+                hits[i] = fire_ray(scene->camera->pos, dirs[i], scene);
+        }
+        double mrays { dirs.size() * repeats / (elapsed_ms(start) * 1000.0) };
+        double nodes_per_ray { (double)traversal_stats.nodes_visited / (dirs.size() * repeats) };
+        double tests_per_ray { (double)traversal_stats.prims_tested / (dirs.size() * repeats) };
+
+        if (reference.empty())
+        {
+            reference = hits;
+        }
+        else
+        {
+            for (unsigned int i = 0; i < hits.size(); i++)
+            {
+                if (!(hits[i] == reference[i]))
+                {
+                    std::cerr << accel.first << " disagrees with " << accels[0].first << std::endl;
+                    return 1;
+                }
+            }
+        }
+
+        RenderSettings settings;
+        settings.accel = accel.second;
+        int width, height;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+            raytrace(scene, width, height, settings);
+        double render_ms { elapsed_ms(start) / repeats };
+
+        std::cout << std::left << std::setw(6) << accel.first << std::right << std::setw(11) << build_ms
+                    << std::setw(15) << mrays << std::setw(11) << nodes_per_ray << std::setw(11) << tests_per_ray
+                    << std::setw(12) << render_ms << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "bvh.hpp"
+#include "objloader.hpp"
+#include "threadpool.hpp"
+
+
+/* BVH build benchmark
+ * Builds the BVH over a mesh's triangles, or over that many random triangles, with each kind
+ * of split on 1, 2, 4, ... threads and reports how many triangles per second are built along
+ * with the SAH cost of the resulting tree (lower traces faster)
+ *
+ * usage: benchbuild <obj_file | num_triangles> [max_threads] [repeats]
+ */
+
+
+const int DEFAULT_REPEATS { 3 };
+
+// Random triangles are scattered through a cube this wide, each up to TRIANGLE_SIZE across
+const float SCENE_SIZE { 1000.0f };
+const float TRIANGLE_SIZE { 5.0f };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+std::vector<Vec3> random_triangles(int num_triangles, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> pos { -SCENE_SIZE / 2.0f, SCENE_SIZE / 2.0f };
+    std::uniform_real_distribution<float> offset { -TRIANGLE_SIZE / 2.0f, TRIANGLE_SIZE / 2.0f };
+
+    std::vector<Vec3> vertices;
+    for (int i = 0; i < num_triangles; i++)
+    {
+        Vec3 c { pos(rng), pos(rng), pos(rng) };
+        for (int v = 0; v < 3; v++)
+            vertices.push_back(c + Vec3 { offset(rng), offset(rng), offset(rng) });
+    }
+
+    return vertices;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: benchbuild <obj_file | num_triangles> [max_threads] [repeats]" << std::endl;
+        return 1;
+    }
+    int max_threads { (argc > 2) ? std::stoi(argv[2]) : (int)std::thread::hardware_concurrency() };
+    int repeats { (argc > 3) ? std::stoi(argv[3]) : DEFAULT_REPEATS };
+
+    std::string source { argv[1] };
+    std::vector<Vec3> vertices;
+    if (source.find_first_not_of("0123456789") == std::string::npos)
+    {
+        std::mt19937 rng { 1 };
+        vertices = random_triangles(std::stoi(source), rng);
+    }
+    else
+    {
+        std::vector<Vec3> normals;
+        std::vector<glm::vec2> uvs;
+        std::vector<int> indices;
+        if (!loadOBJ(source, vertices, normals, uvs, indices))
+        {
+            std::cerr << "Could not load " << source << std::endl;
+            return 1;
+        }
+    }
+
+    // Same as Mesh::triangle_bounds
+    std::vector<AABB> bounds(vertices.size() / 3);
+    for (unsigned int i = 0; i < bounds.size(); i++)
+    {
+        bounds[i].grow(vertices[3 * i]);
+        bounds[i].grow(vertices[3 * i + 1]);
+        bounds[i].grow(vertices[3 * i + 2]);
+        bounds[i].pad();
+    }
+
+    std::cout << bounds.size() << " triangles" << std::endl;
+    std::cout << std::fixed << std::setprecision(2)
+                << "split   threads  build(ms)  Mtris/s  sah_cost   nodes" << std::endl;
+
+    std::vector<std::pair<std::string, BVHSplit>> splits {
+        { "median", BVHSplit::Median },
+        { "sah", BVHSplit::SAH }
+    };
+
+    for (const auto &split : splits)
+    {
+        for (int threads = 1; threads <= std::max(1, max_threads); threads *= 2)
+        {
+            ThreadPool pool { threads };
+            BVH bvh;
+
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++)
+                bvh.build(bounds, split.second, &pool);
+            double build_ms { elapsed_ms(start) / repeats };
+
+            std::cout << std::left << std::setw(8) << split.first << std::right << std::setw(7) << threads
+                        << std::setw(11) << build_ms << std::setw(9) << bounds.size() / (build_ms * 1000.0)
+                        << std::setw(10) << bvh.sah_cost() << std::setw(8) << bvh.nodes.size() << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "objects.hpp"
+
+
+/* Scene memory benchmark
+ * Scatters the given number of unit spheres through a cube, each with one of num_materials
+ * materials in the scene's table, and builds the scene's acceleration structure over them: once
+ * as a Sphere object each and once as a single SpherePool. Each layout is built in a child process of its own and
+ * reports its peak and final resident memory, and what that comes to per sphere over what the
+ * process used before the scene was made
+ * 10 million spheres in a pool with --accel grid (or auto) should stay within a few hundred MB
+ *
+ * usage: benchmemory <num_spheres> [accel] [num_materials]
+ */
+
+
+const int DEFAULT_NUM_MATERIALS { 16 };
+
+// Spheres are scattered through a cube this wide
+const float SCENE_SIZE { 1000.0f };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+// Resident memory of this process right now, in bytes
+double resident_bytes()
+{
+    long pages { 0 }, resident { 0 };
+    FILE *statm { fopen("/proc/self/statm", "r") };
+    if (statm == nullptr)
+        return 0.0;
+
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+
+// Most memory this process has had resident at once, in bytes
+double peak_bytes()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024.0;
+}
+
+
+void build_scene(int num_spheres, int num_materials, bool pooled, AccelType accel)
+{
+    std::mt19937 rng { 1 };
+    std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+    std::uniform_real_distribution<float> pos { -SCENE_SIZE / 2.0f, SCENE_SIZE / 2.0f };
+
+    double before { resident_bytes() };
+    auto start = std::chrono::steady_clock::now();
+
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    for (int i = 0; i < num_materials; i++)
+    {
+        scene->materials.add(Material { Vec3 { 0.1f }, Vec3 { unit(rng), unit(rng), unit(rng) },
+            Vec3 { 0.5f }, 1.0f + 50.0f * unit(rng) });
+    }
+
+    if (pooled)
+    {
+        std::shared_ptr<SpherePool> pool { std::make_shared<SpherePool>() };
+        pool->reserve(num_spheres);
+        for (int i = 0; i < num_spheres; i++)
+            pool->add(Vec3 { pos(rng), pos(rng), pos(rng) }, 1.0f, i % num_materials);
+        scene->objects.push_back(pool);
+    }
+    else
+    {
+        scene->objects.reserve(num_spheres);
+        for (int i = 0; i < num_spheres; i++)
+        {
+            scene->objects.push_back(std::make_shared<Sphere>(
+                Vec3 { pos(rng), pos(rng), pos(rng) }, 1.0f, i % num_materials));
+        }
+    }
+    scene->build_accel(accel);
+    double build_ms { elapsed_ms(start) };
+
+    double after { resident_bytes() };
+    std::cout << std::left << std::setw(9) << (pooled ? "pool" : "objects") << std::right
+                << std::setw(10) << build_ms << std::setw(10) << peak_bytes() / (1 << 20)
+                << std::setw(14) << after / (1 << 20) << std::setw(14) << (after - before) / num_spheres
+                << std::endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: benchmemory <num_spheres> [accel] [num_materials]" << std::endl;
+        return 1;
+    }
+    int num_spheres { std::stoi(argv[1]) };
+    AccelType accel { (argc > 2) ? parse_accel(argv[2]) : AccelType::Grid };
+    int num_materials { (argc > 3) ? std::stoi(argv[3]) : DEFAULT_NUM_MATERIALS };
+
+    std::cout << num_spheres << " spheres, " << num_materials << " materials" << std::endl;
+    std::cout << std::fixed << std::setprecision(1)
+                << "layout   build(ms)  peak(MB)  resident(MB)  bytes/sphere" << std::endl;
+
+    // A fresh process for each layout, so neither sees the other's peak or freed memory
+    for (bool pooled : { false, true })
+    {
+        pid_t pid { fork() };
+        if (pid == 0)
+        {
+            build_scene(num_spheres, num_materials, pooled, accel);
+            _exit(0);
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            std::cerr << (pooled ? "pool" : "objects") << " ran out of memory or crashed" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+
+
+/* BVH update benchmark
+ * Animates a scene of random spheres where a fraction of them drift each frame and compares
+ * the per-frame cost of Scene::update_accel (refit, rebuilding only when the tree degrades)
+ * against rebuilding the BVH from scratch, as well as how fast each tree traces rays
+ *
+ * usage: benchrefit [num_spheres] [moving_fraction] [num_frames]
+ */
+
+
+const int DEFAULT_NUM_SPHERES { 100000 };
+const float DEFAULT_MOVING_FRACTION { 0.05f };
+const int DEFAULT_NUM_FRAMES { 30 };
+
+// Rays traced per frame to measure the quality of each tree
+const int NUM_RAYS { 20000 };
+
+// Spheres are scattered through a cube this wide, and drift up to this far each frame
+const float SCENE_SIZE { 1000.0f };
+const float DRIFT { 4.0f };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+double trace_ms(std::shared_ptr<Scene> scene, const std::vector<Vec3> &dirs, int &hits)
+{
+    auto start = std::chrono::steady_clock::now();
+    hits = 0;
+    for (const Vec3 &d : dirs)
+    {
+        if (!(fire_ray(Vec3 { 0.0 }, d, scene) == NO_COLLISION))
+            hits++;
+    }
+    return elapsed_ms(start);
+}
+
+
+std::string update_name(BVHUpdate update)
+{
+    switch (update)
+    {
+        case BVHUpdate::Refit: return "refit";
+        case BVHUpdate::PartialRebuild: return "partial";
+        case BVHUpdate::FullRebuild: return "full";
+    }
+    return "";
+}
+
+
+int main(int argc, char *argv[])
+{
+    int num_spheres { (argc > 1) ? std::stoi(argv[1]) : DEFAULT_NUM_SPHERES };
+    float moving_fraction { (argc > 2) ? std::stof(argv[2]) : DEFAULT_MOVING_FRACTION };
+    int num_frames { (argc > 3) ? std::stoi(argv[3]) : DEFAULT_NUM_FRAMES };
+
+    std::mt19937 rng { 1 };
+    std::uniform_real_distribution<float> pos { -SCENE_SIZE / 2.0f, SCENE_SIZE / 2.0f };
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    int white { scene->materials.add(Material { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 1.0f }) };
+    for (int i = 0; i < num_spheres; i++)
+    {
+        scene->objects.push_back(std::make_shared<Sphere>(
+            Vec3 { pos(rng), pos(rng), pos(rng) - SCENE_SIZE }, 1.0f, white));
+    }
+
+    // Same objects, but its BVH is rebuilt from scratch every frame
+    std::shared_ptr<Scene> rebuilt { std::make_shared<Scene>() };
+    rebuilt->objects = scene->objects;
+
+    auto start = std::chrono::steady_clock::now();
+    scene->build_accel();
+    std::cout << "Built BVH over " << num_spheres << " spheres in " << elapsed_ms(start) << "ms" << std::endl;
+
+    std::vector<Vec3> dirs;
+    for (int i = 0; i < NUM_RAYS; i++)
+        dirs.push_back(glm::normalize(Vec3 { unit(rng) * 0.5f, unit(rng) * 0.5f, -1.0f }));
+
+    int num_moving = num_spheres * moving_fraction;
+    std::vector<Vec3> velocity;
+    for (int i = 0; i < num_moving; i++)
+        velocity.push_back(Vec3 { unit(rng), unit(rng), unit(rng) } * DRIFT);
+
+    std::cout << std::fixed << std::setprecision(2)
+                << "frame  update(ms)  action   rebuild(ms)  trace updated(ms)  trace rebuilt(ms)  sah updated/rebuilt" << std::endl;
+
+    double total_update { 0.0 }, total_rebuild { 0.0 }, total_trace_updated { 0.0 }, total_trace_rebuilt { 0.0 };
+    std::vector<int> moved;
+    for (int i = 0; i < num_moving; i++)
+        moved.push_back(i);
+
+    for (int frame = 0; frame < num_frames; frame++)
+    {
+        for (int i = 0; i < num_moving; i++)
+            scene->objects[i]->translate(velocity[i]);
+
+        start = std::chrono::steady_clock::now();
+        BVHUpdate update { scene->update_accel(moved) };
+        double update_ms { elapsed_ms(start) };
+
+        start = std::chrono::steady_clock::now();
+        rebuilt->build_accel();
+        double rebuild_ms { elapsed_ms(start) };
+
+        int hits_updated, hits_rebuilt;
+        double trace_updated { trace_ms(scene, dirs, hits_updated) };
+        double trace_rebuilt { trace_ms(rebuilt, dirs, hits_rebuilt) };
+        if (hits_updated != hits_rebuilt)
+        {
+            std::cerr << "Updated and rebuilt BVHs disagree" << std::endl;
+            return 1;
+        }
+
+        total_update += update_ms;
+        total_rebuild += rebuild_ms;
+        total_trace_updated += trace_updated;
+        total_trace_rebuilt += trace_rebuilt;
+
+        std::cout << std::setw(5) << frame << std::setw(12) << update_ms << "  " << std::setw(7) << update_name(update)
+                    << std::setw(13) << rebuild_ms << std::setw(19) << trace_updated << std::setw(19) << trace_rebuilt
+                    << std::setw(12) << scene->bvh.sah_cost() << "/" << rebuilt->bvh.sah_cost() << std::endl;
+    }
+
+    std::cout << "Average per frame: update " << total_update / num_frames << "ms, rebuild "
+                << total_rebuild / num_frames << "ms" << std::endl;
+    std::cout << "Average trace time: updated " << total_trace_updated / num_frames << "ms, rebuilt "
+                << total_trace_rebuilt / num_frames << "ms" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+#include "sceneloader.hpp"
+
+
+/* Sampler convergence benchmark
+ * Renders a scene with each sampler at 1, 4, 16 and 64 camera rays per pixel and prints how far
+ * each image is from a reference rendered with many more Sobol samples (root mean square error
+ * over all colour channels) and how long it took. A better sampler reaches the same error with
+ * fewer rays. Shadows are soft, so try a scene with num_shadows above 1 where shadows and edges
+ * need sampling
+ * Grid shadow rays go to a fixed pattern rather than spreading over the light, so grid converges
+ * to a slightly different image and its error levels off rather than going to zero
+ *
+ * usage: benchsampling <scene_file> [recursion_level num_shadows]
+ */
+
+
+// The camera's focal length is divided by this, so renders stay small
+const int FOCAL_LENGTH_DIVISOR { 4 };
+
+// Camera rays per pixel, along each side, of the renders compared
+const std::vector<int> SSAMPLE_DIVS { 1, 2, 4, 8 };
+
+// Camera rays per pixel, along each side, of the reference render
+const int REFERENCE_SSAMPLE_DIV { 32 };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+double rmse(const Pixel2D &a, const Pixel2D &b, int width, int height)
+{
+    double sum { 0.0 };
+    for (int x = 0; x < width; x++)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            Vec3 diff { a[x][y] - b[x][y] };
+            sum += diff.x * diff.x + diff.y * diff.y + diff.z * diff.z;
+        }
+    }
+    return std::sqrt(sum / (3.0 * width * height));
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 4)
+    {
+        std::cerr << "usage: benchsampling <scene_file> [recursion_level num_shadows]" << std::endl;
+        return 1;
+    }
+
+    int recursion_level { (argc == 4) ? std::stoi(argv[2]) : 0 };
+    int num_shadows { (argc == 4) ? std::stoi(argv[3]) : 4 };
+
+    std::shared_ptr<Scene> scene { load_scene(argv[1]) };
+    scene->camera->f = std::max(1, scene->camera->f / FOCAL_LENGTH_DIVISOR);
+
+    int width, height;
+    RenderSettings ref_settings { recursion_level, REFERENCE_SSAMPLE_DIV, num_shadows };
+    ref_settings.sampler = SamplerType::Sobol;
+    Pixel2D reference { raytrace(scene, width, height, ref_settings) };
+
+    const std::vector<std::pair<std::string, SamplerType>> samplers {
+        { "grid", SamplerType::Grid },
+        { "jittered", SamplerType::Jittered },
+        { "halton", SamplerType::Halton },
+        { "sobol", SamplerType::Sobol },
+        { "bluenoise", SamplerType::BlueNoise }
+    };
+
+    std::cout << width << " x " << height << " pixels, reference " << REFERENCE_SSAMPLE_DIV * REFERENCE_SSAMPLE_DIV
+                << " Sobol rays per pixel" << std::endl;
+    std::cout << std::fixed << std::setprecision(5)
+                << "sampler    rays/px  render(ms)        rmse" << std::endl;
+
+    for (const auto &sampler : samplers)
+    {
+        for (int ss : SSAMPLE_DIVS)
+        {
+            RenderSettings settings { recursion_level, ss, num_shadows };
+            settings.sampler = sampler.second;
+
+            auto start = std::chrono::steady_clock::now();
+            Pixel2D px_data { raytrace(scene, width, height, settings) };
+            double render_ms { elapsed_ms(start) };
+
+            std::cout << std::left << std::setw(9) << sampler.first << std::right << std::setw(9) << ss * ss
+                        << std::setprecision(2) << std::setw(12) << render_ms
+                        << std::setprecision(5) << std::setw(12) << rmse(px_data, reference, width, height)
+                        << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+#include "sceneloader.hpp"
+
+
+/* Adaptive shadow benchmark
+ * Renders a scene firing every shadow ray, then with adaptive_shadows stopping after 1, 2, 4 and 8
+ * rays wherever they agree, on one thread. Prints how many rays fire_ray traced, the render time
+ * and how far each image is from the one that fired every shadow ray (root mean square error over
+ * all colour channels). Try a scene with area lights such as scene8 with many shadow rays
+ *
+ * usage: benchshadows <scene_file> [recursion_level ssample_div num_shadows] [sampler]
+ */
+
+
+// The camera's focal length is divided by this, so renders stay small
+const int FOCAL_LENGTH_DIVISOR { 4 };
+
+// Shadow rays fired before checking whether they agree
+const std::vector<int> ADAPTIVE_SHADOWS { 1, 2, 4, 8 };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+double rmse(const Pixel2D &a, const Pixel2D &b, int width, int height)
+{
+    double sum { 0.0 };
+    for (int x = 0; x < width; x++)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            Vec3 diff { a[x][y] - b[x][y] };
+            sum += diff.x * diff.x + diff.y * diff.y + diff.z * diff.z;
+        }
+    }
+    return std::sqrt(sum / (3.0 * width * height));
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 5 && argc != 6)
+    {
+        std::cerr << "usage: benchshadows <scene_file> [recursion_level ssample_div num_shadows] [sampler]"
+                    << std::endl;
+        return 1;
+    }
+
+    RenderSettings settings { 0, 1, 16 };
+    if (argc >= 5)
+        settings = RenderSettings { std::stoi(argv[2]), std::stoi(argv[3]), std::stoi(argv[4]) };
+    settings.num_threads = 1;
+    settings.sampler = SamplerType::Sobol;
+    if (argc == 6)
+        settings.sampler = parse_sampler(argv[5]);
+
+    std::shared_ptr<Scene> scene { load_scene(argv[1]) };
+    scene->camera->f = std::max(1, scene->camera->f / FOCAL_LENGTH_DIVISOR);
+
+    std::cout << std::fixed << "adaptive  rays(M)  render(ms)  speedup        rmse" << std::endl;
+
+    int width, height;
+    Pixel2D reference;
+    double reference_ms { 0.0 };
+    std::vector<int> adaptive_shadows { 0 };
+    for (int k : ADAPTIVE_SHADOWS)
+    {
+        if (k < settings.num_shadows)
+            adaptive_shadows.push_back(k);
+    }
+
+    for (int k : adaptive_shadows)
+    {
+        settings.adaptive_shadows = k;
+        traversal_stats = TraversalStats { 0, 0, 0 };
+        auto start = std::chrono::steady_clock::now();
+        Pixel2D px_data { raytrace(scene, width, height, settings) };
+        double render_ms { elapsed_ms(start) };
+
+        if (!reference)
+        {
+            reference = std::move(px_data);
+            reference_ms = render_ms;
+        }
+
+        std::cout << std::setw(8) << ((k == 0) ? std::string { "off" } : std::to_string(k))
+                    << std::setprecision(2) << std::setw(9) << traversal_stats.rays / 1e6
+                    << std::setw(12) << render_ms << std::setw(9) << reference_ms / render_ms
+                    << std::setprecision(5) << std::setw(12) << ((k == 0) ? 0.0 : rmse(px_data, reference, width, height))
+                    << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+#include "sceneloader.hpp"
+
+
+/* Render path benchmark
+ * Renders a scene depth first (one camera ray at a time through compute_color), with batch
+ * shading, and as waves of rays (render_tile_wavefront) with and without sorting their shadow and
+ * reflection rays, on one thread so the paths are compared rather than how they share cores. Each
+ * path must give exactly the same image as the depth first render
+ * Along with the render time it reports how many rays per second fire_ray traced and, where the
+ * kernel lets processes count them, the hardware cache misses per ray. Try a reflective scene such
+ * as scene5 with reflections on, or a field of random reflective spheres too big to stay in cache,
+ * which is where sorting rays pays off
+ *
+ * usage: benchwavefront <scene_file | num_spheres> [recursion_level ssample_div num_shadows] [repeats]
+ */
+
+
+const int DEFAULT_REPEATS { 3 };
+
+// Random spheres are scattered through a cube this wide in front of the camera
+const float SCENE_SIZE { 1000.0f };
+
+// Focal length of the camera for random scenes, kept short so renders stay small
+const int RANDOM_SCENE_FOCAL_LENGTH { 200 };
+
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed { std::chrono::steady_clock::now() - start };
+    return elapsed.count();
+}
+
+
+// Starts counting this thread's hardware cache misses, returns -1 if they can't be counted (e.g. in a container)
+int start_cache_misses()
+{
+    perf_event_attr attr {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd { (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0) };
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return fd;
+}
+
+
+// Cache misses since start_cache_misses gave fd, -1 if they weren't counted
+double stop_cache_misses(int fd)
+{
+    if (fd < 0)
+        return -1.0;
+
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long misses;
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+        misses = -1;
+    close(fd);
+    return misses;
+}
+
+
+std::shared_ptr<Scene> random_scene(int num_spheres)
+{
+    std::mt19937 rng { 1 };
+    std::uniform_real_distribution<float> pos { -SCENE_SIZE / 2.0f, SCENE_SIZE / 2.0f };
+
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    scene->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, RANDOM_SCENE_FOCAL_LENGTH, 1.33f);
+    scene->lights.push_back(std::make_shared<Light>(Vec3 { 0.0, SCENE_SIZE, 0.0 },
+        Vec3 { 0.2 }, Vec3 { 0.5 }, Vec3 { 0.5 }));
+
+    int mirror { scene->materials.add(Material { Vec3 { 0.1 }, Vec3 { 0.5 }, Vec3 { 0.8 }, 20.0f }) };
+    for (int i = 0; i < num_spheres; i++)
+    {
+        scene->objects.push_back(std::make_shared<Sphere>(
+            Vec3 { pos(rng), pos(rng), pos(rng) - SCENE_SIZE }, 2.0f, mirror));
+    }
+
+    return scene;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 5 && argc != 6)
+    {
+        std::cerr << "usage: benchwavefront <scene_file | num_spheres> [recursion_level ssample_div num_shadows] [repeats]"
+                    << std::endl;
+        return 1;
+    }
+
+    RenderSettings settings { 0, 1, 1 };
+    if (argc >= 5)
+        settings = RenderSettings { std::stoi(argv[2]), std::stoi(argv[3]), std::stoi(argv[4]) };
+    settings.num_threads = 1;
+    int repeats { (argc == 6) ? std::stoi(argv[5]) : DEFAULT_REPEATS };
+
+    std::string source { argv[1] };
+    std::shared_ptr<Scene> scene;
+    if (source.find_first_not_of("0123456789") == std::string::npos)
+        scene = random_scene(std::stoi(source));
+    else
+        scene = load_scene(source);
+    scene->build_accel(settings.accel);
+
+    std::vector<std::pair<std::string, RenderSettings>> paths { { "depth", settings } };
+    paths.push_back({ "batch", settings });
+    paths.back().second.batch_shading = true;
+    paths.push_back({ "wave", settings });
+    paths.back().second.wavefront = true;
+    paths.push_back({ "sorted", paths.back().second });
+    paths.back().second.sort_rays = true;
+
+    std::cout << std::fixed << std::setprecision(2)
+                << "path    render(ms)  speedup  rays(Mrays/s)  misses/ray" << std::endl;
+
+    Pixel2D reference;
+    double reference_ms { 0.0 };
+    for (const auto &path : paths)
+    {
+        int width, height;
+        Pixel2D px_data;
+        traversal_stats = TraversalStats { 0, 0, 0 };
+        int counter { start_cache_misses() };
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+            px_data = raytrace(scene, width, height, path.second);
+        double render_ms { elapsed_ms(start) / repeats };
+        double misses { stop_cache_misses(counter) };
+        double mrays { traversal_stats.rays / (render_ms * repeats * 1000.0) };
+
+        if (!reference)
+        {
+            reference = std::move(px_data);
+            reference_ms = render_ms;
+        }
+        else
+        {
+            for (int x = 0; x < width; x++)
+            {
+                for (int y = 0; y < height; y++)
+                {
+                    if (px_data[x][y] != reference[x][y])
+                    {
+                        std::cerr << path.first << " disagrees with " << paths[0].first << std::endl;
+                        return 1;
+                    }
+                }
+            }
+        }
+
+        std::cout << std::left << std::setw(6) << path.first << std::right << std::setw(12) << render_ms
+                    << std::setw(9) << reference_ms / render_ms << std::setw(15) << mrays;
+        if (misses < 0.0)
+            std::cout << std::setw(12) << "n/a" << std::endl;
+        else
+            std::cout << std::setw(12) << misses / traversal_stats.rays << std::endl;
+    }
+
+    return 0;
+}
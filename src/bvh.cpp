@@ -0,0 +1,926 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include "bvh.hpp"
+
+
+// Leaves are split until they hold at most this many primitives
+const int MAX_LEAF_SIZE { 4 };
+
+// Candidate split planes per axis for BVHSplit::SAH
+const int NUM_BINS { 16 };
+
+// Nodes with at least this many primitives have their children built as separate tasks
+const int PARALLEL_SUBTREE_MIN { 1 << 12 };
+
+// Nodes with at least this many primitives are binned in parallel, PARALLEL_CHUNK at a time
+const int PARALLEL_BIN_MIN { 1 << 16 };
+const int PARALLEL_CHUNK { 1 << 14 };
+
+// Candidate planes per axis for spatial splits, see BVH::build_spatial
+const int NUM_SPATIAL_BINS { 16 };
+
+// Defaults for SpatialSplitOptions
+const float DEFAULT_MAX_DUPLICATION { 0.5f };
+const float DEFAULT_MIN_OVERLAP { 1e-5f };
+
+// Relative costs of visiting a node and intersecting a primitive, used by the SAH
+const float COST_TRAVERSAL { 1.0f };
+const float COST_INTERSECT { 1.0f };
+
+// A subtree is rebuilt once refitting has grown its surface area this many times over
+const float PARTIAL_REBUILD_GROWTH { 2.0f };
+
+// The whole tree is rebuilt once its SAH cost has grown this many times over
+const float FULL_REBUILD_RATIO { 1.5f };
+
+// Components of a ray direction smaller than this are treated as this, keeps slab tests finite
+const float MIN_DIRECTION { 1e-20f };
+
+
+thread_local TraversalStats traversal_stats { 0, 0, 0 };
+
+
+
+AABB::AABB()
+{
+    min = Vec3 { std::numeric_limits<float>::infinity() };
+    max = Vec3 { -std::numeric_limits<float>::infinity() };
+}
+
+
+AABB::AABB(Vec3 min, Vec3 max)
+{
+    this->min = min;
+    this->max = max;
+}
+
+
+void AABB::grow(Vec3 p)
+{
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+}
+
+
+void AABB::grow(const AABB &b)
+{
+    min = glm::min(min, b.min);
+    max = glm::max(max, b.max);
+}
+
+
+/* Padding scales with the magnitude of the coordinates, since that is what rounding errors
+ * in the primitives' own intersection tests scale with
+ */
+void AABB::pad()
+{
+    Vec3 e { (glm::abs(min) + glm::abs(max)) * 1e-5f + Vec3 { 1e-4f } };
+    min -= e;
+    max += e;
+}
+
+
+AABB AABB::overlap(const AABB &b) const
+{
+    return AABB { glm::max(min, b.min), glm::min(max, b.max) };
+}
+
+
+bool AABB::empty() const
+{
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+}
+
+
+bool AABB::is_finite() const
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (!std::isfinite(min[i]) || !std::isfinite(max[i]))
+            return false;
+    }
+    return true;
+}
+
+
+Vec3 AABB::centroid() const
+{
+    return (min + max) * 0.5f;
+}
+
+
+float AABB::area() const
+{
+    if (empty())
+        return 0.0f;
+
+    Vec3 e { max - min };
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+
+
+Vec3 safe_inverse(Vec3 d)
+{
+    Vec3 inv;
+    for (int i = 0; i < 3; i++)
+        inv[i] = 1.0f / (fabs(d[i]) > MIN_DIRECTION ? d[i] : std::copysign(MIN_DIRECTION, d[i]));
+
+    return inv;
+}
+
+
+
+SpatialSplitOptions::SpatialSplitOptions()
+{
+    max_duplication = DEFAULT_MAX_DUPLICATION;
+    min_overlap = DEFAULT_MIN_OVERLAP;
+}
+
+
+
+/* BVH
+ * Built top-down by splitting each node in two (see BVHSplit) until leaves are small enough
+ * Nodes are allocated from an array sized for the worst case, two siblings at a time, so
+ * subtrees can be built by different threads without moving anyone else's nodes
+ */
+struct BVH::BuildContext
+{
+    const std::vector<AABB> &prim_bounds;
+    const std::vector<Vec3> &centroids;
+    BVHSplit split;
+    ThreadPool *pool;
+
+    // Every subtree task of the build, nullptr for a serial build
+    TaskGroup *group;
+
+    // Index of the next unused node
+    std::atomic<int> next_node;
+
+    BuildContext(const std::vector<AABB> &prim_bounds, const std::vector<Vec3> &centroids,
+                    BVHSplit split, ThreadPool *pool, TaskGroup *group, int next_node) :
+        prim_bounds { prim_bounds }, centroids { centroids }, split { split }, pool { pool },
+        group { group }, next_node { next_node } {}
+};
+
+
+
+void BVH::build(const std::vector<AABB> &prim_bounds, BVHSplit split, ThreadPool *pool)
+{
+    prim_count = prim_bounds.size();
+    this->split = split;
+    nodes.clear();
+    build_area.clear();
+    dead_nodes = 0;
+
+    indices.resize(prim_count);
+    for (int i = 0; i < prim_count; i++)
+        indices[i] = i;
+
+    if (prim_count == 0)
+    {
+        leaf_bounds.clear();
+        build_cost = 0.0f;
+        return;
+    }
+
+    std::vector<Vec3> centroids(prim_count);
+    for (int i = 0; i < prim_count; i++)
+        centroids[i] = prim_bounds[i].centroid();
+
+    // A binary tree with at least one primitive per leaf never has more nodes than this
+    nodes.resize(2 * prim_count - 1);
+    build_area.resize(2 * prim_count - 1);
+
+    if (pool != nullptr && pool->size() > 1)
+    {
+        TaskGroup group { *pool };
+        BuildContext ctx { prim_bounds, centroids, split, pool, &group, 1 };
+        build_node(0, 0, prim_count, 0, ctx);
+        group.wait();
+        nodes.resize(ctx.next_node);
+    }
+    else
+    {
+        BuildContext ctx { prim_bounds, centroids, split, nullptr, nullptr, 1 };
+        build_node(0, 0, prim_count, 0, ctx);
+        nodes.resize(ctx.next_node);
+    }
+
+    build_area.resize(nodes.size());
+    gather_leaf_bounds(prim_bounds);
+
+    build_cost = sah_cost();
+}
+
+
+
+/* Builds the subtree for indices[begin, end) into nodes[node]
+ * Children are taken from ctx.next_node, so this is also used to rebuild a subtree in place
+ */
+void BVH::build_node(int node, int begin, int end, int depth, BuildContext &ctx)
+{
+    AABB bounds, centroid_bounds;
+    range_bounds(begin, end, ctx, bounds, centroid_bounds);
+
+    nodes[node].bounds = bounds;
+    build_area[node] = bounds.area();
+
+    int count { end - begin };
+    if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH)
+    {
+        nodes[node].first = begin;
+        nodes[node].count = count;
+        return;
+    }
+
+    int mid { (ctx.split == BVHSplit::SAH) ? split_sah(begin, end, centroid_bounds, ctx)
+                                            : split_median(begin, end, centroid_bounds, ctx) };
+
+    int left { ctx.next_node.fetch_add(2) };
+    nodes[node].first = left;
+    nodes[node].count = 0;
+
+    if (ctx.group != nullptr && count >= PARALLEL_SUBTREE_MIN)
+    {
+        ctx.group->run([this, left, begin, mid, depth, &ctx]()
+        {
+            build_node(left, begin, mid, depth + 1, ctx);
+        });
+    }
+    else
+    {
+        build_node(left, begin, mid, depth + 1, ctx);
+    }
+
+    build_node(left + 1, mid, end, depth + 1, ctx);
+}
+
+
+
+// Bounds of the primitives in indices[begin, end) and of their centroids
+void BVH::range_bounds(int begin, int end, BuildContext &ctx, AABB &bounds, AABB &centroid_bounds) const
+{
+    auto grow = [this, &ctx](int b, int e, AABB &out_bounds, AABB &out_centroids)
+    {
+        for (int i = b; i < e; i++)
+        {
+            out_bounds.grow(ctx.prim_bounds[indices[i]]);
+            out_centroids.grow(ctx.centroids[indices[i]]);
+        }
+    };
+
+    int count { end - begin };
+    if (ctx.pool == nullptr || count < PARALLEL_BIN_MIN)
+    {
+        grow(begin, end, bounds, centroid_bounds);
+        return;
+    }
+
+    int num_chunks { (count + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK };
+    std::vector<AABB> chunk_bounds(num_chunks), chunk_centroids(num_chunks);
+    parallel_for(*ctx.pool, num_chunks, 0, [&](int c)
+    {
+        grow(begin + c * PARALLEL_CHUNK, std::min(end, begin + (c + 1) * PARALLEL_CHUNK),
+                chunk_bounds[c], chunk_centroids[c]);
+    });
+
+    for (int c = 0; c < num_chunks; c++)
+    {
+        bounds.grow(chunk_bounds[c]);
+        centroid_bounds.grow(chunk_centroids[c]);
+    }
+}
+
+
+
+// Splits at the median centroid along the longest axis, returns where the right child starts
+int BVH::split_median(int begin, int end, const AABB &centroid_bounds, BuildContext &ctx)
+{
+    Vec3 extent { centroid_bounds.max - centroid_bounds.min };
+    int axis { 0 };
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    const std::vector<Vec3> &centroids { ctx.centroids };
+    int mid { begin + (end - begin) / 2 };
+    std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+        [&centroids, axis](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+
+    return mid;
+}
+
+
+
+/* Binned SAH
+ * Centroids are sorted into NUM_BINS equal slices of the node on each axis and the split
+ * between two slices with the lowest surface area cost wins. Primitives whose centroids all
+ * coincide can't be told apart by any plane, they are split in half instead
+ */
+int BVH::split_sah(int begin, int end, const AABB &centroid_bounds, BuildContext &ctx)
+{
+    struct Bin
+    {
+        AABB bounds;
+        int count { 0 };
+    };
+    typedef std::array<std::array<Bin, NUM_BINS>, 3> Bins;
+
+    Vec3 origin { centroid_bounds.min };
+    Vec3 extent { centroid_bounds.max - centroid_bounds.min };
+    Vec3 scale;
+    for (int axis = 0; axis < 3; axis++)
+        scale[axis] = (extent[axis] > 0.0f) ? NUM_BINS / extent[axis] : 0.0f;
+
+    const std::vector<Vec3> &centroids { ctx.centroids };
+    auto bin_of = [&centroids, origin, scale](int prim, int axis)
+    {
+        int b { (int)((centroids[prim][axis] - origin[axis]) * scale[axis]) };
+        return std::min(b, NUM_BINS - 1);
+    };
+
+    auto fill = [this, &ctx, &bin_of](int b, int e, Bins &bins)
+    {
+        for (int i = b; i < e; i++)
+        {
+            int prim { indices[i] };
+            for (int axis = 0; axis < 3; axis++)
+            {
+                Bin &bin { bins[axis][bin_of(prim, axis)] };
+                bin.bounds.grow(ctx.prim_bounds[prim]);
+                bin.count++;
+            }
+        }
+    };
+
+    Bins bins;
+    int count { end - begin };
+    if (ctx.pool == nullptr || count < PARALLEL_BIN_MIN)
+    {
+        fill(begin, end, bins);
+    }
+    else
+    {
+        int num_chunks { (count + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK };
+        std::vector<Bins> chunk_bins(num_chunks);
+        parallel_for(*ctx.pool, num_chunks, 0, [&](int c)
+        {
+            fill(begin + c * PARALLEL_CHUNK, std::min(end, begin + (c + 1) * PARALLEL_CHUNK), chunk_bins[c]);
+        });
+
+        for (const Bins &chunk : chunk_bins)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int b = 0; b < NUM_BINS; b++)
+                {
+                    bins[axis][b].bounds.grow(chunk[axis][b].bounds);
+                    bins[axis][b].count += chunk[axis][b].count;
+                }
+            }
+        }
+    }
+
+    // Sweep each axis from both ends, the split after bin b costs area(left) * n_left + area(right) * n_right
+    int best_axis { -1 }, best_bin { 0 };
+    float best_cost { std::numeric_limits<float>::infinity() };
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (scale[axis] == 0.0f)
+            continue;
+
+        float right_cost[NUM_BINS];
+        AABB right;
+        int n_right { 0 };
+        for (int b = NUM_BINS - 1; b > 0; b--)
+        {
+            right.grow(bins[axis][b].bounds);
+            n_right += bins[axis][b].count;
+            right_cost[b] = right.area() * n_right;
+        }
+
+        AABB left;
+        int n_left { 0 };
+        for (int b = 0; b < NUM_BINS - 1; b++)
+        {
+            left.grow(bins[axis][b].bounds);
+            n_left += bins[axis][b].count;
+            if (n_left == 0 || n_left == count)
+                continue;
+
+            float cost { left.area() * n_left + right_cost[b + 1] };
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (best_axis < 0)
+        return begin + count / 2;
+
+    auto mid = std::partition(indices.begin() + begin, indices.begin() + end,
+        [&bin_of, best_axis, best_bin](int prim) { return bin_of(prim, best_axis) <= best_bin; });
+
+    return mid - indices.begin();
+}
+
+
+
+/* SBVH (Stich et al., "Spatial Splits in Bounding Volume Hierarchies")
+ * Each node compares the best binned SAH object split with the best of NUM_SPATIAL_BINS planes
+ * per axis that may cut references in two, clipping each half to its side of the plane.
+ * Spatial splits are only looked for while the budget of references lasts and where object
+ * splits leave the children overlapping, which is where they pay off.
+ * The build is serial, nodes are appended as they are made and leaves in depth-first order,
+ * so every subtree still covers a contiguous range of indices
+ */
+struct BVH::SpatialContext
+{
+    ClipFunction clip;
+
+    // Object splits whose children overlap by less than this area aren't worth a spatial split
+    float min_overlap_area;
+
+    // References made so far and how many the memory budget allows
+    int num_refs;
+    int max_refs;
+};
+
+
+
+void BVH::build_spatial(const std::vector<AABB> &prim_bounds, ClipFunction clip,
+                        const SpatialSplitOptions &options)
+{
+    prim_count = prim_bounds.size();
+    split = BVHSplit::SAH;
+    nodes.clear();
+    build_area.clear();
+    indices.clear();
+    leaf_bounds.clear();
+    dead_nodes = 0;
+
+    if (prim_count == 0)
+    {
+        build_cost = 0.0f;
+        return;
+    }
+
+    std::vector<Reference> refs(prim_count);
+    AABB root;
+    for (int i = 0; i < prim_count; i++)
+    {
+        refs[i] = Reference { i, prim_bounds[i] };
+        root.grow(prim_bounds[i]);
+    }
+
+    SpatialContext ctx { clip, options.min_overlap * root.area(), prim_count,
+                            prim_count + (int)(prim_count * std::max(0.0f, options.max_duplication)) };
+
+    nodes.resize(1);
+    build_area.resize(1);
+    build_spatial_node(0, refs, 0, ctx);
+
+    build_cost = sah_cost();
+}
+
+
+
+// Builds the subtree over refs into nodes[node], refs is emptied
+void BVH::build_spatial_node(int node, std::vector<Reference> &refs, int depth, SpatialContext &ctx)
+{
+    AABB bounds, centroid_bounds;
+    for (const Reference &ref : refs)
+    {
+        bounds.grow(ref.bounds);
+        centroid_bounds.grow(ref.bounds.centroid());
+    }
+
+    nodes[node].bounds = bounds;
+    build_area[node] = bounds.area();
+
+    int count { (int)refs.size() };
+    if (count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH)
+    {
+        nodes[node].first = (int)indices.size();
+        nodes[node].count = count;
+        for (const Reference &ref : refs)
+        {
+            indices.push_back(ref.prim);
+            leaf_bounds.push_back(ref.bounds);
+        }
+        refs.clear();
+        return;
+    }
+
+    // The part of a reference inside box, padded like the primitive's own bounds but never beyond them
+    auto clip_ref = [&ctx](const Reference &ref, const AABB &box)
+    {
+        AABB part { ctx.clip(ref.prim, ref.bounds.overlap(box)) };
+        if (part.empty())
+            return part;
+
+        part.pad();
+        return part.overlap(ref.bounds);
+    };
+
+    struct Bin
+    {
+        AABB bounds;
+        int count { 0 }, exits { 0 };
+    };
+
+    // Object split, binned SAH over the centroids of the references (see split_sah)
+    int obj_axis { -1 }, obj_bin { 0 };
+    float obj_cost { std::numeric_limits<float>::infinity() };
+    AABB obj_left, obj_right;
+
+    Vec3 c_origin { centroid_bounds.min };
+    Vec3 c_extent { centroid_bounds.max - centroid_bounds.min };
+    auto centroid_bin = [c_origin, c_extent](const Reference &ref, int axis)
+    {
+        int b { (int)((ref.bounds.centroid()[axis] - c_origin[axis]) * NUM_BINS / c_extent[axis]) };
+        return std::min(b, NUM_BINS - 1);
+    };
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (!(c_extent[axis] > 0.0f))
+            continue;
+
+        Bin bins[NUM_BINS];
+        for (const Reference &ref : refs)
+        {
+            Bin &bin { bins[centroid_bin(ref, axis)] };
+            bin.bounds.grow(ref.bounds);
+            bin.count++;
+        }
+
+        AABB right[NUM_BINS];
+        int n_right[NUM_BINS];
+        AABB r;
+        int n { 0 };
+        for (int b = NUM_BINS - 1; b > 0; b--)
+        {
+            r.grow(bins[b].bounds);
+            n += bins[b].count;
+            right[b] = r;
+            n_right[b] = n;
+        }
+
+        AABB left;
+        int n_left { 0 };
+        for (int b = 0; b < NUM_BINS - 1; b++)
+        {
+            left.grow(bins[b].bounds);
+            n_left += bins[b].count;
+            if (n_left == 0 || n_left == count)
+                continue;
+
+            float cost { left.area() * n_left + right[b + 1].area() * n_right[b + 1] };
+            if (cost < obj_cost)
+            {
+                obj_cost = cost;
+                obj_axis = axis;
+                obj_bin = b;
+                obj_left = left;
+                obj_right = right[b + 1];
+            }
+        }
+    }
+
+    /* Spatial split, NUM_SPATIAL_BINS equal slices of the node's bounds per axis
+     * Each reference is clipped to every slice it spans, and counted where it enters and where it
+     * exits, so a plane between two slices has every reference entering before it on its left and
+     * every one exiting after it on its right, straddling references on both
+     */
+    int sp_axis { -1 };
+    float sp_pos { 0.0f };
+    float sp_cost { std::numeric_limits<float>::infinity() };
+
+    bool try_spatial { ctx.num_refs < ctx.max_refs &&
+                        (obj_axis < 0 || obj_left.overlap(obj_right).area() > ctx.min_overlap_area) };
+    for (int axis = 0; try_spatial && axis < 3; axis++)
+    {
+        float lo { bounds.min[axis] }, extent { bounds.max[axis] - bounds.min[axis] };
+        if (!(extent > 0.0f))
+            continue;
+
+        auto slice_of = [lo, extent](float x)
+        {
+            int b { (int)((x - lo) * NUM_SPATIAL_BINS / extent) };
+            return std::max(0, std::min(b, NUM_SPATIAL_BINS - 1));
+        };
+        auto plane = [lo, extent](int b) { return lo + extent * b / NUM_SPATIAL_BINS; };
+
+        Bin bins[NUM_SPATIAL_BINS];
+        for (const Reference &ref : refs)
+        {
+            int first { slice_of(ref.bounds.min[axis]) }, last { slice_of(ref.bounds.max[axis]) };
+            bins[first].count++;
+            bins[last].exits++;
+
+            if (first == last)
+            {
+                bins[first].bounds.grow(ref.bounds);
+                continue;
+            }
+
+            for (int b = first; b <= last; b++)
+            {
+                AABB slice { bounds };
+                slice.min[axis] = plane(b);
+                slice.max[axis] = (b == NUM_SPATIAL_BINS - 1) ? bounds.max[axis] : plane(b + 1);
+                bins[b].bounds.grow(clip_ref(ref, slice));
+            }
+        }
+
+        AABB right[NUM_SPATIAL_BINS];
+        int n_right[NUM_SPATIAL_BINS];
+        AABB r;
+        int n { 0 };
+        for (int b = NUM_SPATIAL_BINS - 1; b > 0; b--)
+        {
+            r.grow(bins[b].bounds);
+            n += bins[b].exits;
+            right[b] = r;
+            n_right[b] = n;
+        }
+
+        AABB left;
+        int n_left { 0 };
+        for (int b = 0; b < NUM_SPATIAL_BINS - 1; b++)
+        {
+            left.grow(bins[b].bounds);
+            n_left += bins[b].count;
+            if (n_left == 0 || n_right[b + 1] == 0 || (n_left == count && n_right[b + 1] == count))
+                continue;
+
+            int duplicates { n_left + n_right[b + 1] - count };
+            if (ctx.num_refs + duplicates > ctx.max_refs)
+                continue;
+
+            float cost { left.area() * n_left + right[b + 1].area() * n_right[b + 1] };
+            if (cost < sp_cost)
+            {
+                sp_cost = cost;
+                sp_axis = axis;
+                sp_pos = plane(b + 1);
+            }
+        }
+    }
+
+    std::vector<Reference> left, right;
+    if (sp_axis >= 0 && sp_cost < obj_cost)
+    {
+        for (const Reference &ref : refs)
+        {
+            if (ref.bounds.max[sp_axis] <= sp_pos)
+            {
+                left.push_back(ref);
+            }
+            else if (ref.bounds.min[sp_axis] >= sp_pos)
+            {
+                right.push_back(ref);
+            }
+            else
+            {
+                AABB left_box { ref.bounds }, right_box { ref.bounds };
+                left_box.max[sp_axis] = sp_pos;
+                right_box.min[sp_axis] = sp_pos;
+
+                AABB l { clip_ref(ref, left_box) }, r { clip_ref(ref, right_box) };
+                if (!l.empty())
+                    left.push_back(Reference { ref.prim, l });
+                if (!r.empty())
+                    right.push_back(Reference { ref.prim, r });
+            }
+        }
+
+        // Clipping can drop a side that was only touched, then the split is no use
+        if (left.empty() || right.empty())
+        {
+            left.clear();
+            right.clear();
+        }
+        else
+        {
+            ctx.num_refs += left.size() + right.size() - count;
+        }
+    }
+
+    if (left.empty())
+    {
+        if (obj_axis >= 0)
+        {
+            for (const Reference &ref : refs)
+                (centroid_bin(ref, obj_axis) <= obj_bin ? left : right).push_back(ref);
+        }
+        else
+        {
+            left.assign(refs.begin(), refs.begin() + count / 2);
+            right.assign(refs.begin() + count / 2, refs.end());
+        }
+    }
+
+    // Only the children's references are needed from here on
+    refs.clear();
+    refs.shrink_to_fit();
+
+    int first { (int)nodes.size() };
+    nodes.resize(first + 2);
+    build_area.resize(first + 2);
+    nodes[node].first = first;
+    nodes[node].count = 0;
+
+    build_spatial_node(first, left, depth + 1, ctx);
+    build_spatial_node(first + 1, right, depth + 1, ctx);
+}
+
+
+
+/* Children are stored after their parents, so sweeping the nodes backwards
+ * updates every child before the parent that depends on it
+ */
+void BVH::refit(const std::vector<AABB> &prim_bounds)
+{
+    gather_leaf_bounds(prim_bounds);
+
+    for (int n = nodes.size() - 1; n >= 0; n--)
+    {
+        BVHNode &node { nodes[n] };
+        AABB bounds;
+        if (node.count > 0)
+        {
+            for (int i = node.first; i < node.first + node.count; i++)
+                bounds.grow(leaf_bounds[i]);
+        }
+        else
+        {
+            bounds.grow(nodes[node.first].bounds);
+            bounds.grow(nodes[node.first + 1].bounds);
+        }
+        node.bounds = bounds;
+    }
+}
+
+
+
+BVHUpdate BVH::update(const std::vector<AABB> &prim_bounds)
+{
+    if ((int)prim_bounds.size() != prim_count || nodes.empty())
+    {
+        build(prim_bounds, split);
+        return BVHUpdate::FullRebuild;
+    }
+
+    refit(prim_bounds);
+
+    if (sah_cost() > build_cost * FULL_REBUILD_RATIO)
+    {
+        build(prim_bounds, split);
+        return BVHUpdate::FullRebuild;
+    }
+
+    // Rebuild the highest subtrees that have loosened too much, the rest are left as refitted
+    std::vector<Vec3> centroids;
+    std::vector<std::pair<int, int>> stack { { 0, 0 } };
+    bool rebuilt { false };
+    while (!stack.empty())
+    {
+        int n { stack.back().first }, depth { stack.back().second };
+        stack.pop_back();
+
+        const BVHNode &node { nodes[n] };
+        if (node.count > 0)
+            continue;
+
+        if (node.bounds.area() > build_area[n] * PARTIAL_REBUILD_GROWTH)
+        {
+            if (centroids.empty())
+            {
+                centroids.reserve(prim_count);
+                for (const AABB &b : prim_bounds)
+                    centroids.push_back(b.centroid());
+            }
+
+            // New nodes go on the end, make room for the worst case first
+            int begin, end;
+            subtree_range(n, begin, end);
+            dead_nodes += count_nodes(n) - 1;
+
+            int first_new = nodes.size();
+            nodes.resize(first_new + 2 * (end - begin));
+            build_area.resize(nodes.size());
+
+            BuildContext ctx { prim_bounds, centroids, split, nullptr, nullptr, first_new };
+            build_node(n, begin, end, depth, ctx);
+            nodes.resize(ctx.next_node);
+            build_area.resize(nodes.size());
+            rebuilt = true;
+            continue;
+        }
+
+        stack.push_back({ node.first, depth + 1 });
+        stack.push_back({ node.first + 1, depth + 1 });
+    }
+
+    if (!rebuilt)
+        return BVHUpdate::Refit;
+
+    gather_leaf_bounds(prim_bounds);
+
+    // Orphaned nodes still cost time in every refit, compact the tree once they dominate it
+    if (dead_nodes > (int)nodes.size() / 2)
+    {
+        build(prim_bounds, split);
+        return BVHUpdate::FullRebuild;
+    }
+
+    return BVHUpdate::PartialRebuild;
+}
+
+
+
+float BVH::sah_cost() const
+{
+    if (nodes.empty())
+        return 0.0f;
+
+    float root_area { nodes[0].bounds.area() };
+    if (root_area <= 0.0f)
+        return 0.0f;
+
+    float cost { 0.0f };
+    std::vector<int> stack { 0 };
+    while (!stack.empty())
+    {
+        const BVHNode &node { nodes[stack.back()] };
+        stack.pop_back();
+
+        float area { node.bounds.area() / root_area };
+        if (node.count > 0)
+        {
+            cost += COST_INTERSECT * node.count * area;
+        }
+        else
+        {
+            cost += COST_TRAVERSAL * area;
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+        }
+    }
+
+    return cost;
+}
+
+
+
+// Every subtree covers a contiguous range of indices, from its leftmost to its rightmost leaf
+void BVH::subtree_range(int node, int &begin, int &end) const
+{
+    int n { node };
+    while (nodes[n].count == 0)
+        n = nodes[n].first;
+    begin = nodes[n].first;
+
+    n = node;
+    while (nodes[n].count == 0)
+        n = nodes[n].first + 1;
+    end = nodes[n].first + nodes[n].count;
+}
+
+
+
+int BVH::count_nodes(int node) const
+{
+    int count { 0 };
+    std::vector<int> stack { node };
+    while (!stack.empty())
+    {
+        const BVHNode &n { nodes[stack.back()] };
+        stack.pop_back();
+        count++;
+
+        if (n.count == 0)
+        {
+            stack.push_back(n.first);
+            stack.push_back(n.first + 1);
+        }
+    }
+
+    return count;
+}
+
+
+
+void BVH::gather_leaf_bounds(const std::vector<AABB> &prim_bounds)
+{
+    leaf_bounds.resize(indices.size());
+    for (unsigned int i = 0; i < indices.size(); i++)
+        leaf_bounds[i] = prim_bounds[indices[i]];
+}
@@ -0,0 +1,278 @@
+#ifndef __BVH_HPP
+#define __BVH_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "threadpool.hpp"
+
+
+typedef glm::vec3 Vec3;
+
+
+// Relative slack given to hits outside the bounds of the primitive they're on, see AABB::hit_range
+const float HIT_TOLERANCE { 1e-3f };
+
+
+// Axis-aligned bounding box, a default constructed box is empty
+struct AABB
+{
+    Vec3 min, max;
+
+    AABB();
+    AABB(Vec3 min, Vec3 max);
+
+    void grow(Vec3 p);
+    void grow(const AABB &b);
+
+    // Pads the box so primitives lying exactly on its faces aren't missed due to rounding
+    void pad();
+
+    // Part of this box that is also inside b, empty if they don't overlap
+    AABB overlap(const AABB &b) const;
+
+    bool empty() const;
+    bool is_finite() const;
+    Vec3 centroid() const;
+    float area() const;
+
+    /* Slab test against the ray p0 + d * t for t >= 0, inv_d is the component-wise inverse of d
+     * (see safe_inverse). Returns false if the ray misses the box, otherwise sets t_min and t_max
+     * to the range of t where a hit on something inside the box is believable: the part of the
+     * ray inside the box, widened by HIT_TOLERANCE to allow for rounding in the hit's own test
+     */
+    bool hit_range(Vec3 p0, Vec3 inv_d, float &t_min, float &t_max) const
+    {
+        float t_enter { 0.0f }, t_exit { std::numeric_limits<float>::infinity() };
+        for (int i = 0; i < 3; i++)
+        {
+            float t_near { (min[i] - p0[i]) * inv_d[i] };
+            float t_far { (max[i] - p0[i]) * inv_d[i] };
+            if (t_near > t_far)
+                std::swap(t_near, t_far);
+
+            t_enter = t_near > t_enter ? t_near : t_enter;
+            t_exit = t_far < t_exit ? t_far : t_exit;
+            if (t_enter > t_exit)
+                return false;
+        }
+
+        t_min = t_enter * (1.0f - HIT_TOLERANCE);
+        t_max = t_exit * (1.0f + HIT_TOLERANCE);
+        return true;
+    }
+};
+
+
+// Inverse of a ray direction with zero components replaced by tiny ones, so slab tests never see 0 * inf
+Vec3 safe_inverse(Vec3 d);
+
+
+/* Node of a binary BVH
+ * Interior nodes have count == 0 and their children at first and first + 1
+ * Leaves hold count primitives starting at BVH::indices[first]
+ * Children are always stored after their parent, so a reverse sweep visits children first
+ */
+struct BVHNode
+{
+    AABB bounds;
+    int first;
+    int count;
+};
+
+
+/* How BVH::build picks where to split a node
+ * Median - At the median primitive along the longest axis, keeps the tree balanced, which matters
+ *          more than split quality when primitives move and the tree is refitted rather than rebuilt
+ * SAH - At the cheapest of NUM_BINS planes per axis by the surface area heuristic, gives a much
+ *       tighter tree over static geometry like mesh triangles
+ */
+enum class BVHSplit { Median, SAH };
+
+
+/* Limits on the spatial splits made by BVH::build_spatial
+ * max_duplication - Memory budget, the tree may hold at most this many extra references per primitive
+ *                   on average, e.g. 0.5 lets it grow to 1.5 times the references of an object split tree
+ * min_overlap - Spatial splits are only tried on nodes whose best object split gives children that
+ *               overlap by more than this fraction of the root's surface area, elsewhere they rarely win
+ */
+struct SpatialSplitOptions
+{
+    float max_duplication;
+    float min_overlap;
+
+    SpatialSplitOptions();
+};
+
+
+// Bounds of the part of primitive prim that lies inside box, empty if none of it does
+typedef std::function<AABB(int prim, const AABB &box)> ClipFunction;
+
+
+/* Work done by the traversals run on this thread, for benchmarks and cost reports
+ * nodes_visited - Nodes whose bounds were tested, a BVH4 node tests all 4 children at once
+ * prims_tested - Calls to the intersect function, including repeats of a primitive that a
+ *                spatial split has put in several leaves
+ * rays - Rays fire_ray traced through the scene
+ * Traversals add to these once they finish, callers reset them however they like
+ */
+struct TraversalStats
+{
+    uint64_t nodes_visited;
+    uint64_t prims_tested;
+    uint64_t rays;
+};
+
+extern thread_local TraversalStats traversal_stats;
+
+
+// What BVH::update had to do to keep the tree in shape
+enum class BVHUpdate { Refit, PartialRebuild, FullRebuild };
+
+
+/* Bounding volume hierarchy over a list of primitive bounds
+ * The BVH only deals in primitive indices, callers test the primitives themselves
+ * (see traverse), so the same structure serves scene objects and mesh triangles
+ */
+class BVH
+{
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> indices;
+
+    /* Bounds of each primitive, in the same order as indices
+     * After a spatial split build a primitive can appear more than once in indices, each time
+     * with the bounds of just the part of it in that leaf
+     */
+    std::vector<AABB> leaf_bounds;
+
+    /* Builds the tree from scratch
+     * With a pool, subtrees are built as separate tasks and large nodes are binned in parallel.
+     * The tree is the same whichever pool builds it, only the order of the nodes changes
+     */
+    void build(const std::vector<AABB> &prim_bounds, BVHSplit split = BVHSplit::Median,
+                ThreadPool *pool = nullptr);
+
+    /* Builds an SBVH, an SAH tree where a node can also be split by a plane that cuts through
+     * primitives, putting the part on each side into each child (see bvh.cpp)
+     * Far tighter than object splits alone around long, thin or overlapping primitives such as
+     * architectural meshes, at the cost of extra references (bounded by options.max_duplication)
+     * clip gives the bounds of part of a primitive, prim_bounds must enclose every primitive.
+     * Refitting the tree afterwards falls back to whole primitive bounds, and rebuilds made by
+     * update() use object splits only, so trees over moving primitives shouldn't be built this way
+     */
+    void build_spatial(const std::vector<AABB> &prim_bounds, ClipFunction clip,
+                        const SpatialSplitOptions &options = SpatialSplitOptions {});
+
+    // Recalculates every node's bounds bottom-up after primitives moved, O(n), keeps the topology
+    void refit(const std::vector<AABB> &prim_bounds);
+
+    /* Refits the tree, then rebuilds whatever refitting made too loose
+     * Subtrees whose bounds have grown by more than PARTIAL_REBUILD_GROWTH times their area at build
+     * time are rebuilt in place, if the whole tree's SAH cost has grown by more than FULL_REBUILD_RATIO
+     * it is rebuilt from scratch
+     */
+    BVHUpdate update(const std::vector<AABB> &prim_bounds);
+
+    // Surface area heuristic cost of the tree relative to its root
+    float sah_cost() const;
+
+    int size() const { return prim_count; }
+
+    /* Visits every primitive whose bounds the ray p0 + d * t hits for some t <= t_max
+     * intersect(prim, t_min, t_max) tests one primitive and returns the new t_max, so
+     * returning a closer hit prunes the rest of the search
+     *
+     * Only hits within [t_min, t_max] (the primitive's AABB::hit_range) should be counted.
+     * Anything outside is a rounding error in the primitive's own test and, since it may or
+     * may not be pruned, counting it would make the result depend on the shape of the tree
+     */
+    template <typename F>
+    void traverse(Vec3 p0, Vec3 d, float t_max, F intersect) const
+    {
+        if (nodes.empty())
+            return;
+
+        Vec3 inv_d { safe_inverse(d) };
+        float t_lo, t_hi;
+        int stack[MAX_DEPTH + 2];
+        int sp { 0 };
+        stack[sp++] = 0;
+        int visited { 0 }, tested { 0 };
+
+        while (sp > 0)
+        {
+            const BVHNode &node { nodes[stack[--sp]] };
+            visited++;
+            if (!node.bounds.hit_range(p0, inv_d, t_lo, t_hi) || t_lo > t_max)
+                continue;
+
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    if (leaf_bounds[i].hit_range(p0, inv_d, t_lo, t_hi) && t_lo <= t_max)
+                    {
+                        t_max = intersect(indices[i], t_lo, t_hi);
+                        tested++;
+                    }
+                }
+            }
+            else
+            {
+                // Visit the child on the ray's side first so closer hits prune the other
+                int near { node.first }, far { node.first + 1 };
+                if (glm::dot(nodes[far].bounds.centroid() - nodes[near].bounds.centroid(), d) < 0.0f)
+                    std::swap(near, far);
+
+                stack[sp++] = far;
+                stack[sp++] = near;
+            }
+        }
+
+        traversal_stats.nodes_visited += visited;
+        traversal_stats.prims_tested += tested;
+    }
+
+    // Trees are never deeper than this, which bounds the traversal stack
+    static const int MAX_DEPTH { 64 };
+
+private:
+    int prim_count { 0 };
+    float build_cost { 0.0f };
+    BVHSplit split { BVHSplit::Median };
+
+    // Area of each node when it was built, used to tell how much refitting has loosened it
+    std::vector<float> build_area;
+
+    // Nodes orphaned by partial rebuilds, the tree is compacted by a full rebuild when this gets large
+    int dead_nodes { 0 };
+
+    // State shared by every node of one build, see bvh.cpp
+    struct BuildContext;
+    struct SpatialContext;
+
+    // Part of a primitive, the only kind of thing a spatial split build deals in
+    struct Reference
+    {
+        int prim;
+        AABB bounds;
+    };
+
+    void build_node(int node, int begin, int end, int depth, BuildContext &ctx);
+    void range_bounds(int begin, int end, BuildContext &ctx, AABB &bounds, AABB &centroid_bounds) const;
+    int split_median(int begin, int end, const AABB &centroid_bounds, BuildContext &ctx);
+    int split_sah(int begin, int end, const AABB &centroid_bounds, BuildContext &ctx);
+    void build_spatial_node(int node, std::vector<Reference> &refs, int depth, SpatialContext &ctx);
+    void subtree_range(int node, int &begin, int &end) const;
+    int count_nodes(int node) const;
+    void gather_leaf_bounds(const std::vector<AABB> &prim_bounds);
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "bvh4.hpp"
+
+
+// Exponents are kept in the range of normal floats so 2^exponent can be built from its bits
+const int MIN_EXPONENT { -126 };
+const int MAX_EXPONENT { 127 };
+
+const int QUANT_STEPS { 255 };
+
+
+
+// 2^e as a float, e must be in [MIN_EXPONENT, MAX_EXPONENT]
+static float exp2_bits(int e)
+{
+    uint32_t bits { (uint32_t)(e + 127) << 23 };
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+
+// Position of quantization step q, the same float operations are used when traversing
+static float dequantize(float origin, float scale, int q)
+{
+    return origin + (float)q * scale;
+}
+
+
+
+void BVH4::clear()
+{
+    nodes.clear();
+    indices.clear();
+    leaf_bounds.clear();
+    bounds = AABB {};
+}
+
+
+
+void BVH4::build(const BVH &bvh)
+{
+    clear();
+    if (bvh.nodes.empty())
+        return;
+
+    indices = bvh.indices;
+    leaf_bounds = bvh.leaf_bounds;
+    bounds = bvh.nodes[0].bounds;
+    if (bvh.nodes[0].count > 0)
+        return;
+
+    nodes.reserve(bvh.nodes.size() / 2 + 1);
+    collapse(bvh, 0);
+}
+
+
+
+/* Turns the binary subtree under node into a BVH4 node
+ * Up to four children are gathered by repeatedly opening the largest interior child,
+ * which keeps the collapsed tree about as good as the binary one by the SAH
+ */
+int BVH4::collapse(const BVH &bvh, int node)
+{
+    std::vector<int> children;
+    if (bvh.nodes[node].count > 0)
+        children.push_back(node);
+    else
+        children = { bvh.nodes[node].first, bvh.nodes[node].first + 1 };
+
+    while (children.size() < 4)
+    {
+        int largest { -1 };
+        float largest_area { -1.0f };
+        for (unsigned int i = 0; i < children.size(); i++)
+        {
+            const BVHNode &c { bvh.nodes[children[i]] };
+            if (c.count == 0 && c.bounds.area() > largest_area)
+            {
+                largest = i;
+                largest_area = c.bounds.area();
+            }
+        }
+        if (largest < 0)
+            break;
+
+        int opened { children[largest] };
+        children[largest] = bvh.nodes[opened].first;
+        children.push_back(bvh.nodes[opened].first + 1);
+    }
+
+    int index = nodes.size();
+    nodes.push_back(BVH4Node {});
+
+    AABB bounds;
+    for (int c : children)
+        bounds.grow(bvh.nodes[c].bounds);
+
+    BVH4Node quantized {};
+    quantized.num_children = children.size();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float origin { bounds.min[axis] };
+        float extent { bounds.max[axis] - bounds.min[axis] };
+
+        // Smallest step that lets QUANT_STEPS steps from the origin reach the far side
+        int e { MIN_EXPONENT };
+        if (extent > 0.0f)
+        {
+            int exp2;
+            std::frexp(extent / QUANT_STEPS, &exp2);
+            e = std::max(MIN_EXPONENT, std::min(MAX_EXPONENT, exp2 - 1));
+        }
+        while (e < MAX_EXPONENT && dequantize(origin, exp2_bits(e), QUANT_STEPS) < bounds.max[axis])
+            e++;
+
+        float scale { exp2_bits(e) };
+        quantized.origin[axis] = origin;
+        quantized.exponent[axis] = e;
+
+        for (unsigned int i = 0; i < children.size(); i++)
+        {
+            const AABB &b { bvh.nodes[children[i]].bounds };
+
+            // Round outwards, then fix up anything rounding in the dequantization pushed back inside
+            int lo = std::floor((b.min[axis] - origin) / scale);
+            int hi = std::ceil((b.max[axis] - origin) / scale);
+            lo = std::max(0, std::min(QUANT_STEPS, lo));
+            hi = std::max(0, std::min(QUANT_STEPS, hi));
+            while (lo > 0 && dequantize(origin, scale, lo) > b.min[axis])
+                lo--;
+            while (hi < QUANT_STEPS && dequantize(origin, scale, hi) < b.max[axis])
+                hi++;
+
+            quantized.qmin[axis][i] = lo;
+            quantized.qmax[axis][i] = hi;
+        }
+    }
+
+    for (unsigned int i = 0; i < children.size(); i++)
+    {
+        const BVHNode &c { bvh.nodes[children[i]] };
+        if (c.count > 0)
+        {
+            if (c.count > UINT16_MAX)
+                throw std::runtime_error("BVH leaf too large to collapse");
+
+            quantized.child[i] = c.first;
+            quantized.count[i] = c.count;
+        }
+        else
+        {
+            quantized.child[i] = collapse(bvh, children[i]);
+            quantized.count[i] = 0;
+        }
+    }
+
+    nodes[index] = quantized;
+    return index;
+}
+
+
+
+int BVH4::intersect_children_scalar(const BVH4Node &node, Vec3 p0, Vec3 inv_d, float t_max, float t_enter[4])
+{
+    int mask { 0 };
+    for (int i = 0; i < node.num_children; i++)
+    {
+        float enter { 0.0f }, exit { std::numeric_limits<float>::infinity() };
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float scale { exp2_bits(node.exponent[axis]) };
+            float t_near { (dequantize(node.origin[axis], scale, node.qmin[axis][i]) - p0[axis]) * inv_d[axis] };
+            float t_far { (dequantize(node.origin[axis], scale, node.qmax[axis][i]) - p0[axis]) * inv_d[axis] };
+            if (t_near > t_far)
+                std::swap(t_near, t_far);
+
+            enter = t_near > enter ? t_near : enter;
+            exit = t_far < exit ? t_far : exit;
+        }
+
+        t_enter[i] = enter;
+        if (enter <= exit && enter * (1.0f - HIT_TOLERANCE) <= t_max)
+            mask |= 1 << i;
+    }
+
+    return mask;
+}
+
+
+
+#ifdef __SSE2__
+
+// Widens the 4 bytes at q to 4 floats
+static inline __m128 load_quantized(const uint8_t q[4])
+{
+    int32_t packed;
+    std::memcpy(&packed, q, sizeof(packed));
+    __m128i zero { _mm_setzero_si128() };
+    __m128i bytes { _mm_cvtsi32_si128(packed) };
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+
+int BVH4::intersect_children(const BVH4Node &node, Vec3 p0, Vec3 inv_d, float t_max, float t_enter[4])
+{
+    __m128 enter { _mm_setzero_ps() };
+    __m128 exit { _mm_set1_ps(std::numeric_limits<float>::infinity()) };
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m128 origin { _mm_set1_ps(node.origin[axis]) };
+        __m128 scale { _mm_set1_ps(exp2_bits(node.exponent[axis])) };
+        __m128 p { _mm_set1_ps(p0[axis]) };
+        __m128 inv { _mm_set1_ps(inv_d[axis]) };
+
+        __m128 lo { _mm_add_ps(origin, _mm_mul_ps(load_quantized(node.qmin[axis]), scale)) };
+        __m128 hi { _mm_add_ps(origin, _mm_mul_ps(load_quantized(node.qmax[axis]), scale)) };
+        __m128 t0 { _mm_mul_ps(_mm_sub_ps(lo, p), inv) };
+        __m128 t1 { _mm_mul_ps(_mm_sub_ps(hi, p), inv) };
+
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+    }
+
+    _mm_storeu_ps(t_enter, enter);
+
+    __m128 lower { _mm_mul_ps(enter, _mm_set1_ps(1.0f - HIT_TOLERANCE)) };
+    __m128 hit { _mm_and_ps(_mm_cmple_ps(enter, exit), _mm_cmple_ps(lower, _mm_set1_ps(t_max))) };
+
+    return _mm_movemask_ps(hit) & ((1 << node.num_children) - 1);
+}
+
+#else
+
+int BVH4::intersect_children(const BVH4Node &node, Vec3 p0, Vec3 inv_d, float t_max, float t_enter[4])
+{
+    return intersect_children_scalar(node, p0, inv_d, t_max, t_enter);
+}
+
+#endif
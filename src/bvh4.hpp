@@ -0,0 +1,202 @@
+#ifndef __BVH4_HPP
+#define __BVH4_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bvh.hpp"
+
+
+// Allocator for std::vector that aligns storage to Align bytes, so nodes start on cache lines
+template <typename T, std::size_t Align>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align> &) {}
+
+    T *allocate(std::size_t n)
+    {
+        void *p { nullptr };
+        if (posix_memalign(&p, Align, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t) { free(p); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Align> &) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Align> &) const { return false; }
+};
+
+
+/* Node of a 4-wide BVH, exactly one 64 byte cache line
+ * Child bounds are stored SoA ([axis][child]) and quantized to 8 bits per plane, as steps of
+ * 2^exponent from the node's origin. They are rounded outwards, so a dequantized box always
+ * contains the child it stands for.
+ * Slot i < num_children is a leaf of count[i] primitives starting at BVH4::indices[child[i]]
+ * if count[i] > 0, otherwise child[i] is the index of an interior node
+ */
+struct BVH4Node
+{
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t num_children;
+    uint8_t qmin[3][4];
+    uint8_t qmax[3][4];
+    int32_t child[4];
+    uint16_t count[4];
+};
+
+static_assert(sizeof(BVH4Node) == 64, "BVH4Node should fill one cache line");
+
+
+/* 4-wide BVH, collapsed from a binary BVH
+ * Each node visit tests all four children against the ray at once (with SSE where available),
+ * and the quantized nodes mean a visit touches a single cache line. Hits are reported exactly
+ * like BVH::traverse, so both trees find the same closest hit
+ */
+class BVH4
+{
+public:
+    std::vector<BVH4Node, AlignedAllocator<BVH4Node, 64>> nodes;
+    std::vector<int> indices;
+    std::vector<AABB> leaf_bounds;
+
+    /* Bounds of the whole tree, tested first so rays that miss everything skip the 4-wide test
+     * A tree that is a single leaf has no nodes, its primitives are tested straight after this
+     */
+    AABB bounds;
+
+    // Collapses bvh into this tree, must be called again whenever bvh changes
+    void build(const BVH &bvh);
+    void clear();
+
+    /* Slab test of the ray p0 + d * t against every child of node
+     * Returns a bitmask of the children that are hit for some t <= t_max (with the same
+     * tolerance as AABB::hit_range) and stores where each one is entered in t_enter
+     */
+    static int intersect_children(const BVH4Node &node, Vec3 p0, Vec3 inv_d, float t_max, float t_enter[4]);
+
+    // Portable version of intersect_children, gives exactly the same results
+    static int intersect_children_scalar(const BVH4Node &node, Vec3 p0, Vec3 inv_d, float t_max,
+                                            float t_enter[4]);
+
+    // Same contract as BVH::traverse
+    template <typename F>
+    void traverse(Vec3 p0, Vec3 d, float t_max, F intersect) const
+    {
+        if (leaf_bounds.empty())
+            return;
+
+        // The root's bounds count as a node, like the binary BVH's root
+        traversal_stats.nodes_visited++;
+
+        Vec3 inv_d { safe_inverse(d) };
+        float t_enter[4];
+        float t_lo, t_hi;
+        if (!bounds.hit_range(p0, inv_d, t_lo, t_hi) || t_lo > t_max)
+            return;
+
+        // Small enough to be a single leaf
+        int visited { 0 }, tested { 0 };
+        if (nodes.empty())
+        {
+            for (unsigned int i = 0; i < leaf_bounds.size(); i++)
+            {
+                if (leaf_bounds[i].hit_range(p0, inv_d, t_lo, t_hi) && t_lo <= t_max)
+                {
+                    t_max = intersect(indices[i], t_lo, t_hi);
+                    tested++;
+                }
+            }
+
+            traversal_stats.nodes_visited += visited;
+            traversal_stats.prims_tested += tested;
+            return;
+        }
+
+        // Interior nodes are pushed as their index, leaves as ~(4 * node + slot)
+        int stack[3 * BVH::MAX_DEPTH + 4];
+        int sp { 0 };
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            int entry { stack[--sp] };
+            if (entry < 0)
+            {
+                const BVH4Node &node { nodes[~entry >> 2] };
+                int slot { ~entry & 3 };
+                int end { node.child[slot] + node.count[slot] };
+                for (int i = node.child[slot]; i < end; i++)
+                {
+                    if (leaf_bounds[i].hit_range(p0, inv_d, t_lo, t_hi) && t_lo <= t_max)
+                    {
+                        t_max = intersect(indices[i], t_lo, t_hi);
+                        tested++;
+                    }
+                }
+                continue;
+            }
+
+            const BVH4Node &node { nodes[entry] };
+            visited++;
+            int mask { intersect_children(node, p0, inv_d, t_max, t_enter) };
+            if (mask == 0)
+                continue;
+
+            // Most visits hit a single child, which needs no sorting
+            if ((mask & (mask - 1)) == 0)
+            {
+                int i { (mask & 1) ? 0 : (mask & 2) ? 1 : (mask & 4) ? 2 : 3 };
+                stack[sp++] = (node.count[i] > 0) ? ~(4 * entry + i) : node.child[i];
+                continue;
+            }
+
+            // Push the hit children furthest first, so the nearest is visited next
+            int order[4];
+            int num_hit { 0 };
+            for (int i = 0; i < 4; i++)
+            {
+                if (!(mask & (1 << i)))
+                    continue;
+
+                int j { num_hit++ };
+                while (j > 0 && t_enter[order[j - 1]] < t_enter[i])
+                {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = i;
+            }
+
+            for (int k = 0; k < num_hit; k++)
+            {
+                int i { order[k] };
+                stack[sp++] = (node.count[i] > 0) ? ~(4 * entry + i) : node.child[i];
+            }
+        }
+
+        traversal_stats.nodes_visited += visited;
+        traversal_stats.prims_tested += tested;
+    }
+
+private:
+    int collapse(const BVH &bvh, int node);
+};
+
+#endif
@@ -0,0 +1,823 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "distributed.hpp"
+#include "sceneloader.hpp"
+
+
+typedef std::chrono::steady_clock Clock;
+
+// Message types sent between the coordinator and workers
+const uint32_t MSG_JOB { 1 };       // coordinator -> worker: scene file and render settings
+const uint32_t MSG_TILE { 2 };      // coordinator -> worker: a tile to render
+const uint32_t MSG_RESULT { 3 };    // worker -> coordinator: the pixels of a finished tile
+const uint32_t MSG_ERROR { 4 };     // worker -> coordinator: the job could not be started
+
+// Upper bound on message size, anything larger is treated as a broken connection
+const uint32_t MAX_MESSAGE_WORDS { 1 << 26 };
+
+// How often the coordinator wakes up to check for slow tiles
+const int POLL_INTERVAL_MS { 50 };
+
+// How long to wait between attempts to connect to a coordinator
+const int CONNECT_RETRY_MS { 100 };
+
+
+
+DistributedOptions::DistributedOptions()
+{
+    tile_size = DEFAULT_TILE_SIZE;
+    max_retries = 3;
+    speculate_factor = 3.0f;
+    max_copies = 2;
+    tile_timeout = 300.0f;
+}
+
+
+
+/* Packet
+ * A message is a type followed by a list of 32-bit words, sent in network byte order
+ * so coordinators and workers don't need to share an architecture
+ */
+class Packet
+{
+public:
+    uint32_t type;
+    std::vector<uint32_t> words;
+
+    Packet(uint32_t type = 0) : type { type }, pos { 0 } {}
+
+    void put(uint32_t w) { words.push_back(w); }
+
+    void put_float(float f)
+    {
+        uint32_t w;
+        memcpy(&w, &f, sizeof(w));
+        words.push_back(w);
+    }
+
+    void put_string(std::string s)
+    {
+        put(s.size());
+        for (unsigned int i = 0; i < s.size(); i += 4)
+        {
+            uint32_t w { 0 };
+            memcpy(&w, s.data() + i, std::min<size_t>(4, s.size() - i));
+            words.push_back(w);
+        }
+    }
+
+    uint32_t get()
+    {
+        if (pos >= words.size())
+            throw std::runtime_error("Message too short");
+        return words[pos++];
+    }
+
+    float get_float()
+    {
+        uint32_t w { get() };
+        float f;
+        memcpy(&f, &w, sizeof(f));
+        return f;
+    }
+
+    std::string get_string()
+    {
+        uint32_t len { get() };
+        if ((len + 3) / 4 > words.size() - pos)
+            throw std::runtime_error("Message too short");
+
+        std::string s(len, '\0');
+        for (unsigned int i = 0; i < len; i += 4)
+        {
+            uint32_t w { get() };
+            memcpy(&s[i], &w, std::min<size_t>(4, len - i));
+        }
+        return s;
+    }
+
+private:
+    size_t pos;
+};
+
+
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p { static_cast<const char *>(buf) };
+    while (len > 0)
+    {
+        // MSG_NOSIGNAL so a dead peer is reported as an error instead of killing us with SIGPIPE
+        ssize_t n { send(fd, p, len, MSG_NOSIGNAL) };
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p { static_cast<char *>(buf) };
+    while (len > 0)
+    {
+        ssize_t n { recv(fd, p, len, 0) };
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+
+static bool send_packet(int fd, const Packet &msg)
+{
+    std::vector<uint32_t> buf;
+    buf.reserve(msg.words.size() + 2);
+    buf.push_back(htonl(msg.type));
+    buf.push_back(htonl(msg.words.size()));
+    for (uint32_t w : msg.words)
+        buf.push_back(htonl(w));
+
+    return write_all(fd, buf.data(), buf.size() * sizeof(uint32_t));
+}
+
+
+
+static bool recv_packet(int fd, Packet &msg)
+{
+    uint32_t header[2];
+    if (!read_all(fd, header, sizeof(header)))
+        return false;
+
+    uint32_t num_words { ntohl(header[1]) };
+    if (num_words > MAX_MESSAGE_WORDS)
+        return false;
+
+    msg = Packet { ntohl(header[0]) };
+    msg.words.resize(num_words);
+    if (!read_all(fd, msg.words.data(), num_words * sizeof(uint32_t)))
+        return false;
+
+    for (uint32_t &w : msg.words)
+        w = ntohl(w);
+
+    return true;
+}
+
+
+
+/* Worker
+ * Loads the scene named in each job and renders every tile it is sent
+ * Errors loading the scene are reported to the coordinator rather than ending the worker,
+ * the coordinator decides whether the frame can still be finished without us
+ */
+void run_worker(int fd)
+{
+    std::shared_ptr<Scene> scene;
+    RenderSettings settings;
+    uint32_t job { 0 };
+    bool job_ok { false };
+    int width { 0 }, height { 0 };
+
+    std::vector<Vec3> px;
+    Packet msg;
+
+    try
+    {
+        while (recv_packet(fd, msg))
+        {
+            if (msg.type == MSG_JOB)
+            {
+                job = msg.get();
+                settings.recursion_level = (int)msg.get();
+                settings.ssample_div = (int)msg.get();
+                settings.num_shadows = (int)msg.get();
+                settings.accel = (AccelType)msg.get();
+                settings.spatial_splits.max_duplication = msg.get_float();
+                settings.spatial_splits.min_overlap = msg.get_float();
+                settings.batch_shading = msg.get() != 0;
+                settings.fast_pow = msg.get() != 0;
+                settings.wavefront = msg.get() != 0;
+                settings.sort_rays = msg.get() != 0;
+                settings.sampler = (SamplerType)msg.get();
+                settings.adaptive_shadows = (int)msg.get();
+                int exp_width { (int)msg.get() };
+                int exp_height { (int)msg.get() };
+                std::string scene_file { msg.get_string() };
+
+                // Always reload, the file may have changed since the last job
+                try
+                {
+                    scene = load_scene(scene_file);
+                    if (scene->camera == nullptr)
+                        throw std::invalid_argument("Scene has no camera");
+
+                    AccelType accel { (settings.accel == AccelType::Auto) ? scene->choose_accel() : settings.accel };
+                    if (scene->accel_type != accel)
+                    {
+                        scene->spatial_splits = settings.spatial_splits;
+                        scene->build_accel(accel);
+                    }
+
+                    image_size(scene->camera, width, height);
+                    if (width != exp_width || height != exp_height)
+                        throw std::invalid_argument("Image size does not match the coordinator's");
+
+                    job_ok = true;
+                }
+                catch (const std::invalid_argument &e)
+                {
+                    job_ok = false;
+
+                    Packet err { MSG_ERROR };
+                    err.put(job);
+                    err.put_string(scene_file + ": " + e.what());
+                    if (!send_packet(fd, err))
+                        break;
+                }
+            }
+            else if (msg.type == MSG_TILE)
+            {
+                uint32_t tile_job { msg.get() };
+                uint32_t tile_id { msg.get() };
+                Tile tile;
+                tile.x0 = (int)msg.get();
+                tile.y0 = (int)msg.get();
+                tile.x1 = (int)msg.get();
+                tile.y1 = (int)msg.get();
+
+                // Tiles for a job we couldn't start are ignored, the coordinator
+                // already knows from our error that we can't do them
+                if (!job_ok || tile_job != job)
+                    continue;
+
+                if (tile.x0 < 0 || tile.y0 < 0 || tile.x1 > width || tile.y1 > height ||
+                    tile.width() <= 0 || tile.height() <= 0)
+                    throw std::runtime_error("Tile out of bounds");
+
+                px.resize(tile.width() * tile.height());
+                render_tile(scene, width, height, tile, settings, px.data());
+
+                Packet result { MSG_RESULT };
+                result.words.reserve(2 + px.size() * 3);
+                result.put(job);
+                result.put(tile_id);
+                for (const Vec3 &c : px)
+                {
+                    result.put_float(c.x);
+                    result.put_float(c.y);
+                    result.put_float(c.z);
+                }
+
+                if (!send_packet(fd, result))
+                    break;
+            }
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Worker: " << e.what() << "\n";
+    }
+
+    close(fd);
+}
+
+
+
+void run_worker(std::string address)
+{
+    run_worker(connect_address(address));
+}
+
+
+
+/* Coordinator
+ * Hands out tiles to idle workers in row-major order. A tile lost to a failed worker
+ * goes back to the front of the queue. When the queue is empty, idle workers speculatively
+ * re-render tiles that are taking much longer than average, the first copy back wins.
+ */
+Pixel2D raytrace_distributed(std::shared_ptr<Scene> scene, std::string scene_file,
+                                const std::vector<int> &workers, int &width, int &height,
+                                const RenderSettings &settings, const DistributedOptions &options)
+{
+    static uint32_t next_job { 1 };
+    uint32_t job { next_job++ };
+
+    image_size(scene->camera, width, height);
+    std::vector<Tile> tiles { split_tiles(width, height, options.tile_size) };
+    int num_tiles = tiles.size();
+
+    Pixel2D px_data { new Pixel1D[width] };
+    for (int i = 0; i < width; i++)
+        px_data[i] = Pixel1D(new Vec3[height]);
+
+    struct WorkerState
+    {
+        int fd;
+        bool alive;
+        int tile;               // -1 when idle
+        Clock::time_point start;
+    };
+
+    std::vector<WorkerState> ws;
+    std::string last_error { "No workers" };
+
+    // Start the job on every worker
+    Packet job_msg { MSG_JOB };
+    job_msg.put(job);
+    job_msg.put(settings.recursion_level);
+    job_msg.put(settings.ssample_div);
+    job_msg.put(settings.num_shadows);
+    job_msg.put((uint32_t)settings.accel);
+    job_msg.put_float(settings.spatial_splits.max_duplication);
+    job_msg.put_float(settings.spatial_splits.min_overlap);
+    job_msg.put(settings.batch_shading);
+    job_msg.put(settings.fast_pow);
+    job_msg.put(settings.wavefront);
+    job_msg.put(settings.sort_rays);
+    job_msg.put((uint32_t)settings.sampler);
+    job_msg.put(settings.adaptive_shadows);
+    job_msg.put(width);
+    job_msg.put(height);
+    job_msg.put_string(scene_file);
+
+    for (int fd : workers)
+        ws.push_back(WorkerState { fd, send_packet(fd, job_msg), -1, Clock::now() });
+
+    std::deque<int> pending;
+    for (int t = 0; t < num_tiles; t++)
+        pending.push_back(t);
+
+    std::vector<bool> done(num_tiles, false);
+    std::vector<int> copies(num_tiles, 0), failures(num_tiles, 0);
+    int num_done { 0 };
+
+    // Running total of tile render times, used to spot slow tiles
+    double total_time { 0.0 };
+    int num_timed { 0 };
+
+    /* Stops using a worker, putting its tile back in the queue if nobody else has it
+     * Only workers that die mid-tile count against the tile's retries, a worker that
+     * couldn't start the job says nothing about the tile
+     */
+    auto lose_worker = [&](WorkerState &w, bool tile_failed)
+    {
+        w.alive = false;
+        if (w.tile < 0)
+            return;
+
+        int t { w.tile };
+        w.tile = -1;
+        copies[t]--;
+        if (!done[t] && copies[t] == 0)
+        {
+            if (tile_failed && ++failures[t] > options.max_retries)
+                throw std::runtime_error("Tile " + std::to_string(t) + " failed too many times");
+
+            if (tile_failed)
+                std::cerr << "Lost a worker, re-issuing tile " << t << "\n";
+            pending.push_front(t);
+        }
+    };
+
+    // Picks the next tile for an idle worker, or -1 if there is nothing worth doing
+    auto next_tile = [&]() -> int
+    {
+        if (!pending.empty())
+        {
+            int t { pending.front() };
+            pending.pop_front();
+            return t;
+        }
+
+        if (num_timed == 0)
+            return -1;
+
+        double threshold { options.speculate_factor * total_time / num_timed };
+        Clock::time_point now { Clock::now() };
+        int slowest { -1 };
+        double slowest_time { threshold };
+        for (const WorkerState &w : ws)
+        {
+            if (!w.alive || w.tile < 0 || done[w.tile] || copies[w.tile] >= options.max_copies)
+                continue;
+
+            double elapsed { std::chrono::duration<double>(now - w.start).count() };
+            if (elapsed > slowest_time)
+            {
+                slowest = w.tile;
+                slowest_time = elapsed;
+            }
+        }
+
+        return slowest;
+    };
+
+    while (num_done < num_tiles)
+    {
+        // Hand out work to idle workers
+        for (WorkerState &w : ws)
+        {
+            if (!w.alive || w.tile >= 0)
+                continue;
+
+            int t { next_tile() };
+            if (t < 0)
+                break;
+
+            Packet msg { MSG_TILE };
+            msg.put(job);
+            msg.put(t);
+            msg.put(tiles[t].x0);
+            msg.put(tiles[t].y0);
+            msg.put(tiles[t].x1);
+            msg.put(tiles[t].y1);
+
+            w.tile = t;
+            w.start = Clock::now();
+            copies[t]++;
+
+            if (!send_packet(w.fd, msg))
+                lose_worker(w, true);
+        }
+
+        // Drop workers that are stuck on a tile, speculation alone can't help if every worker is stuck
+        if (options.tile_timeout > 0.0f)
+        {
+            Clock::time_point now { Clock::now() };
+            for (WorkerState &w : ws)
+            {
+                if (!w.alive || w.tile < 0)
+                    continue;
+
+                double elapsed { std::chrono::duration<double>(now - w.start).count() };
+                if (elapsed > options.tile_timeout)
+                {
+                    last_error = "Timed out on tile " + std::to_string(w.tile);
+                    std::cerr << "Worker timed out on tile " << w.tile << "\n";
+
+                    // Hang up so a late result can't be mistaken for a new frame's
+                    shutdown(w.fd, SHUT_RDWR);
+                    lose_worker(w, true);
+                }
+            }
+        }
+
+        // Wait for results from any worker
+        std::vector<pollfd> fds;
+        std::vector<WorkerState *> polled;
+        for (WorkerState &w : ws)
+        {
+            if (!w.alive)
+                continue;
+
+            fds.push_back(pollfd { w.fd, POLLIN, 0 });
+            polled.push_back(&w);
+        }
+
+        if (fds.empty())
+            throw std::runtime_error("All workers failed: " + last_error);
+
+        if (poll(fds.data(), fds.size(), POLL_INTERVAL_MS) < 0 && errno != EINTR)
+            throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+
+        for (unsigned int i = 0; i < fds.size(); i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            WorkerState &w { *polled[i] };
+            Packet msg;
+            if (!recv_packet(w.fd, msg))
+            {
+                lose_worker(w, true);
+                continue;
+            }
+
+            bool failed { false }, job_failed { false };
+            try
+            {
+                uint32_t msg_job { msg.get() };
+                if (msg_job != job)
+                    continue;   // Left over from a speculative copy in an earlier frame
+
+                if (msg.type == MSG_ERROR)
+                {
+                    last_error = msg.get_string();
+                    std::cerr << "Worker failed: " << last_error << "\n";
+                    job_failed = true;
+                }
+                else if (msg.type != MSG_RESULT)
+                {
+                    throw std::runtime_error("Unexpected message");
+                }
+                else
+                {
+                    // Anyone can connect to a listening coordinator, so never trust the tile id
+                    uint32_t tile_id { msg.get() };
+                    if (w.tile < 0 || tile_id >= (uint32_t)num_tiles || (int)tile_id != w.tile)
+                        throw std::runtime_error("Result for a tile that wasn't requested");
+
+                    int t { w.tile };
+
+                    const Tile &tile { tiles[t] };
+                    if (msg.words.size() != 2 + (size_t)tile.width() * tile.height() * 3)
+                        throw std::runtime_error("Result has the wrong number of pixels");
+
+                    if (!done[t])
+                    {
+                        for (int y = tile.y0; y < tile.y1; y++)
+                        {
+                            for (int x = tile.x0; x < tile.x1; x++)
+                            {
+                                Vec3 &px { px_data[x][y] };
+                                px.x = msg.get_float();
+                                px.y = msg.get_float();
+                                px.z = msg.get_float();
+                            }
+                        }
+
+                        done[t] = true;
+                        num_done++;
+                        total_time += std::chrono::duration<double>(Clock::now() - w.start).count();
+                        num_timed++;
+                    }
+
+                    copies[t]--;
+                    w.tile = -1;
+                }
+            }
+            catch (const std::runtime_error &e)
+            {
+                // A worker talking nonsense is treated like one that died
+                last_error = e.what();
+                failed = true;
+            }
+
+            if (failed || job_failed)
+                lose_worker(w, failed);
+        }
+    }
+
+    return px_data;
+}
+
+
+
+/* Splits "unix:<path>" or "tcp:<host>:<port>" into its parts */
+static void parse_address(std::string address, std::string &kind, std::string &host, std::string &port)
+{
+    size_t sep { address.find(':') };
+    if (sep == std::string::npos)
+        throw std::invalid_argument("Address must start with unix: or tcp:");
+
+    kind = address.substr(0, sep);
+    std::string rest { address.substr(sep + 1) };
+
+    if (kind == "unix")
+    {
+        if (rest.empty() || rest.size() >= sizeof(sockaddr_un::sun_path))
+            throw std::invalid_argument("Invalid socket path '" + rest + "'");
+        host = rest;
+        port = "";
+    }
+    else if (kind == "tcp")
+    {
+        size_t port_sep { rest.rfind(':') };
+        if (port_sep == std::string::npos)
+            throw std::invalid_argument("TCP address must be tcp:<host>:<port>");
+        host = rest.substr(0, port_sep);
+        port = rest.substr(port_sep + 1);
+    }
+    else
+    {
+        throw std::invalid_argument("Address must start with unix: or tcp:");
+    }
+}
+
+
+
+static sockaddr_un unix_address(std::string path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+
+
+int listen_address(std::string address)
+{
+    std::string kind, host, port;
+    parse_address(address, kind, host, port);
+
+    int fd { -1 };
+    if (kind == "unix")
+    {
+        sockaddr_un addr { unix_address(host) };
+        unlink(host.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+            fd = -1;
+    }
+    else
+    {
+        addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0)
+            throw std::runtime_error("Could not resolve " + address);
+
+        for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+
+            int on { 1 };
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+
+    if (fd < 0 || listen(fd, SOMAXCONN) < 0)
+        throw std::runtime_error("Could not listen on " + address + ": " + strerror(errno));
+
+    return fd;
+}
+
+
+
+/* Connects to address, retrying until timeout_ms has passed so workers can be
+ * started before the coordinator
+ */
+int connect_address(std::string address, int timeout_ms)
+{
+    std::string kind, host, port;
+    parse_address(address, kind, host, port);
+
+    Clock::time_point deadline { Clock::now() + std::chrono::milliseconds(timeout_ms) };
+    while (true)
+    {
+        int fd { -1 };
+        if (kind == "unix")
+        {
+            sockaddr_un addr { unix_address(host) };
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        else
+        {
+            addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+                throw std::runtime_error("Could not resolve " + address);
+
+            for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next)
+            {
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (fd < 0)
+                    continue;
+                if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                {
+                    int on { 1 };
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    break;
+                }
+
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(res);
+        }
+
+        if (fd >= 0)
+            return fd;
+
+        if (Clock::now() >= deadline)
+            throw std::runtime_error("Could not connect to " + address);
+
+        usleep(CONNECT_RETRY_MS * 1000);
+    }
+}
+
+
+
+std::vector<int> accept_workers(int listen_fd, int num_workers, int timeout_ms)
+{
+    std::vector<int> workers;
+    Clock::time_point deadline { Clock::now() + std::chrono::milliseconds(timeout_ms) };
+
+    while ((int)workers.size() < num_workers)
+    {
+        int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        pollfd pfd { listen_fd, POLLIN, 0 };
+        if (remaining <= 0 || poll(&pfd, 1, remaining) == 0)
+        {
+            for (int fd : workers)
+                close(fd);
+            throw std::runtime_error("Timed out waiting for workers");
+        }
+
+        int fd { accept(listen_fd, nullptr, nullptr) };
+        if (fd >= 0)
+            workers.push_back(fd);
+    }
+
+    return workers;
+}
+
+
+
+std::vector<int> spawn_local_workers(int num_workers, std::vector<pid_t> &pids)
+{
+    std::vector<int> workers;
+
+    // Anything still buffered would otherwise be written out again by every child
+    std::cout.flush();
+    fflush(stdout);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+            throw std::runtime_error(std::string("socketpair failed: ") + strerror(errno));
+
+        pid_t pid { fork() };
+        if (pid < 0)
+            throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+
+        if (pid == 0)
+        {
+            // Drop our copies of the other workers' connections so they see the coordinator hang up
+            close(sv[0]);
+            for (int fd : workers)
+                close(fd);
+
+            run_worker(sv[1]);
+            _exit(0);
+        }
+
+        close(sv[1]);
+        workers.push_back(sv[0]);
+        pids.push_back(pid);
+    }
+
+    return workers;
+}
+
+
+
+void close_workers(const std::vector<int> &workers, const std::vector<pid_t> &pids)
+{
+    for (int fd : workers)
+        close(fd);
+
+    for (pid_t pid : pids)
+        waitpid(pid, nullptr, 0);
+}
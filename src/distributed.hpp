@@ -0,0 +1,82 @@
+#ifndef __DISTRIBUTED_HPP
+#define __DISTRIBUTED_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+
+
+/* Distributed rendering
+ * A coordinator splits the image into tiles and hands them out to worker processes
+ * over stream sockets. Workers load the scene themselves (from the same path, so the
+ * scene and any .obj files must be reachable from every worker) and send back the
+ * finished pixels of each tile. Since every tile is rendered by render_tile the
+ * assembled image is identical to a local render.
+ *
+ * Addresses are either "unix:<path>" or "tcp:<host>:<port>"
+ */
+
+
+struct DistributedOptions
+{
+    int tile_size;
+
+    // How many times a tile may be lost to a failed worker before giving up on the frame
+    int max_retries;
+
+    // Once no tiles are left to hand out, idle workers take over tiles that have been
+    // running for longer than speculate_factor * the average tile time
+    float speculate_factor;
+
+    // How many workers may render the same tile at once
+    int max_copies;
+
+    // Seconds a worker may spend on one tile before it is dropped as hung, 0 waits forever
+    // The first tile includes the time the worker takes to load the scene
+    float tile_timeout;
+
+    DistributedOptions();
+};
+
+
+
+/* Coordinator
+ * Renders the scene by distributing its tiles over the given (connected) worker sockets
+ * scene_file is sent to the workers so they can load their own copy of scene
+ * Throws std::runtime_error if every worker fails or a tile fails too many times
+ * The worker sockets are left open so they can be reused for another frame
+ */
+Pixel2D raytrace_distributed(std::shared_ptr<Scene> scene, std::string scene_file,
+                                const std::vector<int> &workers, int &width, int &height,
+                                const RenderSettings &settings,
+                                const DistributedOptions &options = DistributedOptions {});
+
+
+// Worker, serves jobs and tiles from the coordinator on fd until the coordinator hangs up
+void run_worker(int fd);
+
+
+// Connects to a coordinator at address and serves tiles until it hangs up
+void run_worker(std::string address);
+
+
+// Socket helpers
+int listen_address(std::string address);
+int connect_address(std::string address, int timeout_ms = 10000);
+std::vector<int> accept_workers(int listen_fd, int num_workers, int timeout_ms = 60000);
+
+
+/* Forks num_workers worker processes on this machine, each connected over a socketpair
+ * Returns the coordinator's end of each connection, the child pids are stored in pids
+ */
+std::vector<int> spawn_local_workers(int num_workers, std::vector<pid_t> &pids);
+
+// Hangs up on every worker and waits for any local worker processes to exit
+void close_workers(const std::vector<int> &workers, const std::vector<pid_t> &pids);
+
+#endif
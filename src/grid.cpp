@@ -0,0 +1,141 @@
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+
+#include "grid.hpp"
+
+
+// Cells per primitive, the grid's resolution is picked to give about this many
+const float GRID_DENSITY { 2.0f };
+
+// Cells per axis are capped so a few outlying primitives can't make the grid huge
+const int MAX_GRID_RES { 512 };
+
+// Primitives are counted and placed this many at a time when building in parallel
+const int GRID_CHUNK { 1 << 14 };
+
+
+
+Grid::Grid()
+{
+    clear();
+}
+
+
+
+void Grid::clear()
+{
+    num_prims = 0;
+    res[0] = res[1] = res[2] = 0;
+    cell_size = Vec3 { 0.0 };
+    cell_start.clear();
+    indices.clear();
+    prim_bounds.clear();
+    bounds = AABB {};
+}
+
+
+
+// Both builds size the grid to the primitives' bounds and counting sort them into cells (see place_prims)
+void Grid::build(const std::vector<AABB> &prim_bounds, ThreadPool *pool)
+{
+    build(prim_bounds.size(), [&prim_bounds](int prim) { return prim_bounds[prim]; }, pool);
+    this->prim_bounds = prim_bounds;
+}
+
+
+
+void Grid::build(int num_prims, BoundsFunction bounds_of, ThreadPool *pool)
+{
+    clear();
+    if (num_prims == 0)
+        return;
+
+    this->num_prims = num_prims;
+    for (int prim = 0; prim < num_prims; prim++)
+        bounds.grow(bounds_of(prim));
+
+    // Cubic cells, as many as GRID_DENSITY per primitive fit in the grid's volume
+    Vec3 extent { glm::max(bounds.max - bounds.min, Vec3 { 1e-6f }) };
+    float cells_per_length { std::cbrt(GRID_DENSITY * num_prims / (extent.x * extent.y * extent.z)) };
+    int num_cells { 1 };
+    for (int axis = 0; axis < 3; axis++)
+    {
+        res[axis] = std::max(1, std::min((int)(extent[axis] * cells_per_length), MAX_GRID_RES));
+        cell_size[axis] = extent[axis] / res[axis];
+        num_cells *= res[axis];
+    }
+
+    // Counters only need to be atomic when the primitives really are placed on several threads
+    int num_chunks { (num_prims + GRID_CHUNK - 1) / GRID_CHUNK };
+    if (pool != nullptr && pool->size() > 1 && num_chunks > 1)
+        place_prims<std::atomic<int>>(num_cells, bounds_of, pool);
+    else
+        place_prims<int>(num_cells, bounds_of, nullptr);
+}
+
+
+
+/* Counting sort of the primitives into cells
+ * Every primitive is counted into each cell it overlaps, the counts are summed into where each
+ * cell's list starts, then each primitive is written into its cells' lists. Writes from different
+ * threads land in any order, so with a pool each list is sorted at the end, which keeps the grid
+ * the same however it was built
+ */
+template <typename Count>
+void Grid::place_prims(int num_cells, const BoundsFunction &bounds_of, ThreadPool *pool)
+{
+    // Runs body(begin, end) over every chunk of GRID_CHUNK primitives
+    int n { num_prims };
+    int num_chunks { (n + GRID_CHUNK - 1) / GRID_CHUNK };
+    auto for_chunks = [&](std::function<void(int, int)> body)
+    {
+        auto chunk = [&](int c) { body(c * GRID_CHUNK, std::min(n, (c + 1) * GRID_CHUNK)); };
+        if (pool != nullptr)
+        {
+            parallel_for(*pool, num_chunks, 0, chunk);
+        }
+        else
+        {
+            for (int c = 0; c < num_chunks; c++)
+                chunk(c);
+        }
+    };
+
+    std::unique_ptr<Count[]> counts { new Count[num_cells] };
+    for (int c = 0; c < num_cells; c++)
+        counts[c] = 0;
+
+    for_chunks([&](int begin, int end)
+    {
+        for (int prim = begin; prim < end; prim++)
+            for_each_cell(bounds_of(prim), [&](int c) { counts[c]++; });
+    });
+
+    cell_start.resize(num_cells + 1);
+    cell_start[0] = 0;
+    for (int c = 0; c < num_cells; c++)
+    {
+        cell_start[c + 1] = cell_start[c] + counts[c];
+        counts[c] = cell_start[c];
+    }
+
+    indices.resize(cell_start[num_cells]);
+    for_chunks([&](int begin, int end)
+    {
+        for (int prim = begin; prim < end; prim++)
+            for_each_cell(bounds_of(prim), [&](int c) { indices[counts[c]++] = prim; });
+    });
+
+    if (pool != nullptr)
+    {
+        int num_cell_chunks { (num_cells + GRID_CHUNK - 1) / GRID_CHUNK };
+        parallel_for(*pool, num_cell_chunks, 0, [&](int chunk)
+        {
+            for (int c = chunk * GRID_CHUNK; c < std::min(num_cells, (chunk + 1) * GRID_CHUNK); c++)
+                std::sort(indices.begin() + cell_start[c], indices.begin() + cell_start[c + 1]);
+        });
+    }
+}
+
@@ -0,0 +1,164 @@
+#ifndef __GRID_HPP
+#define __GRID_HPP
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+#include "threadpool.hpp"
+
+
+/* Uniform grid over a list of primitive bounds
+ * Space is cut into equal cells, about GRID_DENSITY per primitive, and each cell lists every
+ * primitive whose bounds overlap it. Built in O(n) by counting sort, so for many similar
+ * primitives spread evenly through a volume (particle fields) it builds far faster than any tree
+ * and rays step through it cell by cell (3D-DDA) without descending through nodes
+ * Like the BVH it only deals in primitive indices, callers test the primitives themselves
+ */
+// Bounds of primitive prim, for building a grid without a list of every primitive's bounds
+typedef std::function<AABB(int prim)> BoundsFunction;
+
+
+class Grid
+{
+public:
+    // Cells per axis and the size of one cell
+    int res[3];
+    Vec3 cell_size;
+
+    /* Primitives in cell (x, y, z) are indices[cell_start[c], cell_start[c + 1]) with
+     * c = x + res[0] * (y + res[1] * z), in increasing order
+     */
+    std::vector<int> cell_start;
+    std::vector<int> indices;
+
+    // Bounds of each primitive, by primitive index, empty if the grid was built from a BoundsFunction
+    std::vector<AABB> prim_bounds;
+
+    AABB bounds;
+
+    Grid();
+
+    /* Builds the grid from scratch
+     * With a pool, primitives are counted and placed in parallel, the grid is the same either way
+     */
+    void build(const std::vector<AABB> &prim_bounds, ThreadPool *pool = nullptr);
+
+    /* Builds the grid over num_prims primitives without keeping their bounds, 24 bytes a primitive
+     * less for pools of millions of them. traverse then passes every primitive in the cells the
+     * ray crosses to intersect with the whole range [0, inf), callers check their own bounds
+     */
+    void build(int num_prims, BoundsFunction bounds_of, ThreadPool *pool = nullptr);
+    void clear();
+
+    int size() const { return num_prims; }
+
+    /* Same contract as BVH::traverse, cells are visited in order along the ray
+     * A primitive spanning several cells is usually only tested once, the last few primitives
+     * tested are remembered and skipped
+     */
+    template <typename F>
+    void traverse(Vec3 p0, Vec3 d, float t_max, F intersect) const
+    {
+        if (cell_start.empty())
+            return;
+
+        Vec3 inv_d { safe_inverse(d) };
+        float t, t_end;
+        if (!bounds.hit_range(p0, inv_d, t, t_end))
+            return;
+
+        // Start in the cell the ray enters by, clamped since t is widened to just outside the grid
+        Vec3 p { p0 + d * std::max(0.0f, t) };
+        int cell[3], step[3];
+        float t_next[3], t_delta[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int c { (int)((p[axis] - bounds.min[axis]) / cell_size[axis]) };
+            cell[axis] = std::max(0, std::min(c, res[axis] - 1));
+
+            step[axis] = (inv_d[axis] > 0.0f) ? 1 : -1;
+            float boundary { bounds.min[axis] + (cell[axis] + (step[axis] > 0 ? 1 : 0)) * cell_size[axis] };
+            t_next[axis] = (boundary - p0[axis]) * inv_d[axis];
+            t_delta[axis] = cell_size[axis] * inv_d[axis] * step[axis];
+        }
+
+        int recent[MAILBOX_SIZE];
+        std::fill(recent, recent + MAILBOX_SIZE, -1);
+        int slot { 0 };
+        int visited { 0 }, tested { 0 };
+
+        while (true)
+        {
+            visited++;
+            int c { cell[0] + res[0] * (cell[1] + res[1] * cell[2]) };
+            for (int i = cell_start[c]; i < cell_start[c + 1]; i++)
+            {
+                int prim { indices[i] };
+                if (std::find(recent, recent + MAILBOX_SIZE, prim) != recent + MAILBOX_SIZE)
+                    continue;
+
+                recent[slot] = prim;
+                slot = (slot + 1) % MAILBOX_SIZE;
+
+                float t_lo { 0.0f }, t_hi { std::numeric_limits<float>::infinity() };
+                if (prim_bounds.empty() || (prim_bounds[prim].hit_range(p0, inv_d, t_lo, t_hi) && t_lo <= t_max))
+                {
+                    t_max = intersect(prim, t_lo, t_hi);
+                    tested++;
+                }
+            }
+
+            // Step into whichever neighbour the ray reaches first, unless everything there is too far
+            int axis { (t_next[0] < t_next[1]) ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2) };
+            if (t_next[axis] * (1.0f - HIT_TOLERANCE) > t_max)
+                break;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= res[axis])
+                break;
+
+            t_next[axis] += t_delta[axis];
+        }
+
+        traversal_stats.nodes_visited += visited;
+        traversal_stats.prims_tested += tested;
+    }
+
+    // Primitives tested recently by a traversal, which aren't tested again
+    static const int MAILBOX_SIZE { 8 };
+
+private:
+    int num_prims;
+
+    // Sorts the primitives into their cells, Count is std::atomic<int> if pool places them in parallel
+    template <typename Count>
+    void place_prims(int num_cells, const BoundsFunction &bounds_of, ThreadPool *pool);
+
+    // Calls body(c) for every cell c that box overlaps
+    template <typename F>
+    void for_each_cell(const AABB &box, F body) const
+    {
+        int lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int l { (int)((box.min[axis] - bounds.min[axis]) / cell_size[axis]) };
+            int h { (int)((box.max[axis] - bounds.min[axis]) / cell_size[axis]) };
+            lo[axis] = std::max(0, std::min(l, res[axis] - 1));
+            hi[axis] = std::max(0, std::min(h, res[axis] - 1));
+        }
+
+        for (int z = lo[2]; z <= hi[2]; z++)
+        {
+            for (int y = lo[1]; y <= hi[1]; y++)
+            {
+                for (int x = lo[0]; x <= hi[0]; x++)
+                    body(x + res[0] * (y + res[1] * z));
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <cmath>
+
+#include "kdtree.hpp"
+
+
+// Candidate split planes per axis
+const int NUM_KD_BINS { 32 };
+
+// Nodes with at most this many primitives are always leaves
+const int KD_LEAF_SIZE { 2 };
+
+// Trees are never deeper than this, on top of the usual limit of 8 + 1.3 log2(n)
+const int KD_MAX_DEPTH { 64 };
+
+// Relative costs of visiting a node and intersecting a primitive, used by the SAH
+const float KD_COST_TRAVERSAL { 1.0f };
+const float KD_COST_INTERSECT { 2.0f };
+
+// Splits that cut off empty space are made this much cheaper, empty leaves are free to cross
+const float KD_EMPTY_BONUS { 0.2f };
+
+
+
+// State shared by every node of one build
+struct KDTree::BuildContext
+{
+    ClipFunction clip;
+    int max_depth;
+};
+
+
+
+void KDTree::clear()
+{
+    nodes.clear();
+    leaves.clear();
+    indices.clear();
+    prim_bounds.clear();
+    bounds = AABB {};
+}
+
+
+
+void KDTree::build(const std::vector<AABB> &prim_bounds, ClipFunction clip)
+{
+    clear();
+    if (prim_bounds.empty())
+        return;
+
+    this->prim_bounds = prim_bounds;
+    for (const AABB &b : prim_bounds)
+        bounds.grow(b);
+
+    std::vector<int> prims(prim_bounds.size());
+    for (unsigned int i = 0; i < prims.size(); i++)
+        prims[i] = i;
+
+    int max_depth { (int)(8 + 1.3f * std::log2((float)prims.size())) };
+    BuildContext ctx { clip, std::min(max_depth, KD_MAX_DEPTH) };
+    build_node(bounds, prims, 0, ctx);
+
+    int ropes[6] { -1, -1, -1, -1, -1, -1 };
+    set_ropes(0, ropes);
+}
+
+
+
+/* Builds the subtree over the part of space in box, prims are the primitives that may reach it
+ * and are emptied. Nodes are appended depth-first, so the part below a split always comes next
+ */
+void KDTree::build_node(const AABB &box, std::vector<int> &prims, int depth, BuildContext &ctx)
+{
+    int node { (int)nodes.size() };
+    nodes.push_back(KDNode { 0.0f, 3, 0 });
+
+    // Bounds of the part of each primitive inside this node, padded like the primitive's own
+    std::vector<AABB> parts;
+    int count { 0 };
+    for (int prim : prims)
+    {
+        AABB part { prim_bounds[prim].overlap(box) };
+        if (ctx.clip && !part.empty())
+        {
+            part = ctx.clip(prim, part);
+            if (!part.empty())
+            {
+                part.pad();
+                part = part.overlap(prim_bounds[prim]).overlap(box);
+            }
+        }
+        if (part.empty())
+            continue;
+
+        prims[count++] = prim;
+        parts.push_back(part);
+    }
+    prims.resize(count);
+
+    int best_axis { -1 };
+    float best_pos { 0.0f };
+    float best_cost { KD_COST_INTERSECT * count };
+    float area { box.area() };
+    for (int axis = 0; count > KD_LEAF_SIZE && depth < ctx.max_depth && area > 0.0f && axis < 3; axis++)
+    {
+        float lo { box.min[axis] }, extent { box.max[axis] - box.min[axis] };
+        if (!(extent > 0.0f))
+            continue;
+
+        // Counts of the parts starting and ending in each slice, binned like BVH::split_sah
+        int starts[NUM_KD_BINS] {}, ends[NUM_KD_BINS] {};
+        auto bin_of = [lo, extent](float x)
+        {
+            int b { (int)((x - lo) * NUM_KD_BINS / extent) };
+            return std::max(0, std::min(b, NUM_KD_BINS - 1));
+        };
+        for (const AABB &part : parts)
+        {
+            starts[bin_of(part.min[axis])]++;
+            ends[bin_of(part.max[axis])]++;
+        }
+
+        int n_left { 0 }, n_right { count };
+        for (int b = 1; b < NUM_KD_BINS; b++)
+        {
+            n_left += starts[b - 1];
+            n_right -= ends[b - 1];
+
+            float pos { lo + extent * b / NUM_KD_BINS };
+            AABB left { box }, right { box };
+            left.max[axis] = pos;
+            right.min[axis] = pos;
+
+            float cost { KD_COST_TRAVERSAL +
+                            KD_COST_INTERSECT * (left.area() * n_left + right.area() * n_right) / area };
+            if (n_left == 0 || n_right == 0)
+                cost *= 1.0f - KD_EMPTY_BONUS;
+
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_pos = pos;
+            }
+        }
+    }
+
+    // Bins only estimate the counts, the primitives are sorted by their actual bounds
+    std::vector<int> below, above;
+    if (best_axis >= 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            bool left { parts[i].min[best_axis] < best_pos }, right { parts[i].max[best_axis] > best_pos };
+            if (left || !right)
+                below.push_back(prims[i]);
+            if (right || !left)
+                above.push_back(prims[i]);
+        }
+    }
+
+    if (best_axis < 0 || ((int)below.size() == count && (int)above.size() == count))
+    {
+        nodes[node].child = leaves.size();
+        leaves.push_back(KDLeaf { box, (int)indices.size(), count, { -1, -1, -1, -1, -1, -1 } });
+        indices.insert(indices.end(), prims.begin(), prims.end());
+        return;
+    }
+
+    prims.clear();
+    prims.shrink_to_fit();
+    parts.clear();
+    parts.shrink_to_fit();
+
+    AABB below_box { box }, above_box { box };
+    below_box.max[best_axis] = best_pos;
+    above_box.min[best_axis] = best_pos;
+
+    nodes[node].split = best_pos;
+    nodes[node].axis = best_axis;
+    build_node(below_box, below, depth + 1, ctx);
+    nodes[node].child = nodes.size();
+    build_node(above_box, above, depth + 1, ctx);
+}
+
+
+
+/* Gives every leaf under node its ropes, ropes are the neighbours of node's own faces
+ * Each rope is pushed down the neighbouring subtree as long as a single child still covers the
+ * whole face, so traversal has less to descend through when it follows it
+ */
+void KDTree::set_ropes(int node, const int ropes[6])
+{
+    const KDNode &n { nodes[node] };
+    if (n.axis < 3)
+    {
+        int below[6], above[6];
+        std::copy(ropes, ropes + 6, below);
+        std::copy(ropes, ropes + 6, above);
+        below[2 * n.axis + 1] = n.child;
+        above[2 * n.axis] = node + 1;
+
+        set_ropes(node + 1, below);
+        set_ropes(n.child, above);
+        return;
+    }
+
+    KDLeaf &leaf { leaves[n.child] };
+    for (int face = 0; face < 6; face++)
+    {
+        int axis { face / 2 }, side { face % 2 };
+        int r { ropes[face] };
+        while (r >= 0 && nodes[r].axis < 3)
+        {
+            const KDNode &neighbour { nodes[r] };
+            if (neighbour.axis == axis)
+                r = side ? r + 1 : neighbour.child;
+            else if (leaf.bounds.max[neighbour.axis] <= neighbour.split)
+                r = r + 1;
+            else if (leaf.bounds.min[neighbour.axis] >= neighbour.split)
+                r = neighbour.child;
+            else
+                break;
+        }
+        leaf.ropes[face] = r;
+    }
+}
+
+
+
+float KDTree::sah_cost() const
+{
+    float root_area { bounds.area() };
+    if (nodes.empty() || root_area <= 0.0f)
+        return 0.0f;
+
+    float cost { 0.0f };
+    std::vector<std::pair<int, AABB>> stack { { 0, bounds } };
+    while (!stack.empty())
+    {
+        int node { stack.back().first };
+        AABB box { stack.back().second };
+        stack.pop_back();
+
+        const KDNode &n { nodes[node] };
+        float area { box.area() / root_area };
+        if (n.axis == 3)
+        {
+            cost += leaves[n.child].count * area;
+            continue;
+        }
+
+        cost += area;
+        AABB below { box }, above { box };
+        below.max[n.axis] = n.split;
+        above.min[n.axis] = n.split;
+        stack.push_back({ node + 1, below });
+        stack.push_back({ n.child, above });
+    }
+
+    return cost;
+}
@@ -0,0 +1,147 @@
+#ifndef __KDTREE_HPP
+#define __KDTREE_HPP
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "bvh.hpp"
+
+
+/* Node of a kd-tree
+ * Interior nodes split their box at split along axis (0-2), the part below the plane is the
+ * next node and the part above is at child
+ * Leaves have axis == 3 and child is their index in KDTree::leaves
+ */
+struct KDNode
+{
+    float split;
+    int axis;
+    int child;
+};
+
+
+/* Leaf of a kd-tree
+ * Holds count primitives starting at KDTree::indices[first]
+ * ropes[2 * axis + side] is the node on the other side of the face at bounds.min[axis] (side 0)
+ * or bounds.max[axis] (side 1), as deep as it can be while still covering the whole face,
+ * or -1 where the face is on the outside of the tree
+ */
+struct KDLeaf
+{
+    AABB bounds;
+    int first;
+    int count;
+    int ropes[6];
+};
+
+
+/* SAH kd-tree with ropes
+ * Splits space rather than primitives, so a primitive is referenced from every leaf it passes
+ * through and leaves never overlap. Each leaf links to its neighbours, which lets traversal walk
+ * from leaf to leaf along the ray without a stack
+ * Like the BVH it only deals in primitive indices, callers test the primitives themselves
+ */
+class KDTree
+{
+public:
+    std::vector<KDNode> nodes;
+    std::vector<KDLeaf> leaves;
+    std::vector<int> indices;
+
+    // Bounds of each primitive, by primitive index
+    std::vector<AABB> prim_bounds;
+
+    AABB bounds;
+
+    /* Builds the tree from scratch, placing each split at the cheapest of NUM_KD_BINS planes per
+     * axis by the surface area heuristic, or making a leaf if no split is worth it
+     * With clip, primitives are only put in the leaves that their clipped bounds reach
+     * ("perfect splits"), without it in every leaf their bounds overlap
+     */
+    void build(const std::vector<AABB> &prim_bounds, ClipFunction clip = nullptr);
+    void clear();
+
+    // Surface area heuristic cost of the tree relative to its root, comparable to BVH::sah_cost
+    float sah_cost() const;
+
+    /* Same contract as BVH::traverse, but leaves are visited strictly in order along the ray
+     * A primitive in several leaves is tested once for each leaf the ray passes through, each
+     * time with t_min and t_max narrowed to the part of its AABB::hit_range inside that leaf
+     */
+    template <typename F>
+    void traverse(Vec3 p0, Vec3 d, float t_max, F intersect) const
+    {
+        if (nodes.empty())
+            return;
+
+        Vec3 inv_d { safe_inverse(d) };
+        float t, t_end;
+        if (!bounds.hit_range(p0, inv_d, t, t_end))
+            return;
+
+        // hit_range widens the range, entering the root any earlier than the ray can is harmless
+        t = std::max(0.0f, t / (1.0f - HIT_TOLERANCE));
+        int node { 0 };
+        int visited { 0 }, tested { 0 };
+
+        while (node >= 0 && t * (1.0f - HIT_TOLERANCE) <= t_max)
+        {
+            // Down to the leaf the ray enters at t, on a splitting plane it's the side the ray heads into
+            Vec3 p { p0 + d * t };
+            while (nodes[node].axis < 3)
+            {
+                const KDNode &n { nodes[node] };
+                visited++;
+                bool above { p[n.axis] > n.split || (p[n.axis] == n.split && inv_d[n.axis] > 0.0f) };
+                node = above ? n.child : node + 1;
+            }
+            visited++;
+
+            const KDLeaf &leaf { leaves[nodes[node].child] };
+            int exit_face { 0 };
+            float t_exit { std::numeric_limits<float>::infinity() };
+            for (int axis = 0; axis < 3; axis++)
+            {
+                int side { inv_d[axis] > 0.0f ? 1 : 0 };
+                float t_face { ((side ? leaf.bounds.max[axis] : leaf.bounds.min[axis]) - p0[axis]) * inv_d[axis] };
+                if (t_face < t_exit)
+                {
+                    t_exit = t_face;
+                    exit_face = 2 * axis + side;
+                }
+            }
+            t_exit = std::max(t_exit, t);
+
+            float leaf_lo { t * (1.0f - HIT_TOLERANCE) }, leaf_hi { t_exit * (1.0f + HIT_TOLERANCE) };
+            for (int i = leaf.first; i < leaf.first + leaf.count; i++)
+            {
+                float t_lo, t_hi;
+                if (!prim_bounds[indices[i]].hit_range(p0, inv_d, t_lo, t_hi))
+                    continue;
+
+                t_lo = std::max(t_lo, leaf_lo);
+                t_hi = std::min(t_hi, leaf_hi);
+                if (t_lo <= t_hi && t_lo <= t_max)
+                {
+                    t_max = intersect(indices[i], t_lo, t_hi);
+                    tested++;
+                }
+            }
+
+            node = leaf.ropes[exit_face];
+            t = t_exit;
+        }
+
+        traversal_stats.nodes_visited += visited;
+        traversal_stats.prims_tested += tested;
+    }
+
+private:
+    struct BuildContext;
+
+    void build_node(const AABB &box, std::vector<int> &prims, int depth, BuildContext &ctx);
+    void set_ropes(int node, const int ropes[6]);
+};
+
+#endif
@@ -1,11 +1,19 @@
 #include <iostream>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
 
 #include "CImg.h"
 
+#include "distributed.hpp"
 #include "objects.hpp"
 #include "raytracer.hpp"
 #include "sceneloader.hpp"
+#include "sequence.hpp"
 
 
 // Don't change this
@@ -20,28 +28,142 @@ const std::string DEFAULT_OUTPUT_FILENAME { "Render.bmp" };
 const int DEFAULT_RECURSION_LEVEL { 0 };
 const int DEFAULT_SSAMPLE_LEVEL { 1 };
 const int DEFAULT_SOFT_SHADOWS { 1 };
+const int DEFAULT_NUM_WORKERS { 1 };
+const int DEFAULT_TILE_TIMEOUT { 300 };
+
+
+// Options that are followed by a value, e.g. --spawn 4
+const std::set<std::string> VALUE_OPTIONS { "worker", "listen", "workers", "spawn", "tile-timeout", "accel", "threads",
+                                            "sbvh-budget", "sampler", "adaptive-shadows" };
+
+// Options that are on or off, e.g. --no-display
+const std::set<std::string> SWITCH_OPTIONS { "no-display", "sequence", "pipeline", "batch-shading", "fast-pow",
+                                             "wavefront", "sort-rays" };
+
+
+/* Splits the command line into positional arguments (including the program name, so
+ * indices match argv) and --options
+ * Returns false if an option is unknown or is missing its value
+ */
+bool parse_options(int argc, char *argv[], std::vector<std::string> &args,
+                    std::map<std::string, std::string> &options)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg { argv[i] };
+        if (i == 0 || arg.compare(0, 2, "--") != 0)
+        {
+            args.push_back(arg);
+            continue;
+        }
+
+        std::string name { arg.substr(2) };
+        if (VALUE_OPTIONS.count(name))
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "Missing value for " << arg << std::endl;
+                return false;
+            }
+            options[name] = argv[++i];
+        }
+        else if (SWITCH_OPTIONS.count(name))
+        {
+            options[name] = "";
+        }
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int option_int(const std::map<std::string, std::string> &options, std::string name, int default_value)
+{
+    auto it = options.find(name);
+    if (it == options.end())
+        return default_value;
+
+    try { return std::stoi(it->second); }
+    catch (const std::invalid_argument &e){ std::cerr << "Invalid value for --" << name << ", using default (" << default_value << ")\n"; }
+    catch (const std::out_of_range &e){ std::cerr << "Invalid value for --" << name << ", using default (" << default_value << ")\n"; }
+
+    return default_value;
+}
+
+
+float option_float(const std::map<std::string, std::string> &options, std::string name, float default_value)
+{
+    auto it = options.find(name);
+    if (it == options.end())
+        return default_value;
+
+    try { return std::stof(it->second); }
+    catch (const std::invalid_argument &e){ std::cerr << "Invalid value for --" << name << ", using default (" << default_value << ")\n"; }
+    catch (const std::out_of_range &e){ std::cerr << "Invalid value for --" << name << ", using default (" << default_value << ")\n"; }
+
+    return default_value;
+}
+
+
+// Scale 0-1 colour values to 0-255 for bitmap output
+cimg_library::CImg<float> to_image(const Pixel2D &px_data, int width, int height)
+{
+    cimg_library::CImg<float> image(width, height, 1, NUM_CHANNELS, 0);
+
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            for (int z = 0; z < NUM_CHANNELS; z++) {
+                image(x, y, z) = px_data[x][y][z] * 255.0f;
+            }
+        }
+    }
+
+    return image;
+}
 
 
 int main(int argc, char *argv[])
 {
     // Parse command-line arguments
-    if (argc < MIN_ARGS + 1)
+    std::vector<std::string> args;
+    std::map<std::string, std::string> options;
+    if (!parse_options(argc, argv, args, options))
+        return 1;
+
+    // Worker mode, render tiles for a coordinator until it hangs up
+    if (options.count("worker"))
+    {
+        try { run_worker(options["worker"]); }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Worker failed: " << e.what() << "\n";
+            return 2;
+        }
+        return 0;
+    }
+
+    if (args.size() < MIN_ARGS + 1)
     {
         std::cerr << "Missing scene filename" << std::endl;
         return 1;
     }
-    std::string scene_file { argv[1] };
+    std::string scene_file { args[1] };
 
 
     std::string output_filename;
-    output_filename = (argc > 2) ? argv[2] : DEFAULT_OUTPUT_FILENAME;
+    output_filename = (args.size() > 2) ? args[2] : DEFAULT_OUTPUT_FILENAME;
 
 
     int recursion_level { DEFAULT_RECURSION_LEVEL };
-    if (argc > 3)
+    if (args.size() > 3)
     {
         try {
-            recursion_level = std::stoi(argv[3]);
+            recursion_level = std::stoi(args[3]);
             std::cout << "Setting recursion level to " << recursion_level << std::endl;
         }
         catch (const std::invalid_argument &e){ std::cerr << "Invalid recursion level, using default (" << DEFAULT_RECURSION_LEVEL << ")\n"; }
@@ -50,10 +172,10 @@ int main(int argc, char *argv[])
 
 
     int ssample_level { DEFAULT_SSAMPLE_LEVEL };
-    if (argc > 4)
+    if (args.size() > 4)
     {
         try {
-            ssample_level = std::stoi(argv[4]);
+            ssample_level = std::stoi(args[4]);
             std::cout << "Setting supersampling level to " << ssample_level << "x" << std::endl;
         }
         catch (const std::invalid_argument &e){ std::cerr << "Invalid supersample level, using default (" << DEFAULT_SSAMPLE_LEVEL << ")\n"; }
@@ -62,10 +184,10 @@ int main(int argc, char *argv[])
 
 
     int sshadow_level { DEFAULT_SOFT_SHADOWS };
-    if (argc > 5)
+    if (args.size() > 5)
     {
         try {
-            sshadow_level = std::stoi(argv[5]);
+            sshadow_level = std::stoi(args[5]);
             std::cout << "Setting number of soft shadows to " << sshadow_level << std::endl;
         }
         catch (const std::invalid_argument &e){std::cerr << "Invalid soft shadow level, using default (" << DEFAULT_SOFT_SHADOWS << ")\n";}
@@ -74,31 +196,117 @@ int main(int argc, char *argv[])
    
 
 
+    RenderSettings settings { recursion_level, ssample_level, sshadow_level };
+    settings.num_threads = option_int(options, "threads", 0);
+    settings.adaptive_shadows = option_int(options, "adaptive-shadows", 0);
+    settings.batch_shading = options.count("batch-shading") > 0;
+    settings.fast_pow = options.count("fast-pow") > 0;
+    settings.wavefront = options.count("wavefront") > 0;
+    if (settings.fast_pow && !settings.batch_shading && !settings.wavefront)
+        std::cerr << "--fast-pow only applies with --batch-shading or --wavefront" << std::endl;
+    settings.sort_rays = options.count("sort-rays") > 0;
+    if (settings.sort_rays && !settings.wavefront)
+        std::cerr << "--sort-rays only applies with --wavefront" << std::endl;
+    settings.spatial_splits.max_duplication = option_float(options, "sbvh-budget",
+                                                            settings.spatial_splits.max_duplication);
+    if (options.count("accel"))
+    {
+        try { settings.accel = parse_accel(options["accel"]); }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (options.count("sampler"))
+    {
+        try { settings.sampler = parse_sampler(options["sampler"]); }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    // Animation, the input file is a sequence of frames rather than a single scene
+    if (options.count("sequence"))
+    {
+        // Frames are always rendered locally
+        for (std::string name : { "spawn", "listen", "workers", "tile-timeout" })
+        {
+            if (options.count(name))
+            {
+                std::cerr << "--" << name << " can't be used with --sequence" << std::endl;
+                return 1;
+            }
+        }
+
+        try
+        {
+            Sequence sequence { load_sequence(scene_file) };
+            render_sequence(sequence, settings,
+                [&output_filename](int frame, const Pixel2D &px_data, int width, int height)
+                {
+                    to_image(px_data, width, height).save(frame_filename(output_filename, frame).c_str());
+                },
+                options.count("pipeline") > 0);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Could not render sequence " << scene_file << ": " << e.what() << "\n";
+            return 2;
+        }
+        return 0;
+    }
+
+
     // RAYTRACING 
     try 
     {
-        std::shared_ptr<Scene> sc { load_scene(scene_file) };
+        std::shared_ptr<Scene> sc { load_scene(scene_file, settings.accel, settings.spatial_splits) };
 
         int width, height;
-        Pixel2D px_data { 
-            raytrace(sc, width, height, recursion_level, ssample_level, sshadow_level) 
-        };
-
-        cimg_library::CImg<float> image(width, height, 1, NUM_CHANNELS, 0);
-
-        // Scale 0-1 colour values to 0-255 for bitmap output
-        for (int x = 0; x < width; x++) {
-            for (int y = 0; y < height; y++) {
-                for (int z = 0; z < NUM_CHANNELS; z++) {
-                    image(x, y, z) = px_data[x][y][z] * 255.0f;
-                }
+        Pixel2D px_data;
+
+        int num_spawn { option_int(options, "spawn", 0) };
+        if (num_spawn > 0 || options.count("listen"))
+        {
+            // Coordinator mode, hand tiles out to worker processes
+            std::vector<int> workers;
+            std::vector<pid_t> pids;
+            if (num_spawn > 0)
+            {
+                std::cout << "Spawning " << num_spawn << " local workers" << std::endl;
+                workers = spawn_local_workers(num_spawn, pids);
+            }
+            else
+            {
+                int num_workers { option_int(options, "workers", DEFAULT_NUM_WORKERS) };
+                int listen_fd { listen_address(options["listen"]) };
+                std::cout << "Waiting for " << num_workers << " workers on " << options["listen"] << std::endl;
+                workers = accept_workers(listen_fd, num_workers);
+                close(listen_fd);
             }
+
+            DistributedOptions dist_options;
+            dist_options.tile_timeout = option_int(options, "tile-timeout", DEFAULT_TILE_TIMEOUT);
+
+            px_data = raytrace_distributed(sc, scene_file, workers, width, height, settings, dist_options);
+            close_workers(workers, pids);
+        }
+        else
+        {
+            px_data = raytrace(sc, width, height, settings);
         }
 
+        cimg_library::CImg<float> image = to_image(px_data, width, height);
         image.save(output_filename.c_str());
 
-        cimg_library::CImgDisplay main_disp { image, "Render" };
-        while (!main_disp.is_closed()){ main_disp.wait(); }
+        if (!options.count("no-display"))
+        {
+            cimg_library::CImgDisplay main_disp { image, "Render" };
+            while (!main_disp.is_closed()){ main_disp.wait(); }
+        }
 
     }
     catch (const std::invalid_argument &e)
@@ -106,6 +314,11 @@ int main(int argc, char *argv[])
         std::cerr << "Could not raytrace " << scene_file << ": " << e.what() << "\n";
         return 2;
     }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Could not raytrace " << scene_file << ": " << e.what() << "\n";
+        return 2;
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
 #include <iostream>
 #include <limits>
 
@@ -15,6 +18,15 @@ const float BIAS { 0.1f };
 // Arbitrary values for when a ray does not intersect an object
 const float NO_INTERSECT { -std::numeric_limits<float>::max() };
 
+/* AccelType::Auto only picks a grid for at least this many bounded objects, where the largest
+ * is at most GRID_MAX_SIZE_RATIO times the size of the median one and at least
+ * GRID_MIN_OCCUPANCY of the cells of a coarse grid, GRID_SAMPLE_OBJECTS objects per cell, are used
+ */
+const int GRID_MIN_OBJECTS { 1000 };
+const float GRID_MAX_SIZE_RATIO { 4.0f };
+const float GRID_MIN_OCCUPANCY { 0.5f };
+const float GRID_SAMPLE_OBJECTS { 8.0f };
+
 
 
 /* Scene
@@ -25,6 +37,191 @@ Scene::Scene()
     camera = nullptr;
     objects = std::vector<std::shared_ptr<Object>>{};
     lights = std::vector<std::shared_ptr<Light>>{};
+    accel_type = AccelType::BVH;
+}
+
+
+
+AccelType parse_accel(std::string name)
+{
+    if (name == "bvh")
+        return AccelType::BVH;
+    if (name == "bvh4")
+        return AccelType::BVH4;
+    if (name == "sbvh")
+        return AccelType::SBVH;
+    if (name == "kdtree")
+        return AccelType::KDTree;
+    if (name == "grid")
+        return AccelType::Grid;
+    if (name == "auto")
+        return AccelType::Auto;
+
+    throw std::invalid_argument("Unknown acceleration structure '" + name + "'");
+}
+
+
+
+void Scene::build_accel(AccelType type)
+{
+    // Objects get Auto as it is, a SpherePool picks for its own spheres
+    accel_type = (type == AccelType::Auto) ? choose_accel() : type;
+    for (std::shared_ptr<Object> &obj : objects)
+        obj->build_accel(type, spatial_splits);
+
+    bvh_objects.clear();
+    unbounded_objects.clear();
+    object_bounds.clear();
+    bvh_slot.assign(objects.size(), -1);
+
+    for (unsigned int i = 0; i < objects.size(); i++)
+    {
+        AABB b { objects[i]->bounds() };
+        if (b.is_finite())
+        {
+            b.pad();
+            bvh_slot[i] = bvh_objects.size();
+            bvh_objects.push_back(i);
+            object_bounds.push_back(b);
+        }
+        else
+        {
+            unbounded_objects.push_back(i);
+        }
+    }
+
+    if (accel_type == AccelType::Grid)
+    {
+        grid.build(object_bounds, &ThreadPool::shared());
+        bvh = BVH {};
+        bvh4.clear();
+        return;
+    }
+
+    grid.clear();
+    bvh.build(object_bounds, BVHSplit::Median, &ThreadPool::shared());
+
+    if (accel_type == AccelType::BVH4)
+        bvh4.build(bvh);
+    else
+        bvh4.clear();
+}
+
+
+
+/* A grid only beats a BVH when primitives fill its cells evenly, so it is picked for many
+ * primitives of about the same size that are spread through space rather than clustered
+ */
+static AccelType choose_grid_or_bvh(int n, BoundsFunction bounds_of)
+{
+    if (n < GRID_MIN_OBJECTS)
+        return AccelType::BVH;
+
+    std::vector<float> sizes(n);
+    AABB centroid_bounds;
+    for (int i = 0; i < n; i++)
+    {
+        AABB b { bounds_of(i) };
+        Vec3 e { b.max - b.min };
+        sizes[i] = std::max(e.x, std::max(e.y, e.z));
+        centroid_bounds.grow(b.centroid());
+    }
+
+    std::nth_element(sizes.begin(), sizes.begin() + n / 2, sizes.end());
+    float median { sizes[n / 2] };
+    if (*std::max_element(sizes.begin(), sizes.end()) > median * GRID_MAX_SIZE_RATIO)
+        return AccelType::BVH;
+
+    // Cubic cells over the centroids, GRID_SAMPLE_OBJECTS of them per cell if spread evenly
+    Vec3 extent { glm::max(centroid_bounds.max - centroid_bounds.min, Vec3 { median }) };
+    float cells_per_length { std::cbrt(n / GRID_SAMPLE_OBJECTS / (extent.x * extent.y * extent.z)) };
+    int res[3];
+    for (int axis = 0; axis < 3; axis++)
+        res[axis] = std::max(1, (int)(extent[axis] * cells_per_length));
+
+    int n_cells { res[0] * res[1] * res[2] };
+    std::vector<bool> used(n_cells, false);
+    int num_used { 0 };
+    for (int i = 0; i < n; i++)
+    {
+        Vec3 c { bounds_of(i).centroid() };
+        int cell[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int k { (int)((c[axis] - centroid_bounds.min[axis]) / extent[axis] * res[axis]) };
+            cell[axis] = std::max(0, std::min(k, res[axis] - 1));
+        }
+
+        int index { cell[0] + res[0] * (cell[1] + res[1] * cell[2]) };
+        num_used += !used[index];
+        used[index] = true;
+    }
+
+    if (num_used < n_cells * GRID_MIN_OCCUPANCY)
+        return AccelType::BVH;
+
+    return AccelType::Grid;
+}
+
+
+
+AccelType Scene::choose_accel() const
+{
+    std::vector<AABB> bounded;
+    for (const std::shared_ptr<Object> &obj : objects)
+    {
+        AABB b { obj->bounds() };
+        if (b.is_finite())
+            bounded.push_back(b);
+    }
+
+    return choose_grid_or_bvh(bounded.size(), [&bounded](int i) { return bounded[i]; });
+}
+
+
+
+// The BVH is stale if objects were added or removed since it was built
+bool Scene::accel_ready() const
+{
+    return bvh_slot.size() == objects.size() && !bvh_slot.empty();
+}
+
+
+
+/* Only the bounds of the moved objects are recalculated, the rest of the update is
+ * an O(n) refit unless the BVH decides it has degraded enough to be rebuilt
+ */
+BVHUpdate Scene::update_accel(const std::vector<int> &moved)
+{
+    if (!accel_ready())
+    {
+        build_accel();
+        return BVHUpdate::FullRebuild;
+    }
+
+    for (int i : moved)
+    {
+        int slot { bvh_slot[i] };
+        if (slot < 0)
+            continue;
+
+        AABB b { objects[i]->bounds() };
+        b.pad();
+        object_bounds[slot] = b;
+    }
+
+    // Grids take O(n) to build, there is nothing to gain from updating one
+    if (accel_type == AccelType::Grid)
+    {
+        grid.build(object_bounds, &ThreadPool::shared());
+        return BVHUpdate::FullRebuild;
+    }
+
+    BVHUpdate update { bvh.update(object_bounds) };
+    if (accel_type == AccelType::BVH4)
+        bvh4.build(bvh);
+
+    return update;
 }
 
 
@@ -78,7 +275,149 @@ Light::Light(Vec3 pos, Vec3 amb, Vec3 dif, Vec3 spe)
 
 
 
-Object::Object(Vec3 amb, Vec3 dif, Vec3 spe, float shi)
+Vec3 Light::sample_dir(Vec3 p, float u, float v) const
+{
+    return glm::normalize(pos - p);
+}
+
+
+float Light::distance(Vec3 p, Vec3 dir) const
+{
+    return glm::length(pos - p);
+}
+
+
+
+SphereLight::SphereLight(Vec3 pos, float r, Vec3 amb, Vec3 dif, Vec3 spe) : Light(pos, amb, dif, spe)
+{
+    if (r <= 0.0f)
+        throw std::invalid_argument("Radius of a sphere light must be > 0");
+
+    this->r = r;
+}
+
+
+/* Uniform over the cone of directions from p that hit the sphere (PBRT's cone sampling)
+ * From inside the sphere every direction hits it, so any will do
+ */
+Vec3 SphereLight::sample_dir(Vec3 p, float u, float v) const
+{
+    Vec3 w { pos - p };
+    float dist2 { glm::dot(w, w) };
+    if (dist2 <= r * r)
+        return glm::normalize(w);
+
+    w /= std::sqrt(dist2);
+    Vec3 a { glm::normalize(glm::cross(w, (std::abs(w.x) < 0.5f) ? Vec3 { 1.0, 0.0, 0.0 } : Vec3 { 0.0, 1.0, 0.0 })) };
+    Vec3 b { glm::cross(w, a) };
+
+    float cos_max { std::sqrt(std::max(0.0f, 1.0f - r * r / dist2)) };
+    float cos_theta { 1.0f - u * (1.0f - cos_max) };
+    float sin_theta { std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta)) };
+    float phi { glm::two_pi<float>() * v };
+    return glm::normalize(a * (sin_theta * std::cos(phi)) + b * (sin_theta * std::sin(phi)) + w * cos_theta);
+}
+
+
+float SphereLight::distance(Vec3 p, Vec3 dir) const
+{
+    // Nearest hit of the ray, sampled directions that only graze the sphere count as touching it
+    Vec3 oc { p - pos };
+    float b { glm::dot(oc, dir) };
+    float disc { b * b - (glm::dot(oc, oc) - r * r) };
+    return std::max(0.0f, -b - std::sqrt(std::max(0.0f, disc)));
+}
+
+
+
+RectLight::RectLight(Vec3 pos, Vec3 edge_u, Vec3 edge_v, Vec3 amb, Vec3 dif, Vec3 spe) : Light(pos, amb, dif, spe)
+{
+    float len_u { glm::length(edge_u) }, len_v { glm::length(edge_v) };
+    if (len_u <= 0.0f || len_v <= 0.0f)
+        throw std::invalid_argument("Edges of a rectangle light must have length > 0");
+
+    if (std::abs(glm::dot(edge_u, edge_v)) > 1e-4f * len_u * len_v)
+        throw std::invalid_argument("Edges of a rectangle light must be perpendicular");
+
+    this->edge_u = edge_u;
+    this->edge_v = edge_v;
+}
+
+
+/* Uniform over the solid angle of the rectangle, by Urena, Fajardo and King's spherical rectangle
+ * sampling (An Area-Preserving Parametrization for Spherical Rectangles). u picks how far across
+ * the solid angle along edge_u, v where along edge_v at that point
+ * From the rectangle's plane it covers no solid angle, so its centre is used
+ */
+Vec3 RectLight::sample_dir(Vec3 p, float u, float v) const
+{
+    // Local frame with the rectangle at z0 < 0, spanning [x0, x1] x [y0, y1]
+    float len_u { glm::length(edge_u) }, len_v { glm::length(edge_v) };
+    Vec3 x { edge_u / len_u }, y { edge_v / len_v };
+    Vec3 z { glm::cross(x, y) };
+    Vec3 d { pos - 0.5f * edge_u - 0.5f * edge_v - p };
+    float z0 { glm::dot(d, z) };
+    if (z0 > 0.0f)
+    {
+        z = -z;
+        z0 = -z0;
+    }
+    if (z0 > -1e-6f * (len_u + len_v))
+        return glm::normalize(pos - p);
+
+    float x0 { glm::dot(d, x) }, y0 { glm::dot(d, y) };
+    float x1 { x0 + len_u }, y1 { y0 + len_v };
+
+    // Normals of the spherical rectangle's edges and its internal angles
+    Vec3 v00 { x0, y0, z0 }, v01 { x0, y1, z0 }, v10 { x1, y0, z0 }, v11 { x1, y1, z0 };
+    Vec3 n0 { glm::normalize(glm::cross(v00, v10)) };
+    Vec3 n1 { glm::normalize(glm::cross(v10, v11)) };
+    Vec3 n2 { glm::normalize(glm::cross(v11, v01)) };
+    Vec3 n3 { glm::normalize(glm::cross(v01, v00)) };
+    float g0 { std::acos(glm::clamp(-glm::dot(n0, n1), -1.0f, 1.0f)) };
+    float g1 { std::acos(glm::clamp(-glm::dot(n1, n2), -1.0f, 1.0f)) };
+    float g2 { std::acos(glm::clamp(-glm::dot(n2, n3), -1.0f, 1.0f)) };
+    float g3 { std::acos(glm::clamp(-glm::dot(n3, n0), -1.0f, 1.0f)) };
+    float k { glm::two_pi<float>() - g2 - g3 };
+    float solid_angle { g0 + g1 - k };
+
+    // x of the point, such that the solid angle left of it is u of the whole
+    float au { u * solid_angle + k };
+    float fu { (std::cos(au) * n0.z - n2.z) / std::sin(au) };
+    float cu { glm::clamp(((fu > 0.0f) ? 1.0f : -1.0f) / std::sqrt(fu * fu + n0.z * n0.z), -1.0f, 1.0f) };
+    float xu { glm::clamp(-(cu * z0) / std::sqrt(std::max(1e-12f, 1.0f - cu * cu)), x0, x1) };
+
+    // y of the point, uniform in the sine of its angle up the rectangle
+    float dist { std::sqrt(xu * xu + z0 * z0) };
+    float h0 { y0 / std::sqrt(dist * dist + y0 * y0) }, h1 { y1 / std::sqrt(dist * dist + y1 * y1) };
+    float hv { h0 + v * (h1 - h0) };
+    float yv { (hv * hv < 1.0f - 1e-6f) ? hv * dist / std::sqrt(1.0f - hv * hv) : y1 };
+
+    return glm::normalize(x * xu + y * yv + z * z0);
+}
+
+
+float RectLight::distance(Vec3 p, Vec3 dir) const
+{
+    Vec3 normal { glm::cross(edge_u, edge_v) };
+    float denom { glm::dot(dir, normal) };
+    if (std::abs(denom) < 1e-12f * glm::dot(normal, normal))
+        return glm::length(pos - p);
+
+    return glm::dot(pos - p, normal) / denom;
+}
+
+
+
+Material::Material()
+{
+    amb = dif = spe = Vec3 { 0.0 };
+    shi = 1.0f;
+}
+
+
+
+Material::Material(Vec3 amb, Vec3 dif, Vec3 spe, float shi)
 {
     if (!valid_light(amb))
         throw std::invalid_argument("Values of amb must be >= 0");
@@ -100,10 +439,78 @@ Object::Object(Vec3 amb, Vec3 dif, Vec3 spe, float shi)
 
 
 
-Plane::Plane(
-    Vec3 normal, Vec3 point,
-    Vec3 amb, Vec3 dif, Vec3 spe, float shi) :
-    Object::Object(amb, dif, spe, shi)
+size_t MaterialTable::Hash::operator()(const Material &m) const
+{
+    std::hash<float> h;
+    size_t seed { 0 };
+    for (float f : { m.amb.x, m.amb.y, m.amb.z, m.dif.x, m.dif.y, m.dif.z, m.spe.x, m.spe.y, m.spe.z, m.shi })
+        seed ^= h(f) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+
+    return seed;
+}
+
+
+
+int MaterialTable::add(const Material &material)
+{
+    auto found = index.find(material);
+    if (found != index.end())
+        return found->second;
+
+    materials.push_back(material);
+    index[material] = materials.size() - 1;
+    return materials.size() - 1;
+}
+
+
+
+Object::Object(int material)
+{
+    this->material = material;
+}
+
+
+
+// Objects whose normal only depends on the point can use get_normal
+float Object::check_collision_normal(Vec3 p0, Vec3 d, Vec3 &normal)
+{
+    float t { check_collision(p0, d) };
+    if (t > 0.0f)
+        normal = get_normal(p0 + d * t);
+
+    return t;
+}
+
+
+
+// Objects made of a single material
+float Object::check_collision_material(Vec3 p0, Vec3 d, Vec3 &normal, int &material)
+{
+    material = this->material;
+    return check_collision_normal(p0, d, normal);
+}
+
+
+
+// Objects made of a single primitive
+float Object::check_collision_prim(Vec3 p0, Vec3 d, Vec3 &normal, int &material, int &prim)
+{
+    prim = 0;
+    return check_collision_material(p0, d, normal, material);
+}
+
+
+
+// Only a Mesh's check_collision keeps state, and it has a check_primitive of its own
+float Object::check_primitive(int prim, Vec3 p0, Vec3 d)
+{
+    return (prim == 0) ? check_collision(p0, d) : NO_INTERSECT;
+}
+
+
+
+Plane::Plane(Vec3 normal, Vec3 point, int material) :
+    Object::Object(material)
 {
     this->normal = normal;
     this->point = point;
@@ -113,6 +520,16 @@ Plane::Plane(
 Vec3 Plane::get_normal(Vec3 point){ return normal; }
 
 
+void Plane::translate(Vec3 offset){ point += offset; }
+
+
+AABB Plane::bounds()
+{
+    float inf { std::numeric_limits<float>::infinity() };
+    return AABB { Vec3 { -inf }, Vec3 { inf } };
+}
+
+
 
 /* Ray-Plane Collision
  * Algorithm adapted from http://www.geomalgorithms.com/a05-_intersect-1.html
@@ -130,36 +547,13 @@ float Plane::check_collision(Vec3 p0, Vec3 d)
 
 
 
-Sphere::Sphere(
-    Vec3 pos, float r,
-    Vec3 amb, Vec3 dif, Vec3 spe, float shi) :
-    Object::Object(amb, dif, spe, shi)
-{
-    if (r <= 0.0)
-        throw std::invalid_argument("r must be >0.0");
-
-    this->pos = pos;
-    this->r = r;
-}
-
-
-/* Sphere normal calculation
- * Adapted from COMP371 Lecture 13
- * point doesn't need to be on the surface of the sphere to work
- */
-Vec3 Sphere::get_normal(Vec3 point)
-{
-    return (point != pos) ? glm::normalize(point - pos) : Vec3 { 0.0 };
-}
-
-
-
 /* Sphere-Ray collision
  * Adapted from COMP371 Lecture 13
- * Returns the closest intersection of the ray p0 + dt with the sphere
+ * Returns the closest intersection of the ray p0 + dt with the sphere, d must be normalized
  * Returns a negative value if there is no intersection
+ * Shared by Sphere and SpherePool so a sphere is hit in exactly the same place either way
  */
-float Sphere::check_collision(Vec3 p0, Vec3 d)
+static float intersect_sphere(Vec3 pos, float r, Vec3 p0, Vec3 d)
 {
     // Solve for intersections using the quadtratic equation
     Vec3 p_dif { p0 - pos };
@@ -201,9 +595,257 @@ float Sphere::check_collision(Vec3 p0, Vec3 d)
 
 
 
+
+
+
+Sphere::Sphere(Vec3 pos, float r, int material) :
+    Object::Object(material)
+{
+    if (r <= 0.0)
+        throw std::invalid_argument("r must be >0.0");
+
+    this->pos = pos;
+    this->r = r;
+}
+
+
+/* Sphere normal calculation
+ * Adapted from COMP371 Lecture 13
+ * point doesn't need to be on the surface of the sphere to work
+ */
+Vec3 Sphere::get_normal(Vec3 point)
+{
+    return (point != pos) ? glm::normalize(point - pos) : Vec3 { 0.0 };
+}
+
+
+
+void Sphere::translate(Vec3 offset){ pos += offset; }
+
+
+AABB Sphere::bounds(){ return AABB { pos - Vec3 { r }, pos + Vec3 { r } }; }
+
+
+
+/* Sphere-Ray collision, see intersect_sphere */
+float Sphere::check_collision(Vec3 p0, Vec3 d)
+{
+    return intersect_sphere(pos, r, p0, d);
+}
+
+
+
+/* Sphere pool
+ * The pool's own material is unused, every sphere has its own
+ */
+SpherePool::SpherePool() :
+    Object::Object(0)
+{
+    last_col_normal = Vec3 { 0.0 };
+    accel_type = AccelType::BVH;
+}
+
+
+
+void SpherePool::add(Vec3 pos, float r, int material)
+{
+    if (r <= 0.0)
+        throw std::invalid_argument("r must be >0.0");
+
+    spheres.push_back(glm::vec4 { pos.x, pos.y, pos.z, r });
+    material_index.push_back(material);
+    pool_bounds.grow(AABB { pos - Vec3 { r }, pos + Vec3 { r } });
+}
+
+
+
+void SpherePool::reserve(int num_spheres)
+{
+    spheres.reserve(num_spheres);
+    material_index.reserve(num_spheres);
+}
+
+
+
+// Padded like the bounds of a Sphere in the scene's BVH, so the pool ignores the same hits
+AABB SpherePool::sphere_bounds(int i) const
+{
+    const glm::vec4 &s { spheres[i] };
+    Vec3 pos { s.x, s.y, s.z };
+    float r { s.w };
+    AABB b { pos - Vec3 { r }, pos + Vec3 { r } };
+    b.pad();
+    return b;
+}
+
+
+
+// Updated when a collision is checked for, like Mesh::get_normal
+Vec3 SpherePool::get_normal(Vec3 point)
+{
+    return last_col_normal;
+}
+
+
+
+float SpherePool::check_collision(Vec3 p0, Vec3 d)
+{
+    return check_collision_normal(p0, d, last_col_normal);
+}
+
+
+
+float SpherePool::check_collision_normal(Vec3 p0, Vec3 d, Vec3 &normal)
+{
+    int material;
+    return check_collision_material(p0, d, normal, material);
+}
+
+
+
+float SpherePool::check_collision_material(Vec3 p0, Vec3 d, Vec3 &normal, int &material)
+{
+    int prim;
+    return check_collision_prim(p0, d, normal, material, prim);
+}
+
+
+
+float SpherePool::check_collision_prim(Vec3 p0, Vec3 d, Vec3 &normal, int &material, int &prim)
+{
+    float t;
+    int closest { intersect(p0, d, t) };
+    prim = closest;
+    if (closest < 0)
+        return NO_INTERSECT;
+
+    Vec3 pos { spheres[closest].x, spheres[closest].y, spheres[closest].z };
+    Vec3 p_col { p0 + d * t };
+    normal = (p_col != pos) ? glm::normalize(p_col - pos) : Vec3 { 0.0 };
+    material = material_index[closest];
+    return t;
+}
+
+
+
+float SpherePool::check_primitive(int prim, Vec3 p0, Vec3 d)
+{
+    if (prim < 0 || prim >= size())
+        return NO_INTERSECT;
+
+    const glm::vec4 &s { spheres[prim] };
+    return intersect_sphere(Vec3 { s.x, s.y, s.z }, s.w, p0, d);
+}
+
+
+
+/* Index of the closest sphere the ray hits, or -1, and the distance to it in t
+ * Hits are accepted exactly as fire_ray accepts hits on Sphere objects
+ */
+int SpherePool::intersect(Vec3 p0, Vec3 d, float &t) const
+{
+    t = std::numeric_limits<float>::infinity();
+    int closest { -1 };
+    Vec3 inv_d { safe_inverse(d) };
+
+    auto test_sphere = [&](int i, float t_min, float t_max)
+    {
+        // The grid doesn't keep the spheres' bounds, it leaves checking them to us
+        if (accel_type == AccelType::Grid && !sphere_bounds(i).hit_range(p0, inv_d, t_min, t_max))
+            return t;
+
+        const glm::vec4 &s { spheres[i] };
+        float t_sphere { intersect_sphere(Vec3 { s.x, s.y, s.z }, s.w, p0, d) };
+        if (t_sphere - BIAS > 0.0 && t_sphere >= t_min && t_sphere <= t_max &&
+            (t_sphere < t || (t_sphere == t && i < closest)))
+        {
+            t = t_sphere;
+            closest = i;
+        }
+        return t;
+    };
+
+    if (accel_type == AccelType::Grid)
+        grid.traverse(p0, d, t, test_sphere);
+    else if (accel_type == AccelType::BVH4)
+        bvh4.traverse(p0, d, t, test_sphere);
+    else
+        bvh.traverse(p0, d, t, test_sphere);
+
+    return closest;
+}
+
+
+
+/* Moving every sphere by the same offset moves every cell of the grid along with them, but the
+ * grid is cheap enough to rebuild. The BVH is refitted like a Mesh's
+ */
+void SpherePool::translate(Vec3 offset)
+{
+    for (glm::vec4 &s : spheres)
+    {
+        s.x += offset.x;
+        s.y += offset.y;
+        s.z += offset.z;
+    }
+    pool_bounds = AABB { pool_bounds.min + offset, pool_bounds.max + offset };
+
+    if (accel_type == AccelType::Grid)
+    {
+        build_accel(accel_type, SpatialSplitOptions {});
+        return;
+    }
+
+    std::vector<AABB> bounds(spheres.size());
+    for (unsigned int i = 0; i < spheres.size(); i++)
+        bounds[i] = sphere_bounds(i);
+
+    bvh.refit(bounds);
+    if (accel_type == AccelType::BVH4)
+        bvh4.build(bvh);
+}
+
+
+
+AABB SpherePool::bounds(){ return pool_bounds; }
+
+
+
+/* Grid for Grid, and for Auto when the spheres are even enough for one, otherwise an SAH BVH
+ * (collapsed into a BVH4 for BVH4). Spatial splits and kd-trees have nothing to gain on spheres
+ */
+void SpherePool::build_accel(AccelType type, const SpatialSplitOptions &spatial)
+{
+    BoundsFunction bounds_of { [this](int i) { return sphere_bounds(i); } };
+    accel_type = (type == AccelType::Auto) ? choose_grid_or_bvh(spheres.size(), bounds_of) : type;
+    if (accel_type == AccelType::Grid)
+    {
+        grid.build(spheres.size(), bounds_of, &ThreadPool::shared());
+        bvh = BVH {};
+        bvh4.clear();
+        return;
+    }
+
+    if (accel_type != AccelType::BVH4)
+        accel_type = AccelType::BVH;
+
+    std::vector<AABB> bounds(spheres.size());
+    for (unsigned int i = 0; i < spheres.size(); i++)
+        bounds[i] = sphere_bounds(i);
+
+    grid.clear();
+    bvh.build(bounds, BVHSplit::SAH, &ThreadPool::shared());
+    if (accel_type == AccelType::BVH4)
+        bvh4.build(bvh);
+    else
+        bvh4.clear();
+}
+
+
+
 // Constructs a Mesh from a given .obj file
-Mesh::Mesh(std::string filename, Vec3 amb, Vec3 dif, Vec3 spe, float shi) :
-Object::Object(amb, dif, spe, shi)
+Mesh::Mesh(std::string filename, int material) :
+Object::Object(material)
 {
     last_col_normal = Vec3 { 0.0 };
 
@@ -212,13 +854,16 @@ Object::Object(amb, dif, spe, shi)
     {
         throw std::invalid_argument("Invalid input file");
     }
+
+    accel_type = AccelType::BVH;
+    bvh.build(triangle_bounds(), BVHSplit::SAH, &ThreadPool::shared());
 }
 
 
 
 // Constructs a Mesh from a vertex list, used to make triangles
-Mesh::Mesh(std::vector<Vec3> vertices, Vec3 amb, Vec3 dif, Vec3 spe, float shi) :
-Object::Object(amb, dif, spe, shi)
+Mesh::Mesh(std::vector<Vec3> vertices, int material) :
+Object::Object(material)
 {
     last_col_normal = Vec3 { 0.0 };
     if (vertices.size() % 3 == 0)
@@ -236,6 +881,8 @@ Object::Object(amb, dif, spe, shi)
         last_col_normal = glm::cross(u, w);
     }
 
+    accel_type = AccelType::BVH;
+    bvh.build(triangle_bounds(), BVHSplit::SAH, &ThreadPool::shared());
 }
 
 
@@ -250,62 +897,263 @@ Vec3 Mesh::get_normal(Vec3 point)
 
 
 
-/* Mesh-Ray collision
- * Adapted from: http://geomalgorithms.com/a06-_intersect-2.html
- * 
- * Tests for collision against every triangle constructed from the vertex list
- * Updates the normal at the collision position for future get_normal checks
+/* Translating doesn't change the shape of the tree, so a refit keeps it as good as new
+ * except for an SBVH, whose split triangles would be refitted to their whole bounds, and a
+ * kd-tree, which can't be refitted
  */
-float Mesh::check_collision(Vec3 p0, Vec3 d)
+void Mesh::translate(Vec3 offset)
 {
-    float t0 { std::numeric_limits<float>::infinity() };
+    for (Vec3 &v : vertices)
+        v += offset;
+
+    if (accel_type == AccelType::SBVH || accel_type == AccelType::KDTree)
+    {
+        build_accel(accel_type, spatial);
+        return;
+    }
+
+    bvh.refit(triangle_bounds());
+    if (accel_type == AccelType::BVH4)
+        bvh4.build(bvh);
+}
 
-    Vec3 vertex[3];
-    Vec3 u, v, w, normal, p1, p_col;
-    float denom, uu, vv, uv, wv, wu;
-    float t_plane_col, s_tri_col, t_tri_col;
 
-    for (unsigned int i = 0; i < vertices.size(); i += 3)
+
+/* Rebuilds the triangle BVH from scratch, dropping whatever refitting did to it
+ * The binary BVH is always kept since it's what gets refitted, a BVH4 is collapsed from it
+ * Triangles don't move relative to each other, so the tree is worth an SAH build
+ */
+void Mesh::build_accel(AccelType type, const SpatialSplitOptions &spatial)
+{
+    accel_type = type;
+    this->spatial = spatial;
+    ClipFunction clip { [this](int tri, const AABB &box) { return clip_triangle(tri, box); } };
+    if (accel_type == AccelType::KDTree)
     {
-        // Construct a triangle from the next 3 vertices
-        vertex[0] = vertices[i];
-        vertex[1] = vertices[i+1];
-        vertex[2] = vertices[i+2];
+        kdtree.build(triangle_bounds(), clip);
+        bvh = BVH {};
+    }
+    else if (accel_type == AccelType::SBVH)
+    {
+        bvh.build_spatial(triangle_bounds(), clip, spatial);
+        kdtree.clear();
+    }
+    else
+    {
+        bvh.build(triangle_bounds(), BVHSplit::SAH, &ThreadPool::shared());
+        kdtree.clear();
+    }
+
+    if (accel_type == AccelType::BVH4)
+        bvh4.build(bvh);
+    else
+        bvh4.clear();
+}
 
-        u = vertex[1] - vertex[0];
-        v = vertex[2] - vertex[0];
 
-        normal = glm::cross(u, v);
 
-        // Test Ray-Plane intersection for the plane of the triangle
-        p1 = p0 + d;
-        t_plane_col = glm::dot(normal, vertex[0] - p0) / glm::dot(normal, p1 - p0);
+AABB Mesh::bounds()
+{
+    if (accel_type == AccelType::KDTree)
+        return kdtree.bounds;
 
-        if (t_plane_col > 0.0 && t_plane_col < t0)
+    return bvh.nodes.empty() ? AABB {} : bvh.nodes[0].bounds;
+}
+
+
+
+std::vector<AABB> Mesh::triangle_bounds() const
+{
+    std::vector<AABB> bounds(vertices.size() / 3);
+    for (unsigned int i = 0; i < bounds.size(); i++)
+    {
+        bounds[i].grow(vertices[3 * i]);
+        bounds[i].grow(vertices[3 * i + 1]);
+        bounds[i].grow(vertices[3 * i + 2]);
+        bounds[i].pad();
+    }
+
+    return bounds;
+}
+
+
+
+/* Bounds of the part of triangle tri inside box
+ * The triangle is clipped against each face of the box in turn (Sutherland-Hodgman), each
+ * plane adds at most one corner. Rounding can make the polygon slightly concave, if it ever
+ * gets too many corners clipping stops early, which only makes the bounds looser
+ */
+AABB Mesh::clip_triangle(int tri, const AABB &box) const
+{
+    const int MAX_CORNERS { 16 };
+    Vec3 poly[MAX_CORNERS], clipped[MAX_CORNERS];
+    int n { 3 };
+    for (int i = 0; i < 3; i++)
+        poly[i] = vertices[3 * tri + i];
+
+    for (int axis = 0; axis < 3 && n > 0; axis++)
+    {
+        for (int side = 0; side < 2 && n > 0 && 2 * n <= MAX_CORNERS; side++)
         {
-            // We intersect with the plane, use a modified version of Moller-Trumbore algorithm
-            // to test for intersection with a triangle in 3d
-            p_col = p0 + d * t_plane_col;
-            w = p_col - vertex[0];
-
-            uu = glm::dot(u, u);
-            vv = glm::dot(v, v);
-            uv = glm::dot(u, v);
-            wv = glm::dot(w, v);
-            wu = glm::dot(w, u);
-            denom = (uv * uv) - (uu * vv);
-
-            s_tri_col = (uv * wv - vv * wu) / denom;
-            t_tri_col = (uv * wu - uu * wv) / denom;
-
-            // Collision if s, t >= 0 and s + t <= 1
-            if (s_tri_col >= 0 && t_tri_col >= 0 && (s_tri_col + t_tri_col) <= 1)
+            // Distance inside the plane, positive on the side that is kept
+            float plane { side == 0 ? box.min[axis] : box.max[axis] };
+            auto inside = [axis, side, plane](Vec3 p) { return side == 0 ? p[axis] - plane : plane - p[axis]; };
+
+            int m { 0 };
+            for (int i = 0; i < n; i++)
             {
-                t0 = t_plane_col;
-                last_col_normal = normal;
+                Vec3 a { poly[i] }, b { poly[(i + 1) % n] };
+                float da { inside(a) }, db { inside(b) };
+                if (da >= 0.0f)
+                    clipped[m++] = a;
+                if ((da >= 0.0f) != (db >= 0.0f))
+                {
+                    Vec3 p { a + (b - a) * (da / (da - db)) };
+                    p[axis] = plane;
+                    clipped[m++] = p;
+                }
             }
+
+            n = m;
+            std::copy(clipped, clipped + n, poly);
         }
     }
 
-    return (t0 < std::numeric_limits<float>::infinity()) ? t0 : NO_INTERSECT;
-}
\ No newline at end of file
+    AABB bounds;
+    for (int i = 0; i < n; i++)
+        bounds.grow(poly[i]);
+
+    return bounds.overlap(box);
+}
+
+
+
+// Updates the normal at the collision position for future get_normal checks
+float Mesh::check_collision(Vec3 p0, Vec3 d)
+{
+    Vec3 normal;
+    float t { check_collision_normal(p0, d, normal) };
+    if (t > 0.0f)
+        last_col_normal = normal;
+
+    return t;
+}
+
+
+
+// Mesh-Ray collision, see closest_triangle
+float Mesh::check_collision_normal(Vec3 p0, Vec3 d, Vec3 &normal)
+{
+    float t;
+    return (closest_triangle(p0, d, normal, t) >= 0) ? t : NO_INTERSECT;
+}
+
+
+
+float Mesh::check_collision_prim(Vec3 p0, Vec3 d, Vec3 &normal, int &material, int &prim)
+{
+    float t;
+    material = this->material;
+    prim = closest_triangle(p0, d, normal, t);
+    return (prim >= 0) ? t : NO_INTERSECT;
+}
+
+
+
+float Mesh::check_primitive(int prim, Vec3 p0, Vec3 d)
+{
+    if (prim < 0 || 3 * prim + 2 >= (int)vertices.size())
+        return NO_INTERSECT;
+
+    Vec3 normal;
+    return intersect_triangle(prim, p0, d, normal);
+}
+
+
+
+/* Index of the closest triangle the ray hits, or -1, the distance to it in t and its normal in normal
+ * Tests the triangles whose bounds the ray passes through, using the mesh's BVH (or BVH4, or kd-tree)
+ * Ties between triangles go to the one listed first, same as testing every triangle in order
+ */
+int Mesh::closest_triangle(Vec3 p0, Vec3 d, Vec3 &normal, float &t) const
+{
+    float t0 { std::numeric_limits<float>::infinity() };
+    int closest { -1 };
+    Vec3 tri_normal;
+
+    auto test_triangle = [&](int tri, float t_min, float t_max)
+    {
+        float t { intersect_triangle(tri, p0, d, tri_normal) };
+        if (t > 0.0 && t >= t_min && t <= t_max && (t < t0 || (t == t0 && tri < closest)))
+        {
+            t0 = t;
+            closest = tri;
+            normal = tri_normal;
+        }
+        return t0;
+    };
+
+    if (accel_type == AccelType::BVH4)
+        bvh4.traverse(p0, d, t0, test_triangle);
+    else if (accel_type == AccelType::KDTree)
+        kdtree.traverse(p0, d, t0, test_triangle);
+    else
+        bvh.traverse(p0, d, t0, test_triangle);
+
+    t = t0;
+    return closest;
+}
+
+
+
+/* Ray-Triangle collision
+ * Adapted from: http://geomalgorithms.com/a06-_intersect-2.html
+ *
+ * Returns t where p0 + dt is on triangle tri and stores the triangle's normal
+ * Returns NO_INTERSECT if there is no collision
+ */
+float Mesh::intersect_triangle(int tri, Vec3 p0, Vec3 d, Vec3 &normal) const
+{
+    Vec3 vertex[3];
+    Vec3 u, v, w, p1, p_col;
+    float denom, uu, vv, uv, wv, wu;
+    float t_plane_col, s_tri_col, t_tri_col;
+
+    // Construct a triangle from the next 3 vertices
+    vertex[0] = vertices[3 * tri];
+    vertex[1] = vertices[3 * tri + 1];
+    vertex[2] = vertices[3 * tri + 2];
+
+    u = vertex[1] - vertex[0];
+    v = vertex[2] - vertex[0];
+
+    normal = glm::cross(u, v);
+
+    // Test Ray-Plane intersection for the plane of the triangle
+    p1 = p0 + d;
+    t_plane_col = glm::dot(normal, vertex[0] - p0) / glm::dot(normal, p1 - p0);
+
+    if (!(t_plane_col > 0.0))
+        return NO_INTERSECT;
+
+    // We intersect with the plane, use a modified version of Moller-Trumbore algorithm
+    // to test for intersection with a triangle in 3d
+    p_col = p0 + d * t_plane_col;
+    w = p_col - vertex[0];
+
+    uu = glm::dot(u, u);
+    vv = glm::dot(v, v);
+    uv = glm::dot(u, v);
+    wv = glm::dot(w, v);
+    wu = glm::dot(w, u);
+    denom = (uv * uv) - (uu * vv);
+
+    s_tri_col = (uv * wv - vv * wu) / denom;
+    t_tri_col = (uv * wu - uu * wv) / denom;
+
+    // Collision if s, t >= 0 and s + t <= 1
+    if (s_tri_col >= 0 && t_tri_col >= 0 && (s_tri_col + t_tri_col) <= 1)
+        return t_plane_col;
+
+    return NO_INTERSECT;
+}
@@ -1,24 +1,57 @@
 #ifndef __OBJECTS_HPP
 #define __OBJECTS_HPP
 
+#include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <stdexcept>
 
 #include <glm/glm.hpp>
 
+#include "bvh.hpp"
+#include "bvh4.hpp"
+#include "grid.hpp"
+#include "kdtree.hpp"
 
-typedef glm::vec3 Vec3;
 
 class Object;
 
 
-// Info about where & which object a ray collides against
+/* Acceleration structures that rays can be traced through
+ * BVH - Binary BVH, the only one that can be refitted
+ * BVH4 - 4-wide quantized BVH collapsed from the binary one, tests 4 boxes at a time
+ * SBVH - Binary BVH whose mesh triangles may be split between nodes (see BVH::build_spatial),
+ *        scene objects are kept in a plain BVH
+ * KDTree - SAH kd-tree with ropes over each mesh's triangles (see KDTree), scene objects are kept
+ *          in a plain BVH
+ * Grid - Uniform grid over the scene's objects (see Grid), for fields of many similar objects
+ * Auto - Whichever of Grid and BVH suits the scene's objects, see Scene::choose_accel
+ */
+enum class AccelType { BVH, BVH4, SBVH, KDTree, Grid, Auto };
+
+/* Parses the name of an AccelType ("bvh", "bvh4", "sbvh", "kdtree", "grid", "auto"),
+ * throws std::invalid_argument if unknown
+ */
+AccelType parse_accel(std::string name);
+
+
+/* Info about where & which object a ray collides against
+ * normal is the object's (unnormalized) surface normal at coord, it isn't compared
+ * material is the index in the scene's MaterialTable of what the object is made of at coord,
+ * it only differs across a SpherePool
+ * object is the index of obj in the scene's objects and prim which of its primitives was hit
+ * (see Object::check_collision_prim), for the occluder cache
+ */
 struct Collision
 {
     std::shared_ptr<Object> obj;
     Vec3 coord;
+    Vec3 normal;
+    int material;
+    int object, prim;
 
     bool operator==(const Collision &c) const
     {
@@ -46,6 +79,54 @@ bool valid_light(Vec3 L);
 
 
 
+/* Phong material of a primitive
+ * The default material is black, any other must have amb, dif and spe >= 0 and shi > 0
+ */
+struct Material
+{
+    Vec3 amb, dif, spe;
+    float shi;
+
+    Material();
+    Material(Vec3 amb, Vec3 dif, Vec3 spe, float shi);
+
+    bool operator==(const Material &m) const
+    {
+        return (amb == m.amb && dif == m.dif && spe == m.spe && shi == m.shi);
+    }
+};
+
+
+
+/* List of distinct materials, shared by every primitive that uses one
+ * Adding a material that is already in the table gives the index of the one already there
+ * Primitives only keep the index of their material, so shading reads materials from one small
+ * array rather than from each primitive
+ */
+class MaterialTable
+{
+public:
+    int add(const Material &material);
+
+    const Material &operator[](int i) const { return materials[i]; }
+    int size() const { return materials.size(); }
+
+private:
+    struct Hash
+    {
+        size_t operator()(const Material &m) const;
+    };
+
+    std::vector<Material> materials;
+    std::unordered_map<Material, int, Hash> index;
+};
+
+
+
+/* Point light, the parent class of area lights
+ * Shading treats every light as a point at pos, area lights only spread out the shadow rays
+ * fired at them so their shadows have a real penumbra
+ */
 class Light
 {
 public:
@@ -53,6 +134,54 @@ public:
     Vec3 amb, dif, spe;
 
     Light(Vec3 pos, Vec3 amb, Vec3 dif, Vec3 spe);
+    virtual ~Light() {}
+
+    /* Whether shadow rays are aimed at the light with sample_dir
+     * Shadow rays at point lights are scattered around them instead (see ShadowRays)
+     */
+    virtual bool has_area() const { return false; }
+
+    /* Direction from p to a point on the light, for u and v uniform in [0, 1) the directions are
+     * spread uniformly over the solid angle the light covers as seen from p
+     */
+    virtual Vec3 sample_dir(Vec3 p, float u, float v) const;
+
+    // How far the light is from p along dir (normalized), a shadow ray that hits something closer is blocked
+    virtual float distance(Vec3 p, Vec3 dir) const;
+};
+
+
+
+// Spherical light of radius r around pos
+class SphereLight : public Light
+{
+public:
+    SphereLight(Vec3 pos, float r, Vec3 amb, Vec3 dif, Vec3 spe);
+
+    bool has_area() const override { return true; }
+    Vec3 sample_dir(Vec3 p, float u, float v) const override;
+    float distance(Vec3 p, Vec3 dir) const override;
+
+private:
+    float r;
+};
+
+
+
+/* Rectangular light centred on pos with perpendicular edges edge_u and edge_v
+ * It shines from both faces
+ */
+class RectLight : public Light
+{
+public:
+    RectLight(Vec3 pos, Vec3 edge_u, Vec3 edge_v, Vec3 amb, Vec3 dif, Vec3 spe);
+
+    bool has_area() const override { return true; }
+    Vec3 sample_dir(Vec3 p, float u, float v) const override;
+    float distance(Vec3 p, Vec3 dir) const override;
+
+private:
+    Vec3 edge_u, edge_v;
 };
 
 
@@ -66,11 +195,40 @@ public:
     virtual Vec3 get_normal(Vec3 point) = 0;
     virtual float check_collision(Vec3 p0, Vec3 d) = 0;
 
+    /* Like check_collision, but also stores the surface normal at the collision in normal
+     * Unlike get_normal it doesn't depend on what was tested before, so it is what rays
+     * traced from several threads at once use
+     */
+    virtual float check_collision_normal(Vec3 p0, Vec3 d, Vec3 &normal);
+
+    // Like check_collision_normal, but also stores the index of the material at the collision
+    virtual float check_collision_material(Vec3 p0, Vec3 d, Vec3 &normal, int &material);
+
+    /* Like check_collision_material, but also stores which of the object's primitives (the
+     * triangle of a Mesh, the sphere of a SpherePool) was hit in prim, 0 for objects of one
+     */
+    virtual float check_collision_prim(Vec3 p0, Vec3 d, Vec3 &normal, int &material, int &prim);
+
+    /* Where the ray hits primitive prim alone, as check_collision_prim would find it, or a value
+     * <= 0 if it doesn't or there is no such primitive. Safe to call from several threads at once
+     */
+    virtual float check_primitive(int prim, Vec3 p0, Vec3 d);
+
+    // Moves the object by offset, used to animate objects between frames
+    // Scene::update_accel must be told about moved objects before rendering again
+    virtual void translate(Vec3 offset) = 0;
+
+    // Box enclosing the object, unbounded objects (planes) return an infinite box
+    virtual AABB bounds() = 0;
+
+    // Builds the given acceleration structure over the object's own geometry, if it has any
+    virtual void build_accel(AccelType type, const SpatialSplitOptions &spatial) {}
+
     virtual ~Object() {};
-    Object(Vec3 amb, Vec3 dif, Vec3 spe, float shi);
+    explicit Object(int material);
 
-    Vec3 amb, dif, spe;
-    float shi;
+    // Index of the object's material in the scene's MaterialTable
+    int material;
 };
 
 
@@ -82,7 +240,41 @@ public:
     std::vector<std::shared_ptr<Object>> objects;
     std::vector<std::shared_ptr<Light>> lights;
 
+    // Materials of every object, objects refer to them by index
+    MaterialTable materials;
+
     Scene();
+
+    /* Acceleration structure
+     * The BVH holds every bounded object, unbounded ones are tested by every ray
+     * build_accel must be called once objects are added (load_scene does this), until
+     * then fire_ray falls back to testing every object
+     * With AccelType::BVH4 rays are traced through bvh4, which is rebuilt from bvh on updates
+     * With AccelType::Grid the bounded objects are in grid instead and bvh is left empty
+     * accel_type is never Auto, building with Auto picks one (see choose_accel)
+     */
+    AccelType accel_type;
+    BVH bvh;
+    BVH4 bvh4;
+    Grid grid;
+    std::vector<int> bvh_objects, unbounded_objects;
+
+    // Budget for the spatial splits of AccelType::SBVH, takes effect on the next build_accel
+    SpatialSplitOptions spatial_splits;
+
+    void build_accel(AccelType type = AccelType::BVH);
+    bool accel_ready() const;
+
+    // The structure AccelType::Auto builds for the scene as it is now
+    AccelType choose_accel() const;
+
+    // Refits the BVH after the objects at the given indices moved, see BVH::update
+    BVHUpdate update_accel(const std::vector<int> &moved);
+
+private:
+    // Bounds of each of bvh_objects and the position of each object in bvh_objects (or -1)
+    std::vector<AABB> object_bounds;
+    std::vector<int> bvh_slot;
 };
 
 
@@ -90,11 +282,12 @@ public:
 class Plane : public Object
 {
 public:
-    Plane(Vec3 normal, Vec3 point, 
-            Vec3 amb, Vec3 dif, Vec3 spe, float shi);
+    Plane(Vec3 normal, Vec3 point, int material);
 
     Vec3 get_normal(Vec3 point) override;
     float check_collision(Vec3 p0, Vec3 d) override;
+    void translate(Vec3 offset) override;
+    AABB bounds() override;
 
 private:
     Vec3 normal;
@@ -106,11 +299,12 @@ private:
 class Sphere : public Object
 {
 public:
-    Sphere(Vec3 pos, float r,
-            Vec3 amb, Vec3 dif, Vec3 spe, float shi);
+    Sphere(Vec3 pos, float r, int material);
 
     Vec3 get_normal(Vec3 point) override;
     float check_collision(Vec3 p0, Vec3 d) override;
+    void translate(Vec3 offset) override;
+    AABB bounds() override;
 
 private:
     float r;
@@ -122,17 +316,85 @@ private:
 class Mesh : public Object
 {
 public:
-    Mesh(std::string filename, Vec3 amb, Vec3 dif, Vec3 spe, float shi);
-    Mesh(std::vector<Vec3> vertices, Vec3 amb, Vec3 dif, Vec3 spe, float shi);
+    Mesh(std::string filename, int material);
+    Mesh(std::vector<Vec3> vertices, int material);
 
     Vec3 get_normal(Vec3 point) override;
     float check_collision(Vec3 p0, Vec3 d) override;
+    float check_collision_normal(Vec3 p0, Vec3 d, Vec3 &normal) override;
+    float check_collision_prim(Vec3 p0, Vec3 d, Vec3 &normal, int &material, int &prim) override;
+    float check_primitive(int prim, Vec3 p0, Vec3 d) override;
+    void translate(Vec3 offset) override;
+    AABB bounds() override;
+    void build_accel(AccelType type, const SpatialSplitOptions &spatial) override;
 
 private:
     std::vector<Vec3> vertices, normals;
     std::vector<glm::vec2> uvs;
 
     Vec3 last_col_normal, normal;
+
+    // SAH BVH (or SBVH, or kd-tree) over the triangles, triangle i is vertices[3i, 3i + 3)
+    AccelType accel_type;
+    SpatialSplitOptions spatial;
+    BVH bvh;
+    BVH4 bvh4;
+    KDTree kdtree;
+
+    std::vector<AABB> triangle_bounds() const;
+    AABB clip_triangle(int tri, const AABB &box) const;
+    float intersect_triangle(int tri, Vec3 p0, Vec3 d, Vec3 &normal) const;
+    int closest_triangle(Vec3 p0, Vec3 d, Vec3 &normal, float &t) const;
+};
+
+
+
+
+/* Compact pool of spheres, for scenes of millions of them
+ * A Sphere object costs about 100 bytes with its vtable pointer, shared_ptr control block and the
+ * scene's pointer to it. A pool keeps each sphere as just its centre, radius and the index of its
+ * material, 20 bytes, and like a Mesh builds its own acceleration structure over them
+ * With AccelType::Grid (or Auto, for even fields of spheres) the grid doesn't keep the spheres'
+ * bounds, which is what lets 10 million spheres load in a few hundred MB (see benchmemory)
+ * Ties between spheres go to the one added first, so a pool gives the same image as Sphere
+ * objects added to the scene in the same order
+ */
+class SpherePool : public Object
+{
+public:
+    SpherePool();
+
+    // Adds a sphere made of the scene's material at index material, throws std::invalid_argument if r <= 0
+    void add(Vec3 pos, float r, int material);
+    void reserve(int num_spheres);
+    int size() const { return spheres.size(); }
+
+    Vec3 get_normal(Vec3 point) override;
+    float check_collision(Vec3 p0, Vec3 d) override;
+    float check_collision_normal(Vec3 p0, Vec3 d, Vec3 &normal) override;
+    float check_collision_material(Vec3 p0, Vec3 d, Vec3 &normal, int &material) override;
+    float check_collision_prim(Vec3 p0, Vec3 d, Vec3 &normal, int &material, int &prim) override;
+    float check_primitive(int prim, Vec3 p0, Vec3 d) override;
+    void translate(Vec3 offset) override;
+    AABB bounds() override;
+    void build_accel(AccelType type, const SpatialSplitOptions &spatial) override;
+
+private:
+    // Centre in xyz and radius in w
+    std::vector<glm::vec4> spheres;
+    std::vector<uint32_t> material_index;
+    AABB pool_bounds;
+
+    Vec3 last_col_normal;
+
+    // Grid, or SAH BVH (and BVH4) if the spheres are too uneven for one
+    AccelType accel_type;
+    BVH bvh;
+    BVH4 bvh4;
+    Grid grid;
+
+    AABB sphere_bounds(int i) const;
+    int intersect(Vec3 p0, Vec3 d, float &t) const;
 };
 
 
@@ -1,15 +1,19 @@
+#include <algorithm>
+#include <atomic>
 #include <limits>
 #include <memory>
+#include <vector>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtc/constants.hpp>
 #include <glm/gtx/rotate_vector.hpp>
 
 #include "raytracer.hpp"
+#include "shading.hpp"
+#include "threadpool.hpp"
+#include "wavefront.hpp"
 
 
-const Vec3 BACKGROUND_COLOUR { 0.0 };
-
 // Controls how reflective surfaces are when recursion_level > 0
 const float SPECULARITY { 0.3 };
 
@@ -19,6 +23,27 @@ const float AREA_LIGHT_OFFSET { 5 };
 // Reduces shadow acne caused by floating-point precision errors
 const float BIAS { 0.1f };
 
+// Hits shaded together by batch shading, enough to keep SIMD lanes busy while staying in cache
+const int SHADE_BATCH_SIZE { 1024 };
+
+
+
+RenderSettings::RenderSettings(int recursion_level, int ssample_div, int num_shadows)
+{
+    this->recursion_level = recursion_level;
+    this->ssample_div = ssample_div;
+    this->num_shadows = num_shadows;
+    this->accel = AccelType::BVH;
+    this->num_threads = 0;
+    this->batch_shading = false;
+    this->fast_pow = false;
+    this->wavefront = false;
+    this->sort_rays = false;
+    this->adaptive_shadows = 0;
+    this->occluder_cache = true;
+    this->sampler = SamplerType::Grid;
+}
+
 
 
 /* Raytrace
@@ -38,93 +63,283 @@ const float BIAS { 0.1f };
 Pixel2D raytrace(std::shared_ptr<Scene> scene, int &width, int &height, 
                     int recursion_level, int ssample_div, int num_shadows)
 {
-    std::shared_ptr<Camera> cam { scene->camera };
-    Vec3 cam_pos { cam->pos };
-    int cam_f { cam->f };
-    float fov_r { glm::radians((float)(cam->fov)) };
+    return raytrace(scene, width, height, RenderSettings { recursion_level, ssample_div, num_shadows });
+}
+
 
-    // Calculate image size
-    height = ceil(2.0 * cam->f * tan(fov_r / 2.0));
-    width = ceil(cam->a * height);
+
+// Tiles are rendered on the shared thread pool, using settings.num_threads of its threads
+Pixel2D raytrace(std::shared_ptr<Scene> scene, int &width, int &height, const RenderSettings &settings)
+{
+    image_size(scene->camera, width, height);
+
+    AccelType accel { (settings.accel == AccelType::Auto) ? scene->choose_accel() : settings.accel };
+    if (!scene->accel_ready() || scene->accel_type != accel)
+    {
+        scene->spatial_splits = settings.spatial_splits;
+        scene->build_accel(accel);
+    }
 
     // Initialize pixels
     Pixel2D px_data { new Pixel1D[width] };
     for (int i = 0; i < width; i++)
         px_data[i] = Pixel1D(new Vec3[height]);
 
+    // Asking for more threads than the machine has only makes sense in tests, they get a pool of their own
+    ThreadPool *pool { &ThreadPool::shared() };
+    std::unique_ptr<ThreadPool> own_pool;
+    if (settings.num_threads > pool->size())
+    {
+        own_pool.reset(new ThreadPool { settings.num_threads });
+        pool = own_pool.get();
+    }
+
+    // Render the tiles in parallel and copy each finished tile into the image
+    std::vector<Tile> tiles { split_tiles(width, height) };
+    parallel_for(*pool, tiles.size(), settings.num_threads, [&](int i)
+    {
+        const Tile &tile { tiles[i] };
+        std::vector<Vec3> tile_px(tile.width() * tile.height());
+        render_tile(scene, width, height, tile, settings, tile_px.data());
+
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+                px_data[x][y] = tile_px[(y - tile.y0) * tile.width() + (x - tile.x0)];
+    });
+
+    return px_data;
+}
+
+
+
+/* Image size is calculated from the camera's focal length, fov and aspect ratio */
+void image_size(std::shared_ptr<Camera> cam, int &width, int &height)
+{
+    float fov_r { glm::radians((float)(cam->fov)) };
+
+    height = ceil(2.0 * cam->f * tan(fov_r / 2.0));
+    width = ceil(cam->a * height);
+}
+
+
+
+/* Splits a width x height image into tiles of at most tile_size x tile_size pixels
+ * Tiles are returned in row-major order
+ */
+std::vector<Tile> split_tiles(int width, int height, int tile_size)
+{
+    if (tile_size < 1)
+        throw std::invalid_argument("tile_size must be > 0");
+
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size)
+    {
+        for (int x = 0; x < width; x += tile_size)
+        {
+            tiles.push_back(Tile { x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+        }
+    }
+
+    return tiles;
+}
+
+
+
+// Shades the hits of a batch of camera rays, defined with compute_color
+static void shade_batch(std::shared_ptr<Scene> scene, const std::vector<Collision> &cols,
+                        const std::vector<SampleContext> &col_samples, Vec3 view_pos,
+                        const RenderSettings &settings, HitBatch &hits, Vec3 *colors);
+
+
+
+/* Render Tile
+ * Calculates the pixel colours of one tile of a width x height image
+ * Pixels are written to out in row-major order, out must hold tile.width() * tile.height() colours
+ *
+ * Every pixel only depends on its own position, so rendering an image tile by tile
+ * (in any order, in any process) gives exactly the same result as rendering it whole
+ */
+void render_tile(std::shared_ptr<Scene> scene, int width, int height, Tile tile,
+                    const RenderSettings &settings, Vec3 *out)
+{
+    start_occluder_cache(settings.occluder_cache);
+    if (settings.wavefront)
+    {
+        render_tile_wavefront(scene, width, height, tile, settings, out);
+        flush_occluder_stats();
+        return;
+    }
+
+    std::shared_ptr<Camera> cam { scene->camera };
+    Vec3 cam_pos { cam->pos };
+
     // Calculate level of supersampling
-    ssample_div = (ssample_div < 1) ? 1 : ssample_div;
-    float ssample_step { 1.0f / ssample_div };
+    int ssample_div { (settings.ssample_div < 1) ? 1 : settings.ssample_div };
 
     // Fire ray for each pixel
     Collision col;
-    Vec3 px_screen_space, px_world_space, px_offset, ray_dir;
-    px_offset = Vec3 { width / 2, -height / 2, 0 };
-
-    for (int x = 0; x < width; x++)
+    Vec3 ray_dir;
+
+    // With batch shading, samples' hits are shaded SHADE_BATCH_SIZE at a time
+    std::vector<Collision> cols;
+    std::vector<SampleContext> col_samples;
+    std::vector<int> sample_px, sample_hit;
+    std::vector<Vec3> colors;
+    HitBatch hits;
+    auto shade_samples = [&]()
+    {
+        colors.resize(cols.size());
+        shade_batch(scene, cols, col_samples, cam_pos, settings, hits, colors.data());
+        for (unsigned int s = 0; s < sample_px.size(); s++)
+            out[sample_px[s]] += (sample_hit[s] < 0) ? BACKGROUND_COLOUR : colors[sample_hit[s]];
+
+        cols.clear();
+        col_samples.clear();
+        sample_px.clear();
+        sample_hit.clear();
+    };
+
+    for (int x = tile.x0; x < tile.x1; x++)
     {
-        for (int y = 0; y < height; y++)
+        for (int y = tile.y0; y < tile.y1; y++)
         {
-            px_data[x][y] = Vec3 { 0.0 };
+            int px_index { (y - tile.y0) * tile.width() + (x - tile.x0) };
+            Vec3 &px { out[px_index] };
+            px = Vec3 { 0.0 };
             // Supersampling loop
             for (int i = 0; i < ssample_div; i++)
             {
                 for (int j = 0; j < ssample_div; j++)
                 {
-                    // Compute pixel location in world space
-                    px_screen_space = Vec3 { x + i * ssample_step, -y + j * ssample_step, -cam_f };
-                    px_world_space = px_screen_space - px_offset;
-                    ray_dir = glm::normalize(px_world_space - cam_pos);
+                    // Where in the pixel the ray goes and where its shadow rays land are drawn by the sampler
+                    SampleContext samples { settings.sampler, x, y, i * ssample_div + j, ssample_div * ssample_div, 0 };
+                    Vec2 offset { sample_2d(settings.sampler, x, y, samples.index, samples.count, PIXEL_DIMENSION) };
+                    ray_dir = camera_ray(*cam, width, height, x, y, offset.x, offset.y);
 
                     // Check for collision
                     col = fire_ray(cam_pos, ray_dir, scene);
 
-                    if (col == NO_COLLISION) {
-                        px_data[x][y] += BACKGROUND_COLOUR;
+                    if (settings.batch_shading) {
+                        sample_px.push_back(px_index);
+                        sample_hit.push_back((col == NO_COLLISION) ? -1 : (int)cols.size());
+                        if (!(col == NO_COLLISION))
+                        {
+                            cols.push_back(col);
+                            col_samples.push_back(samples);
+                        }
+                        if ((int)cols.size() == SHADE_BATCH_SIZE)
+                            shade_samples();
+                    }
+                    else if (col == NO_COLLISION) {
+                        px += BACKGROUND_COLOUR;
                     }
                     else {
-                        px_data[x][y] += compute_color(col, scene, cam_pos, recursion_level, num_shadows);
+                        px += compute_color(col, scene, cam_pos, settings.recursion_level, settings.num_shadows, samples,
+                                            settings.adaptive_shadows);
                     }
                 }
             }
 
-            // Average to account for supersampling
-            px_data[x][y] = px_data[x][y] / (float)(ssample_div * ssample_div);
+            // Average to account for supersampling, batched samples once they have all been shaded
+            if (!settings.batch_shading)
+                px = px / (float)(ssample_div * ssample_div);
         }
     }
 
-    return px_data;
+    if (settings.batch_shading)
+    {
+        shade_samples();
+        for (int p = 0; p < tile.width() * tile.height(); p++)
+            out[p] = out[p] / (float)(ssample_div * ssample_div);
+    }
+    flush_occluder_stats();
+}
+
+
+
+Vec3 camera_ray(const Camera &cam, int width, int height, int x, int y, float dx, float dy)
+{
+    // Compute pixel location in world space
+    Vec3 px_offset { width / 2, -height / 2, 0 };
+    Vec3 px_screen_space { x + dx, -y + dy, -cam.f };
+    Vec3 px_world_space { px_screen_space - px_offset };
+    return glm::normalize(px_world_space - cam.pos);
 }
 
 
 
 /* Checks if a ray collides with an object in the scene
- * Returns the object and position of the collision if the ray collides
+ * Returns the object, position, normal and material of the collision if the ray collides
  * Returns NO_COLLISION otherwise
+ *
+ * Ties go to the object listed first in the scene and hits outside an object's bounds are
+ * ignored (see BVH::traverse), so the result doesn't depend on how the scene is traversed
  */
 Collision fire_ray(Vec3 p0, Vec3 d, std::shared_ptr<Scene> scene)
 {
-    float t, t_candidate;
-    t = std::numeric_limits<float>::infinity();
-    std::shared_ptr<Object> obj, next_obj;
-    obj =  nullptr;
-
-    // Test collision against every object in scene
-    for (unsigned int i = 0; i < scene->objects.size(); i++)
+    traversal_stats.rays++;
+    float t { std::numeric_limits<float>::infinity() };
+    int closest { -1 };
+    Vec3 normal, candidate_normal;
+    int material { 0 }, candidate_material;
+    int prim { 0 }, candidate_prim;
+
+    auto test_object = [&](int i, float t_min, float t_max)
     {
-        next_obj = scene->objects[i];
-        t_candidate = next_obj->check_collision(p0, d);
-        if (t_candidate - BIAS > 0.0 && t_candidate < t && (t_candidate - t) < BIAS)
+        float t_candidate { scene->objects[i]->check_collision_prim(p0, d, candidate_normal, candidate_material,
+                                                                        candidate_prim) };
+        if (t_candidate - BIAS > 0.0 && t_candidate >= t_min && t_candidate <= t_max &&
+            (t_candidate < t || (t_candidate == t && i < closest)) && (t_candidate - t) < BIAS)
         {
             t = t_candidate;
-            obj = next_obj;
+            closest = i;
+            normal = candidate_normal;
+            material = candidate_material;
+            prim = candidate_prim;
+        }
+        return t;
+    };
+
+    float inf { std::numeric_limits<float>::infinity() };
+    if (scene->accel_ready())
+    {
+        for (int i : scene->unbounded_objects)
+            test_object(i, 0.0f, inf);
+
+        auto test_prim = [&](int prim, float t_min, float t_max)
+        {
+            return test_object(scene->bvh_objects[prim], t_min, t_max);
+        };
+
+        if (scene->accel_type == AccelType::BVH4)
+            scene->bvh4.traverse(p0, d, t, test_prim);
+        else if (scene->accel_type == AccelType::Grid)
+            scene->grid.traverse(p0, d, t, test_prim);
+        else
+            scene->bvh.traverse(p0, d, t, test_prim);
+    }
+    else
+    {
+        // Test collision against every object in scene
+        Vec3 inv_d { safe_inverse(d) };
+        for (unsigned int i = 0; i < scene->objects.size(); i++)
+        {
+            AABB b { scene->objects[i]->bounds() };
+            float t_min { 0.0f }, t_max { inf };
+            if (b.is_finite())
+            {
+                b.pad();
+                if (!b.hit_range(p0, inv_d, t_min, t_max))
+                    continue;
+            }
+            test_object(i, t_min, t_max);
         }
     }
 
-    if (t < std::numeric_limits<float>::infinity())
+    if (closest >= 0)
     {
         Vec3 p_col { p0 + d * t };
-        return Collision { obj, p_col };           
+        return Collision { scene->objects[closest], p_col, normal, material, closest, prim };
     }
     else
     {
@@ -134,75 +349,275 @@ Collision fire_ray(Vec3 p0, Vec3 d, std::shared_ptr<Scene> scene)
 
 
 
+ShadowRays::ShadowRays(const Collision &col, Vec3 normal, const Light &light, int light_index, int num_rays,
+                        const SampleContext &samples)
+{
+    this->light = &light;
+    pos = col.coord;
+    light_pos = light.pos;
+    l = light.pos - col.coord;
+    this->light_index = light_index;
+    this->num_rays = num_rays;
+    this->samples = samples;
+    j = 0;
+
+    if (light.has_area())
+        return;
+
+    if (samples.sampler != SamplerType::Grid)
+    {
+        // Axes of the disk facing the hit, any will do if the light is straight along the normal
+        axis_u = glm::cross(l, normal);
+        if (glm::length(axis_u) < 1e-6f * glm::length(l))
+            axis_u = glm::cross(l, (std::abs(l.x) < std::abs(l.y)) ? Vec3 { 1.0, 0.0, 0.0 } : Vec3 { 0.0, 1.0, 0.0 });
+        axis_u = glm::normalize(axis_u);
+        axis_v = glm::normalize(glm::cross(l, axis_u));
+        return;
+    }
+
+    // Scattering for soft shadows
+    rotation = 2.0f * glm::pi<float>() / num_rays ;
+    mag = AREA_LIGHT_OFFSET / num_rays;
+    offset = glm::normalize(glm::cross(l, normal)) * mag;
+}
+
+
+
+Vec3 ShadowRays::next()
+{
+    if (light->has_area())
+    {
+        Vec2 u { sample_2d(samples.sampler, samples.x, samples.y, samples.index * num_rays + j,
+                            samples.count * num_rays, shadow_dimension(light_index, samples.depth)) };
+        j++;
+        return light->sample_dir(pos, u.x, u.y);
+    }
+
+    // A point on a disk of radius AREA_LIGHT_OFFSET around the light, the pixel's shadow rays are spread over it together
+    if (samples.sampler != SamplerType::Grid)
+    {
+        Vec2 p { square_to_disk(sample_2d(samples.sampler, samples.x, samples.y, samples.index * num_rays + j,
+                                            samples.count * num_rays, shadow_dimension(light_index, samples.depth))) };
+        j++;
+        return glm::normalize(light_pos + (axis_u * p.x + axis_v * p.y) * AREA_LIGHT_OFFSET - pos);
+    }
+
+    Vec3 temp_l { light_pos + offset - pos };
+
+    // No need to turn the offset after the last ray
+    if (j + 1 < num_rays)
+        offset = glm::normalize(glm::rotate(offset, rotation + j, l)) * ((light_index % (j + 1) + 1) * mag);
+    j++;
+    return glm::normalize(temp_l);
+}
+
+
+
+bool ShadowRays::blocked(const Collision &shadow_col, Vec3 dir) const
+{
+    return !(shadow_col == NO_COLLISION || light->distance(pos, dir) < glm::length(pos - shadow_col.coord));
+}
+
+
+
+// The primitive that last blocked a shadow ray to a light, object is -1 if none has yet
+struct Occluder
+{
+    int object, prim;
+};
+
+// What each thread's occluder cache holds, see ShadowRays::cached_blocked
+struct OccluderCache
+{
+    bool enabled;
+    std::vector<Occluder> last;
+    OccluderCacheStats stats;
+};
+
+static thread_local OccluderCache occluder_cache { false, {}, { 0, 0 } };
+static std::atomic<uint64_t> occluder_hits { 0 }, occluder_misses { 0 };
+
+
+
+void start_occluder_cache(bool enabled)
+{
+    occluder_cache.enabled = enabled;
+    occluder_cache.last.clear();
+    occluder_cache.stats = OccluderCacheStats { 0, 0 };
+}
+
+
+
+void flush_occluder_stats()
+{
+    occluder_hits += occluder_cache.stats.hits;
+    occluder_misses += occluder_cache.stats.misses;
+    occluder_cache.stats = OccluderCacheStats { 0, 0 };
+}
+
+
+
+OccluderCacheStats occluder_stats()
+{
+    return OccluderCacheStats { occluder_hits, occluder_misses };
+}
+
+
+
+void reset_occluder_stats()
+{
+    occluder_hits = 0;
+    occluder_misses = 0;
+}
+
+
+
+bool ShadowRays::cached_blocked(const Scene &scene, Vec3 dir) const
+{
+    if (!occluder_cache.enabled)
+        return false;
+
+    // Indices are checked rather than trusted, the cache may be left from another scene
+    if (light_index < (int)occluder_cache.last.size())
+    {
+        const Occluder &occluder { occluder_cache.last[light_index] };
+        if (occluder.object >= 0 && occluder.object < (int)scene.objects.size())
+        {
+            // Accepted as fire_ray accepts hits
+            float t { scene.objects[occluder.object]->check_primitive(occluder.prim, pos, dir) };
+            if (t - BIAS > 0.0 && light->distance(pos, dir) >= glm::length(pos - (pos + dir * t)))
+            {
+                occluder_cache.stats.hits++;
+                return true;
+            }
+        }
+    }
+
+    occluder_cache.stats.misses++;
+    return false;
+}
+
+
+
+void ShadowRays::remember(const Collision &shadow_col) const
+{
+    if (!occluder_cache.enabled)
+        return;
+
+    if (light_index >= (int)occluder_cache.last.size())
+        occluder_cache.last.resize(light_index + 1, Occluder { -1, 0 });
+    occluder_cache.last[light_index] = Occluder { shadow_col.object, shadow_col.prim };
+}
+
+
+
+/* Fires num_rays shadow rays from col towards points scattered around the scene's i-th light
+ * Returns how many of them are blocked before they reach it
+ * With adaptive_shadows, if the first adaptive_shadows rays all agree the rest are taken to as well
+ */
+static int count_shadowed(const Collision &col, Vec3 normal, std::shared_ptr<Scene> scene, int i, int num_rays,
+                            const SampleContext &samples, int adaptive_shadows)
+{
+    ShadowRays rays { col, normal, *scene->lights[i], i, num_rays, samples };
+    int in_shadow { 0 };
+
+    // Fire multiple rays to points near light and average the result to determine how in shadow a point is
+    for (int j = 0; j < num_rays; j++)
+    {
+        Vec3 dir { rays.next() };
+        if (rays.cached_blocked(*scene, dir))
+        {
+            in_shadow++;
+        }
+        else
+        {
+            Collision shadow_col { fire_ray(col.coord, dir, scene) };
+            if (rays.blocked(shadow_col, dir))
+            {
+                in_shadow++;
+                rays.remember(shadow_col);
+            }
+        }
+
+        if (j + 1 == adaptive_shadows && (in_shadow == 0 || in_shadow == adaptive_shadows))
+            return (in_shadow == 0) ? 0 : num_rays;
+    }
+
+    return in_shadow;
+}
+
+
+
+Vec3 reflection_dir(Vec3 normal, Vec3 l)
+{
+    return glm::normalize(glm::reflect(l, normal));
+}
+
+
+
+/* Colour of whatever col reflects in the mirror direction of l, l points from col to a light
+ * samples are those of the ray that hit col
+ */
+static Vec3 reflected_color(const Collision &col, Vec3 normal, Vec3 l, std::shared_ptr<Scene> scene, int rec_depth,
+                            const SampleContext &samples)
+{
+    Collision spec_col { fire_ray(col.coord, reflection_dir(normal, l), scene) };
+    if (spec_col == NO_COLLISION)
+        return BACKGROUND_COLOUR;
+
+    // Don't compute soft shadows when firing recursive rays
+    SampleContext reflected { samples };
+    reflected.depth++;
+    return compute_color(spec_col, scene, col.coord, rec_depth - 1, 1, reflected);
+}
+
+
+
+void add_light(Vec3 &color, const Material &material, const Light &light, Vec3 phong, Vec3 specular_ref,
+                int in_shadow, int num_rays)
+{
+    // Lights always contribute their ambient amount
+    color += light.amb * material.amb;
+
+    // The ray is not completely in shadow
+    if (in_shadow < num_rays)
+    {
+        // Attenuate by amount point is in shadow
+        float shadow_amount { (float)in_shadow / (float)num_rays };
+        color += (1 - shadow_amount) * (phong + (SPECULARITY * material.spe * specular_ref));
+    }
+}
+
+
+
 /* compute_color
  * Computes color at a given point with a given object's properties
- * 
+ * The material is read from the scene's table, not from the object
  */
-Vec3 compute_color(Collision col, std::shared_ptr<Scene> scene, Vec3 view_pos, int rec_depth, int num_rays)
+Vec3 compute_color(Collision col, std::shared_ptr<Scene> scene, Vec3 view_pos, int rec_depth, int num_rays,
+                    const SampleContext &samples, int adaptive_shadows)
 {
-    Vec3 normal, color, l, temp_l, phong;
-    normal = glm::normalize(col.obj->get_normal(col.coord));
+    Vec3 normal, color;
+    normal = glm::normalize(col.normal);
     color = Vec3 { 0.0 };
-    
-    std::shared_ptr<Light> light;
-    Collision shadow_col;
+    const Material &material { scene->materials[col.material] };
 
     // Calculate contribution from each light source
     for (unsigned int i = 0; i < scene->lights.size(); i++)
     {
-        light = scene->lights[i];
-        l = light->pos - col.coord;
-
-        // Scattering for soft shadows
-        float rotation, mag;
-        rotation = 2.0f * glm::pi<float>() / num_rays ;
-        mag = AREA_LIGHT_OFFSET / num_rays;
-        Vec3 offset { glm::normalize(glm::cross(l, normal)) * mag };
-        int in_shadow { num_rays };
-        
-        // Fire multiple rays to points near light and average the result to determine how in shadow a point is
-        for (int j = 0; j < num_rays; j++)
-        {
-            temp_l = light->pos + offset - col.coord;
-            shadow_col = fire_ray(col.coord, glm::normalize(temp_l), scene);
-            if (shadow_col == NO_COLLISION || glm::length(l) < glm::length(col.coord - shadow_col.coord)){
-                in_shadow--;
-            }
-
-            offset = glm::normalize(glm::rotate(offset, rotation + j, l)) * ((i % (j + 1) + 1) * mag);
-        }
-
-        // Lights always contribute their ambient amount
-        color += light->amb * col.obj->amb;
+        std::shared_ptr<Light> light { scene->lights[i] };
+        int in_shadow { count_shadowed(col, normal, scene, i, num_rays, samples, adaptive_shadows) };
 
-        // The ray is not completely in shadow
+        // Phong illumination and specular reflection
+        Vec3 phong { 0.0 }, specular_ref { 0.0 };
         if (in_shadow < num_rays)
-        {   
-            // Phong illumination
-            phong = calc_phong(light, col.obj, col.coord, view_pos);
-
-            // Specular reflection
-            Vec3 r, specular_ref;
-            specular_ref = Vec3 { 0.0 };
+        {
+            phong = calc_phong(light, material, col.coord, normal, view_pos);
             if (rec_depth > 0)
-            {
-                r = Vec3 { glm::reflect(l, normal) };                
-                Collision spec_col { fire_ray(col.coord, r, scene) };
-                if (spec_col == NO_COLLISION)
-                {
-                    specular_ref = (specular_ref == Vec3{ 0.0 }) ? BACKGROUND_COLOUR : specular_ref;
-                }
-                else
-                {
-                    // Don't compute soft shadows when firing recursive rays
-                    specular_ref = compute_color(spec_col, scene, col.coord, rec_depth - 1, 1);
-                }
-            }
-            
-            // Attenuate by amount point is in shadow
-            float shadow_amount { (float)in_shadow / (float)num_rays };
-            color += (1 - shadow_amount) * (phong + (SPECULARITY * col.obj->spe * specular_ref));
+                specular_ref = reflected_color(col, normal, light->pos - col.coord, scene, rec_depth, samples);
         }
+
+        add_light(color, material, *light, phong, specular_ref, in_shadow, num_rays);
     }
 
     //return Vec3 { fmin(color.x, 1.0), fmin(color.y, 1.0), fmin(color.z, 1.0) };
@@ -211,24 +626,51 @@ Vec3 compute_color(Collision col, std::shared_ptr<Scene> scene, Vec3 view_pos, i
 
 
 
-// Calculate Phong illumination at a given point
-Vec3 calc_phong(std::shared_ptr<Light> light, std::shared_ptr<Object> obj, Vec3 pos, Vec3 view_pos)
+/* Shades a batch of hits seen from view_pos into colors, exactly as compute_color would
+ * Shadow and reflection rays are still traced hit by hit, but each light's Phong illumination
+ * is evaluated for the whole batch at once by shade_phong
+ */
+static void shade_batch(std::shared_ptr<Scene> scene, const std::vector<Collision> &cols,
+                        const std::vector<SampleContext> &col_samples, Vec3 view_pos,
+                        const RenderSettings &settings, HitBatch &hits, Vec3 *colors)
 {
-    Vec3 l, n, v, r;
-    l = glm::normalize(light->pos - pos);
-    n = glm::normalize(obj->get_normal(pos));
-    v = glm::normalize(view_pos - pos);
-    r = glm::reflect(l, n);
+    hits.clear();
+    for (const Collision &col : cols)
+        hits.add(col.coord, glm::normalize(col.normal), col.material, view_pos);
+
+    std::fill(colors, colors + cols.size(), Vec3 { 0.0 });
+    std::vector<Vec3> phong(cols.size());
+    for (unsigned int i = 0; i < scene->lights.size(); i++)
+    {
+        const Light &light { *scene->lights[i] };
+        shade_phong(hits, light, scene->materials, settings.fast_pow, phong.data());
+
+        for (unsigned int h = 0; h < cols.size(); h++)
+        {
+            Vec3 normal { hits.nx[h], hits.ny[h], hits.nz[h] };
+            int in_shadow { count_shadowed(cols[h], normal, scene, i, settings.num_shadows, col_samples[h],
+                                            settings.adaptive_shadows) };
+            Vec3 specular_ref { 0.0 };
+            if (in_shadow < settings.num_shadows && settings.recursion_level > 0)
+            {
+                specular_ref = reflected_color(cols[h], normal, light.pos - cols[h].coord, scene,
+                                                settings.recursion_level, col_samples[h]);
+            }
+
+            add_light(colors[h], scene->materials[cols[h].material], light, phong[h], specular_ref,
+                        in_shadow, settings.num_shadows);
+        }
+    }
+}
 
-    float l_angle, v_angle;
-    l_angle = fmax(glm::dot(l, n), 0.0);
-    v_angle = fmax(glm::dot(r, v), 0.0);
 
-    Vec3 amb, dif, spe;
-    amb = light->amb * obj->amb;
-    dif = light->dif * obj->dif * l_angle;
-    spe = light->spe * obj->spe * (float)pow(v_angle, obj->shi);
 
-    // Ignore ambient amount because we are adding it in compute_color
-    return (dif + spe);
-}
\ No newline at end of file
+/* Calculate Phong illumination at a given point
+ * normal is the normalized surface normal at pos, as found by fire_ray, and material is
+ * what the surface is made of there
+ * Ignores the ambient amount because we are adding it in compute_color
+ */
+Vec3 calc_phong(std::shared_ptr<Light> light, const Material &material, Vec3 pos, Vec3 normal, Vec3 view_pos)
+{
+    return phong(*light, material, pos, normal, view_pos);
+}
@@ -2,13 +2,70 @@
 #define __RAYTRACER_HPP
 
 #include <memory>
+#include <vector>
 
 #include "objects.hpp"
+#include "sampler.hpp"
 
 // Type for our image data (2d array of Vec3)
 typedef std::unique_ptr<Vec3[]> Pixel1D;
 typedef std::unique_ptr<Pixel1D[]> Pixel2D;
 
+// Default edge length (in pixels) of the tiles an image is split into
+const int DEFAULT_TILE_SIZE { 64 };
+
+// Colour of rays that don't hit anything
+const Vec3 BACKGROUND_COLOUR { 0.0 };
+
+
+/* Settings shared by every render path (whole image, single tile, distributed)
+ * recursion_level - How many recursive reflections to render
+ * ssample_div - Supersampling level, each pixel will be an average of ssample_div^2 rays
+ * num_shadows - How many rays to fire for soft shadows
+ * accel - Acceleration structure to trace rays through, doesn't change the image
+ * spatial_splits - Budget for the spatial splits of AccelType::SBVH, used whenever the render builds it
+ * num_threads - How many threads raytrace renders tiles on, 0 for one per core, doesn't change the image
+ * batch_shading - Shade camera rays' hits in batches with SIMD (see shade_phong), doesn't change the image
+ * fast_pow - With batch_shading or wavefront, raise specular highlights with fast_pow, which changes the
+ *              image by at most FAST_POW_MAX_ERROR per highlight
+ * wavefront - Render tiles a wave of rays at a time (see render_tile_wavefront), doesn't change the image
+ * sort_rays - With wavefront, trace each wave's shadow and reflection rays sorted by where they start and
+ *              which way they go (see RayQueue::trace), doesn't change the image
+ * sampler - How points are spread within pixels and over lights, see SamplerType
+ * adaptive_shadows - Fire this many of each hit's shadow rays at a light first and stop there if they
+ *              are all blocked or none are, 0 always fires all num_shadows
+ * occluder_cache - Test each shadow ray against the last thing that blocked one to the same light on
+ *              the same thread before tracing it (see ShadowRays::cached_blocked), doesn't change the image
+ */
+struct RenderSettings
+{
+    int recursion_level;
+    int ssample_div;
+    int num_shadows;
+    AccelType accel;
+    SpatialSplitOptions spatial_splits;
+    int num_threads;
+    bool batch_shading;
+    bool fast_pow;
+    bool wavefront;
+    bool sort_rays;
+    SamplerType sampler;
+    int adaptive_shadows;
+    bool occluder_cache;
+
+    explicit RenderSettings(int recursion_level = 0, int ssample_div = 1, int num_shadows = 1);
+};
+
+
+// A rectangular region of the image covering pixels [x0, x1) x [y0, y1)
+struct Tile
+{
+    int x0, y0, x1, y1;
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+};
+
 
 /* Raytrace
  * Main raytracing function
@@ -26,16 +83,121 @@ typedef std::unique_ptr<Pixel1D[]> Pixel2D;
  */
 Pixel2D raytrace(std::shared_ptr<Scene> scene, int &width, int &height, 
                     int recursion_level = 0, int ssample_level = 1, int num_shadows = 1);
+Pixel2D raytrace(std::shared_ptr<Scene> scene, int &width, int &height, const RenderSettings &settings);
+
+
+// Calculates the image dimensions from a camera's focal length, fov and aspect ratio
+void image_size(std::shared_ptr<Camera> cam, int &width, int &height);
+
+
+// Splits an image into row-major tiles of at most tile_size x tile_size pixels
+std::vector<Tile> split_tiles(int width, int height, int tile_size = DEFAULT_TILE_SIZE);
+
+
+/* Renders a single tile of a width x height image
+ * out must hold tile.width() * tile.height() colours and is filled in row-major order
+ */
+void render_tile(std::shared_ptr<Scene> scene, int width, int height, Tile tile,
+                    const RenderSettings &settings, Vec3 *out);
 
 
 /* Checks if a ray collides with an object in the scene
- * Returns the object and position of the collision if the ray collides
+ * d must be normalized, Sphere::check_collision and BIAS both assume t is a distance
+ * Safe to call from several threads at once
+ * Returns the object, position, normal and material of the collision if the ray collides
  * Returns NO_COLLISION otherwise
  */
 Collision fire_ray(Vec3 p0, Vec3 d, std::shared_ptr<Scene> scene);
 
 
-Vec3 compute_color(Collision col, std::shared_ptr<Scene> scene, Vec3 view_pos, int rec_depth, int num_shadows);
-Vec3 calc_phong(std::shared_ptr<Light> light, std::shared_ptr<Object> obj, Vec3 pos, Vec3 view_pos);
+/* Direction of the camera ray through point (x + dx, y + dy) of a width x height image
+ * dx and dy are offsets within the pixel, for supersampling
+ */
+Vec3 camera_ray(const Camera &cam, int width, int height, int x, int y, float dx, float dy);
+
+
+/* Shadow rays from a hit towards points scattered around the light_index-th light of the scene
+ * next gives the direction of each ray in turn, they all start at the hit. compute_color and the
+ * wavefront renderer scatter them alike so both find the same soft shadows
+ * Area lights are sampled uniformly over the solid angle they cover (see Light::sample_dir). Around
+ * point lights, with SamplerType::Grid the rays go to a fixed pattern of points rotating around the
+ * light, otherwise they are spread over a disk around it. Samplers draw samples.count * num_rays
+ * points for the whole pixel so its shadow rays are spread out together
+ */
+class ShadowRays
+{
+public:
+    ShadowRays(const Collision &col, Vec3 normal, const Light &light, int light_index, int num_rays,
+                const SampleContext &samples = FIXED_PATTERN);
+
+    Vec3 next();
+
+    // Whether a shadow ray fired in direction dir that found shadow_col is blocked before it reaches the light
+    bool blocked(const Collision &shadow_col, Vec3 dir) const;
+
+    /* Whether the primitive that last blocked a shadow ray to this light on this thread blocks the
+     * ray in direction dir too, so it needn't be traced. Anything it finds blocked fire_ray would
+     * as well, since fire_ray finds that primitive or something nearer. Always false while the
+     * thread's cache is off (see start_occluder_cache)
+     */
+    bool cached_blocked(const Scene &scene, Vec3 dir) const;
+
+    // Makes what a blocked shadow ray hit the first thing cached_blocked tests for this light
+    void remember(const Collision &shadow_col) const;
+
+private:
+    const Light *light;
+    Vec3 pos, light_pos, l, offset;
+    float rotation, mag;
+    int light_index, num_rays, j;
+
+    SampleContext samples;
+    Vec3 axis_u, axis_v;
+};
+
+
+/* Shadow rays the occluder caches found blocked without tracing them (hits) and those they had to
+ * trace (misses)
+ */
+struct OccluderCacheStats
+{
+    uint64_t hits, misses;
+};
+
+/* Turns the calling thread's occluder cache on or off and empties it, render_tile does this for
+ * each tile. Threads' caches start off
+ */
+void start_occluder_cache(bool enabled);
+
+/* Adds the calling thread's hits and misses since start_occluder_cache to the totals that
+ * occluder_stats returns, render_tile does this once each tile is done
+ */
+void flush_occluder_stats();
+
+// Totals over every thread since the last reset_occluder_stats
+OccluderCacheStats occluder_stats();
+void reset_occluder_stats();
+
+
+// Direction a hit with the given normal reflects towards l, l points from the hit to a light
+Vec3 reflection_dir(Vec3 normal, Vec3 l);
+
+
+/* Adds one light's share of the colour at a hit made of material to color
+ * phong is the light's Phong illumination there, specular_ref the colour reflected towards the light
+ * and in_shadow how many of num_rays shadow rays were blocked. phong and specular_ref are only used
+ * if some weren't
+ */
+void add_light(Vec3 &color, const Material &material, const Light &light, Vec3 phong, Vec3 specular_ref,
+                int in_shadow, int num_rays);
+
+
+/* Colour at a hit seen from view_pos, with rec_depth reflections and num_shadows shadow rays at each light
+ * samples are those of the camera ray that led to the hit, they place its shadow rays
+ * adaptive_shadows is as in RenderSettings
+ */
+Vec3 compute_color(Collision col, std::shared_ptr<Scene> scene, Vec3 view_pos, int rec_depth, int num_shadows,
+                    const SampleContext &samples = FIXED_PATTERN, int adaptive_shadows = 0);
+Vec3 calc_phong(std::shared_ptr<Light> light, const Material &material, Vec3 pos, Vec3 normal, Vec3 view_pos);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <glm/gtc/constants.hpp>
+
+#include "sampler.hpp"
+
+
+// Edge length of the tiling blue noise mask
+const int BLUE_NOISE_SIZE { 64 };
+
+// Spread and reach of the Gaussian the blue noise mask is built with (see make_blue_noise)
+const float BLUE_NOISE_SIGMA { 1.5f };
+const int BLUE_NOISE_RADIUS { 6 };
+
+// Digits of the radical inverse drawn for Halton points, enough for every bit of a float in base 2 and 3
+const int HALTON_DIGITS_BASE_2 { 24 };
+const int HALTON_DIGITS_BASE_3 { 16 };
+
+
+
+SamplerType parse_sampler(std::string name)
+{
+    if (name == "grid")
+        return SamplerType::Grid;
+    if (name == "jittered")
+        return SamplerType::Jittered;
+    if (name == "halton")
+        return SamplerType::Halton;
+    if (name == "sobol")
+        return SamplerType::Sobol;
+    if (name == "bluenoise")
+        return SamplerType::BlueNoise;
+
+    throw std::invalid_argument("Unknown sampler '" + name + "'");
+}
+
+
+
+int shadow_dimension(int light_index, int depth)
+{
+    return 1 + (depth << 16) + light_index;
+}
+
+
+
+// Scrambles the bits of x so similar inputs give unrelated outputs
+static uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+
+// Top 24 bits of x as a float in [0, 1), every one of them is exact
+static float to_unit(uint32_t x)
+{
+    return (x >> 8) * (1.0f / (1 << 24));
+}
+
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+
+/* Owen scrambling of the bits of x, read as a binary fraction
+ * Each bit is flipped or not depending on the seed and every bit above it, which keeps points that
+ * were stratified stratified. The hash is Laine and Karras', applied to the bits in reverse so that
+ * each bit only depends on those above it (Burley, Practical Hash-based Owen Scrambling)
+ */
+static uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+
+// First two dimensions of the Sobol sequence as binary fractions
+static uint32_t sobol_0(uint32_t index)
+{
+    return reverse_bits(index);
+}
+
+
+static uint32_t sobol_1(uint32_t index)
+{
+    uint32_t result { 0 };
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+
+/* Owen scrambled Sobol point for seed
+ * The index is shuffled too, so different seeds don't all start from the same few points
+ */
+static Vec2 scrambled_sobol(uint32_t index, uint32_t seed)
+{
+    index = owen_scramble(index, hash_combine(seed, 0));
+    return Vec2 { to_unit(owen_scramble(sobol_0(index), hash_combine(seed, 1))),
+                    to_unit(owen_scramble(sobol_1(index), hash_combine(seed, 2))) };
+}
+
+
+/* Radical inverse of index in base, with each digit shifted by a hash of the seed and the digits
+ * before it, which scrambles like Owen's nested permutations
+ */
+static float scrambled_radical_inverse(uint32_t index, uint32_t base, int digits, uint32_t seed)
+{
+    double result { 0.0 }, factor { 1.0 / base };
+    uint32_t prefix { seed };
+    for (int d = 0; d < digits; d++)
+    {
+        uint32_t digit { index % base };
+        index /= base;
+        result += ((digit + hash(prefix)) % base) * factor;
+        factor /= base;
+        prefix = hash_combine(prefix, digit);
+    }
+    return std::min((float)result, 1.0f - std::numeric_limits<float>::epsilon() / 2.0f);
+}
+
+
+/* Ranks every pixel of a tiling BLUE_NOISE_SIZE x BLUE_NOISE_SIZE mask with the void and cluster
+ * method (Ulichney): pixels are switched on one at a time, always in the largest gap between those
+ * already on, so every threshold of the ranks gives evenly spread pixels. Gaps are where the on
+ * pixels' Gaussian energy is lowest. Returns the ranks as values in [0, 1)
+ */
+static std::vector<float> make_blue_noise()
+{
+    const int n { BLUE_NOISE_SIZE * BLUE_NOISE_SIZE };
+    const int r { BLUE_NOISE_RADIUS };
+    std::vector<float> kernel((2 * r + 1) * (2 * r + 1));
+    for (int dy = -r; dy <= r; dy++)
+    {
+        for (int dx = -r; dx <= r; dx++)
+            kernel[(dy + r) * (2 * r + 1) + dx + r] = std::exp(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+    }
+
+    std::vector<float> energy(n, 0.0f);
+    std::vector<bool> on(n, false);
+    auto toggle = [&](int p)
+    {
+        on[p] = !on[p];
+        float sign { on[p] ? 1.0f : -1.0f };
+        int px { p % BLUE_NOISE_SIZE }, py { p / BLUE_NOISE_SIZE };
+        for (int dy = -r; dy <= r; dy++)
+        {
+            int y { (py + dy + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE };
+            for (int dx = -r; dx <= r; dx++)
+            {
+                int x { (px + dx + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE };
+                energy[y * BLUE_NOISE_SIZE + x] += sign * kernel[(dy + r) * (2 * r + 1) + dx + r];
+            }
+        }
+    };
+
+    // Most crowded pixel that is on, or the emptiest that is off
+    auto find = [&](bool want_on)
+    {
+        int best { -1 };
+        for (int p = 0; p < n; p++)
+        {
+            if (on[p] == want_on && (best < 0 || (want_on ? energy[p] > energy[best] : energy[p] < energy[best])))
+                best = p;
+        }
+        return best;
+    };
+
+    // A random tenth of the pixels, evened out by moving the most crowded into the largest gap until that stops
+    std::mt19937 rng { 1 };
+    int initial { n / 10 };
+    for (int count = 0; count < initial;)
+    {
+        int p { (int)(rng() % n) };
+        if (!on[p])
+        {
+            toggle(p);
+            count++;
+        }
+    }
+    while (true)
+    {
+        int cluster { find(true) };
+        toggle(cluster);
+        int gap { find(false) };
+        toggle(gap);
+        if (gap == cluster)
+            break;
+    }
+
+    // The initial pixels are ranked by taking the most crowded out first, the rest by filling gaps
+    std::vector<int> rank(n);
+    std::vector<bool> initial_on { on };
+    std::vector<float> initial_energy { energy };
+    for (int k = initial - 1; k >= 0; k--)
+    {
+        int cluster { find(true) };
+        toggle(cluster);
+        rank[cluster] = k;
+    }
+
+    on = initial_on;
+    energy = initial_energy;
+    for (int k = initial; k < n; k++)
+    {
+        int gap { find(false) };
+        toggle(gap);
+        rank[gap] = k;
+    }
+
+    std::vector<float> mask(n);
+    for (int p = 0; p < n; p++)
+        mask[p] = (rank[p] + 0.5f) / n;
+    return mask;
+}
+
+
+// Adds shift to p wrapping around the unit square
+static Vec2 wrap_shift(Vec2 p, Vec2 shift)
+{
+    float u { p.x + shift.x }, v { p.y + shift.y };
+    return Vec2 { (u >= 1.0f) ? u - 1.0f : u, (v >= 1.0f) ? v - 1.0f : v };
+}
+
+
+
+Vec2 sample_2d(SamplerType sampler, int x, int y, int index, int count, int dimension)
+{
+    uint32_t seed { hash_combine(hash_combine(hash(x), y), dimension) };
+    switch (sampler)
+    {
+    case SamplerType::Grid:
+    case SamplerType::Jittered:
+    {
+        // The smallest square grid with a cell for each point, cells are filled a column at a time
+        int side { 1 };
+        while (side * side < count)
+            side++;
+        int i { index / side }, j { index % side };
+        if (sampler == SamplerType::Grid)
+            return Vec2 { i * (1.0f / side), j * (1.0f / side) };
+
+        uint32_t jitter { hash_combine(seed, index) };
+        return Vec2 { (i + to_unit(jitter)) / side, (j + to_unit(hash(jitter))) / side };
+    }
+
+    case SamplerType::Halton:
+        return Vec2 { scrambled_radical_inverse(index, 2, HALTON_DIGITS_BASE_2, hash_combine(seed, 2)),
+                        scrambled_radical_inverse(index, 3, HALTON_DIGITS_BASE_3, hash_combine(seed, 3)) };
+
+    case SamplerType::Sobol:
+        return scrambled_sobol(index, seed);
+
+    case SamplerType::BlueNoise:
+    {
+        // Built once, on first use
+        static const std::vector<float> mask { make_blue_noise() };
+
+        // Each dimension reads the mask from its own place, so their shifts aren't alike
+        uint32_t offset { hash(dimension) };
+        int mx { (int)((x + (offset & 0xffff)) % BLUE_NOISE_SIZE) };
+        int my { (int)((y + (offset >> 16)) % BLUE_NOISE_SIZE) };
+        Vec2 shift { mask[my * BLUE_NOISE_SIZE + mx],
+                        mask[((my + BLUE_NOISE_SIZE / 2) % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE + mx] };
+        return wrap_shift(scrambled_sobol(index, hash(dimension)), shift);
+    }
+    }
+
+    return Vec2 { 0.5f, 0.5f };
+}
+
+
+
+// Shirley and Chiu's concentric mapping
+Vec2 square_to_disk(Vec2 p)
+{
+    float a { 2.0f * p.x - 1.0f }, b { 2.0f * p.y - 1.0f };
+    if (a == 0.0f && b == 0.0f)
+        return Vec2 { 0.0f, 0.0f };
+
+    float r, phi;
+    if (std::abs(a) > std::abs(b))
+    {
+        r = a;
+        phi = (glm::pi<float>() / 4.0f) * (b / a);
+    }
+    else
+    {
+        r = b;
+        phi = glm::half_pi<float>() - (glm::pi<float>() / 4.0f) * (a / b);
+    }
+    return Vec2 { r * std::cos(phi), r * std::sin(phi) };
+}
@@ -0,0 +1,61 @@
+#ifndef __SAMPLER_HPP
+#define __SAMPLER_HPP
+
+#include <string>
+
+#include <glm/glm.hpp>
+
+typedef glm::vec2 Vec2;
+
+
+/* How the points a render samples are spread, both within pixels and over lights for soft shadows
+ * Grid - A regular grid in each pixel and a fixed rotating pattern around lights, as renders always had
+ * Jittered - A random point in each cell of a grid (stratified sampling)
+ * Halton - Halton points in bases 2 and 3, Owen scrambled differently for each pixel
+ * Sobol - The first two dimensions of the Sobol sequence, Owen scrambled differently for each pixel
+ * BlueNoise - The same scrambled Sobol points for every pixel, each pixel's shifted by a blue noise
+ *              mask, so what error is left is spread out as fine noise rather than blotches
+ */
+enum class SamplerType { Grid, Jittered, Halton, Sobol, BlueNoise };
+
+/* Parses the name of a SamplerType ("grid", "jittered", "halton", "sobol", "bluenoise"),
+ * throws std::invalid_argument if unknown
+ */
+SamplerType parse_sampler(std::string name);
+
+
+// Dimension of the points that place camera rays within their pixel
+const int PIXEL_DIMENSION { 0 };
+
+// Dimension of the points that place shadow rays on the light_index-th light, depth reflections from the camera
+int shadow_dimension(int light_index, int depth);
+
+
+/* The index-th of count points in [0, 1)^2 a sampler draws for pixel (x, y)
+ * Each dimension is drawn independently of the others, so e.g. where shadow rays land on a light
+ * doesn't follow where in the pixel the camera ray went. Points only depend on the arguments, so
+ * every tile, thread and worker draws the same ones
+ */
+Vec2 sample_2d(SamplerType sampler, int x, int y, int index, int count, int dimension);
+
+// Maps the unit square onto the unit disk, keeping points that were well spread well spread
+Vec2 square_to_disk(Vec2 p);
+
+
+/* Which samples a ray belongs to, so the shadow rays of what it hits know which points to draw
+ * x, y - The pixel its camera ray went through
+ * index, count - Which of the pixel's camera rays it came from and how many there are
+ * depth - How many reflections it is from the camera
+ */
+struct SampleContext
+{
+    SamplerType sampler;
+    int x, y;
+    int index, count;
+    int depth;
+};
+
+// Draws shadow rays in the fixed pattern, for shading outside of a render
+const SampleContext FIXED_PATTERN { SamplerType::Grid, 0, 0, 0, 1, 0 };
+
+#endif
@@ -6,7 +6,10 @@
 
 #include "sceneloader.hpp"
 
-std::shared_ptr<Scene> load_scene(std::string filename)
+/* Loads a scene and builds its acceleration structure
+ * Pass the structure that will be rendered with, so large scenes aren't built twice
+ */
+std::shared_ptr<Scene> load_scene(std::string filename, AccelType accel, const SpatialSplitOptions &spatial)
 {
     // Read file & make sure we have data to parse
     std::vector<std::string> file_list { read_file(filename) };
@@ -42,19 +45,28 @@ std::shared_ptr<Scene> load_scene(std::string filename)
                 scene->camera = parse_camera(file_deck);
             }
             else if (ent_type == "plane") {
-                scene->objects.push_back(parse_plane(file_deck));
+                scene->objects.push_back(parse_plane(file_deck, scene->materials));
             }
             else if (ent_type == "sphere") {
-                scene->objects.push_back(parse_sphere(file_deck));
+                scene->objects.push_back(parse_sphere(file_deck, scene->materials));
             }
             else if (ent_type == "light") {
                 scene->lights.push_back(parse_light(file_deck));
             }
+            else if (ent_type == "spherelight") {
+                scene->lights.push_back(parse_sphere_light(file_deck));
+            }
+            else if (ent_type == "rectlight") {
+                scene->lights.push_back(parse_rect_light(file_deck));
+            }
             else if (ent_type == "mesh") {
-                scene->objects.push_back(parse_mesh(file_deck));
+                scene->objects.push_back(parse_mesh(file_deck, scene->materials));
             }
             else if (ent_type == "triangle") {
-                scene->objects.push_back(parse_triangle(file_deck));
+                scene->objects.push_back(parse_triangle(file_deck, scene->materials));
+            }
+            else if (ent_type == "spheres") {
+                scene->objects.push_back(parse_spheres(file_deck, scene->materials));
             }
             else {
                 throw std::invalid_argument("Unknown entity type '" + ent_type + "'");
@@ -62,7 +74,9 @@ std::shared_ptr<Scene> load_scene(std::string filename)
         }
     }
     catch (const std::invalid_argument& e) { throw e; }
-    
+
+    scene->spatial_splits = spatial;
+    scene->build_accel(accel);
     return scene;
 }
 
@@ -133,62 +147,72 @@ std::shared_ptr<Camera> parse_camera(std::deque<std::string> &file_deck)
 
 
 
-std::shared_ptr<Plane> parse_plane(std::deque<std::string> &file_deck)
+/* Pops the 4 lines of an object's material from file_deck and adds it to materials
+ * Returns its index in materials, objects of the same material share one entry
+ *
+ * Line format is as follows (or an std::invalid_argument is thrown)
+ *  amb: ar ag ab
+ *  dif: dr dg db
+ *  spe: sr sg sb
+ *  shi: shininess
+ */
+int parse_material(std::deque<std::string> &file_deck, MaterialTable &materials)
+{
+    Vec3 amb { line_to_vec3(pop(file_deck), "amb:") };
+    Vec3 dif { line_to_vec3(pop(file_deck), "dif:") };
+    Vec3 spe { line_to_vec3(pop(file_deck), "spe:") };
+    float shi { line_to_single<float>(pop(file_deck), "shi:") };
+
+    return materials.add(Material { amb, dif, spe, shi });
+}
+
+
+
+std::shared_ptr<Plane> parse_plane(std::deque<std::string> &file_deck, MaterialTable &materials)
 {
     try
     {
         Vec3 normal { line_to_vec3(pop(file_deck), "nor:") };
         Vec3 point { line_to_vec3(pop(file_deck), "pos:") };
-        Vec3 amb { line_to_vec3(pop(file_deck), "amb:") };
-        Vec3 dif { line_to_vec3(pop(file_deck), "dif:") };
-        Vec3 spe { line_to_vec3(pop(file_deck), "spe:") };
-        float shi { line_to_single<float>(pop(file_deck), "shi:") };
+        int material { parse_material(file_deck, materials) };
 
-        return std::make_shared<Plane>(normal, point, amb, dif, spe, shi);
+        return std::make_shared<Plane>(normal, point, material);
     }
     catch (const std::invalid_argument &e){ throw e; }   
 }
 
 
 
-std::shared_ptr<Sphere> parse_sphere(std::deque<std::string> &file_deck)
+std::shared_ptr<Sphere> parse_sphere(std::deque<std::string> &file_deck, MaterialTable &materials)
 {
     try
     {
         Vec3 pos { line_to_vec3(pop(file_deck), "pos:") };
         float r { line_to_single<float>(pop(file_deck), "rad:") };
-        Vec3 amb { line_to_vec3(pop(file_deck), "amb:") };
-        Vec3 dif { line_to_vec3(pop(file_deck), "dif:") };
-        Vec3 spe { line_to_vec3(pop(file_deck), "spe:") };
-        float shi { line_to_single<float>(pop(file_deck), "shi:") };
+        int material { parse_material(file_deck, materials) };
 
-        return std::make_shared<Sphere>(pos, r, amb, dif, spe, shi);
+        return std::make_shared<Sphere>(pos, r, material);
     }
     catch (const std::invalid_argument &e){ throw e; }   
 }
 
 
 
-std::shared_ptr<Mesh> parse_mesh(std::deque<std::string> &file_deck)
+std::shared_ptr<Mesh> parse_mesh(std::deque<std::string> &file_deck, MaterialTable &materials)
 {
     try
     {
         std::string filename { pop(file_deck) };
+        int material { parse_material(file_deck, materials) };
 
-        Vec3 amb, dif, spe;
-        amb = Vec3 { line_to_vec3(pop(file_deck), "amb:") };
-        dif = Vec3 { line_to_vec3(pop(file_deck), "dif:") };
-        spe = Vec3 { line_to_vec3(pop(file_deck), "spe:") };
-        float shi { line_to_single<float>(pop(file_deck), "shi:") };
-
-        return std::make_shared<Mesh>(filename, amb, dif, spe, shi);
+        return std::make_shared<Mesh>(filename, material);
     }
     catch (const std::invalid_argument &e){ throw e; }
 }
 
 
 
-std::shared_ptr<Mesh> parse_triangle(std::deque<std::string> &file_deck)
+std::shared_ptr<Mesh> parse_triangle(std::deque<std::string> &file_deck, MaterialTable &materials)
 {
     try
     {
@@ -196,20 +220,45 @@ std::shared_ptr<Mesh> parse_triangle(std::deque<std::string> &file_deck)
         vertices.push_back(line_to_vec3(pop(file_deck), "v1:"));
         vertices.push_back(line_to_vec3(pop(file_deck), "v2:"));
         vertices.push_back(line_to_vec3(pop(file_deck), "v3:"));
+        int material { parse_material(file_deck, materials) };
 
-        Vec3 amb, dif, spe;
-        amb = Vec3 { line_to_vec3(pop(file_deck), "amb:") };
-        dif = Vec3 { line_to_vec3(pop(file_deck), "dif:") };
-        spe = Vec3 { line_to_vec3(pop(file_deck), "spe:") };
-        float shi { line_to_single<float>(pop(file_deck), "shi:") };
-
-        return std::make_shared<Mesh>(vertices, amb, dif, spe, shi);
+        return std::make_shared<Mesh>(vertices, material);
     }
     catch (const std::invalid_argument &e){ throw e; }
 }
 
 
 
+/* Pops the name of a sphere file from file_deck and loads it into a SpherePool
+ * The file has one sphere per line, its centre, radius and material:
+ *  px py pz r  amb_r amb_g amb_b  dif_r dif_g dif_b  spe_r spe_g spe_b  shi
+ * It is read a sphere at a time, so files of millions of spheres never sit in memory as text
+ * The spheres' materials are added to materials, few distinct ones are expected
+ */
+std::shared_ptr<SpherePool> parse_spheres(std::deque<std::string> &file_deck, MaterialTable &materials)
+{
+    std::string filename { pop(file_deck) };
+    std::ifstream file { filename };
+    if (!file.is_open())
+        throw std::invalid_argument("Could not open sphere file '" + filename + "'");
+
+    std::shared_ptr<SpherePool> pool { std::make_shared<SpherePool>() };
+    Vec3 pos, amb, dif, spe;
+    float r, shi;
+    while (file >> pos.x >> pos.y >> pos.z >> r >> amb.x >> amb.y >> amb.z
+                >> dif.x >> dif.y >> dif.z >> spe.x >> spe.y >> spe.z >> shi)
+    {
+        pool->add(pos, r, materials.add(Material { amb, dif, spe, shi }));
+    }
+
+    if (!file.eof())
+        throw std::invalid_argument("Could not parse sphere " + std::to_string(pool->size() + 1) + " of " + filename);
+
+    return pool;
+}
+
+
+
 std::shared_ptr<Light> parse_light(std::deque<std::string> &file_deck)
 {
     try
@@ -222,4 +271,39 @@ std::shared_ptr<Light> parse_light(std::deque<std::string> &file_deck)
         return std::make_shared<Light>(pos, amb, dif, spe);
     }
     catch (const std::invalid_argument &e){ throw e; }   
-}
\ No newline at end of file
+}
+
+
+
+std::shared_ptr<SphereLight> parse_sphere_light(std::deque<std::string> &file_deck)
+{
+    try
+    {
+        Vec3 pos { line_to_vec3(pop(file_deck), "pos:") };
+        float r { line_to_single<float>(pop(file_deck), "rad:") };
+        Vec3 amb { line_to_vec3(pop(file_deck), "amb:") };
+        Vec3 dif { line_to_vec3(pop(file_deck), "dif:") };
+        Vec3 spe { line_to_vec3(pop(file_deck), "spe:") };
+
+        return std::make_shared<SphereLight>(pos, r, amb, dif, spe);
+    }
+    catch (const std::invalid_argument &e){ throw e; }
+}
+
+
+
+std::shared_ptr<RectLight> parse_rect_light(std::deque<std::string> &file_deck)
+{
+    try
+    {
+        Vec3 pos { line_to_vec3(pop(file_deck), "pos:") };
+        Vec3 edge_u { line_to_vec3(pop(file_deck), "u:") };
+        Vec3 edge_v { line_to_vec3(pop(file_deck), "v:") };
+        Vec3 amb { line_to_vec3(pop(file_deck), "amb:") };
+        Vec3 dif { line_to_vec3(pop(file_deck), "dif:") };
+        Vec3 spe { line_to_vec3(pop(file_deck), "spe:") };
+
+        return std::make_shared<RectLight>(pos, edge_u, edge_v, amb, dif, spe);
+    }
+    catch (const std::invalid_argument &e){ throw e; }
+}
@@ -36,16 +36,25 @@ T line_to_single(std::string line, std::string exp_prefix)
 }
 
 
-std::shared_ptr<Scene> load_scene(std::string filename);
+std::shared_ptr<Scene> load_scene(std::string filename, AccelType accel = AccelType::BVH,
+                                    const SpatialSplitOptions &spatial = SpatialSplitOptions {});
 std::vector<std::string> read_file(std::string filename);
 
 Vec3 line_to_vec3(std::string line, std::string exp_prefix);
 
 std::shared_ptr<Camera> parse_camera(std::deque<std::string> &file_deck);
-std::shared_ptr<Plane> parse_plane(std::deque<std::string> &file_deck);
-std::shared_ptr<Sphere> parse_sphere(std::deque<std::string> &file_deck);
-std::shared_ptr<Mesh> parse_mesh(std::deque<std::string> &file_deck);
-std::shared_ptr<Mesh> parse_triangle(std::deque<std::string> &file_deck);
+int parse_material(std::deque<std::string> &file_deck, MaterialTable &materials);
+
+// Objects' materials are added to materials, usually the scene's, objects keep their index
+std::shared_ptr<Plane> parse_plane(std::deque<std::string> &file_deck, MaterialTable &materials);
+std::shared_ptr<Sphere> parse_sphere(std::deque<std::string> &file_deck, MaterialTable &materials);
+std::shared_ptr<Mesh> parse_mesh(std::deque<std::string> &file_deck, MaterialTable &materials);
+std::shared_ptr<Mesh> parse_triangle(std::deque<std::string> &file_deck, MaterialTable &materials);
+std::shared_ptr<SpherePool> parse_spheres(std::deque<std::string> &file_deck, MaterialTable &materials);
 std::shared_ptr<Light> parse_light(std::deque<std::string> &file_deck);
 
+// Sphere lights are given by pos: and rad:, rectangle lights by their centre pos: and edges u: and v:
+std::shared_ptr<SphereLight> parse_sphere_light(std::deque<std::string> &file_deck);
+std::shared_ptr<RectLight> parse_rect_light(std::deque<std::string> &file_deck);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "sceneloader.hpp"
+#include "sequence.hpp"
+
+
+FrameUpdate::FrameUpdate()
+{
+    move_camera = false;
+    camera_pos = Vec3 { 0.0 };
+}
+
+
+
+Sequence load_sequence(std::string filename)
+{
+    std::vector<std::string> file_list { read_file(filename) };
+    if (file_list.size() == 0)
+        throw std::invalid_argument("File was empty");
+
+    std::deque<std::string> file_deck { file_list.begin(), file_list.end() };
+
+    Sequence sequence;
+    sequence.scene_file = pop(file_deck);
+
+    int num_frames;
+    std::stringstream line { file_deck.empty() ? "" : pop(file_deck) };
+    line >> num_frames;
+    if (line.fail() || num_frames < 1)
+        throw std::invalid_argument("Could not read number of frames");
+
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (file_deck.empty())
+            throw std::invalid_argument("Expected " + std::to_string(num_frames) + " frames");
+
+        std::string block { pop(file_deck) };
+        if (block != "frame")
+            throw std::invalid_argument("Expected 'frame', found '" + block + "'");
+
+        sequence.frames.push_back(parse_frame(file_deck));
+    }
+
+    return sequence;
+}
+
+
+
+/* Pops lines from file_deck up to the next frame (or the end of the file) and
+ * parses them into a FrameUpdate
+ *
+ * Line format is one of the following (or an std::invalid_argument is thrown)
+ *  camera: px py pz
+ *  light: i px py pz
+ *  object: i tx ty tz
+ */
+FrameUpdate parse_frame(std::deque<std::string> &file_deck)
+{
+    FrameUpdate frame;
+
+    while (!file_deck.empty() && file_deck.front() != "frame")
+    {
+        std::string line { pop(file_deck) };
+        if (line.empty())
+            continue;
+
+        std::stringstream ss { line };
+        std::string prefix;
+        ss >> prefix;
+
+        if (prefix == "camera:")
+        {
+            frame.camera_pos = line_to_vec3(line, "camera:");
+            frame.move_camera = true;
+            continue;
+        }
+
+        // Index must be a plain non-negative integer, so "1.5" isn't read as 1 followed by .5
+        std::string index_str;
+        Vec3 v;
+        ss >> index_str >> v.x >> v.y >> v.z;
+        if (ss.fail() || index_str.empty() || index_str.size() > 9 ||
+            index_str.find_first_not_of("0123456789") != std::string::npos)
+            throw std::invalid_argument("Could not parse; Line format incorrect");
+
+        int index { std::stoi(index_str) };
+
+        if (prefix == "light:")
+            frame.light_pos[index] = v;
+        else if (prefix == "object:")
+            frame.object_offset[index] = v;
+        else
+            throw std::invalid_argument("Could not parse; Invalid line prefix");
+    }
+
+    return frame;
+}
+
+
+
+std::vector<int> apply_frame(std::shared_ptr<Scene> scene, const FrameUpdate &frame,
+                                std::vector<Vec3> &offsets)
+{
+    offsets.resize(scene->objects.size(), Vec3 { 0.0 });
+
+    if (frame.move_camera)
+        scene->camera->pos = frame.camera_pos;
+
+    for (const auto &light : frame.light_pos)
+    {
+        if (light.first >= (int)scene->lights.size())
+            throw std::invalid_argument("No light " + std::to_string(light.first) + " in scene");
+
+        scene->lights[light.first]->pos = light.second;
+    }
+
+    std::vector<int> moved;
+    for (const auto &obj : frame.object_offset)
+    {
+        int i { obj.first };
+        if (i >= (int)scene->objects.size())
+            throw std::invalid_argument("No object " + std::to_string(i) + " in scene");
+
+        // Offsets are from the base scene, so only move by what changed since the last frame
+        if (obj.second == offsets[i])
+            continue;
+
+        scene->objects[i]->translate(obj.second - offsets[i]);
+        offsets[i] = obj.second;
+        moved.push_back(i);
+    }
+
+    return moved;
+}
+
+
+
+void render_sequence(const Sequence &sequence, const RenderSettings &settings,
+                        FrameWriter write_frame, bool pipeline)
+{
+    std::shared_ptr<Scene> scene { load_scene(sequence.scene_file) };
+    if (scene->camera == nullptr)
+        throw std::invalid_argument("Scene has no camera");
+
+    std::vector<Vec3> offsets;
+    std::thread writer;
+
+    // Errors on the writer thread are passed back and rethrown once it is joined
+    std::exception_ptr write_error;
+    auto write_async = [&write_frame, &write_error](int i, const Pixel2D &px_data, int width, int height)
+    {
+        try { write_frame(i, px_data, width, height); }
+        catch (...) { write_error = std::current_exception(); }
+    };
+
+    int num_frames = sequence.frames.size();
+    try
+    {
+        for (int i = 0; i < num_frames; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+
+            // Most objects stay put between frames, so refit the BVH rather than rebuilding it
+            std::vector<int> moved { apply_frame(scene, sequence.frames[i], offsets) };
+            if (!moved.empty())
+                scene->update_accel(moved);
+
+            int width, height;
+            Pixel2D px_data { raytrace(scene, width, height, settings) };
+
+            std::chrono::duration<double> elapsed { std::chrono::steady_clock::now() - start };
+            std::cout << "Frame " << i + 1 << "/" << num_frames << " rendered in "
+                        << elapsed.count() << "s" << std::endl;
+
+            // Wait for the previous frame to finish writing so frames are written in order
+            if (writer.joinable())
+                writer.join();
+            if (write_error)
+                std::rethrow_exception(write_error);
+
+            if (pipeline)
+                writer = std::thread(write_async, i, std::move(px_data), width, height);
+            else
+                write_frame(i, px_data, width, height);
+        }
+    }
+    catch (...)
+    {
+        // Never leave the writer running on the way out
+        if (writer.joinable())
+            writer.join();
+        throw;
+    }
+
+    if (writer.joinable())
+        writer.join();
+    if (write_error)
+        std::rethrow_exception(write_error);
+}
+
+
+
+std::string frame_filename(std::string filename, int frame)
+{
+    std::stringstream ss;
+    ss << "_" << std::setw(4) << std::setfill('0') << frame;
+
+    size_t ext { filename.rfind('.') };
+    size_t dir { filename.find_last_of('/') };
+    if (ext == std::string::npos || (dir != std::string::npos && ext < dir))
+        return filename + ss.str();
+
+    return filename.substr(0, ext) + ss.str() + filename.substr(ext);
+}
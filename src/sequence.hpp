@@ -0,0 +1,72 @@
+#ifndef __SEQUENCE_HPP
+#define __SEQUENCE_HPP
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+
+
+/* Sequence files
+ * Describe an animation as a base scene plus the changes made in each frame
+ *
+ *  scene.txt           // base scene file
+ *  num_frames
+ *  frame               // followed by any number of the lines below
+ *  camera: px py pz    // position of the camera
+ *  light: i px py pz   // position of the i-th light in the scene file
+ *  object: i tx ty tz  // translation of the i-th object from its position in the base scene
+ *
+ * Anything not mentioned in a frame keeps its value from the previous frame
+ */
+struct FrameUpdate
+{
+    bool move_camera;
+    Vec3 camera_pos;
+    std::map<int, Vec3> light_pos;
+    std::map<int, Vec3> object_offset;
+
+    FrameUpdate();
+};
+
+
+struct Sequence
+{
+    std::string scene_file;
+    std::vector<FrameUpdate> frames;
+};
+
+
+Sequence load_sequence(std::string filename);
+FrameUpdate parse_frame(std::deque<std::string> &file_deck);
+
+
+/* Applies the changes of a frame to scene, only touching entities whose transform changed
+ * offsets holds each object's current translation from the base scene and is kept up to date
+ * Returns the indices of the objects that moved
+ */
+std::vector<int> apply_frame(std::shared_ptr<Scene> scene, const FrameUpdate &frame,
+                                std::vector<Vec3> &offsets);
+
+
+// Called with each finished frame, frames are always written in order
+typedef std::function<void(int frame, const Pixel2D &px_data, int width, int height)> FrameWriter;
+
+
+/* Renders every frame of a sequence back to back in this process, the base scene is
+ * loaded once and updated in place between frames
+ * If pipeline is true, frame N is written on a separate thread while frame N + 1 renders
+ */
+void render_sequence(const Sequence &sequence, const RenderSettings &settings,
+                        FrameWriter write_frame, bool pipeline = false);
+
+
+// Inserts a zero-padded frame number before the file extension, e.g. Render_0003.bmp
+std::string frame_filename(std::string filename, int frame);
+
+#endif
@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "shading.hpp"
+
+
+// log2(m) = LOG2_C1 t + LOG2_C3 t^3 + ... with t = (m - 1) / (m + 1), the atanh series times 2 / ln(2)
+const float LOG2_C1 { 2.8853900817779268f };
+const float LOG2_C3 { 0.9617966939259756f };
+const float LOG2_C5 { 0.5770780163555854f };
+const float LOG2_C7 { 0.4121985831111324f };
+
+// 2^f = 1 + EXP2_C1 f + EXP2_C2 f^2 + ... for f in [-0.5, 0.5], the Taylor series of e^(f ln(2))
+const float EXP2_C1 { 0.6931471805599453f };
+const float EXP2_C2 { 0.2402265069591007f };
+const float EXP2_C3 { 0.0555041086648216f };
+const float EXP2_C4 { 0.0096181291076285f };
+const float EXP2_C5 { 0.0013333558146428f };
+const float EXP2_C6 { 0.0001540353039338f };
+
+// Mantissas are kept in [1 / sqrt(2), sqrt(2)) so t stays small
+const float SQRT2 { 1.4142135623730951f };
+
+// Denormals are scaled up by 2^23 before their exponent is read
+const float DENORMAL_SCALE { 8388608.0f };
+
+/* Powers of two are kept within 2^-100 and 2^100, anything smaller is as good as 0 for shading
+ * Going much closer to 2^-126 would leave denormals in the colours, which are slow to compute with
+ */
+const float MAX_EXP2 { 100.0f };
+
+// Adding and subtracting 1.5 * 2^23 rounds a float to the nearest integer, ties to even like _mm_cvtps_epi32
+const float ROUND_MAGIC { 12582912.0f };
+
+
+
+void HitBatch::add(Vec3 pos, Vec3 normal, int material, Vec3 view_pos)
+{
+    px.push_back(pos.x);
+    py.push_back(pos.y);
+    pz.push_back(pos.z);
+    nx.push_back(normal.x);
+    ny.push_back(normal.y);
+    nz.push_back(normal.z);
+    vx.push_back(view_pos.x);
+    vy.push_back(view_pos.y);
+    vz.push_back(view_pos.z);
+    this->material.push_back(material);
+}
+
+
+
+void HitBatch::clear()
+{
+    for (std::vector<float> *v : { &px, &py, &pz, &nx, &ny, &nz, &vx, &vy, &vz })
+        v->clear();
+    material.clear();
+}
+
+
+
+/* fast_pow, step by step exactly as fast_pow_sse does it
+ * log2(x) is x's exponent plus the log2 of its mantissa, then 2^(y log2(x)) is split into a
+ * power of two, written straight into the exponent bits, and 2^f for the small remainder
+ */
+float fast_pow(float x, float y)
+{
+    if (!(x > 0.0f))
+        return 0.0f;
+
+    int bias { 127 };
+    if (x < FLT_MIN)
+    {
+        x = x * DENORMAL_SCALE;
+        bias += 23;
+    }
+
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    int e { (int)((bits >> 23) & 0xff) - bias };
+    bits = (bits & 0x7fffff) | 0x3f800000;
+    float m;
+    std::memcpy(&m, &bits, sizeof(m));
+    if (m > SQRT2)
+    {
+        m = m * 0.5f;
+        e += 1;
+    }
+
+    float t { (m - 1.0f) / (m + 1.0f) };
+    float t2 { t * t };
+    float log2_x { (float)e + t * (LOG2_C1 + t2 * (LOG2_C3 + t2 * (LOG2_C5 + t2 * LOG2_C7))) };
+
+    float z { std::max(-MAX_EXP2, std::min(y * log2_x, MAX_EXP2)) };
+    float n { (z + ROUND_MAGIC) - ROUND_MAGIC };
+    float f { z - n };
+    float p { 1.0f + f * (EXP2_C1 + f * (EXP2_C2 + f * (EXP2_C3 + f * (EXP2_C4 + f * (EXP2_C5 + f * EXP2_C6))))) };
+
+    uint32_t scale_bits { (uint32_t)((int)n + 127) << 23 };
+    float scale;
+    std::memcpy(&scale, &scale_bits, sizeof(scale));
+    return p * scale;
+}
+
+
+
+// The specular highlight, the only part of Phong shading that isn't plain arithmetic
+static float specular_pow(float v_angle, float shi, bool use_fast_pow)
+{
+    return use_fast_pow ? fast_pow(v_angle, shi) : (float)pow(v_angle, shi);
+}
+
+
+
+/* Phong illumination at a given point
+ * normal is the normalized surface normal at pos
+ * The ambient amount is left out, compute_color adds it whether or not the point is in shadow
+ */
+Vec3 phong(const Light &light, const Material &material, Vec3 pos, Vec3 normal, Vec3 view_pos,
+            bool use_fast_pow)
+{
+    Vec3 l, n, v, r;
+    l = glm::normalize(light.pos - pos);
+    n = normal;
+    v = glm::normalize(view_pos - pos);
+    r = glm::reflect(l, n);
+
+    float l_angle, v_angle;
+    l_angle = fmax(glm::dot(l, n), 0.0);
+    v_angle = fmax(glm::dot(r, v), 0.0);
+
+    Vec3 dif, spe;
+    dif = light.dif * material.dif * l_angle;
+    spe = light.spe * material.spe * specular_pow(v_angle, material.shi, use_fast_pow);
+
+    return (dif + spe);
+}
+
+
+
+void shade_phong_scalar(const HitBatch &hits, const Light &light, const MaterialTable &materials,
+                        bool use_fast_pow, Vec3 *out)
+{
+    for (int h = 0; h < hits.size(); h++)
+    {
+        out[h] = phong(light, materials[hits.material[h]], Vec3 { hits.px[h], hits.py[h], hits.pz[h] },
+                        Vec3 { hits.nx[h], hits.ny[h], hits.nz[h] }, Vec3 { hits.vx[h], hits.vy[h], hits.vz[h] },
+                        use_fast_pow);
+    }
+}
+
+
+
+#ifdef __SSE2__
+
+static inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+
+// Same order of operations as glm::dot
+static inline __m128 dot3(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+
+// Same as glm::normalize, 1 / sqrt rather than the approximate _mm_rsqrt_ps
+static inline void normalize3(__m128 &x, __m128 &y, __m128 &z)
+{
+    __m128 inv_len { _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(dot3(x, y, z, x, y, z))) };
+    x = _mm_mul_ps(x, inv_len);
+    y = _mm_mul_ps(y, inv_len);
+    z = _mm_mul_ps(z, inv_len);
+}
+
+
+// fast_pow of four values at once, exactly the same results
+static __m128 fast_pow_sse(__m128 x, __m128 y)
+{
+    __m128 positive { _mm_cmpgt_ps(x, _mm_setzero_ps()) };
+    __m128 denormal { _mm_cmplt_ps(x, _mm_set1_ps(FLT_MIN)) };
+    x = select(denormal, _mm_mul_ps(x, _mm_set1_ps(DENORMAL_SCALE)), x);
+    __m128i bias { _mm_add_epi32(_mm_set1_epi32(127), _mm_and_si128(_mm_castps_si128(denormal), _mm_set1_epi32(23))) };
+
+    __m128i bits { _mm_castps_si128(x) };
+    __m128i e { _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)), bias) };
+    __m128 m { _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)),
+                                                _mm_set1_epi32(0x3f800000))) };
+    __m128 big { _mm_cmpgt_ps(m, _mm_set1_ps(SQRT2)) };
+    m = select(big, _mm_mul_ps(m, _mm_set1_ps(0.5f)), m);
+    e = _mm_sub_epi32(e, _mm_castps_si128(big));
+
+    __m128 one { _mm_set1_ps(1.0f) };
+    __m128 t { _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one)) };
+    __m128 t2 { _mm_mul_ps(t, t) };
+    __m128 poly { _mm_add_ps(_mm_set1_ps(LOG2_C5), _mm_mul_ps(t2, _mm_set1_ps(LOG2_C7))) };
+    poly = _mm_add_ps(_mm_set1_ps(LOG2_C3), _mm_mul_ps(t2, poly));
+    poly = _mm_add_ps(_mm_set1_ps(LOG2_C1), _mm_mul_ps(t2, poly));
+    __m128 log2_x { _mm_add_ps(_mm_cvtepi32_ps(e), _mm_mul_ps(t, poly)) };
+
+    __m128 z { _mm_max_ps(_mm_set1_ps(-MAX_EXP2), _mm_min_ps(_mm_mul_ps(y, log2_x), _mm_set1_ps(MAX_EXP2))) };
+    __m128i n { _mm_cvtps_epi32(z) };
+    __m128 f { _mm_sub_ps(z, _mm_cvtepi32_ps(n)) };
+    __m128 p { _mm_add_ps(_mm_set1_ps(EXP2_C5), _mm_mul_ps(f, _mm_set1_ps(EXP2_C6))) };
+    for (float c : { EXP2_C4, EXP2_C3, EXP2_C2, EXP2_C1, 1.0f })
+        p = _mm_add_ps(_mm_set1_ps(c), _mm_mul_ps(f, p));
+
+    __m128 scale { _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23)) };
+    return _mm_and_ps(positive, _mm_mul_ps(p, scale));
+}
+
+
+/* Four hits per step, each lane does exactly what phong does for its hit
+ * Materials are gathered lane by lane from the table, the remaining hits are shaded one by one
+ */
+void shade_phong(const HitBatch &hits, const Light &light, const MaterialTable &materials,
+                    bool use_fast_pow, Vec3 *out)
+{
+    const int WIDTH { 4 };
+    int n { hits.size() };
+    int h { 0 };
+    for (; h + WIDTH <= n; h += WIDTH)
+    {
+        float dif[3][WIDTH], spe[3][WIDTH], shi[WIDTH];
+        for (int k = 0; k < WIDTH; k++)
+        {
+            const Material &m { materials[hits.material[h + k]] };
+            for (int c = 0; c < 3; c++)
+            {
+                dif[c][k] = light.dif[c] * m.dif[c];
+                spe[c][k] = light.spe[c] * m.spe[c];
+            }
+            shi[k] = m.shi;
+        }
+
+        __m128 px { _mm_loadu_ps(&hits.px[h]) }, py { _mm_loadu_ps(&hits.py[h]) }, pz { _mm_loadu_ps(&hits.pz[h]) };
+        __m128 nx { _mm_loadu_ps(&hits.nx[h]) }, ny { _mm_loadu_ps(&hits.ny[h]) }, nz { _mm_loadu_ps(&hits.nz[h]) };
+
+        __m128 lx { _mm_sub_ps(_mm_set1_ps(light.pos.x), px) };
+        __m128 ly { _mm_sub_ps(_mm_set1_ps(light.pos.y), py) };
+        __m128 lz { _mm_sub_ps(_mm_set1_ps(light.pos.z), pz) };
+        normalize3(lx, ly, lz);
+
+        __m128 vx { _mm_sub_ps(_mm_loadu_ps(&hits.vx[h]), px) };
+        __m128 vy { _mm_sub_ps(_mm_loadu_ps(&hits.vy[h]), py) };
+        __m128 vz { _mm_sub_ps(_mm_loadu_ps(&hits.vz[h]), pz) };
+        normalize3(vx, vy, vz);
+
+        // glm::reflect(l, n) = l - n * dot(n, l) * 2
+        __m128 n_dot_l { dot3(nx, ny, nz, lx, ly, lz) };
+        __m128 two { _mm_set1_ps(2.0f) };
+        __m128 rx { _mm_sub_ps(lx, _mm_mul_ps(_mm_mul_ps(nx, n_dot_l), two)) };
+        __m128 ry { _mm_sub_ps(ly, _mm_mul_ps(_mm_mul_ps(ny, n_dot_l), two)) };
+        __m128 rz { _mm_sub_ps(lz, _mm_mul_ps(_mm_mul_ps(nz, n_dot_l), two)) };
+
+        __m128 zero { _mm_setzero_ps() };
+        __m128 l_angle { _mm_max_ps(dot3(lx, ly, lz, nx, ny, nz), zero) };
+        __m128 v_angle { _mm_max_ps(dot3(rx, ry, rz, vx, vy, vz), zero) };
+
+        __m128 highlight;
+        if (use_fast_pow)
+        {
+            highlight = fast_pow_sse(v_angle, _mm_loadu_ps(shi));
+        }
+        else
+        {
+            float v[WIDTH];
+            _mm_storeu_ps(v, v_angle);
+            for (int k = 0; k < WIDTH; k++)
+                v[k] = specular_pow(v[k], shi[k], false);
+            highlight = _mm_loadu_ps(v);
+        }
+
+        float color[3][WIDTH];
+        for (int c = 0; c < 3; c++)
+        {
+            __m128 d { _mm_mul_ps(_mm_loadu_ps(dif[c]), l_angle) };
+            __m128 s { _mm_mul_ps(_mm_loadu_ps(spe[c]), highlight) };
+            _mm_storeu_ps(color[c], _mm_add_ps(d, s));
+        }
+        for (int k = 0; k < WIDTH; k++)
+            out[h + k] = Vec3 { color[0][k], color[1][k], color[2][k] };
+    }
+
+    for (; h < n; h++)
+    {
+        out[h] = phong(light, materials[hits.material[h]], Vec3 { hits.px[h], hits.py[h], hits.pz[h] },
+                        Vec3 { hits.nx[h], hits.ny[h], hits.nz[h] }, Vec3 { hits.vx[h], hits.vy[h], hits.vz[h] },
+                        use_fast_pow);
+    }
+}
+
+#else
+
+void shade_phong(const HitBatch &hits, const Light &light, const MaterialTable &materials,
+                    bool use_fast_pow, Vec3 *out)
+{
+    shade_phong_scalar(hits, light, materials, use_fast_pow, out);
+}
+
+#endif
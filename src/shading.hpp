@@ -0,0 +1,54 @@
+#ifndef __SHADING_HPP
+#define __SHADING_HPP
+
+#include <vector>
+
+#include "objects.hpp"
+
+
+// Most fast_pow can differ from pow for x in [0, 1] and y in (0, MAX_FAST_POW_EXPONENT]
+const float FAST_POW_MAX_ERROR { 1e-6f };
+const float MAX_FAST_POW_EXPONENT { 1000.0f };
+
+
+/* Hits waiting to be shaded, stored by component so SIMD lanes load several hits at once
+ * normal must be normalized, view_pos is where the hit is seen from
+ */
+struct HitBatch
+{
+    std::vector<float> px, py, pz;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> vx, vy, vz;
+    std::vector<int> material;
+
+    void add(Vec3 pos, Vec3 normal, int material, Vec3 view_pos);
+    void clear();
+    int size() const { return material.size(); }
+};
+
+
+/* x^y for x in [0, 1] and y > 0, as exp2(y * log2(x)) with polynomials for both
+ * Within FAST_POW_MAX_ERROR of pow, several times faster and vectorizes with SSE
+ */
+float fast_pow(float x, float y);
+
+
+/* Diffuse and specular Phong light from light at pos, like calc_phong
+ * With use_fast_pow the specular highlight is raised to shi with fast_pow rather than pow
+ */
+Vec3 phong(const Light &light, const Material &material, Vec3 pos, Vec3 normal, Vec3 view_pos,
+            bool use_fast_pow = false);
+
+
+/* Phong light from light at every hit in hits, into out (which must hold hits.size() colours)
+ * Hits are shaded four at a time with SSE where available, each result is exactly what phong
+ * gives for that hit, whichever lane it was shaded in
+ */
+void shade_phong(const HitBatch &hits, const Light &light, const MaterialTable &materials,
+                    bool use_fast_pow, Vec3 *out);
+
+// Portable version of shade_phong, gives exactly the same results
+void shade_phong_scalar(const HitBatch &hits, const Light &light, const MaterialTable &materials,
+                        bool use_fast_pow, Vec3 *out);
+
+#endif
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <pthread.h>
+
+#include "threadpool.hpp"
+
+
+// The shared pool, replaced in forked children (see ThreadPool::shared)
+static ThreadPool *shared_pool { nullptr };
+
+
+
+ThreadPool::ThreadPool(int num_threads)
+{
+    this->num_threads = std::max(1, num_threads);
+    stopping = false;
+
+    for (int i = 1; i < this->num_threads; i++)
+        threads.push_back(std::thread { &ThreadPool::worker_loop, this });
+}
+
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+        stopping = true;
+    }
+    changed.notify_all();
+
+    for (std::thread &t : threads)
+        t.join();
+}
+
+
+
+/* Only the forking thread survives a fork, so the child can't use (or even destroy) the
+ * parent's pool. It is leaked instead and the child makes its own when it first needs one
+ */
+ThreadPool &ThreadPool::shared()
+{
+    static std::once_flag once;
+    std::call_once(once, []()
+    {
+        pthread_atfork(nullptr, nullptr, []() { shared_pool = nullptr; });
+    });
+
+    if (shared_pool == nullptr)
+        shared_pool = new ThreadPool { (int)std::thread::hardware_concurrency() };
+
+    return *shared_pool;
+}
+
+
+
+void ThreadPool::worker_loop()
+{
+    std::unique_lock<std::mutex> lock { mutex };
+    while (true)
+    {
+        changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty())
+            return;
+
+        run_front(lock);
+    }
+}
+
+
+
+// Runs the task at the front of the queue with the lock released, lock must be held
+void ThreadPool::run_front(std::unique_lock<std::mutex> &lock)
+{
+    Task task { std::move(queue.front()) };
+    queue.pop_front();
+
+    lock.unlock();
+    std::exception_ptr error;
+    try { task.run(); }
+    catch (...) { error = std::current_exception(); }
+    lock.lock();
+
+    if (error && !task.group->error)
+        task.group->error = error;
+
+    task.group->pending--;
+    changed.notify_all();
+}
+
+
+
+TaskGroup::TaskGroup(ThreadPool &pool) : pool { pool }, pending { 0 } {}
+
+
+
+// Tasks refer to the group, so it can't go away before they have all finished
+TaskGroup::~TaskGroup()
+{
+    try { wait(); }
+    catch (...) {}
+}
+
+
+
+void TaskGroup::run(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock { pool.mutex };
+        pending++;
+        pool.queue.push_back(ThreadPool::Task { this, std::move(task) });
+    }
+    pool.changed.notify_all();
+}
+
+
+
+// Queued tasks may belong to other groups, running them still moves everything forwards
+void TaskGroup::wait()
+{
+    std::unique_lock<std::mutex> lock { pool.mutex };
+    while (pending > 0)
+    {
+        if (!pool.queue.empty())
+            pool.run_front(lock);
+        else
+            pool.changed.wait(lock);
+    }
+
+    if (error)
+    {
+        std::exception_ptr e { error };
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+
+
+void parallel_for(ThreadPool &pool, int n, int num_threads, std::function<void(int)> body)
+{
+    int workers { (num_threads > 0) ? std::min(num_threads, pool.size()) : pool.size() };
+    workers = std::min(workers, n);
+
+    std::atomic<int> next { 0 };
+    auto loop = [&]()
+    {
+        for (int i = next++; i < n; i = next++)
+            body(i);
+    };
+
+    TaskGroup group { pool };
+    for (int i = 1; i < workers; i++)
+        group.run(loop);
+
+    loop();
+    group.wait();
+}
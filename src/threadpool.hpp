@@ -0,0 +1,99 @@
+#ifndef __THREADPOOL_HPP
+#define __THREADPOOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class TaskGroup;
+
+
+/* Thread pool
+ * A fixed set of threads running tasks queued through TaskGroups
+ * Rendering and acceleration structure builds share one pool (see shared()), so a build
+ * started from inside a render can't oversubscribe the machine
+ */
+class ThreadPool
+{
+public:
+    /* num_threads counts the thread that waits on a TaskGroup, since it runs queued tasks
+     * while it waits, so a pool of 1 starts no threads and runs everything on the caller
+     */
+    explicit ThreadPool(int num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const { return num_threads; }
+
+    /* Pool with one thread per core, created on first use
+     * A forked child gets a fresh pool, the parent's threads don't exist in the child
+     */
+    static ThreadPool &shared();
+
+private:
+    friend class TaskGroup;
+
+    struct Task
+    {
+        TaskGroup *group;
+        std::function<void()> run;
+    };
+
+    int num_threads;
+    std::vector<std::thread> threads;
+
+    // Guards everything below and the pending count of every TaskGroup on this pool
+    std::mutex mutex;
+
+    // Signalled whenever a task is queued or finishes, and on shutdown
+    std::condition_variable changed;
+
+    std::deque<Task> queue;
+    bool stopping;
+
+    void worker_loop();
+    void run_front(std::unique_lock<std::mutex> &lock);
+};
+
+
+
+/* A set of tasks on a pool that can be waited for together
+ * Tasks may add more tasks to their own group, which is how recursive builds split their work.
+ * wait() runs queued tasks until the whole group is done, so nested parallelism can't deadlock.
+ * The first exception thrown by a task is rethrown by wait()
+ */
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool &pool);
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    friend class ThreadPool;
+
+    ThreadPool &pool;
+    int pending;
+    std::exception_ptr error;
+};
+
+
+
+/* Calls body(i) for every i in [0, n) on at most num_threads threads of pool (0 for all of them)
+ * Indices are handed out one at a time in increasing order, so uneven work balances itself
+ */
+void parallel_for(ThreadPool &pool, int n, int num_threads, std::function<void(int)> body);
+
+#endif
@@ -0,0 +1,404 @@
+#include <algorithm>
+
+#include "shading.hpp"
+#include "wavefront.hpp"
+
+
+// Camera rays followed through their shadows and reflections together, few enough to stay in cache
+const int WAVE_SIZE { 1024 };
+
+// Cells per axis of the grid sorted rays are binned on, by where they start
+const int BIN_RES { 4 };
+
+// Marks a hit and light without a reflection ray, the light is blocked or there are no reflections left
+const int NO_REFLECTION { -1 };
+
+// Marks a reflection ray that didn't hit anything
+const int REFLECTION_MISSED { -2 };
+
+
+// A hit waiting to be shaded, seen from view_pos, samples are those of the ray that hit it
+struct PathVertex
+{
+    Collision col;
+    Vec3 normal;
+    Vec3 view_pos;
+    SampleContext samples;
+};
+
+
+/* Hits at one depth of the render, the camera rays' hits or the reflections of the wave before
+ * Every hit of a wave has rec_depth reflections left and fires num_rays shadow rays at each light
+ * Everything per hit and light is stored at [vertex * number of lights + light]: how many shadow
+ * rays were blocked, the Phong illumination and which vertex of the next wave the reflection hit
+ */
+struct Wave
+{
+    std::vector<PathVertex> verts;
+    int rec_depth, num_rays;
+
+    std::vector<int> in_shadow;
+    std::vector<Vec3> phong;
+    std::vector<int> reflection;
+
+    std::vector<Vec3> colors;
+};
+
+
+
+void RayQueue::add(Vec3 origin, Vec3 dir)
+{
+    this->origin.push_back(origin);
+    this->dir.push_back(dir);
+}
+
+
+
+void RayQueue::clear()
+{
+    origin.clear();
+    dir.clear();
+    hits.clear();
+}
+
+
+
+void RayQueue::trace(std::shared_ptr<Scene> scene, bool sorted)
+{
+    hits.resize(origin.size());
+    if (!sorted)
+    {
+        for (unsigned int r = 0; r < origin.size(); r++)
+            hits[r] = fire_ray(origin[r], dir[r], scene);
+        return;
+    }
+
+    bin_rays();
+    for (int r : order)
+        hits[r] = fire_ray(origin[r], dir[r], scene);
+}
+
+
+
+// Spreads the low 10 bits of v out to every third bit, for Morton codes
+static uint32_t spread_bits(uint32_t v)
+{
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+
+
+// Counting sort of the rays into their bins, rays in the same bin stay in the order they were added
+void RayQueue::bin_rays()
+{
+    AABB bounds;
+    for (Vec3 p : origin)
+        bounds.grow(p);
+    Vec3 scale { float(BIN_RES) / glm::max(bounds.max - bounds.min, Vec3 { 1e-6f }) };
+
+    const int num_cells { BIN_RES * BIN_RES * BIN_RES };
+    std::vector<int> start(8 * num_cells + 1, 0);
+    bins.resize(origin.size());
+    for (unsigned int r = 0; r < origin.size(); r++)
+    {
+        int octant { (dir[r].x < 0.0f ? 1 : 0) | (dir[r].y < 0.0f ? 2 : 0) | (dir[r].z < 0.0f ? 4 : 0) };
+        uint32_t cell[3];
+        for (int axis = 0; axis < 3; axis++)
+            cell[axis] = std::min((int)((origin[r][axis] - bounds.min[axis]) * scale[axis]), BIN_RES - 1);
+
+        bins[r] = octant * num_cells + (spread_bits(cell[0]) | (spread_bits(cell[1]) << 1) | (spread_bits(cell[2]) << 2));
+        start[bins[r] + 1]++;
+    }
+
+    for (int bin = 0; bin < 8 * num_cells; bin++)
+        start[bin + 1] += start[bin];
+
+    order.resize(origin.size());
+    for (unsigned int r = 0; r < origin.size(); r++)
+        order[start[bins[r]]++] = r;
+}
+
+
+
+/* Traces every shadow ray of the wave and counts how many are blocked for each hit and light
+ * With adaptive_shadows the first that many rays of every hit and light are traced first, and the
+ * rest only for those whose first rays disagree
+ * Rays the occluder cache finds blocked aren't queued. The whole wave is checked against the cache
+ * before any of it is traced, so it holds the occluders of the wave before
+ */
+static void trace_shadows(std::shared_ptr<Scene> scene, const RenderSettings &settings, Wave &wave, RayQueue &rays)
+{
+    int num_lights { (int)scene->lights.size() };
+    std::vector<ShadowRays> shadow_rays;
+    shadow_rays.reserve(wave.verts.size() * num_lights);
+
+    int first { wave.num_rays };
+    if (settings.adaptive_shadows > 0)
+        first = std::min(settings.adaptive_shadows, wave.num_rays);
+
+    // Queues rays j0 to j1 of shadow_rays[s], owner holds which s each queued ray is for
+    std::vector<int> owner;
+    auto queue_rays = [&](int s, int j0, int j1)
+    {
+        for (int j = j0; j < j1; j++)
+        {
+            Vec3 dir { shadow_rays[s].next() };
+            if (shadow_rays[s].cached_blocked(*scene, dir))
+            {
+                wave.in_shadow[s]++;
+                continue;
+            }
+            rays.add(wave.verts[s / num_lights].col.coord, dir);
+            owner.push_back(s);
+        }
+    };
+    auto count_blocked = [&]()
+    {
+        rays.trace(scene, settings.sort_rays);
+        for (int r = 0; r < rays.size(); r++)
+        {
+            const ShadowRays &shadow { shadow_rays[owner[r]] };
+            if (shadow.blocked(rays.hits[r], rays.dir[r]))
+            {
+                wave.in_shadow[owner[r]]++;
+                shadow.remember(rays.hits[r]);
+            }
+        }
+    };
+
+    rays.clear();
+    wave.in_shadow.assign(wave.verts.size() * num_lights, 0);
+    for (const PathVertex &vert : wave.verts)
+    {
+        for (int i = 0; i < num_lights; i++)
+        {
+            shadow_rays.emplace_back(vert.col, vert.normal, *scene->lights[i], i, wave.num_rays, vert.samples);
+            queue_rays(shadow_rays.size() - 1, 0, first);
+        }
+    }
+    count_blocked();
+    if (first == wave.num_rays)
+        return;
+
+    // The rest of the rays of hits and lights that were partly blocked
+    rays.clear();
+    owner.clear();
+    for (unsigned int s = 0; s < shadow_rays.size(); s++)
+    {
+        if (wave.in_shadow[s] == first)
+            wave.in_shadow[s] = wave.num_rays;
+        if (wave.in_shadow[s] > 0 && wave.in_shadow[s] < wave.num_rays)
+            queue_rays(s, first, wave.num_rays);
+    }
+    count_blocked();
+}
+
+
+
+/* Phong illumination from every light at every hit of the wave
+ * Hits are put in the batch grouped by material, so neighbouring lanes of shade_phong mostly
+ * read the same material
+ */
+static void shade_wave(std::shared_ptr<Scene> scene, const RenderSettings &settings, Wave &wave, HitBatch &batch)
+{
+    int num_verts { (int)wave.verts.size() };
+    int num_lights { (int)scene->lights.size() };
+
+    // Counting sort by material index, the table is small
+    std::vector<int> start(scene->materials.size() + 1, 0);
+    for (const PathVertex &vert : wave.verts)
+        start[vert.col.material + 1]++;
+    for (int m = 0; m < scene->materials.size(); m++)
+        start[m + 1] += start[m];
+
+    std::vector<int> order(num_verts);
+    for (int v = 0; v < num_verts; v++)
+        order[start[wave.verts[v].col.material]++] = v;
+
+    batch.clear();
+    for (int v : order)
+        batch.add(wave.verts[v].col.coord, wave.verts[v].normal, wave.verts[v].col.material, wave.verts[v].view_pos);
+
+    std::vector<Vec3> phong(num_verts);
+    wave.phong.resize(num_verts * num_lights);
+    for (int i = 0; i < num_lights; i++)
+    {
+        shade_phong(batch, *scene->lights[i], scene->materials, settings.fast_pow, phong.data());
+        for (int k = 0; k < num_verts; k++)
+            wave.phong[order[k] * num_lights + i] = phong[k];
+    }
+}
+
+
+
+/* Traces the reflection of every light that isn't completely blocked from a hit of the wave
+ * Returns the next wave, made of whatever the reflections hit
+ */
+static Wave trace_reflections(std::shared_ptr<Scene> scene, const RenderSettings &settings, Wave &wave, RayQueue &rays)
+{
+    int num_lights { (int)scene->lights.size() };
+    wave.reflection.assign(wave.verts.size() * num_lights, NO_REFLECTION);
+
+    Wave next;
+    next.rec_depth = wave.rec_depth - 1;
+    // Don't compute soft shadows when firing recursive rays
+    next.num_rays = 1;
+    if (wave.rec_depth <= 0)
+        return next;
+
+    rays.clear();
+    for (unsigned int s = 0; s < wave.reflection.size(); s++)
+    {
+        const PathVertex &vert { wave.verts[s / num_lights] };
+        const Light &light { *scene->lights[s % num_lights] };
+        if (wave.in_shadow[s] < wave.num_rays)
+            rays.add(vert.col.coord, reflection_dir(vert.normal, light.pos - vert.col.coord));
+    }
+    rays.trace(scene, settings.sort_rays);
+
+    int r { 0 };
+    for (unsigned int s = 0; s < wave.reflection.size(); s++)
+    {
+        if (wave.in_shadow[s] == wave.num_rays)
+            continue;
+
+        Collision &hit { rays.hits[r++] };
+        if (hit == NO_COLLISION)
+        {
+            wave.reflection[s] = REFLECTION_MISSED;
+        }
+        else
+        {
+            const PathVertex &vert { wave.verts[s / num_lights] };
+            SampleContext samples { vert.samples };
+            samples.depth++;
+
+            wave.reflection[s] = next.verts.size();
+            Vec3 normal { glm::normalize(hit.normal) };
+            next.verts.push_back(PathVertex { std::move(hit), normal, vert.col.coord, samples });
+        }
+    }
+
+    return next;
+}
+
+
+
+// Sums up the colour of every hit of the wave like compute_color, next is the wave its reflections made
+static void sum_colors(std::shared_ptr<Scene> scene, Wave &wave, const Wave *next)
+{
+    int num_lights { (int)scene->lights.size() };
+    wave.colors.assign(wave.verts.size(), Vec3 { 0.0 });
+    for (unsigned int v = 0; v < wave.verts.size(); v++)
+    {
+        const Material &material { scene->materials[wave.verts[v].col.material] };
+        for (int i = 0; i < num_lights; i++)
+        {
+            int s { (int)v * num_lights + i };
+            Vec3 specular_ref { 0.0 };
+            if (wave.reflection[s] == REFLECTION_MISSED)
+                specular_ref = BACKGROUND_COLOUR;
+            else if (wave.reflection[s] != NO_REFLECTION)
+                specular_ref = next->colors[wave.reflection[s]];
+
+            add_light(wave.colors[v], material, *scene->lights[i], wave.phong[s], specular_ref,
+                        wave.in_shadow[s], wave.num_rays);
+        }
+    }
+}
+
+
+
+/* Renders camera rays [begin, end) of the queue, adding each sample's colour to its pixel
+ * sample_px and samples are the pixel (within the tile) and samples of each camera ray
+ * rays is left with the camera rays' hits replaced by those of later waves
+ */
+static void render_samples(std::shared_ptr<Scene> scene, const RenderSettings &settings, const RayQueue &camera_rays,
+                            const std::vector<int> &sample_px, const std::vector<SampleContext> &samples,
+                            int begin, int end, RayQueue &rays, HitBatch &batch, Vec3 *out)
+{
+    rays.clear();
+    for (int s = begin; s < end; s++)
+        rays.add(camera_rays.origin[s], camera_rays.dir[s]);
+    rays.trace(scene);
+
+    std::vector<Wave> waves(1);
+    waves[0].rec_depth = settings.recursion_level;
+    waves[0].num_rays = settings.num_shadows;
+    std::vector<int> sample_hit(rays.size(), -1);
+    for (int s = 0; s < rays.size(); s++)
+    {
+        if (rays.hits[s] == NO_COLLISION)
+            continue;
+
+        sample_hit[s] = waves[0].verts.size();
+        Vec3 normal { glm::normalize(rays.hits[s].normal) };
+        waves[0].verts.push_back(PathVertex { std::move(rays.hits[s]), normal, rays.origin[s], samples[begin + s] });
+    }
+
+    // Each wave's reflections make the next, until one has no reflections left to trace
+    for (unsigned int w = 0; w < waves.size(); w++)
+    {
+        trace_shadows(scene, settings, waves[w], rays);
+        shade_wave(scene, settings, waves[w], batch);
+        Wave next { trace_reflections(scene, settings, waves[w], rays) };
+        if (!next.verts.empty())
+            waves.push_back(std::move(next));
+    }
+
+    // Reflections' colours are needed before the colours of the hits they were reflected from
+    for (int w = (int)waves.size() - 1; w >= 0; w--)
+        sum_colors(scene, waves[w], (w + 1 < (int)waves.size()) ? &waves[w + 1] : nullptr);
+
+    for (int s = begin; s < end; s++)
+        out[sample_px[s]] += (sample_hit[s - begin] < 0) ? BACKGROUND_COLOUR : waves[0].colors[sample_hit[s - begin]];
+}
+
+
+
+void render_tile_wavefront(std::shared_ptr<Scene> scene, int width, int height, Tile tile,
+                            const RenderSettings &settings, Vec3 *out)
+{
+    const Camera &cam { *scene->camera };
+
+    // Calculate level of supersampling
+    int ssample_div { (settings.ssample_div < 1) ? 1 : settings.ssample_div };
+
+    // Camera rays, in the order render_tile fires them so each pixel sums its samples alike
+    RayQueue camera_rays;
+    std::vector<int> sample_px;
+    std::vector<SampleContext> samples;
+    for (int x = tile.x0; x < tile.x1; x++)
+    {
+        for (int y = tile.y0; y < tile.y1; y++)
+        {
+            for (int i = 0; i < ssample_div; i++)
+            {
+                for (int j = 0; j < ssample_div; j++)
+                {
+                    samples.push_back(SampleContext { settings.sampler, x, y, i * ssample_div + j, ssample_div * ssample_div, 0 });
+                    Vec2 offset { sample_2d(settings.sampler, x, y, samples.back().index, samples.back().count, PIXEL_DIMENSION) };
+                    camera_rays.add(cam.pos, camera_ray(cam, width, height, x, y, offset.x, offset.y));
+                    sample_px.push_back((y - tile.y0) * tile.width() + (x - tile.x0));
+                }
+            }
+        }
+    }
+
+    std::fill(out, out + tile.width() * tile.height(), Vec3 { 0.0 });
+    RayQueue rays;
+    HitBatch batch;
+    for (int begin = 0; begin < camera_rays.size(); begin += WAVE_SIZE)
+    {
+        int end { std::min(begin + WAVE_SIZE, camera_rays.size()) };
+        render_samples(scene, settings, camera_rays, sample_px, samples, begin, end, rays, batch, out);
+    }
+
+    // Average to account for supersampling
+    for (int p = 0; p < tile.width() * tile.height(); p++)
+        out[p] = out[p] / (float)(ssample_div * ssample_div);
+}
@@ -0,0 +1,55 @@
+#ifndef __WAVEFRONT_HPP
+#define __WAVEFRONT_HPP
+
+#include <memory>
+#include <vector>
+
+#include "objects.hpp"
+#include "raytracer.hpp"
+
+
+/* Rays waiting to be traced through a scene
+ * Rays are queued up by add and all traced at once by trace, which leaves what each ray hit
+ * (or NO_COLLISION) in hits, in the order they were added
+ */
+class RayQueue
+{
+public:
+    std::vector<Vec3> origin;
+    std::vector<Vec3> dir;
+    std::vector<Collision> hits;
+
+    void add(Vec3 origin, Vec3 dir);
+    void clear();
+    int size() const { return origin.size(); }
+
+    /* With sorted, rays are binned by the octant of their direction and the cell of a coarse grid
+     * over the queue their origin is in, and traced bin by bin with the cells in Morton order. Rays
+     * traced one after the other then start close together, head the same way and mostly visit the
+     * same nodes while they are still in cache. Shadow and reflection rays of a wave can leave the
+     * hits they start from in all directions, which this undoes
+     * The hits are the same either way
+     */
+    void trace(std::shared_ptr<Scene> scene, bool sorted = false);
+
+private:
+    // Bin of each ray and the rays in the order they are traced, for sorted traces
+    std::vector<int> bins;
+    std::vector<int> order;
+
+    void bin_rays();
+};
+
+
+/* Renders a single tile like render_tile, but breadth first
+ * Rather than following each camera ray through its shadows and reflections before firing the
+ * next, every camera ray of the tile is traced at once, then every shadow ray of their hits, then
+ * every reflection ray, whose hits make the next wave, and so on until no reflections are left.
+ * Each wave's hits are shaded together, grouped by material, with shade_phong. Colours are summed
+ * up from the last wave back to the camera in the same order compute_color sums them, so the tile
+ * is exactly the same as render_tile's
+ */
+void render_tile_wavefront(std::shared_ptr<Scene> scene, int width, int height, Tile tile,
+                            const RenderSettings &settings, Vec3 *out);
+
+#endif
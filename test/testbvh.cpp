@@ -0,0 +1,1058 @@
+#include <assert.h>
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include <glm/glm.hpp>
+
+#include "bvh.hpp"
+#include "bvh4.hpp"
+#include "grid.hpp"
+#include "kdtree.hpp"
+#include "objects.hpp"
+#include "raytracer.hpp"
+
+void test_aabb();
+void test_build();
+void test_parallel_build();
+void test_update();
+void test_bvh4();
+void test_spatial_splits();
+void test_kdtree();
+void test_grid();
+void test_scene_accel();
+void test_accelerators();
+
+int main()
+{
+    std::cout << "Testing AABB... ";
+    test_aabb();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing BVH::build()... ";
+    test_build();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing BVH::build() with SAH splits and a thread pool... ";
+    test_parallel_build();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing BVH::update()... ";
+    test_update();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing BVH4... ";
+    test_bvh4();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing BVH::build_spatial()... ";
+    test_spatial_splits();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing KDTree... ";
+    test_kdtree();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing Grid... ";
+    test_grid();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing Scene::build_accel()... ";
+    test_scene_accel();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing every AccelType against testing every primitive... ";
+    test_accelerators();
+    std::cout << "PASS" << std::endl;
+
+    return 0;
+}
+
+
+const float INF { std::numeric_limits<float>::infinity() };
+
+// Same as raytracer.cpp
+const float BIAS { 0.1f };
+
+
+// Unit boxes centred on random points in a cube of the given size
+std::vector<AABB> random_boxes(std::mt19937 &rng, int n, float size)
+{
+    std::uniform_real_distribution<float> pos { -size / 2.0f, size / 2.0f };
+    std::vector<AABB> boxes;
+    for (int i = 0; i < n; i++)
+    {
+        Vec3 c { pos(rng), pos(rng), pos(rng) };
+        boxes.push_back(AABB { c - Vec3 { 0.5 }, c + Vec3 { 0.5 } });
+    }
+    return boxes;
+}
+
+
+// Checks the tree's structure and that every primitive is in exactly one leaf
+void check_tree(const BVH &bvh, const std::vector<AABB> &boxes)
+{
+    std::vector<int> seen(boxes.size(), 0);
+    std::vector<int> stack { 0 };
+    while (!stack.empty())
+    {
+        int n { stack.back() };
+        stack.pop_back();
+        const BVHNode &node { bvh.nodes[n] };
+
+        if (node.count > 0)
+        {
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                seen[bvh.indices[i]]++;
+                const AABB &b { boxes[bvh.indices[i]] };
+                assert (glm::all(glm::lessThanEqual(node.bounds.min, b.min)));
+                assert (glm::all(glm::greaterThanEqual(node.bounds.max, b.max)));
+            }
+        }
+        else
+        {
+            for (int c = node.first; c < node.first + 2; c++)
+            {
+                // Children come after their parent so a reverse sweep can refit the tree
+                assert (c > n);
+                assert (glm::all(glm::lessThanEqual(node.bounds.min, bvh.nodes[c].bounds.min)));
+                assert (glm::all(glm::greaterThanEqual(node.bounds.max, bvh.nodes[c].bounds.max)));
+                stack.push_back(c);
+            }
+        }
+    }
+
+    for (int s : seen)
+        assert (s == 1);
+}
+
+
+// Every primitive whose box a ray hits must be visited exactly once
+template <typename Tree>
+void check_traversal(const Tree &bvh, const std::vector<AABB> &boxes, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    for (int r = 0; r < 200; r++)
+    {
+        Vec3 p0 { unit(rng) * 60.0f, unit(rng) * 60.0f, unit(rng) * 60.0f };
+        Vec3 d { glm::normalize(Vec3 { unit(rng), unit(rng), unit(rng) }) };
+        Vec3 inv_d { safe_inverse(d) };
+
+        std::vector<int> expected, visited;
+        float t_min, t_max;
+        for (unsigned int i = 0; i < boxes.size(); i++)
+        {
+            if (boxes[i].hit_range(p0, inv_d, t_min, t_max))
+                expected.push_back(i);
+        }
+
+        bvh.traverse(p0, d, INF, [&visited](int prim, float t_min, float t_max)
+        {
+            visited.push_back(prim);
+            return INF;
+        });
+
+        std::sort(visited.begin(), visited.end());
+        assert (visited == expected);
+    }
+}
+
+
+void test_aabb()
+{
+    AABB b;
+    assert (b.empty());
+    assert (b.area() == 0.0f);
+
+    b.grow(Vec3 { 0.0 });
+    b.grow(Vec3 { 1.0, 2.0, 3.0 });
+    assert (!b.empty());
+    assert (b.is_finite());
+    assert (b.centroid() == (Vec3 { 0.5, 1.0, 1.5 }));
+    assert (b.area() == 22.0f);
+
+    AABB inf { Vec3 { -INF }, Vec3 { INF } };
+    assert (!inf.is_finite());
+
+    // Ray through the box along z
+    float t_min, t_max;
+    Vec3 p0 { 0.5, 1.0, 10.0 };
+    Vec3 d { 0.0, 0.0, -1.0 };
+    assert (b.hit_range(p0, safe_inverse(d), t_min, t_max));
+    assert (t_min <= 7.0f && t_min > 6.9f);
+    assert (t_max >= 10.0f && t_max < 10.1f);
+
+    // Pointing away from the box, and past it
+    assert (!b.hit_range(p0, safe_inverse(-d), t_min, t_max));
+    assert (!b.hit_range(Vec3 { 5.0, 1.0, 10.0 }, safe_inverse(d), t_min, t_max));
+
+    // Starting inside the box
+    assert (b.hit_range(Vec3 { 0.5 }, safe_inverse(d), t_min, t_max));
+    assert (t_min == 0.0f);
+
+    // Padding grows the box in every direction
+    AABB padded { b };
+    padded.pad();
+    assert (glm::all(glm::lessThan(padded.min, b.min)));
+    assert (glm::all(glm::greaterThan(padded.max, b.max)));
+}
+
+
+void test_build()
+{
+    std::mt19937 rng { 1 };
+
+    // Empty tree
+    BVH empty;
+    empty.build(std::vector<AABB> {});
+    assert (empty.nodes.empty());
+    bool visited { false };
+    empty.traverse(Vec3 { 0.0 }, Vec3 { 0.0, 0.0, -1.0 }, INF,
+        [&visited](int prim, float t_min, float t_max) { visited = true; return t_max; });
+    assert (!visited);
+
+    // Small enough to be a single leaf
+    std::vector<AABB> boxes { random_boxes(rng, 3, 10.0f) };
+    BVH bvh;
+    bvh.build(boxes);
+    assert (bvh.nodes.size() == 1);
+    assert (bvh.size() == 3);
+    check_tree(bvh, boxes);
+
+    boxes = random_boxes(rng, 1000, 100.0f);
+    bvh.build(boxes);
+    assert (bvh.size() == 1000);
+    check_tree(bvh, boxes);
+    check_traversal(bvh, boxes, rng);
+    assert (bvh.sah_cost() > 0.0f);
+}
+
+
+void test_parallel_build()
+{
+    std::mt19937 rng { 3 };
+
+    // Most boxes packed into one corner, where median splits waste their effort
+    std::vector<AABB> boxes { random_boxes(rng, 20000, 1000.0f) };
+    for (AABB &b : random_boxes(rng, 80000, 50.0f))
+        boxes.push_back(AABB { b.min + Vec3 { 400.0f }, b.max + Vec3 { 400.0f } });
+
+    BVH median, sah;
+    median.build(boxes, BVHSplit::Median);
+    sah.build(boxes, BVHSplit::SAH);
+    check_tree(sah, boxes);
+    check_traversal(sah, boxes, rng);
+    assert (sah.sah_cost() < median.sah_cost());
+
+    // Threads only change the order of the nodes, the tree is the same
+    ThreadPool pool { 4 };
+    for (BVHSplit split : { BVHSplit::Median, BVHSplit::SAH })
+    {
+        const BVH &serial { (split == BVHSplit::SAH) ? sah : median };
+        BVH parallel;
+        parallel.build(boxes, split, &pool);
+        check_tree(parallel, boxes);
+        assert (parallel.nodes.size() == serial.nodes.size());
+        assert (parallel.indices == serial.indices);
+        assert (parallel.sah_cost() == serial.sah_cost());
+    }
+
+    // Partial rebuilds keep splitting by SAH
+    Vec3 c { -boxes[0].centroid() };
+    boxes[0] = AABB { c - Vec3 { 0.5 }, c + Vec3 { 0.5 } };
+    sah.update(boxes);
+    check_tree(sah, boxes);
+    check_traversal(sah, boxes, rng);
+}
+
+
+void test_update()
+{
+    std::mt19937 rng { 2 };
+    std::vector<AABB> boxes { random_boxes(rng, 1000, 100.0f) };
+    BVH bvh;
+    bvh.build(boxes);
+
+    // Small movements are refitted
+    std::uniform_real_distribution<float> jitter { -0.2f, 0.2f };
+    for (AABB &b : boxes)
+    {
+        Vec3 offset { jitter(rng), jitter(rng), jitter(rng) };
+        b = AABB { b.min + offset, b.max + offset };
+    }
+    std::vector<BVHNode> before { bvh.nodes };
+    assert (bvh.update(boxes) == BVHUpdate::Refit);
+    assert (bvh.nodes.size() == before.size());
+    check_tree(bvh, boxes);
+    check_traversal(bvh, boxes, rng);
+
+    // Moving one primitive across the scene loosens its side of the tree, which is rebuilt
+    int leaf { 0 };
+    while (bvh.nodes[leaf].count == 0)
+        leaf = bvh.nodes[leaf].first;
+    int moved { bvh.indices[bvh.nodes[leaf].first] };
+    Vec3 c { -boxes[moved].centroid() };
+    boxes[moved] = AABB { c - Vec3 { 0.5 }, c + Vec3 { 0.5 } };
+
+    assert (bvh.update(boxes) == BVHUpdate::PartialRebuild);
+    check_tree(bvh, boxes);
+    check_traversal(bvh, boxes, rng);
+
+    // Scrambling every primitive ruins the whole tree
+    std::shuffle(boxes.begin(), boxes.end(), rng);
+    assert (bvh.update(boxes) == BVHUpdate::FullRebuild);
+    check_tree(bvh, boxes);
+    check_traversal(bvh, boxes, rng);
+
+    // So does changing the number of primitives
+    boxes.pop_back();
+    assert (bvh.update(boxes) == BVHUpdate::FullRebuild);
+    check_tree(bvh, boxes);
+}
+
+
+void test_bvh4()
+{
+    std::mt19937 rng { 4 };
+
+    BVH bvh;
+    BVH4 bvh4;
+    bvh.build(std::vector<AABB> {});
+    bvh4.build(bvh);
+    assert (bvh4.nodes.empty());
+
+    // A single leaf needs no nodes at all
+    std::vector<AABB> boxes { random_boxes(rng, 3, 10.0f) };
+    bvh.build(boxes);
+    bvh4.build(bvh);
+    assert (bvh4.nodes.empty());
+    assert (bvh4.leaf_bounds.size() == 3);
+    check_traversal(bvh4, boxes, rng);
+
+    // Quantized bounds must never lose a primitive, even far from the origin
+    for (float offset : { 0.0f, 10000.0f })
+    {
+        boxes = random_boxes(rng, 2000, 100.0f);
+        for (AABB &b : boxes)
+            b = AABB { b.min + Vec3 { offset }, b.max + Vec3 { offset } };
+
+        bvh.build(boxes);
+        bvh4.build(bvh);
+        assert (bvh4.nodes.size() < bvh.nodes.size() / 2);
+        check_traversal(bvh4, boxes, rng);
+    }
+
+    // SIMD and scalar child tests agree exactly
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    for (int r = 0; r < 100; r++)
+    {
+        Vec3 p0 { unit(rng) * 60.0f + 10000.0f, unit(rng) * 60.0f + 10000.0f, unit(rng) * 60.0f + 10000.0f };
+        Vec3 inv_d { safe_inverse(Vec3 { unit(rng), unit(rng), unit(rng) }) };
+        float t_max { (r % 2) ? INF : 50.0f };
+
+        for (const BVH4Node &node : bvh4.nodes)
+        {
+            float enter[4], enter_scalar[4];
+            int mask { BVH4::intersect_children(node, p0, inv_d, t_max, enter) };
+            assert (mask == BVH4::intersect_children_scalar(node, p0, inv_d, t_max, enter_scalar));
+            for (int i = 0; i < node.num_children; i++)
+                assert (enter[i] == enter_scalar[i]);
+        }
+    }
+
+    // Refitting the binary tree and collapsing it again keeps up with moving primitives
+    for (AABB &b : boxes)
+        b = AABB { b.min + Vec3 { 1.0, 0.0, 0.0 }, b.max + Vec3 { 1.0, 0.0, 0.0 } };
+    bvh.update(boxes);
+    bvh4.build(bvh);
+    check_traversal(bvh4, boxes, rng);
+}
+
+
+/* fire_ray as it was before scenes had an acceleration structure: every object is tested and
+ * its hit taken as is, without checking it against the object's bounds
+ */
+Collision exhaustive_fire_ray(Vec3 p0, Vec3 d, std::shared_ptr<Scene> scene)
+{
+    float t { INF };
+    int closest { -1 };
+    for (unsigned int i = 0; i < scene->objects.size(); i++)
+    {
+        float t_candidate { scene->objects[i]->check_collision(p0, d) };
+        if (t_candidate - BIAS > 0.0 && t_candidate < t && (t_candidate - t) < BIAS)
+        {
+            t = t_candidate;
+            closest = i;
+        }
+    }
+
+    if (closest < 0)
+        return NO_COLLISION;
+
+    return Collision { scene->objects[closest], p0 + d * t };
+}
+
+
+// Renders the whole image as one tile, through whatever acceleration structure the scene has
+// Bounds of the part of the segment a-b inside box (Liang-Barsky)
+AABB clip_segment(Vec3 a, Vec3 b, const AABB &box)
+{
+    float t0 { 0.0f }, t1 { 1.0f };
+    Vec3 d { b - a };
+    for (int i = 0; i < 3; i++)
+    {
+        if (d[i] == 0.0f)
+        {
+            if (a[i] < box.min[i] || a[i] > box.max[i])
+                return AABB {};
+            continue;
+        }
+
+        float near { (box.min[i] - a[i]) / d[i] }, far { (box.max[i] - a[i]) / d[i] };
+        if (near > far)
+            std::swap(near, far);
+        t0 = std::max(t0, near);
+        t1 = std::min(t1, far);
+    }
+
+    if (t0 > t1)
+        return AABB {};
+
+    AABB bounds;
+    bounds.grow(a + d * t0);
+    bounds.grow(a + d * t1);
+    return bounds.overlap(box);
+}
+
+
+// Long thin triangles crossing a box of the given size diagonally, like the beams of a building
+std::vector<Vec3> sliver_triangles(std::mt19937 &rng, int n, float size)
+{
+    std::uniform_real_distribution<float> pos { -size / 2.0f, size / 2.0f };
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    std::vector<Vec3> vertices;
+    for (int i = 0; i < n; i++)
+    {
+        Vec3 a { pos(rng), pos(rng), pos(rng) };
+        Vec3 along { glm::normalize(Vec3 { 1.0f, 1.0f, 0.3f } + Vec3 { unit(rng), unit(rng), unit(rng) } * 0.2f) };
+        vertices.push_back(a);
+        vertices.push_back(a + along * size * 0.5f);
+        vertices.push_back(a + Vec3 { unit(rng), unit(rng), unit(rng) } * 0.05f);
+    }
+    return vertices;
+}
+
+
+void test_spatial_splits()
+{
+    // Short needles with a few long ones criss-crossing the whole scene, whose boxes no object split can keep out of the way
+    std::mt19937 rng { 11 };
+    std::uniform_real_distribution<float> pos { -50.0f, 50.0f };
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    const int NUM_NEEDLES { 2000 };
+    std::vector<Vec3> ends;
+    std::vector<AABB> boxes;
+    for (int i = 0; i < NUM_NEEDLES; i++)
+    {
+        Vec3 a { pos(rng), pos(rng), pos(rng) };
+        float length { (i % 10 == 0) ? 80.0f : 2.0f };
+        Vec3 b { a + glm::normalize(Vec3 { unit(rng), unit(rng), unit(rng) }) * length };
+        ends.push_back(a);
+        ends.push_back(b);
+
+        AABB box;
+        box.grow(a);
+        box.grow(b);
+        box.pad();
+        boxes.push_back(box);
+    }
+    auto clip = [&ends](int prim, const AABB &box) { return clip_segment(ends[2 * prim], ends[2 * prim + 1], box); };
+
+    BVH object_split, spatial;
+    object_split.build(boxes, BVHSplit::SAH);
+    spatial.build_spatial(boxes, clip);
+    assert (spatial.size() == NUM_NEEDLES);
+
+    // Some needles were split, within the default budget, and the tree is tighter for it
+    SpatialSplitOptions defaults;
+    assert ((int)spatial.indices.size() > NUM_NEEDLES);
+    assert (spatial.indices.size() <= NUM_NEEDLES * (1.0f + defaults.max_duplication));
+    assert (spatial.leaf_bounds.size() == spatial.indices.size());
+    assert (spatial.sah_cost() < object_split.sah_cost() * 0.9f);
+
+    // Every reference is inside its leaf and its primitive's bounds, and is the only one of its primitive in that leaf
+    std::vector<std::vector<AABB>> parts(NUM_NEEDLES);
+    std::vector<int> stack { 0 };
+    while (!stack.empty())
+    {
+        int n { stack.back() };
+        stack.pop_back();
+        const BVHNode &node { spatial.nodes[n] };
+        if (node.count == 0)
+        {
+            assert (node.first > n);
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+            continue;
+        }
+
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            const AABB &b { spatial.leaf_bounds[i] };
+            int prim { spatial.indices[i] };
+            assert (glm::all(glm::lessThanEqual(node.bounds.min, b.min)));
+            assert (glm::all(glm::greaterThanEqual(node.bounds.max, b.max)));
+            assert (glm::all(glm::lessThanEqual(boxes[prim].min, b.min)));
+            assert (glm::all(glm::greaterThanEqual(boxes[prim].max, b.max)));
+            for (int j = node.first; j < i; j++)
+                assert (spatial.indices[j] != prim);
+            parts[prim].push_back(b);
+        }
+    }
+
+    // Between them the references of a needle cover all of it
+    for (int prim = 0; prim < NUM_NEEDLES; prim++)
+    {
+        assert (!parts[prim].empty());
+        for (int k = 0; k <= 20; k++)
+        {
+            Vec3 p { glm::mix(ends[2 * prim], ends[2 * prim + 1], k / 20.0f) };
+            bool covered { false };
+            for (const AABB &b : parts[prim])
+            {
+                covered = covered || (glm::all(glm::lessThanEqual(b.min, p)) &&
+                                        glm::all(glm::greaterThanEqual(b.max, p)));
+            }
+            assert (covered);
+        }
+    }
+
+    // Without a budget the tree has no room for spatial splits
+    SpatialSplitOptions no_budget;
+    no_budget.max_duplication = 0.0f;
+    spatial.build_spatial(boxes, clip, no_budget);
+    assert ((int)spatial.indices.size() == NUM_NEEDLES);
+
+    // A mesh of slivers finds the same hits through an SBVH, testing fewer triangles per ray
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    std::shared_ptr<Mesh> mesh { std::make_shared<Mesh>(sliver_triangles(rng, 3000, 40.0f), 0) };
+    mesh->translate(Vec3 { 0.0, 0.0, -60.0 });
+    scene->objects.push_back(mesh);
+
+    std::vector<Vec3> dirs;
+    for (int r = 0; r < 2000; r++)
+        dirs.push_back(glm::normalize(Vec3 { unit(rng) * 0.4f, unit(rng) * 0.4f, -1.0f }));
+
+    auto trace = [&](AccelType type, uint64_t &tested)
+    {
+        scene->build_accel(type);
+        traversal_stats = TraversalStats { 0, 0, 0 };
+        std::vector<Collision> hits;
+        for (Vec3 d : dirs)
+            hits.push_back(fire_ray(Vec3 { 0.0 }, d, scene));
+        tested = traversal_stats.prims_tested;
+        return hits;
+    };
+
+    uint64_t bvh_tested, sbvh_tested;
+    std::vector<Collision> expected { trace(AccelType::BVH, bvh_tested) };
+    assert (trace(AccelType::SBVH, sbvh_tested) == expected);
+    assert (sbvh_tested < bvh_tested);
+    assert (parse_accel("sbvh") == AccelType::SBVH);
+
+    int num_hits { 0 };
+    for (const Collision &col : expected)
+        num_hits += !(col == NO_COLLISION);
+    assert (num_hits > 100);
+
+    // Moving the mesh rebuilds its SBVH rather than loosening it to whole triangles
+    mesh->translate(Vec3 { 1.0, 0.0, 0.0 });
+    scene->update_accel({ 0 });
+    std::vector<Collision> moved { trace(AccelType::SBVH, sbvh_tested) };
+    assert (moved == trace(AccelType::BVH, bvh_tested));
+    assert (!(moved == expected));
+}
+
+
+void test_kdtree()
+{
+    std::mt19937 rng { 13 };
+    std::vector<AABB> boxes { random_boxes(rng, 2000, 100.0f) };
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    for (int i = 0; i < 50; i++)
+    {
+        AABB &b { boxes[i] };
+        b.max += Vec3 { 40.0f * (unit(rng) + 1.0f), 0.0f, 0.0f };
+    }
+
+    KDTree kdtree;
+    kdtree.build(boxes);
+    assert (kdtree.nodes.size() > 1 && !kdtree.leaves.empty());
+
+    // Walk down from the root, working out the box of every node
+    std::vector<AABB> node_box(kdtree.nodes.size());
+    node_box[0] = kdtree.bounds;
+    float leaf_volume { 0.0f };
+    for (unsigned int n = 0; n < kdtree.nodes.size(); n++)
+    {
+        const KDNode &node { kdtree.nodes[n] };
+        const AABB &box { node_box[n] };
+        if (node.axis == 3)
+        {
+            // Leaves know their own box and reference every primitive that overlaps it
+            const KDLeaf &leaf { kdtree.leaves[node.child] };
+            assert (leaf.bounds.min == box.min && leaf.bounds.max == box.max);
+            Vec3 e { box.max - box.min };
+            leaf_volume += e.x * e.y * e.z;
+
+            std::vector<int> expected, held(kdtree.indices.begin() + leaf.first,
+                                            kdtree.indices.begin() + leaf.first + leaf.count);
+            for (unsigned int i = 0; i < boxes.size(); i++)
+            {
+                if (!boxes[i].overlap(box).empty())
+                    expected.push_back(i);
+            }
+            std::sort(held.begin(), held.end());
+            assert (held == expected);
+            continue;
+        }
+
+        assert (node.child > (int)n + 1);
+        assert (node.split >= box.min[node.axis] && node.split <= box.max[node.axis]);
+        node_box[n + 1] = box;
+        node_box[n + 1].max[node.axis] = node.split;
+        node_box[node.child] = box;
+        node_box[node.child].min[node.axis] = node.split;
+    }
+
+    // Leaves don't overlap and fill the root
+    Vec3 e { kdtree.bounds.max - kdtree.bounds.min };
+    assert (fabs(leaf_volume - e.x * e.y * e.z) < e.x * e.y * e.z * 1e-3f);
+
+    // Every rope leads to the node just across the face, which covers all of it
+    for (const KDLeaf &leaf : kdtree.leaves)
+    {
+        for (int face = 0; face < 6; face++)
+        {
+            int axis { face / 2 }, side { face % 2 };
+            float plane { side ? leaf.bounds.max[axis] : leaf.bounds.min[axis] };
+            int r { leaf.ropes[face] };
+            if (r < 0)
+            {
+                assert (plane == (side ? kdtree.bounds.max[axis] : kdtree.bounds.min[axis]));
+                continue;
+            }
+
+            const AABB &box { node_box[r] };
+            assert ((side ? box.min[axis] : box.max[axis]) == plane);
+            for (int other = 0; other < 3; other++)
+            {
+                if (other == axis)
+                    continue;
+                assert (box.min[other] <= leaf.bounds.min[other] && box.max[other] >= leaf.bounds.max[other]);
+            }
+        }
+    }
+
+    /* Traversal visits every primitive a ray passes through, however many leaves it's in
+     * Every other ray runs along an axis, where the zero components of d must still leave
+     * each leaf by the right face
+     */
+    for (int r = 0; r < 400; r++)
+    {
+        Vec3 p0 { unit(rng) * 60.0f, unit(rng) * 60.0f, unit(rng) * 60.0f };
+        Vec3 d { glm::normalize(Vec3 { unit(rng), unit(rng), unit(rng) }) };
+        if (r % 2)
+        {
+            d = Vec3 { 0.0 };
+            d[r % 3] = (unit(rng) < 0.0f) ? -1.0f : 1.0f;
+        }
+        Vec3 inv_d { safe_inverse(d) };
+
+        std::vector<int> expected, visited;
+        float t_min, t_max;
+        for (unsigned int i = 0; i < boxes.size(); i++)
+        {
+            if (boxes[i].hit_range(p0, inv_d, t_min, t_max))
+                expected.push_back(i);
+        }
+
+        kdtree.traverse(p0, d, INF, [&](int prim, float t_min, float t_max)
+        {
+            float lo, hi;
+            assert (boxes[prim].hit_range(p0, inv_d, lo, hi) && t_min >= lo && t_max <= hi);
+            visited.push_back(prim);
+            return INF;
+        });
+
+        std::sort(visited.begin(), visited.end());
+        visited.erase(std::unique(visited.begin(), visited.end()), visited.end());
+        assert (visited == expected);
+    }
+
+    // No split is worth making over a handful of primitives
+    kdtree.build(std::vector<AABB>(boxes.begin(), boxes.begin() + 2));
+    assert (kdtree.nodes.size() == 1 && kdtree.leaves.size() == 1 && kdtree.leaves[0].count == 2);
+    kdtree.build({});
+    assert (kdtree.nodes.empty());
+    kdtree.traverse(Vec3 { 0.0 }, Vec3 { 1.0, 0.0, 0.0 }, INF, [](int prim, float t_min, float t_max)
+    {
+        assert (false);
+        return INF;
+    });
+}
+
+
+void test_grid()
+{
+    std::mt19937 rng { 19 };
+    std::vector<AABB> boxes { random_boxes(rng, 5000, 100.0f) };
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    for (int i = 0; i < 20; i++)
+        boxes[i].max += Vec3 { 30.0f * (unit(rng) + 1.0f), 0.0f, 0.0f };
+
+    Grid grid;
+    grid.build(boxes);
+    assert (grid.size() == 5000);
+    int num_cells { grid.res[0] * grid.res[1] * grid.res[2] };
+    assert (num_cells > 1000 && (int)grid.cell_start.size() == num_cells + 1);
+
+    // Every cell lists exactly the primitives overlapping it, in order
+    for (int z = 0; z < grid.res[2]; z++)
+    {
+        for (int y = 0; y < grid.res[1]; y++)
+        {
+            for (int x = 0; x < grid.res[0]; x++)
+            {
+                int c { x + grid.res[0] * (y + grid.res[1] * z) };
+                Vec3 lo { grid.bounds.min + Vec3 { x, y, z } * grid.cell_size };
+                AABB cell { lo, lo + grid.cell_size };
+
+                std::vector<int> held(grid.indices.begin() + grid.cell_start[c],
+                                      grid.indices.begin() + grid.cell_start[c + 1]);
+                assert (std::is_sorted(held.begin(), held.end()));
+                for (int prim : held)
+                    assert (!boxes[prim].overlap(cell).empty() || boxes[prim].overlap(cell).area() == 0.0f);
+
+                // Boxes overlapping a cell by a margin are certainly in it
+                cell.min += grid.cell_size * 0.01f;
+                cell.max -= grid.cell_size * 0.01f;
+                for (unsigned int i = 0; i < boxes.size(); i++)
+                {
+                    if (!boxes[i].overlap(cell).empty())
+                        assert (std::binary_search(held.begin(), held.end(), (int)i));
+                }
+            }
+        }
+    }
+
+    // Building from a function gives the same cells without keeping the bounds
+    Grid from_function;
+    from_function.build(boxes.size(), [&boxes](int prim) { return boxes[prim]; });
+    assert (from_function.size() == 5000 && from_function.prim_bounds.empty());
+    assert (from_function.cell_start == grid.cell_start && from_function.indices == grid.indices);
+
+    // Building on a thread pool gives the same grid
+    ThreadPool pool { 4 };
+    std::vector<AABB> many { random_boxes(rng, 50000, 200.0f) };
+    Grid serial, parallel;
+    serial.build(many);
+    parallel.build(many, &pool);
+    assert (parallel.cell_start == serial.cell_start && parallel.indices == serial.indices);
+
+    // Traversal visits every primitive a ray passes through, including along the axes
+    for (int r = 0; r < 400; r++)
+    {
+        Vec3 p0 { unit(rng) * 60.0f, unit(rng) * 60.0f, unit(rng) * 60.0f };
+        Vec3 d { glm::normalize(Vec3 { unit(rng), unit(rng), unit(rng) }) };
+        if (r % 2)
+        {
+            d = Vec3 { 0.0 };
+            d[r % 3] = (unit(rng) < 0.0f) ? -1.0f : 1.0f;
+        }
+        Vec3 inv_d { safe_inverse(d) };
+
+        std::vector<int> expected, visited;
+        float t_min, t_max;
+        for (unsigned int i = 0; i < boxes.size(); i++)
+        {
+            if (boxes[i].hit_range(p0, inv_d, t_min, t_max))
+                expected.push_back(i);
+        }
+
+        grid.traverse(p0, d, INF, [&](int prim, float t_min, float t_max)
+        {
+            visited.push_back(prim);
+            return INF;
+        });
+
+        std::sort(visited.begin(), visited.end());
+        visited.erase(std::unique(visited.begin(), visited.end()), visited.end());
+        assert (visited == expected);
+
+        // Without bounds the grid passes on everything in the cells, the whole range for each
+        std::vector<int> passed;
+        from_function.traverse(p0, d, INF, [&](int prim, float t_min, float t_max)
+        {
+            assert (t_min == 0.0f && t_max == INF);
+            passed.push_back(prim);
+            return INF;
+        });
+        std::sort(passed.begin(), passed.end());
+        assert (std::includes(passed.begin(), passed.end(), expected.begin(), expected.end()));
+    }
+
+    grid.build({});
+    assert (grid.cell_start.empty());
+    grid.traverse(Vec3 { 0.0 }, Vec3 { 1.0, 0.0, 0.0 }, INF, [](int prim, float t_min, float t_max)
+    {
+        assert (false);
+        return INF;
+    });
+
+    // Auto picks the grid for an even field of many spheres, not for few or clustered ones
+    auto sphere_scene = [&](int n, float size, bool clustered)
+    {
+        std::uniform_real_distribution<float> pos { -size / 2.0f, size / 2.0f };
+        std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+        for (int i = 0; i < n; i++)
+        {
+            Vec3 c { pos(rng), pos(rng), pos(rng) };
+            if (clustered)
+                c = (i % 2) ? c * 0.01f : c + Vec3 { size };
+            scene->objects.push_back(std::make_shared<Sphere>(c, 1.0f, 0));
+        }
+        return scene;
+    };
+
+    std::shared_ptr<Scene> field { sphere_scene(20000, 500.0f, false) };
+    assert (field->choose_accel() == AccelType::Grid);
+    field->build_accel(AccelType::Auto);
+    assert (field->accel_type == AccelType::Grid && field->accel_ready());
+    assert (field->grid.size() == 20000 && field->bvh.nodes.empty());
+
+    // Moving an object rebuilds the grid around it
+    field->objects[0]->translate(Vec3 { 2000.0, 0.0, 0.0 });
+    assert (field->update_accel({ 0 }) == BVHUpdate::FullRebuild);
+    assert (field->grid.bounds.max.x > 1500.0f);
+
+    assert (sphere_scene(100, 50.0f, false)->choose_accel() == AccelType::BVH);
+    assert (sphere_scene(20000, 500.0f, true)->choose_accel() == AccelType::BVH);
+
+    // One huge sphere among the small ones is better left to the BVH
+    field->objects.push_back(std::make_shared<Sphere>(Vec3 { 0.0 }, 100.0f, 0));
+    assert (field->choose_accel() == AccelType::BVH);
+}
+
+
+std::vector<Vec3> render_pixels(std::shared_ptr<Scene> scene, const RenderSettings &settings)
+{
+    int width, height;
+    image_size(scene->camera, width, height);
+
+    std::vector<Vec3> px(width * height);
+    render_tile(scene, width, height, Tile { 0, 0, width, height }, settings, px.data());
+    return px;
+}
+
+
+void test_scene_accel()
+{
+    std::mt19937 rng { 3 };
+    std::uniform_real_distribution<float> pos { -20.0f, 20.0f };
+
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    int white { scene->materials.add(Material { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 1.0f }) };
+    for (int i = 0; i < 200; i++)
+    {
+        scene->objects.push_back(std::make_shared<Sphere>(
+            Vec3 { pos(rng), pos(rng), pos(rng) - 60.0f }, 1.0f, white));
+    }
+    scene->objects.push_back(std::make_shared<Plane>(
+        Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -25.0, 0.0 }, white));
+
+    // Without an acceleration structure every object is tested
+    std::shared_ptr<Scene> brute { std::make_shared<Scene>() };
+    brute->objects = scene->objects;
+    brute->materials = scene->materials;
+
+    assert (!scene->accel_ready());
+    scene->build_accel();
+    assert (scene->accel_ready());
+    assert (scene->bvh.size() == 200);
+    assert (scene->unbounded_objects.size() == 1 && scene->unbounded_objects[0] == 200);
+
+    /* Camera rays and the rays compute_color fires from where they hit: towards a light, and
+     * that direction reflected about the normal. Both must find what testing every object finds,
+     * except from far along the plane where the old loop also took hits that cancellation in
+     * Sphere::check_collision put well off the sphere
+     */
+    const float FAR_FIELD { 1000.0f };
+    Vec3 light { 10.0, 30.0, -20.0 };
+    auto check_rays = [&]()
+    {
+        std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+        for (int r = 0; r < 2000; r++)
+        {
+            Vec3 d { glm::normalize(Vec3 { unit(rng) * 0.5f, unit(rng) * 0.5f, -1.0f }) };
+            Collision col { fire_ray(Vec3 { 0.0 }, d, scene) };
+            assert (col == fire_ray(Vec3 { 0.0 }, d, brute));
+            assert (col == exhaustive_fire_ray(Vec3 { 0.0 }, d, scene));
+            if (col == NO_COLLISION)
+                continue;
+
+            Vec3 normal { glm::normalize(col.obj->get_normal(col.coord)) };
+            Vec3 l { light - col.coord };
+            for (Vec3 secondary : { glm::normalize(l), glm::normalize(glm::reflect(l, normal)) })
+            {
+                Collision next { fire_ray(col.coord, secondary, scene) };
+                assert (next == fire_ray(col.coord, secondary, brute));
+                if (glm::length(col.coord) < FAR_FIELD)
+                    assert (next == exhaustive_fire_ray(col.coord, secondary, scene));
+            }
+        }
+    };
+    check_rays();
+
+    // The BVH4 finds the same hits
+    scene->build_accel(AccelType::BVH4);
+    assert (scene->accel_type == AccelType::BVH4 && !scene->bvh4.nodes.empty());
+    check_rays();
+
+    // Move a sphere onto the camera's view axis, the BVH finds it once updated
+    std::shared_ptr<Object> sphere { scene->objects[10] };
+    sphere->translate(Vec3 { 0.0, 0.0, -30.0 } - (sphere->bounds().centroid()));
+    assert (scene->update_accel({ 10 }) != BVHUpdate::FullRebuild);
+
+    Collision col { fire_ray(Vec3 { 0.0 }, Vec3 { 0.0, 0.0, -1.0 }, scene) };
+    assert (col.obj == sphere);
+    assert (fabs(col.coord.z + 29.0f) < 0.01f);
+    check_rays();
+
+    // Which also keeps up with moving objects
+    scene->build_accel(AccelType::BVH4);
+    sphere->translate(Vec3 { 0.0, 0.0, -5.0 });
+    scene->update_accel({ 10 });
+    col = fire_ray(Vec3 { 0.0 }, Vec3 { 0.0, 0.0, -1.0 }, scene);
+    assert (col.obj == sphere);
+    assert (fabs(col.coord.z + 34.0f) < 0.01f);
+    check_rays();
+
+    assert (parse_accel("bvh") == AccelType::BVH);
+    assert (parse_accel("bvh4") == AccelType::BVH4);
+    assert (parse_accel("kdtree") == AccelType::KDTree);
+    assert (parse_accel("grid") == AccelType::Grid);
+    assert (parse_accel("auto") == AccelType::Auto);
+    bool parse_failed { false };
+    try { parse_accel("octree"); }
+    catch (const std::invalid_argument &e){ parse_failed = true; }
+    assert (parse_failed);
+
+    // Renders with reflections and soft shadows don't depend on how rays are traced either
+    scene->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 100, 1.0f);
+    scene->lights.push_back(std::make_shared<Light>(light, Vec3 { 0.2 }, Vec3 { 0.5 }, Vec3 { 0.5 }));
+    brute->camera = scene->camera;
+    brute->lights = scene->lights;
+
+    RenderSettings settings { 2, 1, 3 };
+    std::vector<Vec3> expected { render_pixels(brute, settings) };
+    assert (!brute->accel_ready());
+    scene->build_accel(AccelType::BVH);
+    assert (render_pixels(scene, settings) == expected);
+    scene->build_accel(AccelType::BVH4);
+    assert (render_pixels(scene, settings) == expected);
+
+    // Adding an object makes the BVH stale until it is rebuilt
+    scene->objects.push_back(sphere);
+    assert (!scene->accel_ready());
+    scene->objects.pop_back();
+    assert (scene->accel_ready());
+}
+
+
+
+/* Every acceleration structure must find the same closest hit as testing every primitive
+ * The mesh's triangles are also added to the reference scene one Mesh each, so that
+ * scene has nothing to accelerate
+ */
+void test_accelerators()
+{
+    const std::vector<AccelType> ACCELS {
+        AccelType::BVH, AccelType::BVH4, AccelType::SBVH, AccelType::KDTree, AccelType::Grid
+    };
+
+    std::mt19937 rng { 17 };
+    std::uniform_real_distribution<float> pos { -20.0f, 20.0f };
+    std::shared_ptr<Scene> scene { std::make_shared<Scene>() };
+    std::shared_ptr<Scene> brute { std::make_shared<Scene>() };
+
+    for (int i = 0; i < 100; i++)
+    {
+        scene->objects.push_back(std::make_shared<Sphere>(
+            Vec3 { pos(rng), pos(rng), pos(rng) - 60.0f }, 1.0f, 0));
+    }
+    scene->objects.push_back(std::make_shared<Plane>(
+        Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -25.0, 0.0 }, 0));
+    brute->objects = scene->objects;
+
+    // Slivers mixed with small triangles, so spatial splits and perfect splits both have work to do
+    std::vector<Vec3> vertices { sliver_triangles(rng, 300, 40.0f) };
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    for (int i = 0; i < 1500; i++)
+    {
+        Vec3 c { pos(rng), pos(rng), pos(rng) };
+        for (int v = 0; v < 3; v++)
+            vertices.push_back(c + Vec3 { unit(rng), unit(rng), unit(rng) });
+    }
+    for (Vec3 &v : vertices)
+        v.z -= 60.0f;
+
+    std::shared_ptr<Mesh> mesh { std::make_shared<Mesh>(vertices, 0) };
+    scene->objects.push_back(mesh);
+    std::vector<std::shared_ptr<Object>> triangles;
+    for (unsigned int i = 0; i < vertices.size(); i += 3)
+    {
+        triangles.push_back(std::make_shared<Mesh>(std::vector<Vec3>(vertices.begin() + i, vertices.begin() + i + 3), 0));
+        brute->objects.push_back(triangles.back());
+    }
+
+    auto same_hit = [&](const Collision &col, const Collision &expected)
+    {
+        if (!(col.coord == expected.coord))
+            return false;
+        if (col.obj == mesh)
+            return std::find(triangles.begin(), triangles.end(), expected.obj) != triangles.end();
+        return col.obj == expected.obj;
+    };
+
+    std::vector<Vec3> origins, dirs;
+    for (int r = 0; r < 1000; r++)
+    {
+        origins.push_back(Vec3 { 0.0 });
+        dirs.push_back(glm::normalize(Vec3 { unit(rng) * 0.6f, unit(rng) * 0.6f, -1.0f }));
+    }
+    for (int r = 0; r < 1000; r++)
+    {
+        origins.push_back(Vec3 { pos(rng), pos(rng), pos(rng) - 60.0f });
+        dirs.push_back(glm::normalize(Vec3 { unit(rng), unit(rng), unit(rng) }));
+    }
+
+    std::vector<Collision> expected;
+    for (unsigned int r = 0; r < dirs.size(); r++)
+        expected.push_back(fire_ray(origins[r], dirs[r], brute));
+    assert (!brute->accel_ready());
+
+    int num_mesh_hits { 0 };
+    for (const Collision &col : expected)
+        num_mesh_hits += std::find(triangles.begin(), triangles.end(), col.obj) != triangles.end();
+    assert (num_mesh_hits > 100);
+
+    for (AccelType accel : ACCELS)
+    {
+        scene->build_accel(accel);
+        for (unsigned int r = 0; r < dirs.size(); r++)
+            assert (same_hit(fire_ray(origins[r], dirs[r], scene), expected[r]));
+    }
+}
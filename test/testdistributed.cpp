@@ -0,0 +1,424 @@
+#include <assert.h>
+#include <iostream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "distributed.hpp"
+#include "raytracer.hpp"
+#include "sceneloader.hpp"
+
+const std::string TEST_SCENE { "../../test/scenes/test_raytrace.txt" };
+
+// Message types, see distributed.cpp
+const uint32_t MSG_TILE { 2 };
+const uint32_t MSG_RESULT { 3 };
+
+void test_local_workers();
+void test_failed_worker();
+void test_slow_worker();
+void test_bad_scene();
+void test_rogue_worker();
+void test_address_workers();
+
+int main()
+{
+    std::cout << "Testing raytrace_distributed() with local workers... ";
+    test_local_workers();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace_distributed() with a failing worker... ";
+    test_failed_worker();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace_distributed() with a stalled worker... ";
+    test_slow_worker();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace_distributed() with a bad scene... ";
+    test_bad_scene();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace_distributed() with a rogue worker... ";
+    test_rogue_worker();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace_distributed() with workers connecting to an address... ";
+    test_address_workers();
+    std::cout << "PASS" << std::endl;
+
+    return 0;
+}
+
+
+// Forks a process running body on its end of a new connection, returns the coordinator's end
+int fork_worker(void (*body)(int), std::vector<int> &workers, std::vector<pid_t> &pids)
+{
+    int sv[2];
+    assert (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    pid_t pid { fork() };
+    assert (pid >= 0);
+    if (pid == 0)
+    {
+        close(sv[0]);
+        for (int fd : workers)
+            close(fd);
+        body(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    workers.push_back(sv[0]);
+    pids.push_back(pid);
+    return sv[0];
+}
+
+
+// Reads a raw message, returns false if the connection was closed
+bool read_message(int fd, uint32_t &type, std::vector<uint32_t> &words)
+{
+    uint32_t header[2];
+    if (recv(fd, header, sizeof(header), MSG_WAITALL) != sizeof(header))
+        return false;
+
+    type = ntohl(header[0]);
+    words.resize(ntohl(header[1]));
+    size_t len { words.size() * sizeof(uint32_t) };
+    if (len > 0 && recv(fd, words.data(), len, MSG_WAITALL) != (ssize_t)len)
+        return false;
+
+    for (uint32_t &w : words)
+        w = ntohl(w);
+    return true;
+}
+
+
+// Writes a raw message, returns false if the connection was closed
+bool write_message(int fd, uint32_t type, std::vector<uint32_t> words)
+{
+    words.insert(words.begin(), { type, (uint32_t)words.size() });
+    for (uint32_t &w : words)
+        w = htonl(w);
+
+    size_t len { words.size() * sizeof(uint32_t) };
+    return send(fd, words.data(), len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+
+/* Relays messages between the coordinator and a real worker, but hangs up when the
+ * worker is handed tile max_tiles + 1, as if the worker had died
+ */
+void flaky_worker(int fd, int max_tiles)
+{
+    int sv[2];
+    assert (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    pid_t pid { fork() };
+    assert (pid >= 0);
+    if (pid == 0)
+    {
+        close(fd);
+        close(sv[0]);
+        run_worker(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+
+    int num_tiles { 0 };
+    pollfd fds[2] { { fd, POLLIN, 0 }, { sv[0], POLLIN, 0 } };
+    while (poll(fds, 2, -1) > 0)
+    {
+        uint32_t type;
+        std::vector<uint32_t> words;
+        if (fds[0].revents != 0)
+        {
+            if (!read_message(fd, type, words) || (type == MSG_TILE && num_tiles++ == max_tiles))
+                break;
+            write_message(sv[0], type, words);
+        }
+
+        if (fds[1].revents != 0)
+        {
+            if (!read_message(sv[0], type, words))
+                break;
+            write_message(fd, type, words);
+        }
+    }
+
+    close(sv[0]);
+    close(fd);
+    waitpid(pid, nullptr, 0);
+}
+
+
+// Checks a distributed render against a local render of the same scene
+void assert_matches_local(Pixel2D &px_data, int width, int height, const RenderSettings &settings)
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+    int exp_width, exp_height;
+    Pixel2D exp_px { raytrace(sc, exp_width, exp_height, settings) };
+
+    assert (width == exp_width);
+    assert (height == exp_height);
+    for (int x = 0; x < width; x++)
+        for (int y = 0; y < height; y++)
+            assert (px_data[x][y] == exp_px[x][y]);
+}
+
+
+void test_local_workers()
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+    RenderSettings settings { 1, 2, 2 };
+
+    std::vector<pid_t> pids;
+    std::vector<int> workers { spawn_local_workers(3, pids) };
+
+    int width, height;
+    Pixel2D px_data { raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings) };
+    assert_matches_local(px_data, width, height, settings);
+
+    // Workers can be reused for another frame
+    settings = RenderSettings { 0, 1, 1 };
+    px_data = raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings);
+    assert_matches_local(px_data, width, height, settings);
+
+    close_workers(workers, pids);
+}
+
+
+void test_failed_worker()
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+    RenderSettings settings;
+
+    // One worker drops the connection on its second tile, the tile must be re-issued
+    std::vector<int> workers;
+    std::vector<pid_t> pids;
+    fork_worker([](int fd){ flaky_worker(fd, 1); }, workers, pids);
+    fork_worker([](int fd){ run_worker(fd); }, workers, pids);
+
+    int width, height;
+    Pixel2D px_data { raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings) };
+    assert_matches_local(px_data, width, height, settings);
+
+    close_workers(workers, pids);
+
+
+    // Every worker fails, the frame can't be finished
+    workers.clear();
+    pids.clear();
+    fork_worker([](int fd){ flaky_worker(fd, 0); }, workers, pids);
+
+    bool render_failed = false;
+    try { px_data = raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings); }
+    catch (const std::runtime_error &e){ render_failed = true; }
+    assert (render_failed);
+
+    close_workers(workers, pids);
+}
+
+
+void test_slow_worker()
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+    RenderSettings settings;
+
+    // The first worker never answers, its tile has to be speculatively re-issued
+    std::vector<int> workers;
+    std::vector<pid_t> pids;
+    fork_worker([](int fd){ sleep(60); }, workers, pids);
+    fork_worker([](int fd){ run_worker(fd); }, workers, pids);
+    fork_worker([](int fd){ run_worker(fd); }, workers, pids);
+
+    int width, height;
+    Pixel2D px_data { raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings) };
+    assert_matches_local(px_data, width, height, settings);
+
+    kill(pids[0], SIGKILL);
+    close_workers(workers, pids);
+
+
+    // With speculation off, the stalled worker's tile is only re-issued once it times out
+    workers.clear();
+    pids.clear();
+    fork_worker([](int fd){ sleep(60); }, workers, pids);
+    fork_worker([](int fd){ run_worker(fd); }, workers, pids);
+
+    DistributedOptions options;
+    options.max_copies = 1;
+    options.tile_timeout = 1.0f;
+    px_data = raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings, options);
+    assert_matches_local(px_data, width, height, settings);
+
+    kill(pids[0], SIGKILL);
+    close_workers(workers, pids);
+
+
+    // The only worker is stalled, the frame fails instead of waiting forever
+    workers.clear();
+    pids.clear();
+    fork_worker([](int fd){ sleep(60); }, workers, pids);
+
+    bool render_failed = false;
+    try { px_data = raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings, options); }
+    catch (const std::runtime_error &e){ render_failed = true; }
+    assert (render_failed);
+
+    kill(pids[0], SIGKILL);
+    close_workers(workers, pids);
+}
+
+
+void test_bad_scene()
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+
+    std::vector<pid_t> pids;
+    std::vector<int> workers { spawn_local_workers(2, pids) };
+
+    int width, height;
+    bool render_failed = false;
+    try { Pixel2D px_data { raytrace_distributed(sc, "NOT A FILE", workers, width, height, RenderSettings {}) }; }
+    catch (const std::runtime_error &e){ render_failed = true; }
+    assert (render_failed);
+
+    close_workers(workers, pids);
+}
+
+
+// Before it has been given a tile, sends a result for tile 0xFFFFFFFF of the current job
+void rogue_worker(int fd)
+{
+    uint32_t type;
+    std::vector<uint32_t> job;
+    if (read_message(fd, type, job))
+        write_message(fd, MSG_RESULT, { job[0], 0xFFFFFFFF });
+    sleep(60);
+}
+
+
+void test_rogue_worker()
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+    RenderSettings settings;
+    int width, height;
+
+    // The rogue is busy with a tile of its own, it's dropped and its tile re-issued
+    std::vector<int> workers;
+    std::vector<pid_t> pids;
+    fork_worker(rogue_worker, workers, pids);
+    fork_worker([](int fd){ run_worker(fd); }, workers, pids);
+
+    Pixel2D px_data { raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings) };
+    assert_matches_local(px_data, width, height, settings);
+
+    kill(pids[0], SIGKILL);
+    close_workers(workers, pids);
+
+
+    // The whole image is one tile, so the rogue is idle when its result arrives
+    workers.clear();
+    pids.clear();
+    fork_worker([](int fd){ run_worker(fd); }, workers, pids);
+    fork_worker(rogue_worker, workers, pids);
+
+    DistributedOptions options;
+    options.tile_size = 4096;
+    px_data = raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings, options);
+    assert_matches_local(px_data, width, height, settings);
+
+    kill(pids[1], SIGKILL);
+    close_workers(workers, pids);
+}
+
+
+// Forks num_workers processes that connect to the coordinator at address
+std::vector<pid_t> fork_address_workers(int listen_fd, std::string address, int num_workers)
+{
+    std::vector<pid_t> pids;
+    for (int i = 0; i < num_workers; i++)
+    {
+        pid_t pid { fork() };
+        assert (pid >= 0);
+        if (pid == 0)
+        {
+            close(listen_fd);
+            run_worker(address);
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+    return pids;
+}
+
+
+// Renders with workers that connect to address, which is already being listened on
+void render_with_address_workers(int listen_fd, std::string address)
+{
+    std::shared_ptr<Scene> sc { load_scene(TEST_SCENE) };
+    RenderSettings settings { 1, 1, 2 };
+
+    std::vector<pid_t> pids { fork_address_workers(listen_fd, address, 2) };
+    std::vector<int> workers { accept_workers(listen_fd, 2) };
+    assert (workers.size() == 2);
+
+    int width, height;
+    Pixel2D px_data { raytrace_distributed(sc, TEST_SCENE, workers, width, height, settings) };
+    assert_matches_local(px_data, width, height, settings);
+
+    close_workers(workers, pids);
+}
+
+
+void test_address_workers()
+{
+    // Unix socket
+    std::string path { "/tmp/testdistributed-" + std::to_string(getpid()) + ".sock" };
+    int listen_fd { listen_address("unix:" + path) };
+    render_with_address_workers(listen_fd, "unix:" + path);
+
+    // Nobody else is coming
+    bool timed_out = false;
+    try { accept_workers(listen_fd, 1, 100); }
+    catch (const std::runtime_error &e){ timed_out = true; }
+    assert (timed_out);
+
+    close(listen_fd);
+    unlink(path.c_str());
+
+    // Nobody is listening any more
+    timed_out = false;
+    try { connect_address("unix:" + path, 100); }
+    catch (const std::runtime_error &e){ timed_out = true; }
+    assert (timed_out);
+
+
+    // TCP on loopback, on whichever port the system picks
+    listen_fd = listen_address("tcp:127.0.0.1:0");
+    sockaddr_in addr;
+    socklen_t addr_len { sizeof(addr) };
+    assert (getsockname(listen_fd, (sockaddr *)&addr, &addr_len) == 0);
+    render_with_address_workers(listen_fd, "tcp:127.0.0.1:" + std::to_string(ntohs(addr.sin_port)));
+    close(listen_fd);
+
+
+    // Malformed addresses
+    for (std::string address : { "127.0.0.1:5000", "udp:127.0.0.1:5000", "tcp:127.0.0.1", "unix:" })
+    {
+        bool invalid = false;
+        try { listen_address(address); }
+        catch (const std::invalid_argument &e){ invalid = true; }
+        assert (invalid);
+
+        invalid = false;
+        try { connect_address(address, 0); }
+        catch (const std::invalid_argument &e){ invalid = true; }
+        assert (invalid);
+    }
+}
@@ -17,6 +17,8 @@ void test_parse_sphere();
 void test_parse_plane();
 //void test_parse_mesh();
 void test_parse_light();
+void test_parse_area_lights();
+void test_parse_spheres();
 
 int main()
 {
@@ -56,6 +58,14 @@ int main()
     test_parse_light();
     std::cout << "PASS" << std::endl;
 
+    std::cout << "Testing parse_sphere_light() and parse_rect_light()... ";
+    test_parse_area_lights();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing parse_spheres()... ";
+    test_parse_spheres();
+    std::cout << "PASS" << std::endl;
+
     return 0;
 }
 
@@ -192,6 +202,8 @@ void test_load_scene()
     assert (sc->lights.size() == 1);
     assert (sc->objects.size() == 2);
     assert (sc->camera != nullptr);
+    assert (sc->materials.size() == 2);
+    assert (sc->materials[sc->objects[1]->material].shi == 6.0f);
 
     // Case 4: Unknown entity type
     load_failed = false;
@@ -204,6 +216,13 @@ void test_load_scene()
     try { sc = load_scene("../../test/scenes/5_badent.txt"); }
     catch (const std::exception &e){ load_failed = true; }
     assert (load_failed);
+
+    // Case 6: Pool of spheres from a sphere file, built with the structure asked for
+    sc = load_scene("../../test/scenes/6_spheres.txt", AccelType::Grid);
+    assert (sc->objects.size() == 1);
+    assert (std::dynamic_pointer_cast<SpherePool>(sc->objects[0])->size() == 3);
+    assert (sc->accel_type == AccelType::Grid);
+    assert (sc->materials.size() == 2);
 }
 
 
@@ -285,6 +304,7 @@ void test_parse_camera()
 void test_parse_plane()
 {
     std::shared_ptr<Plane> p;
+    MaterialTable materials;
 
     std::deque<std::string> val_plane {
         "nor: 1.0 1.0 1.0", "pos: 2.0 2.0 2.0",
@@ -292,12 +312,12 @@ void test_parse_plane()
         "shi: 6.0"
     };
 
-    p = parse_plane(val_plane);
+    p = parse_plane(val_plane, materials);
     assert (p->get_normal(Vec3 { 1.0 }) == Vec3 { 1.0 });
-    assert (p->amb == Vec3 { 3.0 });
-    assert (p->dif == Vec3 { 4.0 });
-    assert (p->spe == Vec3 { 5.0 });
-    assert ((p->shi - 6.0) < 0.01);
+    assert (materials[p->material].amb == Vec3 { 3.0 });
+    assert (materials[p->material].dif == Vec3 { 4.0 });
+    assert (materials[p->material].spe == Vec3 { 5.0 });
+    assert ((materials[p->material].shi - 6.0) < 0.01);
 
     std::deque<std::string> inv_normal {
         "nor: 1.0 1.0", "pos: 2.0 2.0 2.0",
@@ -345,7 +365,7 @@ void test_parse_plane()
     for (int i = 0; i < NUM_TEST_CASES; i++)
     {
         inst_failed = false;
-        try { p = parse_plane(test_inst[i]); }
+        try { p = parse_plane(test_inst[i], materials); }
         catch (const std::invalid_argument &e){ inst_failed = true; }
         assert (inst_failed);
     }
@@ -355,6 +375,7 @@ void test_parse_plane()
 void test_parse_sphere()
 {
     std::shared_ptr<Sphere> s;
+    MaterialTable materials;
 
     std::deque<std::string> val_sphere {
         "pos: 1.0 1.0 1.0", "rad: 2.0",
@@ -362,12 +383,21 @@ void test_parse_sphere()
         "shi: 6.0"
     };
 
-    s = parse_sphere(val_sphere);
+    s = parse_sphere(val_sphere, materials);
     //assert (p->get_normal(Vec3 { 1.0 }) == Vec3 { 1.0 });
-    assert (s->amb == Vec3 { 3.0 });
-    assert (s->dif == Vec3 { 4.0 });
-    assert (s->spe == Vec3 { 5.0 });
-    assert ((s->shi - 6.0) < 0.01);
+    assert (materials[s->material].amb == Vec3 { 3.0 });
+    assert (materials[s->material].dif == Vec3 { 4.0 });
+    assert (materials[s->material].spe == Vec3 { 5.0 });
+    assert ((materials[s->material].shi - 6.0) < 0.01);
+
+    // A second sphere of the same material adds nothing to the table
+    std::deque<std::string> same_material {
+        "pos: 9.0 9.0 9.0", "rad: 1.0",
+        "amb: 3.0 3.0 3.0", "dif: 4.0 4.0 4.0", "spe: 5.0 5.0 5.0",
+        "shi: 6.0"
+    };
+    assert (parse_sphere(same_material, materials)->material == s->material);
+    assert (materials.size() == 1);
 
     std::deque<std::string> inv_pos {
         "pos: one", "rad: 2.0",
@@ -416,7 +446,7 @@ void test_parse_sphere()
     for (int i = 0; i < NUM_TEST_CASES; i++)
     {
         inst_failed = false;
-        try { s = parse_sphere(test_inst[i]); }
+        try { s = parse_sphere(test_inst[i], materials); }
         catch (const std::invalid_argument &e){ inst_failed = true; }
         assert (inst_failed);
     }
@@ -470,4 +500,80 @@ void test_parse_light()
         catch (const std::invalid_argument &e){ inst_failed = true; }
         assert (inst_failed);
     }
-}
\ No newline at end of file
+}
+
+
+void test_parse_area_lights()
+{
+    std::deque<std::string> val_sphere {
+        "pos: 1.0 2.0 3.0", "rad: 0.5",
+        "amb: 3.0 3.0 3.0", "dif: 4.0 4.0 4.0", "spe: 5.0 5.0 5.0",
+    };
+    std::shared_ptr<SphereLight> sphere { parse_sphere_light(val_sphere) };
+    assert (sphere->pos == (Vec3 { 1.0, 2.0, 3.0 }));
+    assert (sphere->has_area());
+    assert (sphere->spe == Vec3 { 5.0 });
+
+    std::deque<std::string> val_rect {
+        "pos: 1.0 2.0 3.0", "u: 2.0 0.0 0.0", "v: 0.0 0.0 1.0",
+        "amb: 3.0 3.0 3.0", "dif: 4.0 4.0 4.0", "spe: 5.0 5.0 5.0",
+    };
+    std::shared_ptr<RectLight> rect { parse_rect_light(val_rect) };
+    assert (rect->pos == (Vec3 { 1.0, 2.0, 3.0 }));
+    assert (rect->has_area());
+    assert (rect->amb == Vec3 { 3.0 });
+
+    std::deque<std::string> inv_rad {
+        "pos: 1.0 2.0 3.0", "rad: -1",
+        "amb: 3.0 3.0 3.0", "dif: 4.0 4.0 4.0", "spe: 5.0 5.0 5.0",
+    };
+
+    std::deque<std::string> inv_edge {
+        "pos: 1.0 2.0 3.0", "u: 2.0 0.0", "v: 0.0 0.0 1.0",
+        "amb: 3.0 3.0 3.0", "dif: 4.0 4.0 4.0", "spe: 5.0 5.0 5.0",
+    };
+
+    std::deque<std::string> inv_prefix {
+        "pos: 1.0 2.0 3.0", "v: 2.0 0.0 0.0", "u: 0.0 0.0 1.0",
+        "amb: 3.0 3.0 3.0", "dif: 4.0 4.0 4.0", "spe: 5.0 5.0 5.0",
+    };
+
+    bool inst_failed = false;
+    try { parse_sphere_light(inv_rad); }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+
+    for (std::deque<std::string> inst : { inv_edge, inv_prefix })
+    {
+        inst_failed = false;
+        try { parse_rect_light(inst); }
+        catch (const std::invalid_argument &e){ inst_failed = true; }
+        assert (inst_failed);
+    }
+}
+
+
+void test_parse_spheres()
+{
+    MaterialTable materials;
+    std::deque<std::string> val_spheres { "../../test/scenes/spheres.txt" };
+    std::shared_ptr<SpherePool> pool { parse_spheres(val_spheres, materials) };
+    assert (val_spheres.empty());
+    assert (pool->size() == 3);
+
+    // The first and last spheres share a material
+    assert (materials.size() == 2);
+    assert (materials[1].dif == (Vec3 { 0.0, 1.0, 0.0 }));
+    assert (pool->bounds().min == (Vec3 { -5.0, -2.0, -22.0 }));
+    assert (pool->bounds().max == (Vec3 { 4.0, 2.0, -18.0 }));
+
+    std::deque<std::string> inv_number { "../../test/scenes/spheres_bad.txt" };
+    std::deque<std::string> inv_file { "NOT A FILE" };
+    for (std::deque<std::string> deck : { inv_number, inv_file })
+    {
+        bool inst_failed = false;
+        try { pool = parse_spheres(deck, materials); }
+        catch (const std::invalid_argument &e){ inst_failed = true; }
+        assert (inst_failed);
+    }
+}
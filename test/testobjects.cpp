@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <iostream>
+#include <limits>
+#include <random>
 
 #include <glm/glm.hpp>
 
@@ -9,10 +11,13 @@ const float EPSILON = 0.01;
 
 void test_camera();
 void test_light();
+void test_area_lights();
 void test_scene();
 void test_plane();
 void test_sphere();
 void test_mesh();
+void test_material_table();
+void test_sphere_pool();
 
 int main()
 {
@@ -24,6 +29,10 @@ int main()
     test_light();
     std::cout << "PASS" << std::endl;
 
+    std::cout << "Testing SphereLight and RectLight... ";
+    test_area_lights();
+    std::cout << "PASS" << std::endl;
+
     std::cout << "Testing Scene... ";
     test_scene();
     std::cout << "PASS" << std::endl;
@@ -40,6 +49,14 @@ int main()
     test_mesh();
     std::cout << "PASS" << std::endl;
 
+    std::cout << "Testing MaterialTable... ";
+    test_material_table();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing SpherePool... ";
+    test_sphere_pool();
+    std::cout << "PASS" << std::endl;
+
     return 0;
 }
 
@@ -141,6 +158,75 @@ void test_light()
     assert (inst_failed);
 }
 
+void test_area_lights()
+{
+    Vec3 col { 0.5 };
+
+    bool inst_failed = false;
+    try { SphereLight l { Vec3 { 0.0 }, 0.0f, col, col, col }; }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+
+    // Edges that aren't perpendicular
+    inst_failed = false;
+    try { RectLight l { Vec3 { 0.0 }, Vec3 { 1.0, 0.0, 0.0 }, Vec3 { 1.0, 1.0, 0.0 }, col, col, col }; }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+
+    Light point { Vec3 { 0.0, 10.0, 0.0 }, col, col, col };
+    assert (!point.has_area());
+    assert (std::abs(point.distance(Vec3 { 0.0 }, Vec3 { 1.0, 0.0, 0.0 }) - 10.0f) < EPSILON);
+
+    /* Directions from the origin to a sphere of radius 2 ten units up all hit it, and being uniform
+     * over the cone their mean cosine to its axis is halfway between 1 and the edge of the cone
+     */
+    SphereLight sphere { Vec3 { 0.0, 10.0, 0.0 }, 2.0f, col, col, col };
+    assert (sphere.has_area());
+    std::mt19937 rng { 1 };
+    std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+    const int NUM_SAMPLES { 10000 };
+    float cos_max { std::sqrt(1.0f - 4.0f / 100.0f) };
+    double mean_cos { 0.0 };
+    for (int i = 0; i < NUM_SAMPLES; i++)
+    {
+        Vec3 dir { sphere.sample_dir(Vec3 { 0.0 }, unit(rng), unit(rng)) };
+        assert (std::abs(glm::length(dir) - 1.0f) < EPSILON);
+        assert (dir.y >= cos_max - EPSILON);
+        Vec3 point_on { dir * sphere.distance(Vec3 { 0.0 }, dir) };
+        assert (std::abs(glm::length(point_on - sphere.pos) - 2.0f) < EPSILON);
+        mean_cos += dir.y / NUM_SAMPLES;
+    }
+    assert (std::abs(mean_cos - (1.0 + cos_max) / 2.0) < 0.001);
+
+    /* Directions to a 4 x 2 rectangle in the plane y = 5 all land on it, and seen from straight
+     * below its centre they are spread evenly around it
+     */
+    RectLight rect { Vec3 { 0.0, 5.0, 0.0 }, Vec3 { 4.0, 0.0, 0.0 }, Vec3 { 0.0, 0.0, 2.0 }, col, col, col };
+    assert (rect.has_area());
+    Vec3 mean_point { 0.0 };
+    for (int i = 0; i < NUM_SAMPLES; i++)
+    {
+        Vec3 dir { rect.sample_dir(Vec3 { 0.0 }, unit(rng), unit(rng)) };
+        Vec3 point_on { dir * rect.distance(Vec3 { 0.0 }, dir) };
+        assert (std::abs(point_on.y - 5.0f) < EPSILON);
+        assert (std::abs(point_on.x) <= 2.0f + EPSILON && std::abs(point_on.z) <= 1.0f + EPSILON);
+        mean_point += point_on / (float)NUM_SAMPLES;
+    }
+    assert (std::abs(mean_point.x) < 0.05f && std::abs(mean_point.z) < 0.05f);
+
+    // Seen from the side, the near half covers more of the solid angle and gets more of the directions
+    int near { 0 };
+    for (int i = 0; i < NUM_SAMPLES; i++)
+    {
+        Vec3 dir { rect.sample_dir(Vec3 { 3.0, 0.0, 0.0 }, unit(rng), unit(rng)) };
+        Vec3 point_on { Vec3 { 3.0, 0.0, 0.0 } + dir * rect.distance(Vec3 { 3.0, 0.0, 0.0 }, dir) };
+        if (point_on.x > 0.0f)
+            near++;
+    }
+    assert (near > NUM_SAMPLES / 2 + NUM_SAMPLES / 20);
+}
+
+
 void test_scene()
 {
     // Test destructor and shared_ptrs are working properly
@@ -151,26 +237,27 @@ void test_scene()
         1000,
         1.33 );
 
+    int m1 { s.materials.add(Material { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0 }) };
+    int m2 { s.materials.add(Material { Vec3 { 2.0 }, Vec3 { 2.0 }, Vec3 { 2.0 }, 25.0 }) };
     s.objects.push_back(
         std::make_shared<Plane>(
             Vec3 { 1.0 }, 
             Vec3 { 1.0 },
-            Vec3 { 1.0 }, 
-            Vec3 { 1.0 }, 
-            Vec3 { 1.0 },
-            5.0)
+            m1)
     );
     
     s.objects.push_back(
         std::make_shared<Plane>(
             Vec3 { 2.0 }, 
             Vec3 { 2.0 },
-            Vec3 { 2.0 }, 
-            Vec3 { 2.0 }, 
-            Vec3 { 2.0 },
-            25.0)
+            m2)
     );
 
+    // Objects of the same material share the scene's entry
+    s.objects.push_back(std::make_shared<Plane>(Vec3 { 3.0 }, Vec3 { 3.0 },
+        s.materials.add(Material { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0 })));
+    assert (s.objects[2]->material == m1);
+    assert (s.materials.size() == 2);
 }
 
 
@@ -179,10 +266,8 @@ void test_plane()
     Plane p { 
         Vec3 { 1.0, 2.0, 3.0 }, 
         Vec3 { 11.0, 12.0, 13.0 },
-        Vec3 { 21.0, 22.0, 23.0 }, 
-        Vec3 { 31.0, 32.0, 33.0 },
-        Vec3 { 41.0, 42.0, 43.0 },
-        5.0 };
+        7 };
+    assert (p.material == 7);
 
     // Test get_normal
     Vec3 exp_normal = Vec3 { 1.0, 2.0, 3.0 };
@@ -192,7 +277,7 @@ void test_plane()
     Plane p2 {
         Vec3 { 0, 1, 0 }, // normal
         Vec3 { 1, 1, 1 }, // point on plane
-        Vec3 { 0.0 }, Vec3 { 0.0 }, Vec3 { 0.0 }, 1.0
+        0
     };
 
     // Case 1: 45-degree ray collides with plane
@@ -210,66 +295,11 @@ void test_plane()
     Vec3 d2 { 1, 0, -1 };
     col_result = p2.check_collision(p0, d2);
     assert (col_result < 0.0);
-    
-    // Test constructors
-    // Invalid amb
-    bool inst_failed = false;
-    try {
-        Plane p2 {
-            Vec3 { 1.0 },
-            Vec3 { 11.0 },
-            Vec3 { -1.0, 1.0, 1.0 },
-            Vec3 { 1.0 },
-            Vec3 { 1.0 },
-            5.0 };
-    }
-    catch (const std::invalid_argument &e){ inst_failed = true; }
-
-    assert (inst_failed);
-
-    // Invalid dif
-    inst_failed = false;
-    try {
-        Plane p2 {
-            Vec3 { 1.0 },
-            Vec3 { 11.0 },
-            Vec3 { 1.0 },
-            Vec3 { 1.0, -1.0, 1.0 },
-            Vec3 { 1.0 },
-            5.0 };
-    }
-    catch (const std::invalid_argument &e){ inst_failed = true; }
 
-    assert (inst_failed);
-    
-    // Invalid spe
-    inst_failed = false;
-    try {
-        Plane p2 {
-            Vec3 { 1.0 },
-            Vec3 { 11.0 },
-            Vec3 { 1.0 },
-            Vec3 { 1.0 },
-            Vec3 { 1.0, 1.0, -1.0 },
-            5.0 };
-    }
-    catch (const std::invalid_argument &e){ inst_failed = true; }
-
-    assert (inst_failed);
-    
-    // Invalid shi
-    inst_failed = false;
-    try {
-        Plane p2 {
-            Vec3 { 1.0 },
-            Vec3 { 11.0 },
-            Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 },
-            0.0 };
-    }
-    catch (const std::invalid_argument &e){ inst_failed = true; }
-
-    assert (inst_failed);
-    
+    // Test translate
+    p2.translate(Vec3 { 5.0, -0.5, 0.0 });
+    col_result = p2.check_collision(p0, d0);
+    assert ( (p0 + d0 * col_result) == (Vec3 { 2.5, 0.5, 1 }) );
 }
 
 
@@ -278,8 +308,7 @@ void test_sphere()
     Sphere s {
         Vec3 { 1.0 },
         1.0,
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 },
-        5.0 };
+        0 };
 
     // Test get_normal
     // Case 1: on the surface of the sphere
@@ -303,7 +332,7 @@ void test_sphere()
     Sphere s2 {
         Vec3 { 3.0, 1.0, 3.0 }, // pos
         1.0, // r
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0 };
+        0 };
 
     Vec3 p0 { 1, 2, 3 };
     Vec3 d  { 1, 0, 0 };
@@ -315,7 +344,7 @@ void test_sphere()
     Sphere s3 {
         Vec3 { 4.0, 2.0, 3.0 }, // pos
         2.0, // r
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0 };
+        0 };
 
     col_result = s3.check_collision(p0, d);
     assert ( (p0 + d * col_result == Vec3 { 2, 2, 3}) );
@@ -324,7 +353,7 @@ void test_sphere()
     Sphere s4 {
         Vec3 { -4.0, 2.0, 3.0 }, // pos
         2.0, // r
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0 };
+        0 };
 
     col_result = s4.check_collision(p0, d);
     assert (col_result < 0.0);
@@ -333,11 +362,17 @@ void test_sphere()
     Sphere s5 {
         Vec3 { 4.0, 5.0, 5.0 }, // pos
         2.0, // r
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0 };
+        0 };
 
     col_result = s5.check_collision(p0, d);
     assert (col_result < 0.0);
 
+    // Test translate
+    // Moving s5 down into the path of the ray
+    s5.translate(Vec3 { 0.0, -3.0, -2.0 });
+    col_result = s5.check_collision(p0, d);
+    assert ( (p0 + d * col_result == Vec3 { 2, 2, 3}) );
+
 
     // Test instantiation
     // Invalid r
@@ -347,8 +382,7 @@ void test_sphere()
         Sphere s {
             Vec3 { 1.0 },
             0.0,
-            Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 },
-            5.0 };
+            0 };
     }
     catch (const std::invalid_argument &e){ inst_failed = true; }
 
@@ -361,7 +395,7 @@ void test_mesh()
 {
     Mesh m { 
         "../../test/scenes/cube.obj",
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0
+        0
         };
 
     // Test check_collision
@@ -378,6 +412,13 @@ void test_mesh()
     float t { m.check_collision(p0, Vec3 { 0.0, 1.0, 0.0 }) };
     assert (t < 0);
 
+    // Test translate
+    // Cube moves 2 units back, so a ray straight ahead hits its front face at z = -40
+    d = Vec3 { 0.0, 0.0, -1.0 };
+    assert (fabs(m.check_collision(p0, d) - 38.0) < EPSILON);
+    m.translate(Vec3 { 0.0, 0.0, -2.0 });
+    assert (fabs(m.check_collision(p0, d) - 40.0) < EPSILON);
+
 
     // Testing alternate constructor
     /*
@@ -389,7 +430,7 @@ void test_mesh()
 
     Mesh m2 {
         tri_verts,
-        Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 5.0
+        0
     };
 
     exp_collision = Vec3 { -2.5, 10.0, -27.5 };
@@ -404,4 +445,138 @@ void test_mesh()
     assert (glm::length(act_collision - exp_collision) < EPSILON);
     */
 
-}
\ No newline at end of file
+}
+
+
+
+void test_material_table()
+{
+    MaterialTable table;
+    Material red { Vec3 { 0.1 }, Vec3 { 1.0, 0.0, 0.0 }, Vec3 { 0.5 }, 10.0f };
+    Material blue { Vec3 { 0.1 }, Vec3 { 0.0, 0.0, 1.0 }, Vec3 { 0.5 }, 10.0f };
+
+    // Identical materials share an index
+    assert (table.add(red) == 0);
+    assert (table.add(blue) == 1);
+    assert (table.add(Material { Vec3 { 0.1 }, Vec3 { 1.0, 0.0, 0.0 }, Vec3 { 0.5 }, 10.0f }) == 0);
+    assert (table.size() == 2);
+    assert (table[1] == blue);
+
+    // Only shininess differs
+    Material shiny { red };
+    shiny.shi = 20.0f;
+    assert (table.add(shiny) == 2);
+
+    // Invalid amb, dif, spe and shi
+    bool inst_failed = false;
+    try { Material m { Vec3 { -1.0, 1.0, 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 1.0f }; }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+
+    inst_failed = false;
+    try { Material m { Vec3 { 1.0 }, Vec3 { 1.0, -1.0, 1.0 }, Vec3 { 1.0 }, 1.0f }; }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+
+    inst_failed = false;
+    try { Material m { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0, 1.0, -1.0 }, 1.0f }; }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+
+    inst_failed = false;
+    try { Material m { Vec3 { 1.0 }, Vec3 { 1.0 }, Vec3 { 1.0 }, 0.0f }; }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+}
+
+
+
+void test_sphere_pool()
+{
+    SpherePool pool;
+    const int NUM_MATERIALS { 3 };
+
+    // Spheres of the pool and the same spheres as Sphere objects
+    std::mt19937 rng { 5 };
+    std::uniform_real_distribution<float> pos { -20.0f, 20.0f };
+    std::uniform_real_distribution<float> radius { 0.5f, 2.0f };
+    std::vector<std::shared_ptr<Sphere>> spheres;
+    for (int i = 0; i < 2000; i++)
+    {
+        Vec3 c { pos(rng), pos(rng), pos(rng) };
+        float r { radius(rng) };
+        pool.add(c, r, i % NUM_MATERIALS);
+        spheres.push_back(std::make_shared<Sphere>(c, r, i % NUM_MATERIALS));
+    }
+    assert (pool.size() == 2000);
+
+    AABB expected_bounds;
+    for (const std::shared_ptr<Sphere> &s : spheres)
+        expected_bounds.grow(s->bounds());
+    assert (pool.bounds().min == expected_bounds.min && pool.bounds().max == expected_bounds.max);
+
+    // Closest sphere each ray hits, by testing every one
+    auto closest_sphere = [&](Vec3 p0, Vec3 d, float &t)
+    {
+        int closest { -1 };
+        t = std::numeric_limits<float>::infinity();
+        for (unsigned int i = 0; i < spheres.size(); i++)
+        {
+            float t_sphere { spheres[i]->check_collision(p0, d) };
+            if (t_sphere - 0.1f > 0.0f && t_sphere < t)
+            {
+                t = t_sphere;
+                closest = i;
+            }
+        }
+        return closest;
+    };
+
+    std::uniform_real_distribution<float> unit { -1.0f, 1.0f };
+    for (AccelType accel : { AccelType::BVH, AccelType::BVH4, AccelType::Grid, AccelType::Auto })
+    {
+        pool.build_accel(accel, SpatialSplitOptions {});
+        for (int r = 0; r < 300; r++)
+        {
+            Vec3 p0 { unit(rng) * 30.0f, unit(rng) * 30.0f, unit(rng) * 30.0f };
+            Vec3 d { glm::normalize(Vec3 { unit(rng), unit(rng), unit(rng) }) };
+
+            float t;
+            int closest { closest_sphere(p0, d, t) };
+
+            Vec3 normal;
+            int material { -1 };
+            float t_pool { pool.check_collision_material(p0, d, normal, material) };
+            if (closest < 0)
+            {
+                assert (t_pool < 0.0f);
+                continue;
+            }
+
+            assert (t_pool == t);
+            assert (material == spheres[closest]->material);
+            assert (glm::length(normal - spheres[closest]->get_normal(p0 + d * t)) < EPSILON);
+            assert (pool.check_collision(p0, d) == t);
+            assert (pool.get_normal(Vec3 { 0.0 }) == normal);
+        }
+    }
+
+    // Moving the pool moves every sphere
+    for (AccelType accel : { AccelType::BVH, AccelType::Grid })
+    {
+        pool.build_accel(accel, SpatialSplitOptions {});
+        pool.translate(Vec3 { 0.0, 100.0, 0.0 });
+        assert (pool.bounds().min.y > expected_bounds.min.y + 99.0f);
+
+        Vec3 normal;
+        int material;
+        assert (pool.check_collision_material(Vec3 { 0.0 }, Vec3 { 1.0, 0.0, 0.0 }, normal, material) < 0.0f);
+        assert (pool.check_collision_material(Vec3 { 0.0, 100.0, -50.0 }, Vec3 { 0.0, 0.0, 1.0 }, normal, material) > 0.0f);
+        pool.translate(Vec3 { 0.0, -100.0, 0.0 });
+    }
+
+    bool inst_failed = false;
+    try { pool.add(Vec3 { 0.0 }, 0.0f, 0); }
+    catch (const std::invalid_argument &e){ inst_failed = true; }
+    assert (inst_failed);
+}
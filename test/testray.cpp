@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <iostream>
+#include <random>
 
 #include <glm/gtc/epsilon.hpp>
 #include <glm/gtc/constants.hpp>
@@ -7,11 +8,22 @@
 #include "sceneloader.hpp"
 #include "objects.hpp"
 #include "raytracer.hpp"
+#include "shading.hpp"
 
 const float EPSILON { 0.01 };
 
 void test_raytrace();
 void test_fire_ray();
+void test_split_tiles();
+void test_render_tile();
+void test_reflection();
+void test_mesh_shading();
+void test_threads();
+void test_sphere_pool();
+void test_batch_shading();
+void test_wavefront();
+void test_samplers();
+void test_adaptive_shadows();
 
 int main()
 {
@@ -23,6 +35,46 @@ int main()
     test_raytrace();
     std::cout << "PASS" << std::endl;
 
+    std::cout << "Testing split_tiles()... ";
+    test_split_tiles();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing render_tile()... ";
+    test_render_tile();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing compute_color() reflections... ";
+    test_reflection();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing compute_color() on meshes... ";
+    test_mesh_shading();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace() on several threads... ";
+    test_threads();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace() of a SpherePool against Sphere objects... ";
+    test_sphere_pool();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing batch shading and fast_pow()... ";
+    test_batch_shading();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing raytrace() as waves of rays... ";
+    test_wavefront();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing samplers... ";
+    test_samplers();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing area lights and adaptive shadows... ";
+    test_adaptive_shadows();
+    std::cout << "PASS" << std::endl;
+
     return 0;
 }
 
@@ -84,4 +136,478 @@ void test_fire_ray()
 
     assert (c == NO_COLLISION);
 
-}
\ No newline at end of file
+}
+
+
+void test_split_tiles()
+{
+    // Case 1: Image is an exact multiple of the tile size
+    std::vector<Tile> tiles { split_tiles(128, 64, 32) };
+    assert (tiles.size() == 8);
+    assert (tiles[0].x0 == 0 && tiles[0].y0 == 0 && tiles[0].x1 == 32 && tiles[0].y1 == 32);
+    assert (tiles[4].x0 == 0 && tiles[4].y0 == 32);
+
+    // Case 2: Edge tiles are clipped to the image
+    tiles = split_tiles(100, 50, 32);
+    assert (tiles.size() == 8);
+    assert (tiles[3].x0 == 96 && tiles[3].x1 == 100);
+    assert (tiles[7].y0 == 32 && tiles[7].y1 == 50);
+
+    // Every pixel is covered exactly once
+    int covered { 0 };
+    for (const Tile &t : tiles)
+        covered += t.width() * t.height();
+    assert (covered == 100 * 50);
+
+    // Case 3: Invalid tile size
+    bool split_failed = false;
+    try { tiles = split_tiles(100, 50, 0); }
+    catch (const std::invalid_argument &e){ split_failed = true; }
+    assert (split_failed);
+}
+
+
+void test_render_tile()
+{
+    std::shared_ptr<Scene> sc { load_scene("../../test/scenes/test_raytrace.txt") };
+    RenderSettings settings { 1, 2, 1 };
+
+    int width, height;
+    Pixel2D px_data { raytrace(sc, width, height, settings) };
+
+    // A tile rendered on its own matches the same pixels of the whole image
+    Tile tile { 700, 500, 750, 530 };
+    std::vector<Vec3> tile_px(tile.width() * tile.height());
+    render_tile(sc, width, height, tile, settings, tile_px.data());
+
+    for (int y = tile.y0; y < tile.y1; y++)
+        for (int x = tile.x0; x < tile.x1; x++)
+            assert (tile_px[(y - tile.y0) * tile.width() + (x - tile.x0)] == px_data[x][y]);
+}
+
+
+void test_reflection()
+{
+    // A sphere seen head on, lit from above, with a second sphere where the light's reflection points
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    std::shared_ptr<Object> mirror { std::make_shared<Sphere>(Vec3 { 0.0, 0.0, -10.0 }, 1.0f,
+        sc->materials.add(Material { Vec3 { 0.1 }, Vec3 { 0.5 }, Vec3 { 1.0 }, 10.0f })) };
+    std::shared_ptr<Object> reflected { std::make_shared<Sphere>(Vec3 { 0.0, 10.0, -14.0 }, 1.0f,
+        sc->materials.add(Material { Vec3 { 0.5 }, Vec3 { 0.5 }, Vec3 { 0.5 }, 10.0f })) };
+    sc->objects = { mirror, reflected };
+    sc->lights.push_back(std::make_shared<Light>(Vec3 { 0.0, 10.0, -4.0 }, Vec3 { 0.2 }, Vec3 { 0.5 }, Vec3 { 0.5 }));
+    sc->build_accel();
+
+    Collision col { fire_ray(Vec3 { 0.0 }, Vec3 { 0.0, 0.0, -1.0 }, sc) };
+    assert (col.obj == mirror);
+    assert (glm::length(col.coord - Vec3 { 0.0, 0.0, -9.0 }) < EPSILON);
+
+    // The reflection of the direction to the light, (0, 10, 5), leads straight to the second sphere
+    Collision spec_col { fire_ray(col.coord, glm::normalize(Vec3 { 0.0, 10.0, -5.0 }), sc) };
+    assert (spec_col.obj == reflected);
+    assert (glm::length(spec_col.coord - Vec3 { 0.0, 10.0, -14.0 }) < 1.0f + EPSILON);
+
+    // So one level of recursion must add some of the second sphere's colour
+    Vec3 direct { compute_color(col, sc, Vec3 { 0.0 }, 0, 1) };
+    Vec3 with_reflection { compute_color(col, sc, Vec3 { 0.0 }, 1, 1) };
+    Vec3 reflection { compute_color(spec_col, sc, col.coord, 0, 1) };
+    Vec3 added { with_reflection - direct };
+    assert (glm::all(glm::greaterThan(added, Vec3 { EPSILON })));
+    assert (fabs(added.x / reflection.x - added.y / reflection.y) < EPSILON);
+    assert (fabs(added.x / reflection.x - added.z / reflection.z) < EPSILON);
+}
+
+
+void test_mesh_shading()
+{
+    /* A mesh with a floor facing up and a ceiling facing down, which shadows the floor from
+     * the first light but not from the second
+     */
+    std::vector<Vec3> vertices {
+        Vec3 { -10.0, 0.0, 10.0 }, Vec3 { 10.0, 0.0, 10.0 }, Vec3 { 0.0, 0.0, -10.0 },
+        Vec3 { 1.0, 10.0, -20.0 }, Vec3 { 30.0, 10.0, -20.0 }, Vec3 { 1.0, 10.0, 30.0 }
+    };
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    Material material { Vec3 { 0.1, 0.2, 0.3 }, Vec3 { 0.6, 0.5, 0.4 }, Vec3 { 0.3, 0.3, 0.3 }, 5.0f };
+    std::shared_ptr<Mesh> mesh { std::make_shared<Mesh>(vertices, sc->materials.add(material)) };
+
+    sc->objects.push_back(mesh);
+    std::shared_ptr<Light> shadowed { std::make_shared<Light>(Vec3 { 5.0, 20.0, 0.25 },
+        Vec3 { 0.1 }, Vec3 { 0.5 }, Vec3 { 0.5 }) };
+    std::shared_ptr<Light> lit { std::make_shared<Light>(Vec3 { -5.0, 20.0, 0.25 },
+        Vec3 { 0.2 }, Vec3 { 0.7 }, Vec3 { 0.4 }) };
+    sc->lights = { shadowed, lit };
+    sc->build_accel();
+
+    Vec3 view { 0.25, 5.0, 0.25 };
+    Collision col { fire_ray(view, Vec3 { 0.0, -1.0, 0.0 }, sc) };
+    assert (col.obj == mesh);
+    assert (col.coord == (Vec3 { 0.25, 0.0, 0.25 }));
+    Vec3 floor_normal { glm::normalize(col.normal) };
+    assert (floor_normal == (Vec3 { 0.0, 1.0, 0.0 }));
+
+    // Only the second light adds diffuse and specular light, lit by the floor's normal
+    Vec3 color { compute_color(col, sc, view, 0, 1) };
+    Vec3 expected { shadowed->amb * material.amb + lit->amb * material.amb +
+                    calc_phong(lit, material, col.coord, floor_normal, view) };
+    assert (glm::length(color - expected) < 1e-6f);
+
+    /* The first light's shadow ray hits the ceiling. Shading with the ceiling's normal (as when
+     * the normal was read back from get_normal after the shadow rays) would leave the floor
+     * without any diffuse light
+     */
+    Collision shadow_col { fire_ray(col.coord, glm::normalize(shadowed->pos - col.coord), sc) };
+    assert (shadow_col.obj == mesh);
+    Vec3 ceiling_normal { glm::normalize(shadow_col.normal) };
+    assert (ceiling_normal == (Vec3 { 0.0, -1.0, 0.0 }));
+    Vec3 stale { shadowed->amb * material.amb + lit->amb * material.amb +
+                    calc_phong(lit, material, col.coord, ceiling_normal, view) };
+    assert (glm::length(color - stale) > EPSILON);
+}
+
+
+void test_threads()
+{
+    // A mesh between reflective spheres, so threads trace meshes, shadows and reflections at once
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    sc->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 200, 1.33f);
+    sc->objects.push_back(std::make_shared<Mesh>("../../test/scenes/cube.obj",
+        sc->materials.add(Material { Vec3 { 0.5, 0.2, 0.7 }, Vec3 { 0.2, 0.4, 0.2 }, Vec3 { 0.1, 0.7, 0.2 }, 0.5f })));
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 0.0, 6.0, -40.0 }, 2.0f,
+        sc->materials.add(Material { Vec3 { 0.1, 0.5, 0.5 }, Vec3 { 0.4, 0.6, 0.2 }, Vec3 { 0.2, 0.5, 0.5 }, 1.0f })));
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 4.0, 0.0, -40.0 }, 2.0f,
+        sc->materials.add(Material { Vec3 { 0.5, 0.5, 0.6 }, Vec3 { 0.2, 0.6, 0.8 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f })));
+    sc->objects.push_back(std::make_shared<Plane>(Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -5.0, 0.0 },
+        sc->materials.add(Material { Vec3 { 0.8 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 6.0f })));
+    sc->lights.push_back(std::make_shared<Light>(Vec3 { 15.0, 12.0, -3.0 },
+        Vec3 { 0.3 }, Vec3 { 0.5 }, Vec3 { 0.8 }));
+    sc->build_accel();
+
+    RenderSettings settings { 2, 1, 3 };
+    settings.num_threads = 1;
+    int width, height;
+    Pixel2D expected { raytrace(sc, width, height, settings) };
+
+    settings.num_threads = 4;
+    Pixel2D px_data { raytrace(sc, width, height, settings) };
+    for (int x = 0; x < width; x++)
+        for (int y = 0; y < height; y++)
+            assert (px_data[x][y] == expected[x][y]);
+}
+
+
+// A pool renders exactly like the same spheres added one by one, however either is traced
+void test_sphere_pool()
+{
+    std::vector<Material> palette {
+        Material { Vec3 { 0.1, 0.5, 0.5 }, Vec3 { 0.4, 0.6, 0.2 }, Vec3 { 0.2, 0.5, 0.5 }, 1.0f },
+        Material { Vec3 { 0.5, 0.5, 0.6 }, Vec3 { 0.2, 0.6, 0.8 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f }
+    };
+
+    std::shared_ptr<Scene> objects { std::make_shared<Scene>() };
+    std::shared_ptr<Scene> pooled { std::make_shared<Scene>() };
+    std::shared_ptr<SpherePool> pool { std::make_shared<SpherePool>() };
+    for (std::shared_ptr<Scene> sc : { objects, pooled })
+    {
+        for (const Material &m : palette)
+            sc->materials.add(m);
+    }
+
+    std::mt19937 rng { 7 };
+    std::uniform_real_distribution<float> pos { -15.0f, 15.0f };
+    for (int i = 0; i < 1500; i++)
+    {
+        Vec3 c { pos(rng), pos(rng), pos(rng) - 50.0f };
+        objects->objects.push_back(std::make_shared<Sphere>(c, 0.5f, i % 2));
+        pool->add(c, 0.5f, i % 2);
+    }
+    pooled->objects.push_back(pool);
+
+    for (std::shared_ptr<Scene> sc : { objects, pooled })
+    {
+        sc->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 60, 1.0f);
+        sc->objects.push_back(std::make_shared<Plane>(Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -20.0, 0.0 },
+            sc->materials.add(Material { Vec3 { 0.8 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 6.0f })));
+        sc->lights.push_back(std::make_shared<Light>(Vec3 { 15.0, 30.0, -3.0 },
+            Vec3 { 0.3 }, Vec3 { 0.5 }, Vec3 { 0.8 }));
+    }
+
+    for (AccelType accel : { AccelType::BVH, AccelType::BVH4, AccelType::Grid, AccelType::Auto })
+    {
+        RenderSettings settings { 1, 1, 2 };
+        settings.accel = accel;
+        int width, height;
+        Pixel2D expected { raytrace(objects, width, height, settings) };
+        Pixel2D px_data { raytrace(pooled, width, height, settings) };
+        for (int x = 0; x < width; x++)
+            for (int y = 0; y < height; y++)
+                assert (px_data[x][y] == expected[x][y]);
+    }
+}
+
+
+// Batches shade exactly like phong one hit at a time, and fast_pow stays close to pow
+void test_batch_shading()
+{
+    for (int i = 0; i <= 100; i++)
+    {
+        float x { i / 100.0f };
+        for (float y : { 0.5f, 1.0f, 6.0f, 20.0f, 128.0f, MAX_FAST_POW_EXPONENT })
+            assert (std::abs(fast_pow(x, y) - std::pow(x, y)) <= FAST_POW_MAX_ERROR);
+    }
+    assert (fast_pow(0.0f, 3.0f) == 0.0f);
+    assert (fast_pow(1.0f, 3.0f) == 1.0f);
+
+    MaterialTable materials;
+    materials.add(Material { Vec3 { 0.1 }, Vec3 { 0.4, 0.6, 0.2 }, Vec3 { 0.2, 0.5, 0.5 }, 1.0f });
+    materials.add(Material { Vec3 { 0.1 }, Vec3 { 0.2, 0.6, 0.8 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f });
+    materials.add(Material { Vec3 { 0.1 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 300.0f });
+    std::shared_ptr<Light> light { std::make_shared<Light>(Vec3 { 15.0, 12.0, -3.0 },
+        Vec3 { 0.3 }, Vec3 { 0.5 }, Vec3 { 0.8 }) };
+
+    // Not a multiple of four, so some hits are shaded outside the SIMD lanes
+    std::mt19937 rng { 3 };
+    std::uniform_real_distribution<float> coord { -10.0f, 10.0f };
+    HitBatch hits;
+    for (int i = 0; i < 103; i++)
+    {
+        Vec3 pos { coord(rng), coord(rng), coord(rng) - 30.0f };
+        Vec3 normal { glm::normalize(Vec3 { coord(rng), coord(rng), coord(rng) }) };
+        hits.add(pos, normal, i % materials.size(), Vec3 { 0.0 });
+    }
+
+    std::vector<Vec3> batched(hits.size()), scalar(hits.size());
+    for (bool use_fast_pow : { false, true })
+    {
+        shade_phong(hits, *light, materials, use_fast_pow, batched.data());
+        shade_phong_scalar(hits, *light, materials, use_fast_pow, scalar.data());
+        for (int i = 0; i < hits.size(); i++)
+        {
+            Vec3 pos { hits.px[i], hits.py[i], hits.pz[i] };
+            Vec3 normal { hits.nx[i], hits.ny[i], hits.nz[i] };
+            const Material &material { materials[hits.material[i]] };
+            assert (batched[i] == scalar[i]);
+            if (use_fast_pow)
+                assert (glm::length(batched[i] - calc_phong(light, material, pos, normal, Vec3 { 0.0 })) < 1e-5f);
+            else
+                assert (batched[i] == calc_phong(light, material, pos, normal, Vec3 { 0.0 }));
+        }
+    }
+
+    // Whole renders, with shadows and reflections of the batched hits
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    sc->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 120, 1.33f);
+    sc->objects.push_back(std::make_shared<Mesh>("../../test/scenes/cube.obj",
+        sc->materials.add(Material { Vec3 { 0.5, 0.2, 0.7 }, Vec3 { 0.2, 0.4, 0.2 }, Vec3 { 0.1, 0.7, 0.2 }, 0.5f })));
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 4.0, 0.0, -40.0 }, 2.0f,
+        sc->materials.add(Material { Vec3 { 0.5, 0.5, 0.6 }, Vec3 { 0.2, 0.6, 0.8 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f })));
+    sc->objects.push_back(std::make_shared<Plane>(Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -5.0, 0.0 },
+        sc->materials.add(Material { Vec3 { 0.8 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 6.0f })));
+    sc->lights.push_back(light);
+    sc->build_accel();
+
+    RenderSettings settings { 2, 1, 3 };
+    int width, height;
+    Pixel2D expected { raytrace(sc, width, height, settings) };
+
+    settings.batch_shading = true;
+    Pixel2D px_data { raytrace(sc, width, height, settings) };
+    settings.fast_pow = true;
+    Pixel2D fast_data { raytrace(sc, width, height, settings) };
+    for (int x = 0; x < width; x++)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            assert (px_data[x][y] == expected[x][y]);
+            assert (glm::length(fast_data[x][y] - expected[x][y]) < 1e-4f);
+        }
+    }
+}
+
+
+// Wavefront renders are exactly the same as depth first ones, with reflections, soft shadows and supersampling
+void test_wavefront()
+{
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    sc->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 150, 1.33f);
+    sc->objects.push_back(std::make_shared<Mesh>("../../test/scenes/cube.obj",
+        sc->materials.add(Material { Vec3 { 0.5, 0.2, 0.7 }, Vec3 { 0.2, 0.4, 0.2 }, Vec3 { 0.1, 0.7, 0.2 }, 0.5f })));
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 0.0, 6.0, -40.0 }, 2.0f,
+        sc->materials.add(Material { Vec3 { 0.1, 0.5, 0.5 }, Vec3 { 0.4, 0.6, 0.2 }, Vec3 { 0.2, 0.5, 0.5 }, 1.0f })));
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 4.0, 0.0, -40.0 }, 2.0f,
+        sc->materials.add(Material { Vec3 { 0.5, 0.5, 0.6 }, Vec3 { 0.2, 0.6, 0.8 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f })));
+    sc->objects.push_back(std::make_shared<Plane>(Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -5.0, 0.0 },
+        sc->materials.add(Material { Vec3 { 0.8 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 6.0f })));
+    sc->lights.push_back(std::make_shared<Light>(Vec3 { 15.0, 12.0, -3.0 },
+        Vec3 { 0.3 }, Vec3 { 0.5 }, Vec3 { 0.8 }));
+    sc->lights.push_back(std::make_shared<Light>(Vec3 { -20.0, 5.0, -10.0 },
+        Vec3 { 0.1 }, Vec3 { 0.3 }, Vec3 { 0.4 }));
+    sc->build_accel();
+
+    for (RenderSettings settings : { RenderSettings { 0, 1, 1 }, RenderSettings { 2, 2, 3 } })
+    {
+        int width, height;
+        Pixel2D expected { raytrace(sc, width, height, settings) };
+
+        // Sorting the rays of each wave only changes the order they are traced in
+        settings.wavefront = true;
+        for (bool sort_rays : { false, true })
+        {
+            settings.sort_rays = sort_rays;
+            Pixel2D px_data { raytrace(sc, width, height, settings) };
+            for (int x = 0; x < width; x++)
+                for (int y = 0; y < height; y++)
+                    assert (px_data[x][y] == expected[x][y]);
+
+            // A single tile of odd size, split into several waves
+            Tile tile { 3, 5, 70, 40 };
+            std::vector<Vec3> out(tile.width() * tile.height());
+            render_tile(sc, width, height, tile, settings, out.data());
+            for (int x = tile.x0; x < tile.x1; x++)
+                for (int y = tile.y0; y < tile.y1; y++)
+                    assert (out[(y - tile.y0) * tile.width() + (x - tile.x0)] == expected[x][y]);
+        }
+    }
+}
+
+
+void test_samplers()
+{
+    bool thrown { false };
+    try { parse_sampler("random"); }
+    catch (const std::invalid_argument &) { thrown = true; }
+    assert (thrown);
+    assert (parse_sampler("sobol") == SamplerType::Sobol);
+
+    // Grid is the regular pattern supersampling always used
+    assert (sample_2d(SamplerType::Grid, 7, 3, 5, 9, PIXEL_DIMENSION) == (Vec2 { 1.0f / 3.0f, 2.0f / 3.0f }));
+
+    /* Jittered and Sobol put one of 16 points in each cell of a 4 x 4 grid, Halton one in each
+     * sixteenth along x (base 2), blue noise shifts its points so only keeps them apart
+     */
+    for (SamplerType sampler : { SamplerType::Jittered, SamplerType::Halton, SamplerType::Sobol, SamplerType::BlueNoise })
+    {
+        for (int dimension : { PIXEL_DIMENSION, shadow_dimension(1, 2) })
+        {
+            std::vector<int> cells(16, 0), columns(16, 0);
+            for (int i = 0; i < 16; i++)
+            {
+                Vec2 p { sample_2d(sampler, 12, 34, i, 16, dimension) };
+                assert (p.x >= 0.0f && p.x < 1.0f && p.y >= 0.0f && p.y < 1.0f);
+                assert (p == sample_2d(sampler, 12, 34, i, 16, dimension));
+                cells[(int)(p.x * 4) * 4 + (int)(p.y * 4)]++;
+                columns[(int)(p.x * 16)]++;
+
+                Vec2 disk { square_to_disk(p) };
+                assert (glm::length(disk) <= 1.0f + EPSILON);
+            }
+            for (int c = 0; c < 16; c++)
+            {
+                if (sampler == SamplerType::Jittered || sampler == SamplerType::Sobol)
+                    assert (cells[c] == 1);
+                if (sampler == SamplerType::Halton)
+                    assert (columns[c] == 1);
+            }
+        }
+    }
+
+    // Pixels draw different points
+    assert (sample_2d(SamplerType::Sobol, 0, 0, 0, 4, PIXEL_DIMENSION) != sample_2d(SamplerType::Sobol, 1, 0, 0, 4, PIXEL_DIMENSION));
+
+    // A reflective sphere casting a soft shadow on a plane
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    sc->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 100, 1.33f);
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 0.0, 0.0, -30.0 }, 3.0f,
+        sc->materials.add(Material { Vec3 { 0.1, 0.5, 0.5 }, Vec3 { 0.4, 0.6, 0.2 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f })));
+    sc->objects.push_back(std::make_shared<Plane>(Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -5.0, 0.0 },
+        sc->materials.add(Material { Vec3 { 0.8 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 6.0f })));
+    sc->lights.push_back(std::make_shared<Light>(Vec3 { 5.0, 15.0, -25.0 },
+        Vec3 { 0.3 }, Vec3 { 0.5 }, Vec3 { 0.8 }));
+    sc->build_accel();
+
+    RenderSettings settings { 1, 2, 3 };
+    int width, height;
+    Pixel2D grid { raytrace(sc, width, height, settings) };
+    for (SamplerType sampler : { SamplerType::Jittered, SamplerType::Halton, SamplerType::Sobol, SamplerType::BlueNoise })
+    {
+        settings.sampler = sampler;
+        settings.num_threads = 1;
+        settings.wavefront = false;
+        Pixel2D expected { raytrace(sc, width, height, settings) };
+
+        // Samples only depend on the pixel, so threads and waves render the same image
+        settings.num_threads = 3;
+        Pixel2D threaded { raytrace(sc, width, height, settings) };
+        settings.wavefront = true;
+        Pixel2D wave { raytrace(sc, width, height, settings) };
+
+        bool differs { false };
+        for (int x = 0; x < width; x++)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                assert (threaded[x][y] == expected[x][y]);
+                assert (wave[x][y] == expected[x][y]);
+                differs = differs || expected[x][y] != grid[x][y];
+            }
+        }
+        assert (differs);
+    }
+}
+
+
+void test_adaptive_shadows()
+{
+    // A sphere under a sphere light and beside a rectangle light, with a penumbra on the plane below
+    std::shared_ptr<Scene> sc { std::make_shared<Scene>() };
+    sc->camera = std::make_shared<Camera>(Vec3 { 0.0 }, 60, 100, 1.33f);
+    sc->objects.push_back(std::make_shared<Sphere>(Vec3 { 0.0, 0.0, -30.0 }, 3.0f,
+        sc->materials.add(Material { Vec3 { 0.1, 0.5, 0.5 }, Vec3 { 0.4, 0.6, 0.2 }, Vec3 { 0.5, 0.5, 0.3 }, 20.0f })));
+    sc->objects.push_back(std::make_shared<Plane>(Vec3 { 0.0, 1.0, 0.0 }, Vec3 { 0.0, -5.0, 0.0 },
+        sc->materials.add(Material { Vec3 { 0.8 }, Vec3 { 0.1 }, Vec3 { 0.7 }, 6.0f })));
+    sc->lights.push_back(std::make_shared<SphereLight>(Vec3 { 0.0, 15.0, -30.0 }, 3.0f,
+        Vec3 { 0.3 }, Vec3 { 0.5 }, Vec3 { 0.8 }));
+    sc->lights.push_back(std::make_shared<RectLight>(Vec3 { 15.0, 10.0, -30.0 }, Vec3 { 0.0, 0.0, 6.0 },
+        Vec3 { 0.0, 6.0, 0.0 }, Vec3 { 0.1 }, Vec3 { 0.3 }, Vec3 { 0.4 }));
+    sc->build_accel();
+
+    RenderSettings settings { 1, 1, 16 };
+    settings.sampler = SamplerType::Sobol;
+    int width, height;
+    Pixel2D full { raytrace(sc, width, height, settings) };
+
+    // Fewer rays where the first agree, but the same image where they all do
+    settings.adaptive_shadows = 4;
+    settings.num_threads = 1;
+    traversal_stats = TraversalStats { 0, 0, 0 };
+    Pixel2D adaptive { raytrace(sc, width, height, settings) };
+    uint64_t adaptive_rays { traversal_stats.rays };
+    settings.adaptive_shadows = 0;
+    traversal_stats = TraversalStats { 0, 0, 0 };
+    raytrace(sc, width, height, settings);
+    assert (adaptive_rays < traversal_stats.rays / 2);
+
+    int same { 0 }, lit { 0 };
+    for (int x = 0; x < width; x++)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            same += (adaptive[x][y] == full[x][y]) ? 1 : 0;
+            lit += (full[x][y] != BACKGROUND_COLOUR) ? 1 : 0;
+        }
+    }
+    assert (same > width * height * 9 / 10);
+
+    // Every render path agrees on which rays are fired
+    settings.adaptive_shadows = 4;
+    for (int path = 0; path < 2; path++)
+    {
+        settings.batch_shading = (path == 0);
+        settings.wavefront = (path == 1);
+        Pixel2D px_data { raytrace(sc, width, height, settings) };
+        for (int x = 0; x < width; x++)
+            for (int y = 0; y < height; y++)
+                assert (px_data[x][y] == adaptive[x][y]);
+    }
+    assert (lit > 0);
+}
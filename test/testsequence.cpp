@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <iostream>
+
+#include "sceneloader.hpp"
+#include "sequence.hpp"
+
+void test_load_sequence();
+void test_parse_frame();
+void test_apply_frame();
+void test_render_sequence();
+void test_frame_filename();
+
+int main()
+{
+    std::cout << "Testing load_sequence()... ";
+    test_load_sequence();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing parse_frame()... ";
+    test_parse_frame();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing apply_frame()... ";
+    test_apply_frame();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing render_sequence()... ";
+    test_render_sequence();
+    std::cout << "PASS" << std::endl;
+
+    std::cout << "Testing frame_filename()... ";
+    test_frame_filename();
+    std::cout << "PASS" << std::endl;
+
+    return 0;
+}
+
+
+void test_load_sequence()
+{
+    Sequence seq { load_sequence("../../test/scenes/test_sequence.txt") };
+    assert (seq.scene_file == "../../test/scenes/test_fire_ray.txt");
+    assert (seq.frames.size() == 3);
+
+    // Case 1: Empty frame
+    assert (!seq.frames[0].move_camera);
+    assert (seq.frames[0].light_pos.empty());
+    assert (seq.frames[0].object_offset.empty());
+
+    // Case 2: Frame moving the camera, a light and an object
+    assert (seq.frames[1].move_camera);
+    assert (seq.frames[1].camera_pos == (Vec3 { 0.0, 1.0, 0.0 }));
+    assert (seq.frames[1].light_pos.at(0) == (Vec3 { 0.0, 12.0, 1.0 }));
+    assert (seq.frames[1].object_offset.at(0) == (Vec3 { 1.0, 0.0, 0.0 }));
+
+    // Case 3: File does not exist
+    bool load_failed = false;
+    try { seq = load_sequence("NOT A FILE"); }
+    catch (const std::invalid_argument &e){ load_failed = true; }
+    assert (load_failed);
+
+    // Case 4: Fewer frames than expected
+    load_failed = false;
+    try { seq = load_sequence("../../test/scenes/test_sequence_bad.txt"); }
+    catch (const std::invalid_argument &e){ load_failed = true; }
+    assert (load_failed);
+}
+
+
+void test_parse_frame()
+{
+    // Parsing stops at the next frame
+    std::deque<std::string> val_frame {
+        "camera: 1.0 2.0 3.0", "light: 1 4.0 5.0 6.0", "object: 2 7.0 8.0 9.0", "frame"
+    };
+
+    FrameUpdate f { parse_frame(val_frame) };
+    assert (f.move_camera);
+    assert (f.camera_pos == (Vec3 { 1.0, 2.0, 3.0 }));
+    assert (f.light_pos.at(1) == (Vec3 { 4.0, 5.0, 6.0 }));
+    assert (f.object_offset.at(2) == (Vec3 { 7.0, 8.0, 9.0 }));
+    assert (val_frame.size() == 1);
+
+    int NUM_TEST_CASES = 5;
+    std::deque<std::string> test_inst[] {
+        { "camera: 1.0 2.0" },
+        { "light: 1.0 2.0 3.0" },
+        { "object: -1 1.0 2.0 3.0" },
+        { "object: one 1.0 2.0 3.0" },
+        { "sphere: 0 1.0 2.0 3.0" }
+    };
+
+    bool inst_failed;
+    for (int i = 0; i < NUM_TEST_CASES; i++)
+    {
+        inst_failed = false;
+        try { f = parse_frame(test_inst[i]); }
+        catch (const std::invalid_argument &e){ inst_failed = true; }
+        assert (inst_failed);
+    }
+}
+
+
+void test_apply_frame()
+{
+    Sequence seq { load_sequence("../../test/scenes/test_sequence.txt") };
+    std::shared_ptr<Scene> sc { load_scene(seq.scene_file) };
+    std::vector<Vec3> offsets;
+
+    // Case 1: Nothing changes
+    assert (apply_frame(sc, seq.frames[0], offsets).empty());
+    assert (offsets.size() == sc->objects.size());
+    assert (sc->camera->pos == Vec3 { 0.0 });
+
+    // Case 2: Camera, light and first object move
+    std::vector<int> moved { apply_frame(sc, seq.frames[1], offsets) };
+    assert (moved.size() == 1 && moved[0] == 0);
+    assert (sc->camera->pos == (Vec3 { 0.0, 1.0, 0.0 }));
+    assert (sc->lights[0]->pos == (Vec3 { 0.0, 12.0, 1.0 }));
+
+    // Sphere was at (-3, 3, -4), so the ray now hits its top at (-2, 5, -4)
+    float t { sc->objects[0]->check_collision(Vec3 { -2.0, 10.0, -4.0 }, Vec3 { 0.0, -1.0, 0.0 }) };
+    assert (fabs(t - 5.0) < 0.01);
+
+    // Case 3: First object keeps its offset so only the second object moves
+    moved = apply_frame(sc, seq.frames[2], offsets);
+    assert (moved.size() == 1 && moved[0] == 1);
+    assert (offsets[0] == (Vec3 { 1.0, 0.0, 0.0 }));
+    assert (offsets[1] == (Vec3 { 0.0, 0.0, -2.0 }));
+
+    // Case 4: Frame refers to an object that isn't in the scene
+    FrameUpdate bad;
+    bad.object_offset[10] = Vec3 { 1.0 };
+    bool apply_failed = false;
+    try { apply_frame(sc, bad, offsets); }
+    catch (const std::invalid_argument &e){ apply_failed = true; }
+    assert (apply_failed);
+}
+
+
+void test_render_sequence()
+{
+    Sequence seq { load_sequence("../../test/scenes/test_sequence.txt") };
+    RenderSettings settings { 2, 1, 2 };
+
+    // Keep a copy of every frame
+    std::vector<std::vector<Vec3>> frames, pipelined_frames;
+    auto record = [](std::vector<std::vector<Vec3>> &out, int frame, const Pixel2D &px_data, int width, int height)
+    {
+        assert (frame == (int)out.size());
+        std::vector<Vec3> px;
+        for (int x = 0; x < width; x++)
+            for (int y = 0; y < height; y++)
+                px.push_back(px_data[x][y]);
+        out.push_back(px);
+    };
+
+    render_sequence(seq, settings,
+        [&](int frame, const Pixel2D &px_data, int width, int height){ record(frames, frame, px_data, width, height); });
+    render_sequence(seq, settings,
+        [&](int frame, const Pixel2D &px_data, int width, int height){ record(pipelined_frames, frame, px_data, width, height); },
+        true);
+
+    assert (frames.size() == 3);
+    assert (frames == pipelined_frames);
+
+    // The last frame matches the scene edited and rendered from scratch
+    std::shared_ptr<Scene> sc { load_scene(seq.scene_file) };
+    sc->camera->pos = Vec3 { 0.0, 1.0, 0.0 };
+    sc->lights[0]->pos = Vec3 { 0.0, 12.0, 1.0 };
+    sc->objects[0]->translate(Vec3 { 1.0, 0.0, 0.0 });
+    sc->objects[1]->translate(Vec3 { 0.0, 0.0, -2.0 });
+    sc->update_accel({ 0, 1 });
+
+    std::vector<std::vector<Vec3>> expected;
+    int width, height;
+    Pixel2D px_data { raytrace(sc, width, height, settings) };
+    record(expected, 0, px_data, width, height);
+
+    assert (frames[2] == expected[0]);
+    assert (frames[0] != frames[2]);
+}
+
+
+void test_frame_filename()
+{
+    assert (frame_filename("Render.bmp", 3) == "Render_0003.bmp");
+    assert (frame_filename("out/frame.v2.png", 12) == "out/frame.v2_0012.png");
+    assert (frame_filename("out.d/render", 7) == "out.d/render_0007");
+    assert (frame_filename("render", 12345) == "render_12345");
+}